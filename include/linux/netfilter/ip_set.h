@@ -0,0 +1,181 @@
+#ifndef _IP_SET_H
+#define _IP_SET_H
+
+/*
+ * IP sets: named sets of addresses, networks or address/port pairs,
+ * managed over nfnetlink and tested or updated from the packet path by
+ * the "set" match and "SET" target.  A rule refers to a whole set, so
+ * matching a packet against a large list is a single lookup.
+ */
+
+#define IPSET_MAXNAMELEN	32
+
+/* Message types, subsystem NFNL_SUBSYS_IPSET */
+enum ipset_msg_types {
+	IPSET_MSG_CREATE,	/* create an empty set */
+	IPSET_MSG_DESTROY,	/* destroy an unreferenced set, or all */
+	IPSET_MSG_FLUSH,	/* remove every element */
+	IPSET_MSG_SWAP,		/* exchange two sets of the same type */
+	IPSET_MSG_LIST,		/* dump one set or all */
+	IPSET_MSG_ADD,		/* add one element, or a batch */
+	IPSET_MSG_DEL,		/* delete one element, or a batch */
+	IPSET_MSG_TEST,		/* is an element in the set? */
+	IPSET_MSG_MAX
+};
+
+enum ipset_attr {
+	IPSET_ATTR_UNSPEC,
+	IPSET_ATTR_SETNAME,	/* NUL terminated string */
+	IPSET_ATTR_SETNAME2,	/* the other set of a swap */
+	IPSET_ATTR_TYPENAME,	/* NUL terminated string */
+	IPSET_ATTR_DATA,	/* nested: create parameters or one element */
+	IPSET_ATTR_ADT,		/* nested: one IPSET_ATTR_DATA per element */
+	__IPSET_ATTR_MAX
+};
+#define IPSET_ATTR_MAX (__IPSET_ATTR_MAX - 1)
+
+/* Inside IPSET_ATTR_DATA */
+enum ipset_attr_data {
+	IPSET_ATTR_DATA_UNSPEC,
+	IPSET_ATTR_IP,		/* __be32 */
+	IPSET_ATTR_IP_TO,	/* __be32, last address of a bitmap */
+	IPSET_ATTR_CIDR,	/* u_int8_t prefix length */
+	IPSET_ATTR_PORT,	/* __be16 */
+	IPSET_ATTR_PROTO,	/* u_int8_t, IPPROTO_TCP or IPPROTO_UDP */
+	IPSET_ATTR_TIMEOUT,	/* __be32 seconds */
+	IPSET_ATTR_HASHSIZE,	/* __be32 initial buckets */
+	IPSET_ATTR_MAXELEM,	/* __be32 */
+	IPSET_ATTR_ELEMENTS,	/* __be32, listing only */
+	IPSET_ATTR_REFERENCES,	/* __be32, listing only */
+	__IPSET_ATTR_DATA_MAX
+};
+#define IPSET_ATTR_DATA_MAX (__IPSET_ATTR_DATA_MAX - 1)
+
+/* Which packet fields feed the dimensions of a set: bit n set means
+ * the source address (or port) for dimension n, clear the destination. */
+#define IPSET_DIM_MAX		2
+#define IPSET_DIM_ONE_SRC	0x01
+#define IPSET_DIM_TWO_SRC	0x02
+
+typedef u_int16_t ip_set_id_t;
+#define IPSET_INVALID_ID	65535
+
+#ifdef __KERNEL__
+
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/skbuff.h>
+#include <linux/ip.h>
+#include <linux/jiffies.h>
+#include <linux/netfilter/nfnetlink.h>
+
+enum ipset_adt {
+	IPSET_ADD,
+	IPSET_DEL,
+	IPSET_TEST,
+};
+
+struct ip_set;
+
+struct ip_set_type {
+	struct list_head list;
+	const char *name;
+	u_int8_t dimension;
+
+	/* Build set->data from the IPSET_ATTR_DATA of a create request */
+	int (*create)(struct ip_set *set, struct nfattr *tb[]);
+	void (*destroy)(struct ip_set *set);
+	void (*flush)(struct ip_set *set);
+
+	/* Packet path: called with set->lock held, for writing unless
+	 * testing.  Returns 1 for a hit or a change, 0 otherwise. */
+	int (*kadt)(struct ip_set *set, const struct sk_buff *skb,
+		    enum ipset_adt adt, u_int8_t flags);
+
+	/* Userspace request: takes set->lock itself, so it may sleep
+	 * first.  @excl asks for adding an existing or deleting a missing
+	 * element to fail.  Returns 0 or -errno; a failed test is
+	 * -ENOENT. */
+	int (*uadt)(struct ip_set *set, struct nfattr *tb[],
+		    enum ipset_adt adt, int excl);
+
+	/* Listing, with set->lock read-held.  head() fills in the
+	 * parameters; dump() adds elements from *pos on and returns 1
+	 * when the skb filled up before the end. */
+	int (*head)(struct ip_set *set, struct sk_buff *skb);
+	int (*dump)(struct ip_set *set, struct sk_buff *skb,
+		    unsigned long *pos);
+
+	struct module *me;
+};
+
+struct ip_set {
+	char name[IPSET_MAXNAMELEN];
+	rwlock_t lock;
+	unsigned int ref;		/* rules using us, under ip_set_ref_lock */
+	struct ip_set_type *type;
+	void *data;
+};
+
+extern int ip_set_type_register(struct ip_set_type *type);
+extern void ip_set_type_unregister(struct ip_set_type *type);
+
+extern ip_set_id_t ip_set_get_byname(const char *name, u_int8_t *dim);
+extern void ip_set_put_byindex(ip_set_id_t index);
+
+extern int ip_set_test(ip_set_id_t index, const struct sk_buff *skb,
+		       u_int8_t flags);
+extern int ip_set_add(ip_set_id_t index, const struct sk_buff *skb,
+		      u_int8_t flags);
+extern int ip_set_del(ip_set_id_t index, const struct sk_buff *skb,
+		      u_int8_t flags);
+
+/* Helpers for set types */
+extern void *ip_set_alloc(size_t size);
+extern void ip_set_free(void *members, size_t size);
+extern int ip_set_get_port(const struct sk_buff *skb, int src,
+			   __be16 *port, u_int8_t *proto);
+
+static inline __be32 ip_set_get_ip(const struct sk_buff *skb, int src)
+{
+	return src ? skb->nh.iph->saddr : skb->nh.iph->daddr;
+}
+
+static inline __be32 ip_set_netmask(u_int8_t cidr)
+{
+	return cidr ? htonl(~0U << (32 - cidr)) : 0;
+}
+
+/* Longest element timeout, in seconds, that fits in jiffies */
+#define IPSET_MAX_TIMEOUT	(MAX_JIFFY_OFFSET / HZ)
+
+/* Expiry stored for an element added with a timeout of zero to a set
+ * with a timeout: it stays until deleted. */
+#define IPSET_ELEM_PERMANENT	(~0UL)
+
+/* Expiry of an element added for @timeout seconds; never zero, which
+ * marks an unused slot, nor IPSET_ELEM_PERMANENT. */
+static inline unsigned long ip_set_timeout_set(u_int32_t timeout)
+{
+	unsigned long expires;
+
+	expires = jiffies +
+		  min_t(unsigned long, timeout, IPSET_MAX_TIMEOUT) * HZ;
+	if (!expires || expires == IPSET_ELEM_PERMANENT)
+		expires = 1;
+	return expires;
+}
+
+static inline int ip_set_timeout_expired(unsigned long expires)
+{
+	return time_after_eq(jiffies, expires);
+}
+
+/* How often timeout sets look for expired elements, in seconds. */
+#define IPSET_GC_PERIOD(timeout) \
+	((timeout / 3) ? (timeout / 3) : 1)
+
+#define IPSET_DEFAULT_MAXELEM	65536
+
+#endif /* __KERNEL__ */
+#endif /* _IP_SET_H */
@@ -73,6 +73,10 @@ enum ip_conntrack_status {
 	/* Connection has fixed timeout. */
 	IPS_FIXED_TIMEOUT_BIT = 10,
 	IPS_FIXED_TIMEOUT = (1 << IPS_FIXED_TIMEOUT_BIT),
+
+	/* A listener that wants every destroy event missed this one. */
+	IPS_EVENT_LOST_BIT = 11,
+	IPS_EVENT_LOST = (1 << IPS_EVENT_LOST_BIT),
 };
 
 /* Connection tracking event bits */
@@ -160,6 +164,7 @@ struct ip_conntrack_stat
 	unsigned int expect_new;
 	unsigned int expect_create;
 	unsigned int expect_delete;
+	unsigned int event_overflow;
 };
 
 /* call to create an explicit dependency on nf_conntrack. */
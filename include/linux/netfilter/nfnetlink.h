@@ -101,7 +101,8 @@ struct nfgenmsg {
 #define NFNL_SUBSYS_CTNETLINK_EXP	2
 #define NFNL_SUBSYS_QUEUE		3
 #define NFNL_SUBSYS_ULOG		4
-#define NFNL_SUBSYS_COUNT		5
+#define NFNL_SUBSYS_IPSET		5
+#define NFNL_SUBSYS_COUNT		6
 
 #ifdef __KERNEL__
 
@@ -8,6 +8,7 @@ enum nfqnl_msg_types {
 	NFQNL_MSG_PACKET,		/* packet from kernel to userspace */
 	NFQNL_MSG_VERDICT,		/* verdict from userspace to kernel */
 	NFQNL_MSG_CONFIG,		/* connect to a particular queue */
+	NFQNL_MSG_VERDICT_BATCH,	/* verdict on all packets up to an id */
 
 	NFQNL_MSG_MAX
 };
@@ -83,8 +84,14 @@ enum nfqnl_attr_config {
 	NFQA_CFG_CMD,			/* nfqnl_msg_config_cmd */
 	NFQA_CFG_PARAMS,		/* nfqnl_msg_config_params */
 	NFQA_CFG_QUEUE_MAXLEN,		/* u_int32_t */
+	NFQA_CFG_MASK,			/* u_int32_t, flags to change */
+	NFQA_CFG_FLAGS,			/* u_int32_t, their new value */
 	__NFQA_CFG_MAX
 };
 #define NFQA_CFG_MAX (__NFQA_CFG_MAX-1)
 
+/* Queue flags */
+#define NFQA_CFG_F_FAIL_OPEN		(1 << 0)	/* accept, not drop, when full */
+#define NFQA_CFG_F_MAX			(1 << 1)
+
 #endif /* _NFNETLINK_QUEUE_H */
@@ -121,6 +121,8 @@ struct xt_counters_info
 #ifdef __KERNEL__
 
 #include <linux/netdevice.h>
+#include <linux/percpu.h>
+#include <linux/seqlock.h>
 
 struct xt_match
 {
@@ -231,10 +233,7 @@ struct xt_table
 	/* What hooks you will enter on */
 	unsigned int valid_hooks;
 
-	/* Lock for the curtain */
-	rwlock_t lock;
-
-	/* Man behind the curtain... */
+	/* Man behind the curtain: an xt_table_info, replaced under RCU */
 	//struct ip6t_table_info *private;
 	void *private;
 
@@ -260,10 +259,46 @@ struct xt_table_info
 	unsigned int hook_entry[NF_IP_NUMHOOKS];
 	unsigned int underflow[NF_IP_NUMHOOKS];
 
-	/* ipt_entry tables: one per CPU */
-	char *entries[NR_CPUS];
+	/* ipt_entry table, shared by all CPUs and never written while
+	 * live.  Here the counters of an entry hold its rule number, the
+	 * index of its real counters in the per-CPU arrays below. */
+	char *entries;
+
+	/* Lookup structure compiled from the entries by the family
+	 * code, if any, and how to free it */
+	void *compiled;
+	void (*free_compiled)(void *compiled);
+
+	/* Per-CPU state, see xt_alloc_table_percpu(): the return stack
+	 * of the rule walk with its depth, and the rule counters */
+	unsigned int stacksize;
+	unsigned int *stackptr;
+	void **jumpstack[NR_CPUS];
+	struct xt_counters *counters[NR_CPUS];
 };
 
+/* Bumped around counter updates on this CPU, so that readers can take
+ * consistent 64-bit snapshots.  A target may send a packet through
+ * another table on the same CPU; only the outermost walk counts. */
+DECLARE_PER_CPU(seqcount_t, xt_recseq);
+
+/* Call with BHs disabled */
+static inline unsigned int xt_write_recseq_begin(void)
+{
+	unsigned int addend;
+
+	addend = (__get_cpu_var(xt_recseq).sequence + 1) & 1;
+	__get_cpu_var(xt_recseq).sequence += addend;
+	smp_wmb();
+	return addend;
+}
+
+static inline void xt_write_recseq_end(unsigned int addend)
+{
+	smp_wmb();
+	__get_cpu_var(xt_recseq).sequence += addend;
+}
+
 extern int xt_register_target(struct xt_target *target);
 extern void xt_unregister_target(struct xt_target *target);
 extern int xt_register_targets(struct xt_target *target, unsigned int n);
@@ -305,8 +340,14 @@ extern int xt_proto_init(int af);
 extern void xt_proto_fini(int af);
 
 extern struct xt_table_info *xt_alloc_table_info(unsigned int size);
+extern int xt_alloc_table_percpu(struct xt_table_info *info);
 extern void xt_free_table_info(struct xt_table_info *info);
 
+extern void xt_get_counters(const struct xt_table_info *info,
+			    struct xt_counters counters[]);
+extern void xt_add_counters(const struct xt_table_info *info,
+			    const struct xt_counters counters[]);
+
 #ifdef CONFIG_COMPAT
 #include <net/compat.h>
 
@@ -13,4 +13,10 @@ struct xt_NFQ_info {
 	u_int16_t queuenum;
 };
 
+/* revision 1: spread flows over queuenum .. queuenum + queues_total - 1 */
+struct xt_NFQ_info_v1 {
+	u_int16_t queuenum;
+	u_int16_t queues_total;
+};
+
 #endif /* _XT_NFQ_TARGET_H */
@@ -0,0 +1,29 @@
+#ifndef _XT_SET_H
+#define _XT_SET_H
+
+#include <linux/netfilter/ip_set.h>
+
+/* Set in flags to negate the match */
+#define XT_SET_INV		0x80
+
+struct xt_set_info {
+	char name[IPSET_MAXNAMELEN];	/* empty: not used */
+	u_int8_t flags;			/* IPSET_DIM_*_SRC, XT_SET_INV */
+
+	/* Used internally by the kernel */
+	u_int8_t dim;
+	ip_set_id_t index;
+};
+
+/* match "set" */
+struct xt_set_info_match {
+	struct xt_set_info match_set;
+};
+
+/* target "SET" */
+struct xt_set_info_target {
+	struct xt_set_info add_set;
+	struct xt_set_info del_set;
+};
+
+#endif /* _XT_SET_H */
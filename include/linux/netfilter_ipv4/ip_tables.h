@@ -289,6 +289,10 @@ extern int ipt_register_table(struct ipt_table *table,
 			      const struct ipt_replace *repl);
 extern void ipt_unregister_table(struct ipt_table *table);
 
+/* Bumped whenever the rules of a table are set, for anything that
+ * caches their verdicts */
+extern unsigned int ipt_table_gen;
+
 /* net/sched/ipt.c: Gimme access to your targets!  Gets target->me. */
 extern struct ipt_target *ipt_find_target(const char *name, u8 revision);
 
@@ -283,6 +283,7 @@ extern void FASTCALL(call_rcu_bh(struct rcu_head *head,
 extern void synchronize_rcu(void);
 void synchronize_idle(void);
 extern void rcu_barrier(void);
+extern void rcu_barrier_bh(void);
 
 #endif /* __KERNEL__ */
 #endif /* __LINUX_RCUPDATE_H */
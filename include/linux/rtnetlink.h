@@ -229,6 +229,7 @@ enum rt_scope_t
 #define RTM_F_CLONED		0x200	/* This route is cloned		*/
 #define RTM_F_EQUALIZE		0x400	/* Multipath equalizer: NI	*/
 #define RTM_F_PREFIX		0x800	/* Prefix addresses		*/
+#define RTM_F_BATCH		0x1000	/* Part of a bulk update	*/
 
 /* Reserved table identifiers */
 
@@ -139,9 +139,23 @@ struct skb_shared_info {
 	unsigned short  gso_type;
 	__be32          ip6_frag_id;
 	struct sk_buff	*frag_list;
+	struct sk_buff	*zerocopy;
 	skb_frag_t	frags[MAX_SKB_FRAGS];
 };
 
+/* A MSG_ZEROCOPY send is tracked by a notification skb whose control
+ * block holds the state below.  Every skb_shared_info with frags that
+ * point into the user's buffer holds a reference on it; when the last
+ * one is released the notification is queued on the socket error queue.
+ */
+struct skb_zerocopy_cb {
+	atomic_t	refcnt;
+	u32		id;
+	u8		copied;
+};
+
+#define SKB_ZEROCOPY_CB(skb) ((struct skb_zerocopy_cb *)((skb)->cb))
+
 /* We divide dataref into two halves.  The higher 16 bits hold references
  * to the payload part of skb->data.  The lower 16 bits hold references to
  * the entire skb->data.  It is up to the users of the skb to agree on
@@ -179,6 +193,9 @@ enum {
 	SKB_GSO_TCP_ECN = 1 << 3,
 
 	SKB_GSO_TCPV6 = 1 << 4,
+
+	/* Datagrams of gso_size bytes, each with its own UDP header. */
+	SKB_GSO_UDP_L4 = 1 << 5,
 };
 
 /** 
@@ -1331,6 +1348,14 @@ extern void	       skb_split(struct sk_buff *skb,
 				 struct sk_buff *skb1, const u32 len);
 
 extern struct sk_buff *skb_segment(struct sk_buff *skb, int features);
+extern struct sk_buff *skb_zerocopy_alloc(struct sock *sk);
+extern void	       skb_zerocopy_put(struct sk_buff *zskb);
+extern void	       skb_zerocopy_abort(struct sk_buff *zskb);
+
+static inline void skb_zerocopy_get(struct sk_buff *zskb)
+{
+	atomic_inc(&SKB_ZEROCOPY_CB(zskb)->refcnt);
+}
 
 static inline void *skb_header_pointer(const struct sk_buff *skb, int offset,
 				       int len, void *buffer)
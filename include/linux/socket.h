@@ -246,6 +246,7 @@ struct ucred {
 #define MSG_ERRQUEUE	0x2000	/* Fetch message from error queue */
 #define MSG_NOSIGNAL	0x4000	/* Do not generate SIGPIPE */
 #define MSG_MORE	0x8000	/* Sender will send more */
+#define MSG_ZEROCOPY	0x4000000	/* Use user data in kernel path */
 
 #define MSG_EOF         MSG_FIN
 
@@ -96,6 +96,7 @@ enum {
 #define TCP_QUICKACK		12	/* Block/reenable quick acks */
 #define TCP_CONGESTION		13	/* Congestion control algorithm */
 #define TCP_MD5SIG		14	/* TCP MD5 Signature (RFC2385) */
+#define TCP_ZEROCOPY_RECEIVE	15	/* Map received payload into user space */
 
 #define TCPI_OPT_TIMESTAMPS	1
 #define TCPI_OPT_SACK		2
@@ -170,6 +171,13 @@ struct tcp_md5sig {
 	__u8	tcpm_key[TCP_MD5SIG_MAXKEYLEN];		/* key (binary) */
 };
 
+/* for TCP_ZEROCOPY_RECEIVE socket option */
+struct tcp_zerocopy_receive {
+	__u64	address;		/* in: address of mapping */
+	__u32	length;			/* in/out: bytes to map/mapped */
+	__u32	recv_skip_hint;		/* out: bytes to read with recvmsg */
+};
+
 #ifdef __KERNEL__
 
 #include <linux/skbuff.h>
@@ -403,7 +411,7 @@ struct tcp_timewait_sock {
 	long			  tw_ts_recent_stamp;
 #ifdef CONFIG_TCP_MD5SIG
 	u16			  tw_md5_keylen;
-	u8			  tw_md5_key[TCP_MD5SIG_MAXKEYLEN];
+	u8			  *tw_md5_key;	/* kmalloc()ed, few socks have one */
 #endif
 };
 
@@ -29,6 +29,7 @@ struct udphdr {
 /* UDP socket options */
 #define UDP_CORK	1	/* Never send partially complete segments */
 #define UDP_ENCAP	100	/* Set the socket to accept encapsulated packets */
+#define UDP_SEGMENT	103	/* Set GSO segmentation size */
 
 /* UDP encapsulation types */
 #define UDP_ENCAP_ESPINUDP_NON_IKE	1 /* draft-ietf-ipsec-nat-t-ike-00/01 */
@@ -38,7 +39,6 @@ struct udphdr {
 #include <linux/types.h>
 
 #include <net/inet_sock.h>
-#define UDP_HTABLE_SIZE		128
 
 struct udp_sock {
 	/* inet_sock has to be the first member */
@@ -61,6 +61,18 @@ struct udp_sock {
 #define UDPLITE_SEND_CC  0x2  		/* set via udplite setsockopt         */
 #define UDPLITE_RECV_CC  0x4		/* set via udplite setsocktopt        */
 	__u8		 pcflag;        /* marks socket as UDP-Lite if > 0    */
+	__u16		 gso_size;	/* UDP_SEGMENT, 0 if off              */
+	/*
+	 * Secondary hash on (local address, local port).
+	 */
+	struct hlist_node udp_portaddr_node;
+	unsigned int	 udp_portaddr_hash;
+	/*
+	 * Datagrams spliced off sk_receive_queue for udp_recvmsg(), and
+	 * receive memory consumed from it but not yet returned.
+	 */
+	struct sk_buff_head reader_queue;
+	int		 forward_deficit;
 };
 
 static inline struct udp_sock *udp_sk(const struct sock *sk)
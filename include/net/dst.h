@@ -50,6 +50,7 @@ struct dst_entry
 #define DST_NOPOLICY		4
 #define DST_NOHASH		8
 #define DST_BALANCED            0x10
+#define DST_NOCACHE		0x20	/* not hashed, freed on last release */
 	unsigned long		lastuse;
 	unsigned long		expires;
 
@@ -147,13 +148,18 @@ struct dst_entry * dst_clone(struct dst_entry * dst)
 	return dst;
 }
 
+extern void dst_nocache_free(struct dst_entry *dst);
+
 static inline
 void dst_release(struct dst_entry * dst)
 {
 	if (dst) {
+		int nocache = dst->flags & DST_NOCACHE;
+
 		WARN_ON(atomic_read(&dst->__refcnt) < 1);
 		smp_mb__before_atomic_dec();
-		atomic_dec(&dst->__refcnt);
+		if (atomic_dec_and_test(&dst->__refcnt) && unlikely(nocache))
+			dst_nocache_free(dst);
 	}
 }
 
@@ -169,9 +175,12 @@ static inline struct dst_entry *dst_pop(struct dst_entry *dst)
 	return child;
 }
 
+extern int dst_discard(struct sk_buff *skb);
 extern void * dst_alloc(struct dst_ops * ops);
 extern void __dst_free(struct dst_entry * dst);
 extern struct dst_entry *dst_destroy(struct dst_entry * dst);
+extern void dst_ifdown(struct dst_entry *dst, struct net_device *dev,
+		       int unregister);
 
 static inline void dst_free(struct dst_entry * dst)
 {
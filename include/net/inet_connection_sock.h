@@ -242,6 +242,11 @@ extern struct request_sock *inet_csk_search_req(const struct sock *sk,
 						const __be16 rport,
 						const __be32 raddr,
 						const __be32 laddr);
+extern struct request_sock *inet_csk_search_req_lock(const struct sock *sk,
+						     spinlock_t **lockp,
+						     const __be16 rport,
+						     const __be32 raddr,
+						     const __be32 laddr);
 extern int inet_csk_bind_conflict(const struct sock *sk,
 				  const struct inet_bind_bucket *tb);
 extern int inet_csk_get_port(struct inet_hashinfo *hashinfo,
@@ -259,9 +264,13 @@ static inline void inet_csk_reqsk_queue_add(struct sock *sk,
 	reqsk_queue_add(&inet_csk(sk)->icsk_accept_queue, req, sk, child);
 }
 
-extern void inet_csk_reqsk_queue_hash_add(struct sock *sk,
-					  struct request_sock *req,
-					  unsigned long timeout);
+extern int inet_csk_reqsk_queue_hash_add(struct sock *sk,
+					 struct request_sock *req,
+					 unsigned long timeout);
+extern int inet_csk_reqsk_queue_hash_add_lock(struct sock *sk,
+					      struct request_sock *req,
+					      unsigned long timeout,
+					      spinlock_t **lockp);
 
 static inline void inet_csk_reqsk_queue_removed(struct sock *sk,
 						struct request_sock *req)
@@ -0,0 +1,149 @@
+/*
+ *	Protocol-independent fragment queue engine, shared by the IPv4
+ *	and IPv6 reassembly code and by IPv6 connection tracking.
+ *
+ *	Queues live in a resizable hash with one lock per bucket.  The hash
+ *	table pointer and the hash secret are protected by a seqlock that
+ *	is only write-locked by the rebuild worker; fast path users take
+ *	a single bucket lock.  Memory is accounted per CPU and folded into
+ *	a shared counter in batches.  Every fragment is checked against the
+ *	high threshold; past it, one batch of queues is evicted inline and a
+ *	work item brings usage down to the low threshold.
+ */
+
+#ifndef _NET_INET_FRAG_H
+#define _NET_INET_FRAG_H
+
+#include <linux/types.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/seqlock.h>
+#include <linux/timer.h>
+#include <linux/time.h>
+#include <linux/percpu.h>
+#include <linux/rcupdate.h>
+#include <linux/workqueue.h>
+#include <asm/atomic.h>
+
+struct sk_buff;
+
+struct inet_frag_queue {
+	struct hlist_node	list;
+	spinlock_t		lock;
+	atomic_t		refcnt;
+	struct timer_list	timer;		/* when will this queue expire? */
+	struct sk_buff		*fragments;	/* list of received fragments */
+	struct timeval		stamp;
+	int			len;		/* total length of orig datagram */
+	int			meat;
+	__u8			last_in;	/* first/last segment arrived? */
+
+#define INET_FRAG_EVICTED	8
+#define INET_FRAG_COMPLETE	4
+#define INET_FRAG_FIRST_IN	2
+#define INET_FRAG_LAST_IN	1
+};
+
+struct inet_frag_bucket {
+	struct hlist_head	chain;
+	spinlock_t		chain_lock;
+};
+
+struct inet_frag_table {
+	unsigned int		mask;
+	struct rcu_head		rcu;
+	struct inet_frag_bucket	buckets[0];
+};
+
+#define INETFRAGS_HASHSZ_MIN	1024
+#define INETFRAGS_HASHSZ_MAX	16384
+
+/* Buckets scanned per run of the eviction worker. */
+#define INETFRAGS_EVICT_BUCKETS	128
+/* Queues claimed from one bucket before its lock is dropped. */
+#define INETFRAGS_EVICT_BATCH	16
+
+/* Per-CPU memory deltas are folded into the shared counter once they
+ * grow past this many bytes, so the shared cacheline is touched about
+ * once per handful of fragments instead of on every one.  Smaller on
+ * machines with many CPUs or a low threshold, see inet_frag_mem_tune().
+ */
+#define INETFRAGS_MEM_BATCH	(16 * 1024)
+
+struct inet_frags_ctl {
+	int			high_thresh;
+	int			low_thresh;
+	int			timeout;
+	int			secret_interval;
+};
+
+struct inet_frags {
+	struct inet_frag_table	*table;		/* under rnd_seqlock */
+	seqlock_t		rnd_seqlock;
+	u32			rnd;
+	atomic_t		nqueues;
+
+	atomic_t		mem;
+	int			*mem_pcpu;
+	int			mem_batch;	/* per-CPU fold threshold */
+	int			mem_slack;	/* max error of f->mem */
+	int			mem_thresh;	/* high_thresh they suit */
+
+	struct inet_frags_ctl	*ctl;
+	struct timer_list	secret_timer;
+	struct work_struct	rebuild_work;
+	struct work_struct	evict_work;
+	unsigned int		next_bucket;	/* evictor position */
+
+	unsigned int		qsize;
+	unsigned int		(*hashfn)(struct inet_frag_queue *q, u32 rnd);
+	unsigned int		(*keyhash)(void *arg, u32 rnd);
+	int			(*match)(struct inet_frag_queue *q, void *arg);
+	void			(*constructor)(struct inet_frag_queue *q,
+					       void *arg);
+	void			(*destructor)(struct inet_frag_queue *q);
+	void			(*skb_free)(struct sk_buff *skb);
+	void			(*frag_expire)(unsigned long data);
+};
+
+extern int inet_frags_init(struct inet_frags *f);
+extern void inet_frags_fini(struct inet_frags *f);
+
+extern void inet_frag_kill(struct inet_frag_queue *q, struct inet_frags *f);
+extern void inet_frag_destroy(struct inet_frag_queue *q,
+			      struct inet_frags *f);
+extern struct inet_frag_queue *inet_frag_find(struct inet_frags *f,
+					      void *key);
+extern int inet_frag_mem_sum(struct inet_frags *f);
+
+static inline void inet_frag_put(struct inet_frag_queue *q,
+				 struct inet_frags *f)
+{
+	if (atomic_dec_and_test(&q->refcnt))
+		inet_frag_destroy(q, f);
+}
+
+/* Callers run with BH disabled, which keeps the per-CPU slot stable. */
+static inline void inet_frag_mem_add(struct inet_frags *f, int i)
+{
+	int *pcount = per_cpu_ptr(f->mem_pcpu, smp_processor_id());
+
+	*pcount += i;
+	if (*pcount >= f->mem_batch || *pcount <= -f->mem_batch) {
+		atomic_add(*pcount, &f->mem);
+		*pcount = 0;
+	}
+}
+
+static inline void inet_frag_mem_sub(struct inet_frags *f, int i)
+{
+	inet_frag_mem_add(f, -i);
+}
+
+/* Approximate usage, off by at most f->mem_slack. */
+static inline int inet_frag_mem(struct inet_frags *f)
+{
+	return atomic_read(&f->mem);
+}
+
+#endif /* _NET_INET_FRAG_H */
@@ -118,6 +118,7 @@ struct inet_sock {
 	__s16			uc_ttl;
 	__u16			cmsg_flags;
 	struct ip_options	*opt;
+	struct dst_entry	*rx_dst;	/* input route for early demux */
 	__be16			sport;
 	__u16			id;
 	__u8			tos;
@@ -139,6 +140,7 @@ struct inet_sock {
 		int			length; /* Total length of all frames */
 		__be32			addr;
 		struct flowi		fl;
+		__u16			gso_size; /* build one GSO skb */
 	} cork;
 };
 
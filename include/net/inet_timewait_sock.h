@@ -18,6 +18,7 @@
 
 #include <linux/list.h>
 #include <linux/module.h>
+#include <linux/percpu_counter.h>
 #include <linux/timer.h>
 #include <linux/types.h>
 #include <linux/workqueue.h>
@@ -31,61 +32,49 @@
 
 struct inet_hashinfo;
 
-#define INET_TWDR_RECYCLE_SLOTS_LOG	5
-#define INET_TWDR_RECYCLE_SLOTS		(1 << INET_TWDR_RECYCLE_SLOTS_LOG)
-
 /*
- * If time > 4sec, it is "slow" path, no recycling is required,
- * so that we select tick to get range about 4 seconds.
+ * TIME_WAIT reaping mechanism.
+ *
+ * Each cpu owns a death row of FIFO queues, a TIME_WAIT sock stays on the
+ * row of the cpu that created it.  Timeouts shorter than the full
+ * TIME_WAIT length are rounded up to a power of two jiffies and every
+ * power has its own queue, so all queues are ordered by expiry and the
+ * reaper only looks at their heads.  It kills at most
+ * INET_TWDR_TWKILL_QUOTA socks per run and comes back on the next tick
+ * if there is more, instead of purging whole slots in one go.
+ *
+ * Queue 0 is for the full timewait_len, queue q + 1 for timeouts of
+ * 2^q jiffies; timeouts are ints, so q < 32.
  */
-#if HZ <= 16 || HZ > 4096
-# error Unsupported: HZ <= 16 or HZ > 4096
-#elif HZ <= 32
-# define INET_TWDR_RECYCLE_TICK (5 + 2 - INET_TWDR_RECYCLE_SLOTS_LOG)
-#elif HZ <= 64
-# define INET_TWDR_RECYCLE_TICK (6 + 2 - INET_TWDR_RECYCLE_SLOTS_LOG)
-#elif HZ <= 128
-# define INET_TWDR_RECYCLE_TICK (7 + 2 - INET_TWDR_RECYCLE_SLOTS_LOG)
-#elif HZ <= 256
-# define INET_TWDR_RECYCLE_TICK (8 + 2 - INET_TWDR_RECYCLE_SLOTS_LOG)
-#elif HZ <= 512
-# define INET_TWDR_RECYCLE_TICK (9 + 2 - INET_TWDR_RECYCLE_SLOTS_LOG)
-#elif HZ <= 1024
-# define INET_TWDR_RECYCLE_TICK (10 + 2 - INET_TWDR_RECYCLE_SLOTS_LOG)
-#elif HZ <= 2048
-# define INET_TWDR_RECYCLE_TICK (11 + 2 - INET_TWDR_RECYCLE_SLOTS_LOG)
-#else
-# define INET_TWDR_RECYCLE_TICK (12 + 2 - INET_TWDR_RECYCLE_SLOTS_LOG)
-#endif
-
-/* TIME_WAIT reaping mechanism. */
-#define INET_TWDR_TWKILL_SLOTS	8 /* Please keep this a power of 2. */
+#define INET_TWDR_QUEUES	33
 
 #define INET_TWDR_TWKILL_QUOTA 100
 
+struct inet_timewait_death_row;
+
+struct inet_twdr_cpu {
+	spinlock_t			lock;
+	struct timer_list		timer;
+	struct inet_timewait_death_row	*twdr;
+	struct list_head		queue[INET_TWDR_QUEUES];
+};
+
 struct inet_timewait_death_row {
-	/* Short-time timewait calendar */
-	int			twcal_hand;
-	int			twcal_jiffie;
-	struct timer_list	twcal_timer;
-	struct hlist_head	twcal_row[INET_TWDR_RECYCLE_SLOTS];
-
-	spinlock_t		death_lock;
-	int			tw_count;
-	int			period;
-	u32			thread_slots;
-	struct work_struct	twkill_work;
-	struct timer_list	tw_timer;
-	int			slot;
-	struct hlist_head	cells[INET_TWDR_TWKILL_SLOTS];
+	struct inet_twdr_cpu	*rows;
+	struct percpu_counter	tw_count;
 	struct inet_hashinfo 	*hashinfo;
 	int			sysctl_tw_recycle;
 	int			sysctl_max_tw_buckets;
 };
 
-extern void inet_twdr_hangman(unsigned long data);
-extern void inet_twdr_twkill_work(struct work_struct *work);
-extern void inet_twdr_twcal_tick(unsigned long data);
+extern int inet_twdr_init(struct inet_timewait_death_row *twdr);
+extern void inet_twdr_destroy(struct inet_timewait_death_row *twdr);
+
+/* Approximate, used for the sysctl_max_tw_buckets limit and /proc. */
+static inline int inet_twdr_count(struct inet_timewait_death_row *twdr)
+{
+	return percpu_counter_read_positive(&twdr->tw_count);
+}
 
 #if (BITS_PER_LONG == 64)
 #define INET_TIMEWAIT_ADDRCMP_ALIGN_BYTES 8
@@ -126,13 +115,13 @@ struct inet_timewait_sock {
 	__be16			tw_dport;
 	__u16			tw_num;
 	/* And these are ours. */
-	__u8			tw_ipv6only:1;
-	/* 15 bits hole, try to pack */
+	__u16			tw_ipv6only:1,
+				tw_cpu:15;	/* death row we live on */
 	__u16			tw_ipv6_offset;
 	int			tw_timeout;
 	unsigned long		tw_ttd;
 	struct inet_bind_bucket	*tw_tb;
-	struct hlist_node	tw_death_node;
+	struct list_head	tw_death_node;
 };
 
 static inline void inet_twsk_add_node(struct inet_timewait_sock *tw,
@@ -149,18 +138,17 @@ static inline void inet_twsk_add_bind_node(struct inet_timewait_sock *tw,
 
 static inline int inet_twsk_dead_hashed(const struct inet_timewait_sock *tw)
 {
-	return !hlist_unhashed(&tw->tw_death_node);
+	return !list_empty(&tw->tw_death_node);
 }
 
 static inline void inet_twsk_dead_node_init(struct inet_timewait_sock *tw)
 {
-	tw->tw_death_node.pprev = NULL;
+	INIT_LIST_HEAD(&tw->tw_death_node);
 }
 
 static inline void __inet_twsk_del_dead_node(struct inet_timewait_sock *tw)
 {
-	__hlist_del(&tw->tw_death_node);
-	inet_twsk_dead_node_init(tw);
+	list_del_init(&tw->tw_death_node);
 }
 
 static inline int inet_twsk_del_dead_node(struct inet_timewait_sock *tw)
@@ -175,12 +163,6 @@ static inline int inet_twsk_del_dead_node(struct inet_timewait_sock *tw)
 #define inet_twsk_for_each(tw, node, head) \
 	hlist_for_each_entry(tw, node, head, tw_node)
 
-#define inet_twsk_for_each_inmate(tw, node, jail) \
-	hlist_for_each_entry(tw, node, jail, tw_death_node)
-
-#define inet_twsk_for_each_inmate_safe(tw, node, safe, jail) \
-	hlist_for_each_entry_safe(tw, node, safe, jail, tw_death_node)
-
 static inline struct inet_timewait_sock *inet_twsk(const struct sock *sk)
 {
 	return (struct inet_timewait_sock *)sk;
@@ -18,6 +18,7 @@
 #include <linux/ipv6_route.h>
 #include <linux/rtnetlink.h>
 #include <linux/spinlock.h>
+#include <linux/workqueue.h>
 #include <net/dst.h>
 #include <net/flow.h>
 #include <net/netlink.h>
@@ -155,11 +156,27 @@ struct rt6_statistics {
 
 typedef void			(*f_pnode)(struct fib6_node *fn, void *);
 
+/*
+ * Multibit stride index over the top of the radix tree: entry v is the
+ * node a descent for any destination whose first FIB6_STRIDE_BITS bits
+ * equal v reaches once it has consumed those bits.  Lookups resume the
+ * bit-at-a-time descent from there.  Built only for tables holding at
+ * least FIB6_STRIDE_MIN_ROUTES routes.
+ */
+#define FIB6_STRIDE_BITS	16
+#define FIB6_STRIDE_SIZE	(1 << FIB6_STRIDE_BITS)
+#define FIB6_STRIDE_MIN_ROUTES	1024
+
 struct fib6_table {
 	struct hlist_node	tb6_hlist;
 	u32			tb6_id;
 	rwlock_t		tb6_lock;
 	struct fib6_node	tb6_root;
+	unsigned int		tb6_nroutes;
+	int			tb6_stride_valid;
+	unsigned int		tb6_stride_gen;
+	struct fib6_node	**tb6_stride;
+	struct work_struct	tb6_stride_work;
 };
 
 #define RT6_TABLE_UNSPEC	RT_TABLE_UNSPEC
@@ -194,6 +211,10 @@ extern struct fib6_node		*fib6_lookup(struct fib6_node *root,
 					     struct in6_addr *daddr,
 					     struct in6_addr *saddr);
 
+extern struct fib6_node		*fib6_lookup_radix(struct fib6_node *root,
+						   struct in6_addr *daddr,
+						   struct in6_addr *saddr);
+
 struct fib6_node		*fib6_locate(struct fib6_node *root,
 					     struct in6_addr *daddr, int dst_len,
 					     struct in6_addr *saddr, int src_len);
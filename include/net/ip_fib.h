@@ -20,13 +20,16 @@
 #include <linux/seq_file.h>
 #include <net/fib_rules.h>
 
+struct rtable;
+
 struct fib_config {
 	u8			fc_dst_len;
 	u8			fc_tos;
 	u8			fc_protocol;
 	u8			fc_scope;
 	u8			fc_type;
-	/* 3 bytes unused */
+	u8			fc_batch;	/* RTM_F_BATCH was set */
+	/* 2 bytes unused */
 	u32			fc_table;
 	__be32			fc_dst;
 	__be32			fc_gw;
@@ -54,15 +57,20 @@ struct fib_nh {
 	unsigned char		nh_scope;
 #ifdef CONFIG_IP_ROUTE_MULTIPATH
 	int			nh_weight;
-	int			nh_power;
+	int			nh_upper_bound;	/* hash-threshold, see fib_rebalance() */
 #endif
 #ifdef CONFIG_NET_CLS_ROUTE
 	__u32			nh_tclassid;
 #endif
 	int			nh_oif;
 	__be32			nh_gw;
+	struct rtable		*nh_rth_input;	/* forwarding dst, nocache mode */
+	struct rtable		**nh_rth_onlink; /* same, per host, no nh_gw */
 };
 
+/* Forwarding dsts kept per on-link nexthop, see rt_nh_input_slot() */
+#define FIB_NH_ONLINK_SLOTS	256
+
 /*
  * This structure contains data shared by many of routes.
  */
@@ -83,9 +91,6 @@ struct fib_info {
 #define fib_rtt fib_metrics[RTAX_RTT-1]
 #define fib_advmss fib_metrics[RTAX_ADVMSS-1]
 	int			fib_nhs;
-#ifdef CONFIG_IP_ROUTE_MULTIPATH
-	int			fib_power;
-#endif
 #ifdef CONFIG_IP_ROUTE_MULTIPATH_CACHED
 	u32			fib_mp_alg;
 #endif
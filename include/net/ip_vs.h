@@ -20,6 +20,10 @@
  */
 #define IP_VS_SVC_F_PERSISTENT	0x0001		/* persistent port */
 #define IP_VS_SVC_F_HASHED	0x0002		/* hashed entry */
+#define IP_VS_SVC_F_SCHED1	0x0008		/* scheduler flag 1 */
+#define IP_VS_SVC_F_SCHED2	0x0010		/* scheduler flag 2 */
+
+#define IP_VS_SVC_F_SCHED_MH_PORT IP_VS_SVC_F_SCHED1	/* mh: hash ports too */
 
 /*
  *      Destination Server Flags
@@ -254,6 +258,9 @@ struct ip_vs_daemon_user {
 #include <asm/atomic.h>                 /* for struct atomic_t */
 #include <linux/compiler.h>
 #include <linux/timer.h>
+#include <linux/rcupdate.h>             /* for struct rcu_head */
+#include <linux/percpu.h>
+#include <linux/interrupt.h>            /* for local_bh_disable() */
 
 #include <net/checksum.h>
 
@@ -500,7 +507,7 @@ extern struct ip_vs_protocol * ip_vs_proto_get(unsigned short proto);
  *	IP_VS structure allocated for each dynamically scheduled connection
  */
 struct ip_vs_conn {
-	struct list_head        c_list;         /* hashed list heads */
+	struct hlist_node       c_list;         /* hashed list heads */
 
 	/* Protocol, addresses and port numbers */
 	__be32                   caddr;          /* client address */
@@ -541,6 +548,8 @@ struct ip_vs_conn {
 	void                    *app_data;      /* Application private data */
 	struct ip_vs_seq        in_seq;         /* incoming seq. struct */
 	struct ip_vs_seq        out_seq;        /* outgoing seq. struct */
+
+	struct rcu_head		rcu_head;	/* lookups are lockless */
 };
 
 
@@ -591,10 +600,11 @@ struct ip_vs_dest {
 	atomic_t		refcnt;		/* reference counter */
 	struct ip_vs_stats      stats;          /* statistics */
 
-	/* connection counters and thresholds */
+	/* connection counters and thresholds, see ip_vs_dest_conns_add() */
 	atomic_t		activeconns;	/* active connections */
 	atomic_t		inactconns;	/* inactive connections */
 	atomic_t		persistconns;	/* persistent connections */
+	struct ip_vs_dest_conns	*conns;		/* per-CPU changes not in them */
 	__u32			u_threshold;	/* upper threshold */
 	__u32			l_threshold;	/* lower threshold */
 
@@ -612,6 +622,66 @@ struct ip_vs_dest {
 };
 
 
+/*
+ *	Per-CPU part of the connection counters of a destination
+ */
+struct ip_vs_dest_conns {
+	int			active;
+	int			inact;
+	int			persist;
+};
+
+#define IP_VS_DEST_CONNS_BATCH	4
+
+static inline void __ip_vs_dest_conns_add(atomic_t *count, int *delta, int n)
+{
+	*delta += n;
+	if (*delta >= IP_VS_DEST_CONNS_BATCH ||
+	    *delta <= -IP_VS_DEST_CONNS_BATCH) {
+		atomic_add(*delta, count);
+		*delta = 0;
+	}
+}
+
+/*
+ *	Add @n to the active, inact or persist connection counter of @dest.
+ *	Changes gather per CPU and reach the shared counter in batches, so
+ *	ip_vs_dest_conns_read() is cheap but approximate: it may be off by
+ *	less than IP_VS_DEST_CONNS_BATCH per CPU.  That is good enough for
+ *	the schedulers; ip_vs_dest_conns_sum() gives the exact value.
+ */
+#define ip_vs_dest_conns_add(dest, field, n)				\
+do {									\
+	local_bh_disable();						\
+	__ip_vs_dest_conns_add(&(dest)->field##conns,			\
+		&per_cpu_ptr((dest)->conns, smp_processor_id())->field, (n)); \
+	local_bh_enable();						\
+} while (0)
+
+/*
+ *	The shared counter alone, which can dip below zero while the
+ *	increments sit on other CPUs: clamp it, as a negative count would
+ *	make the overhead of the destination huge in unsigned arithmetic.
+ */
+static inline int __ip_vs_dest_conns_read(atomic_t *count)
+{
+	int n = atomic_read(count);
+
+	return n < 0 ? 0 : n;
+}
+
+#define ip_vs_dest_conns_read(dest, field)				\
+	__ip_vs_dest_conns_read(&(dest)->field##conns)
+
+#define ip_vs_dest_conns_sum(dest, field)				\
+({									\
+	int __n = atomic_read(&(dest)->field##conns), __cpu;		\
+	for_each_possible_cpu(__cpu)					\
+		__n += per_cpu_ptr((dest)->conns, __cpu)->field;	\
+	__n < 0 ? 0 : __n;						\
+})
+
+
 /*
  *	The scheduler object
  */
@@ -715,7 +785,8 @@ extern void ip_vs_init_hash_table(struct list_head *table, int rows);
  */
 
 /*
- *     IPVS connection entry hash table
+ *     IPVS connection entry hash table, at least this big, see
+ *     ip_vs_conn_init()
  */
 #ifndef CONFIG_IP_VS_TAB_BITS
 #define CONFIG_IP_VS_TAB_BITS   12
@@ -730,8 +801,9 @@ extern void ip_vs_init_hash_table(struct list_head *table, int rows);
 #if 8 <= CONFIG_IP_VS_TAB_BITS && CONFIG_IP_VS_TAB_BITS <= 20
 #define IP_VS_CONN_TAB_BITS	CONFIG_IP_VS_TAB_BITS
 #endif
-#define IP_VS_CONN_TAB_SIZE     (1 << IP_VS_CONN_TAB_BITS)
-#define IP_VS_CONN_TAB_MASK     (IP_VS_CONN_TAB_SIZE - 1)
+#define IP_VS_CONN_TAB_BITS_MAX	20
+
+extern int ip_vs_conn_tab_size;
 
 enum {
 	IP_VS_DIR_INPUT = 0,
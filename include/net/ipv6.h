@@ -20,6 +20,7 @@
 #include <net/ndisc.h>
 #include <net/flow.h>
 #include <net/snmp.h>
+#include <net/inet_frag.h>
 
 #define SIN6_LEN_RFC2133	24
 
@@ -261,8 +262,8 @@ struct ipv6_txoptions *ipv6_fixup_options(struct ipv6_txoptions *opt_space,
 
 extern int ipv6_opt_accepted(struct sock *sk, struct sk_buff *skb);
 
-extern int ip6_frag_nqueues;
-extern atomic_t ip6_frag_mem;
+extern int ip6_frag_nqueues(void);
+extern int ip6_frag_mem(void);
 
 #define IPV6_FRAG_TIMEOUT	(60*HZ)		/* 60 seconds */
 
@@ -574,10 +575,36 @@ extern int inet6_hash_connect(struct inet_timewait_death_row *death_row,
 /*
  * reassembly.c
  */
-extern int sysctl_ip6frag_high_thresh;
-extern int sysctl_ip6frag_low_thresh;
-extern int sysctl_ip6frag_time;
-extern int sysctl_ip6frag_secret_interval;
+extern struct inet_frags_ctl ip6_frags_ctl;
+
+/*
+ *	Equivalent of ipv4 struct ipq, shared with nf_conntrack_reasm.c
+ */
+struct frag_queue
+{
+	struct inet_frag_queue	q;
+
+	__be32			id;		/* fragment id		*/
+	struct in6_addr		saddr;
+	struct in6_addr		daddr;
+
+	int			iif;
+	unsigned int		csum;
+	__u16			nhoffset;
+};
+
+struct ip6_create_arg {
+	__be32 id;
+	struct in6_addr *src;
+	struct in6_addr *dst;
+};
+
+extern unsigned int inet6_hash_frag(__be32 id, struct in6_addr *saddr,
+				    struct in6_addr *daddr, u32 rnd);
+extern unsigned int ip6_frag_keyhash(void *a, u32 rnd);
+extern unsigned int ip6_frag_hashfn(struct inet_frag_queue *q, u32 rnd);
+extern int ip6_frag_match(struct inet_frag_queue *q, void *a);
+extern void ip6_frag_init(struct inet_frag_queue *q, void *a);
 
 extern const struct proto_ops inet6_stream_ops;
 extern const struct proto_ops inet6_dgram_ops;
@@ -101,6 +101,7 @@ struct neighbour
 	__u8			dead;
 	atomic_t		probes;
 	rwlock_t		lock;
+	seqlock_t		ha_lock;
 	unsigned char		ha[ALIGN(MAX_ADDR_LEN, sizeof(unsigned long))];
 	struct hh_cache		*hh;
 	atomic_t		refcnt;
@@ -108,6 +109,7 @@ struct neighbour
 	struct sk_buff_head	arp_queue;
 	struct timer_list	timer;
 	struct neigh_ops	*ops;
+	struct rcu_head		rcu;
 	u8			primary_key[0];
 };
 
@@ -134,6 +136,18 @@ struct pneigh_entry
  *	neighbour table manipulation
  */
 
+/*
+ * Hash chains are read under rcu_read_lock_bh() and modified under
+ * tbl->lock.  Growing the table publishes a new neigh_hash_table, so the
+ * bucket array, mask and seed a reader sees always belong together.
+ */
+struct neigh_hash_table
+{
+	struct neighbour	**hash_buckets;
+	unsigned int		hash_mask;
+	__u32			hash_rnd;
+	struct rcu_head		rcu;
+};
 
 struct neigh_table
 {
@@ -141,7 +155,9 @@ struct neigh_table
 	int			family;
 	int			entry_size;
 	int			key_len;
-	__u32			(*hash)(const void *pkey, const struct net_device *);
+	__u32			(*hash)(const void *pkey,
+					const struct net_device *dev,
+					__u32 hash_rnd);
 	int			(*constructor)(struct neighbour *);
 	int			(*pconstructor)(struct pneigh_entry *);
 	void			(*pdestructor)(struct pneigh_entry *);
@@ -162,10 +178,9 @@ struct neigh_table
 	unsigned long		last_rand;
 	struct kmem_cache		*kmem_cachep;
 	struct neigh_statistics	*stats;
-	struct neighbour	**hash_buckets;
-	unsigned int		hash_mask;
-	__u32			hash_rnd;
+	struct neigh_hash_table	*nht;
 	unsigned int		hash_chain_gc;
+	unsigned int		hash_chain_forced_gc;
 	struct pneigh_entry	**phash_buckets;
 #ifdef CONFIG_PROC_FS
 	struct proc_dir_entry	*pde;
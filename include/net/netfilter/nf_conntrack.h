@@ -57,6 +57,8 @@ union nf_conntrack_help {
 #include <linux/types.h>
 #include <linux/skbuff.h>
 #include <linux/timer.h>
+#include <linux/spinlock.h>
+#include <linux/rcupdate.h>
 
 #ifdef CONFIG_NETFILTER_DEBUG
 #define NF_CT_ASSERT(x)							\
@@ -107,6 +109,12 @@ struct nf_conn
 	/* Timer function; drops refcnt when it goes off. */
 	struct timer_list timeout;
 
+	/* Serialises timeout refresh and accounting. */
+	spinlock_t lock;
+
+	/* CPU whose unconfirmed list holds us until confirmation. */
+	int cpu;
+
 #ifdef CONFIG_NF_CT_ACCT
 	/* Accounting Information (same cache line as other written members) */
 	struct ip_conntrack_counter counters[IP_CT_DIR_MAX];
@@ -129,6 +137,9 @@ struct nf_conn
 	/* Storage reserved for other modules: */
 	union nf_conntrack_proto proto;
 
+	/* Hash lookups run under RCU: freeing is deferred. */
+	struct rcu_head rcu;
+
 	/* features dynamically at the end: helper, nat (both optional) */
 	char data[0];
 };
@@ -173,6 +184,7 @@ static inline void nf_ct_put(struct nf_conn *ct)
 extern int nf_ct_l3proto_try_module_get(unsigned short l3proto);
 extern void nf_ct_l3proto_module_put(unsigned short l3proto);
 
+/* Caller must hold rcu_read_lock(). */
 extern struct nf_conntrack_tuple_hash *
 __nf_conntrack_find(const struct nf_conntrack_tuple *tuple,
 		    const struct nf_conn *ignored_conntrack);
@@ -220,6 +232,9 @@ extern void nf_conntrack_tcp_update(struct sk_buff *skb,
 				    unsigned int dataoff,
 				    struct nf_conn *conntrack,
 				    int dir);
+/* Stop window tracking on a connection whose segments conntrack no
+ * longer sees all of */
+extern void nf_conntrack_tcp_be_liberal(struct nf_conn *conntrack);
 
 /* Call me when a conntrack is destroyed. */
 extern void (*nf_conntrack_destroyed)(struct nf_conn *conntrack);
@@ -255,6 +270,7 @@ extern int nf_conntrack_max;
 
 DECLARE_PER_CPU(struct ip_conntrack_stat, nf_conntrack_stat);
 #define NF_CT_STAT_INC(count) (__get_cpu_var(nf_conntrack_stat).count++)
+#define NF_CT_STAT_ADD(count, n) (__get_cpu_var(nf_conntrack_stat).count += (n))
 
 /* no helper, no nat */
 #define	NF_CT_F_BASIC	0
@@ -13,6 +13,9 @@
 #define _NF_CONNTRACK_CORE_H
 
 #include <linux/netfilter.h>
+#include <linux/mutex.h>
+#include <linux/seqlock.h>
+#include <linux/rcupdate.h>
 #include <net/netfilter/nf_conntrack_l3proto.h>
 #include <net/netfilter/nf_conntrack_l4proto.h>
 #include <net/netfilter/nf_conntrack_ecache.h>
@@ -26,6 +29,7 @@ extern unsigned int nf_conntrack_in(int pf,
 
 extern int nf_conntrack_init(void);
 extern void nf_conntrack_cleanup(void);
+extern int nf_conntrack_set_hashsize(unsigned int hashsize);
 
 struct nf_conntrack_l3proto;
 extern struct nf_conntrack_l3proto *nf_ct_find_l3proto(u_int16_t pf);
@@ -78,9 +82,32 @@ print_tuple(struct seq_file *s, const struct nf_conntrack_tuple *tuple,
 	    struct nf_conntrack_l3proto *l3proto,
 	    struct nf_conntrack_l4proto *proto);
 
-extern struct list_head *nf_conntrack_hash;
+extern struct hlist_head *nf_conntrack_hash;
+extern seqcount_t nf_conntrack_generation;
+extern struct mutex nf_conntrack_hash_mutex;
+extern int nf_conntrack_hash_grow;
 extern struct list_head nf_conntrack_expect_list;
 extern rwlock_t nf_conntrack_lock ;
-extern struct list_head unconfirmed;
+
+/*
+ * Consistent snapshot of the hash table and its size.  Walkers that
+ * must see every entry hold nf_conntrack_hash_mutex, so no resize is
+ * half way through draining the previous table; lockless callers get
+ * a table that stays valid until they leave their RCU read-side
+ * critical section.
+ */
+static inline struct hlist_head *nf_conntrack_get_ht(unsigned int *size)
+{
+	struct hlist_head *hash;
+	unsigned int seq;
+
+	do {
+		seq = read_seqcount_begin(&nf_conntrack_generation);
+		hash = rcu_dereference(nf_conntrack_hash);
+		*size = nf_conntrack_htable_size;
+	} while (read_seqcount_retry(&nf_conntrack_generation, seq));
+
+	return hash;
+}
 
 #endif /* _NF_CONNTRACK_CORE_H */
@@ -71,6 +71,22 @@ static inline void nf_conntrack_event(enum ip_conntrack_events event,
 		atomic_notifier_call_chain(&nf_conntrack_chain, event, ct);
 }
 
+/* Report the end of a confirmed entry, dying or not.  Returns -ENOBUFS
+ * if a listener asked for reliable delivery and could not take it; such
+ * a listener flags the entry rather than stopping the chain, so the
+ * notifiers after it still see the event. */
+static inline int nf_conntrack_destroy_event(struct nf_conn *ct)
+{
+	if (!nf_ct_is_confirmed(ct))
+		return 0;
+
+	clear_bit(IPS_EVENT_LOST_BIT, &ct->status);
+	atomic_notifier_call_chain(&nf_conntrack_chain, IPCT_DESTROY, ct);
+	if (test_and_clear_bit(IPS_EVENT_LOST_BIT, &ct->status))
+		return -ENOBUFS;
+	return 0;
+}
+
 static inline void
 nf_conntrack_expect_event(enum ip_conntrack_expect_events event,
 			  struct nf_conntrack_expect *exp)
@@ -84,6 +100,10 @@ static inline void nf_conntrack_event_cache(enum ip_conntrack_events event,
 					    const struct sk_buff *skb) {}
 static inline void nf_conntrack_event(enum ip_conntrack_events event,
 				      struct nf_conn *ct) {}
+static inline int nf_conntrack_destroy_event(struct nf_conn *ct)
+{
+	return 0;
+}
 static inline void nf_ct_deliver_cached_events(const struct nf_conn *ct) {}
 static inline void
 nf_conntrack_expect_event(enum ip_conntrack_expect_events event,
@@ -91,5 +111,16 @@ nf_conntrack_expect_event(enum ip_conntrack_expect_events event,
 static inline void nf_ct_event_cache_flush(void) {}
 #endif /* CONFIG_NF_CONNTRACK_EVENTS */
 
+/* How long a dying entry waits before its destroy event is retried */
+#define NF_CT_DESTROY_RETRY	(HZ / 10)
+
+/* Have the timer of a dying entry report its destroy event again later.
+ * The caller's reference passes to the timer. */
+static inline void nf_ct_destroy_event_retry(struct nf_conn *ct)
+{
+	ct->timeout.expires = jiffies + NF_CT_DESTROY_RETRY;
+	add_timer(&ct->timeout);
+}
+
 #endif /*_NF_CONNTRACK_ECACHE_H*/
 
@@ -18,6 +18,8 @@
 #include <linux/slab.h>
 #include <linux/spinlock.h>
 #include <linux/types.h>
+#include <linux/rcupdate.h>
+#include <linux/workqueue.h>
 
 #include <net/sock.h>
 
@@ -46,7 +48,7 @@ struct request_sock {
 	struct request_sock		*dl_next; /* Must be first member! */
 	u16				mss;
 	u8				retrans;
-	u8				__pad;
+	u8				syn_lock;  /* index into listen_sock->syn_lock */
 	/* The following two fields can be easily recomputed I think -AK */
 	u32				window_clamp; /* window clamp at creation time */
 	u32				rcv_wnd;	  /* rcv_wnd offered first time */
@@ -81,21 +83,42 @@ static inline void reqsk_free(struct request_sock *req)
 
 extern int sysctl_max_syn_backlog;
 
+#define LISTEN_SOCK_LOCK_BITS	5
+#define LISTEN_SOCK_LOCKS	(1 << LISTEN_SOCK_LOCK_BITS)
+
 /** struct listen_sock - listen state
  *
  * @max_qlen_log - log_2 of maximal queued SYNs/REQUESTs
+ * @syn_lock - striped locks serializing changes to the syn_table chains
+ *
+ * Requests are added to the head of a chain under its syn_lock only, so
+ * SYNs can be queued without the listener lock.  Requests are unlinked
+ * and freed under the listener lock, the syn_lock and %syn_wait_lock.
+ *
+ * Lockless users find the listen_sock under rcu_read_lock(); it is freed
+ * after a grace period.  @dead is set, under every syn_lock in turn, when
+ * the listener stops, so that nothing is added to the emptied chains.
  */
 struct listen_sock {
 	u8			max_qlen_log;
-	/* 3 bytes hole, try to use */
-	int			qlen;
-	int			qlen_young;
+	u8			dead;
+	/* 2 bytes hole, try to use */
+	atomic_t		qlen;
+	atomic_t		qlen_young;
 	int			clock_hand;
 	u32			hash_rnd;
 	u32			nr_table_entries;
+	struct rcu_head		rcu;
+	struct work_struct	free_work;	/* vfree() from the RCU callback */
+	spinlock_t		syn_lock[LISTEN_SOCK_LOCKS];
 	struct request_sock	*syn_table[0];
 };
 
+static inline u8 listen_sock_lock_index(const u32 hash)
+{
+	return hash & (LISTEN_SOCK_LOCKS - 1);
+}
+
 /** struct request_sock_queue - queue of request_socks
  *
  * @rskq_accept_head - FIFO head of established children
@@ -161,8 +184,15 @@ static inline void reqsk_queue_unlink(struct request_sock_queue *queue,
 				      struct request_sock *req,
 				      struct request_sock **prev_req)
 {
+	spinlock_t *lock = &queue->listen_opt->syn_lock[req->syn_lock];
+
 	write_lock(&queue->syn_wait_lock);
+	spin_lock_bh(lock);
+	/* SYNs queued meanwhile may sit between the hint and us. */
+	while (*prev_req != req)
+		prev_req = &(*prev_req)->dl_next;
 	*prev_req = req->dl_next;
+	spin_unlock_bh(lock);
 	write_unlock(&queue->syn_wait_lock);
 }
 
@@ -215,50 +245,70 @@ static inline int reqsk_queue_removed(struct request_sock_queue *queue,
 	struct listen_sock *lopt = queue->listen_opt;
 
 	if (req->retrans == 0)
-		--lopt->qlen_young;
+		atomic_dec(&lopt->qlen_young);
 
-	return --lopt->qlen;
+	return atomic_dec_return(&lopt->qlen);
 }
 
-static inline int reqsk_queue_added(struct request_sock_queue *queue)
+static inline int __reqsk_queue_added(struct listen_sock *lopt)
 {
-	struct listen_sock *lopt = queue->listen_opt;
-	const int prev_qlen = lopt->qlen;
+	atomic_inc(&lopt->qlen_young);
+	return atomic_inc_return(&lopt->qlen) - 1;
+}
 
-	lopt->qlen_young++;
-	lopt->qlen++;
-	return prev_qlen;
+static inline int reqsk_queue_added(struct request_sock_queue *queue)
+{
+	return __reqsk_queue_added(queue->listen_opt);
 }
 
+/* The three below may run without the listener lock, see listen_sock. */
 static inline int reqsk_queue_len(const struct request_sock_queue *queue)
 {
-	return queue->listen_opt != NULL ? queue->listen_opt->qlen : 0;
+	struct listen_sock *lopt = rcu_dereference(queue->listen_opt);
+
+	return lopt != NULL ? atomic_read(&lopt->qlen) : 0;
 }
 
 static inline int reqsk_queue_len_young(const struct request_sock_queue *queue)
 {
-	return queue->listen_opt->qlen_young;
+	struct listen_sock *lopt = rcu_dereference(queue->listen_opt);
+
+	return lopt != NULL ? atomic_read(&lopt->qlen_young) : 0;
 }
 
 static inline int reqsk_queue_is_full(const struct request_sock_queue *queue)
 {
-	return queue->listen_opt->qlen >> queue->listen_opt->max_qlen_log;
+	struct listen_sock *lopt = rcu_dereference(queue->listen_opt);
+
+	return lopt == NULL || atomic_read(&lopt->qlen) >> lopt->max_qlen_log;
 }
 
-static inline void reqsk_queue_hash_req(struct request_sock_queue *queue,
-					u32 hash, struct request_sock *req,
-					unsigned long timeout)
+/* Caller holds lopt->syn_lock[listen_sock_lock_index(hash)]. */
+static inline void __reqsk_queue_hash_req(struct listen_sock *lopt,
+					  u32 hash, struct request_sock *req,
+					  unsigned long timeout)
 {
-	struct listen_sock *lopt = queue->listen_opt;
-
 	req->expires = jiffies + timeout;
 	req->retrans = 0;
 	req->sk = NULL;
-	req->dl_next = lopt->syn_table[hash];
+	req->syn_lock = listen_sock_lock_index(hash);
 
-	write_lock(&queue->syn_wait_lock);
+	req->dl_next = lopt->syn_table[hash];
+	/* Lockless walkers must see a complete request. */
+	smp_wmb();
 	lopt->syn_table[hash] = req;
-	write_unlock(&queue->syn_wait_lock);
+}
+
+static inline void reqsk_queue_hash_req(struct request_sock_queue *queue,
+					u32 hash, struct request_sock *req,
+					unsigned long timeout)
+{
+	struct listen_sock *lopt = queue->listen_opt;
+	spinlock_t *lock = &lopt->syn_lock[listen_sock_lock_index(hash)];
+
+	spin_lock_bh(lock);
+	__reqsk_queue_hash_req(lopt, hash, req, timeout);
+	spin_unlock_bh(lock);
 }
 
 #endif /* _REQUEST_SOCK_H */
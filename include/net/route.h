@@ -48,6 +48,7 @@
 
 struct fib_nh;
 struct inet_peer;
+struct rt_uncached_list;
 struct rtable
 {
 	union
@@ -75,6 +76,11 @@ struct rtable
 	/* Miscellaneous cached information */
 	__be32			rt_spec_dst; /* RFC1122 specific destination */
 	struct inet_peer	*peer; /* long-living peer info */
+
+	/* Uncached (DST_NOCACHE) routes */
+	int			rt_genid;
+	struct list_head	rt_uncached;
+	struct rt_uncached_list	*rt_uncached_list; /* per-CPU list it is on */
 };
 
 struct ip_rt_acct
@@ -113,6 +119,7 @@ extern void		ip_rt_redirect(__be32 old_gw, __be32 dst, __be32 new_gw,
 				       __be32 src, struct net_device *dev);
 extern void		ip_rt_advice(struct rtable **rp, int advice);
 extern void		rt_cache_flush(int how);
+extern void		rt_flush_dev(struct net_device *dev);
 extern int		__ip_route_output_key(struct rtable **, const struct flowi *flp);
 extern int		ip_route_output_key(struct rtable **, struct flowi *flp);
 extern int		ip_route_output_flow(struct rtable **rp, struct flowi *flp, struct sock *sk, int flags);
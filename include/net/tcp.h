@@ -267,6 +267,8 @@ extern void			tcp_v4_err(struct sk_buff *skb, u32);
 
 extern void			tcp_shutdown (struct sock *sk, int how);
 
+extern void			tcp_v4_early_demux(struct sk_buff *skb);
+
 extern int			tcp_v4_rcv(struct sk_buff *skb);
 
 extern int			tcp_v4_remember_stamp(struct sock *sk);
@@ -277,6 +279,9 @@ extern int			tcp_sendmsg(struct kiocb *iocb, struct sock *sk,
 					    struct msghdr *msg, size_t size);
 extern ssize_t			tcp_sendpage(struct socket *sock, struct page *page, int offset, size_t size, int flags);
 
+extern int			tcp_mmap(struct file *file, struct socket *sock,
+					 struct vm_area_struct *vma);
+
 extern int			tcp_ioctl(struct sock *sk, 
 					  int cmd, 
 					  unsigned long arg);
@@ -412,6 +417,7 @@ extern void			tcp_unhash(struct sock *sk);
 /* From syncookies.c */
 extern struct sock *cookie_v4_check(struct sock *sk, struct sk_buff *skb, 
 				    struct ip_options *opt);
+extern int cookie_v4_check_ack(struct sock *sk, struct sk_buff *skb);
 extern __u32 cookie_v4_init_sequence(struct sock *sk, struct sk_buff *skb, 
 				     __u16 *mss);
 
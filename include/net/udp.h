@@ -23,6 +23,8 @@
 #define _UDP_H
 
 #include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/jhash.h>
 #include <net/inet_sock.h>
 #include <net/sock.h>
 #include <net/snmp.h>
@@ -50,13 +52,70 @@ struct udp_skb_cb {
 };
 #define UDP_SKB_CB(__skb)	((struct udp_skb_cb *)((__skb)->cb))
 
-extern struct hlist_head udp_hash[UDP_HTABLE_SIZE];
-extern rwlock_t udp_hash_lock;
+/**
+ *	struct udp_hslot - UDP hash slot
+ *
+ *	@head:	chain of sockets, walked under rcu_read_lock()
+ *	@count:	number of sockets in @head
+ *	@lock:	serializes additions and removals on @head
+ */
+struct udp_hslot {
+	struct hlist_head	head;
+	int			count;
+	spinlock_t		lock;
+} __attribute__((aligned(2 * sizeof(long))));
+
+/**
+ *	struct udp_table - UDP table
+ *
+ *	@hash:	primary hash, keyed by local port
+ *	@hash2:	secondary hash, keyed by (local address, local port)
+ *	@mask:	number of slots in each hash, minus one
+ *	@log:	log2(number of slots in each hash)
+ *
+ *	Both hashes are sized at boot from the amount of memory.  The primary
+ *	hash owns the socket reference and decides which port a socket gets;
+ *	the secondary hash lets a lookup skip the primary slot when many
+ *	sockets share a port, e.g. one per local address.
+ */
+struct udp_table {
+	struct udp_hslot	*hash;
+	struct udp_hslot	*hash2;
+	unsigned int		mask;
+	unsigned int		log;
+};
+extern struct udp_table udp_table;
+extern void udp_table_init(struct udp_table *table, const char *name);
+
+#define UDP_HTABLE_SIZE_MIN	(CONFIG_BASE_SMALL ? 128 : 256)
+
+static inline struct udp_hslot *udp_hashslot(struct udp_table *table,
+					     unsigned int num)
+{
+	return &table->hash[num & table->mask];
+}
+
+static inline struct udp_hslot *udp_hashslot2(struct udp_table *table,
+					      unsigned int hash)
+{
+	return &table->hash2[hash & table->mask];
+}
+
+/* An IPv4 address and the IPv6 address it maps to hash alike, so that
+ * dual-stack sockets are found from either family.
+ */
+static inline unsigned int udp4_portaddr_hash(__be32 saddr, unsigned int port)
+{
+	return jhash_1word((__force u32)saddr, 0) ^ port;
+}
 
 
 /* Note: this must match 'valbool' in sock_setsockopt */
 #define UDP_CSUM_NOXMIT		1
 
+/* Most datagrams one UDP_SEGMENT send may be cut into. */
+#define UDP_MAX_SEGMENTS	(1 << 6)
+
 /* Used by SunRPC/xprt layer. */
 #define UDP_CSUM_NORCV		2
 
@@ -106,21 +165,20 @@ static inline void udp_lib_hash(struct sock *sk)
 	BUG();
 }
 
-static inline void udp_lib_unhash(struct sock *sk)
-{
-	write_lock_bh(&udp_hash_lock);
-	if (sk_del_node_init(sk)) {
-		inet_sk(sk)->num = 0;
-		sock_prot_dec_use(sk->sk_prot);
-	}
-	write_unlock_bh(&udp_hash_lock);
-}
+extern void udp_lib_unhash(struct sock *sk);
+extern void udp_lib_rehash(struct sock *sk, unsigned int newhash);
 
 static inline void udp_lib_close(struct sock *sk, long timeout)
 {
 	sk_common_release(sk);
 }
 
+static inline int udp_lib_init_sock(struct sock *sk)
+{
+	skb_queue_head_init(&udp_sk(sk)->reader_queue);
+	return 0;
+}
+
 
 /* net/ipv4/udp.c */
 extern int	udp_get_port(struct sock *sk, unsigned short snum,
@@ -129,8 +187,16 @@ extern void	udp_err(struct sk_buff *, u32);
 
 extern int	udp_sendmsg(struct kiocb *iocb, struct sock *sk,
 			    struct msghdr *msg, size_t len);
+extern int	udp_cmsg_send(struct msghdr *msg, u16 *gso_size);
+extern int	udp4_gso_send_check(struct sk_buff *skb);
+extern struct sk_buff *udp4_gso_segment(struct sk_buff *skb, int features);
 
 extern int	udp_rcv(struct sk_buff *skb);
+extern struct sk_buff *udp_recv_datagram(struct sock *sk, unsigned int flags,
+					 int noblock, int *err);
+extern void	udp_kill_datagram(struct sock *sk, struct sk_buff *skb,
+				  unsigned int flags);
+extern void	udp_purge_reader_queue(struct sock *sk);
 extern int	udp_ioctl(struct sock *sk, int cmd, unsigned long arg);
 extern int	udp_disconnect(struct sock *sk, int flags);
 extern unsigned int udp_poll(struct file *file, struct socket *sock,
@@ -157,14 +223,14 @@ struct udp_seq_afinfo {
 	struct module		*owner;
 	char			*name;
 	sa_family_t		family;
-	struct hlist_head	*hashtable;
+	struct udp_table	*udp_table;
 	int 			(*seq_show) (struct seq_file *m, void *v);
 	struct file_operations	*seq_fops;
 };
 
 struct udp_iter_state {
 	sa_family_t		family;
-	struct hlist_head	*hashtable;
+	struct udp_table	*udp_table;
 	int			bucket;
 	struct seq_operations	seq_ops;
 };
@@ -196,34 +196,56 @@ static void rcu_barrier_callback(struct rcu_head *notused)
 
 /*
  * Called with preemption disabled, and from cross-cpu IRQ context.
+ * A non-NULL argument asks for the _bh flavour.
  */
-static void rcu_barrier_func(void *notused)
+static void rcu_barrier_func(void *bh)
 {
 	int cpu = smp_processor_id();
-	struct rcu_data *rdp = &per_cpu(rcu_data, cpu);
+	struct rcu_data *rdp;
 	struct rcu_head *head;
 
-	head = &rdp->barrier;
 	atomic_inc(&rcu_barrier_cpu_count);
-	call_rcu(head, rcu_barrier_callback);
+	if (bh) {
+		rdp = &per_cpu(rcu_bh_data, cpu);
+		head = &rdp->barrier;
+		call_rcu_bh(head, rcu_barrier_callback);
+	} else {
+		rdp = &per_cpu(rcu_data, cpu);
+		head = &rdp->barrier;
+		call_rcu(head, rcu_barrier_callback);
+	}
 }
 
-/**
- * rcu_barrier - Wait until all the in-flight RCUs are complete.
- */
-void rcu_barrier(void)
+static void __rcu_barrier(void *bh)
 {
 	BUG_ON(in_interrupt());
 	/* Take cpucontrol mutex to protect against CPU hotplug */
 	mutex_lock(&rcu_barrier_mutex);
 	init_completion(&rcu_barrier_completion);
 	atomic_set(&rcu_barrier_cpu_count, 0);
-	on_each_cpu(rcu_barrier_func, NULL, 0, 1);
+	on_each_cpu(rcu_barrier_func, bh, 0, 1);
 	wait_for_completion(&rcu_barrier_completion);
 	mutex_unlock(&rcu_barrier_mutex);
 }
+
+/**
+ * rcu_barrier - Wait until all the in-flight RCUs are complete.
+ */
+void rcu_barrier(void)
+{
+	__rcu_barrier(NULL);
+}
 EXPORT_SYMBOL_GPL(rcu_barrier);
 
+/**
+ * rcu_barrier_bh - Wait until all the in-flight call_rcu_bh()s are complete.
+ */
+void rcu_barrier_bh(void)
+{
+	__rcu_barrier((void *)1);
+}
+EXPORT_SYMBOL_GPL(rcu_barrier_bh);
+
 /*
  * Invoke the completed RCU callbacks. They are expected to be in
  * a per-cpu list.
@@ -117,18 +117,29 @@ unsigned long neigh_rand_reach_time(unsigned long base)
 }
 
 
+/*
+ * Forced GC runs from neigh_alloc() when the table is over gc_thresh2/3.
+ * Rather than sweeping every chain each time, it resumes where the last
+ * run stopped and quits as soon as the table is back under gc_thresh2.
+ */
 static int neigh_forced_gc(struct neigh_table *tbl)
 {
+	struct neigh_hash_table *nht;
 	int shrunk = 0;
-	int i;
+	unsigned int i, chain = 0;
 
 	NEIGH_CACHE_STAT_INC(tbl, forced_gc_runs);
 
 	write_lock_bh(&tbl->lock);
-	for (i = 0; i <= tbl->hash_mask; i++) {
+	nht = tbl->nht;
+	for (i = 0; i <= nht->hash_mask; i++) {
 		struct neighbour *n, **np;
 
-		np = &tbl->hash_buckets[i];
+		if (shrunk && atomic_read(&tbl->entries) < tbl->gc_thresh2)
+			break;
+
+		chain = (tbl->hash_chain_forced_gc + i) & nht->hash_mask;
+		np = &nht->hash_buckets[chain];
 		while ((n = *np) != NULL) {
 			/* Neighbour record may be discarded if:
 			 * - nobody refers to it.
@@ -149,6 +160,7 @@ static int neigh_forced_gc(struct neigh_table *tbl)
 		}
 	}
 
+	tbl->hash_chain_forced_gc = (chain + 1) & nht->hash_mask;
 	tbl->last_flush = jiffies;
 
 	write_unlock_bh(&tbl->lock);
@@ -178,10 +190,11 @@ static void pneigh_queue_purge(struct sk_buff_head *list)
 
 static void neigh_flush_dev(struct neigh_table *tbl, struct net_device *dev)
 {
+	struct neigh_hash_table *nht = tbl->nht;
 	int i;
 
-	for (i = 0; i <= tbl->hash_mask; i++) {
-		struct neighbour *n, **np = &tbl->hash_buckets[i];
+	for (i = 0; i <= nht->hash_mask; i++) {
+		struct neighbour *n, **np = &nht->hash_buckets[i];
 
 		while ((n = *np) != NULL) {
 			if (dev && n->dev != dev) {
@@ -259,6 +272,7 @@ static struct neighbour *neigh_alloc(struct neigh_table *tbl)
 
 	skb_queue_head_init(&n->arp_queue);
 	rwlock_init(&n->lock);
+	seqlock_init(&n->ha_lock);
 	n->updated	  = n->used = now;
 	n->nud_state	  = NUD_NONE;
 	n->output	  = neigh_blackhole;
@@ -279,104 +293,129 @@ out_entries:
 	goto out;
 }
 
-static struct neighbour **neigh_hash_alloc(unsigned int entries)
+static struct neigh_hash_table *neigh_hash_alloc(unsigned int entries)
 {
 	unsigned long size = entries * sizeof(struct neighbour *);
-	struct neighbour **ret;
+	struct neigh_hash_table *nht;
+
+	nht = kmalloc(sizeof(*nht), GFP_ATOMIC);
+	if (!nht)
+		return NULL;
 
 	if (size <= PAGE_SIZE) {
-		ret = kzalloc(size, GFP_ATOMIC);
+		nht->hash_buckets = kzalloc(size, GFP_ATOMIC);
 	} else {
-		ret = (struct neighbour **)
+		nht->hash_buckets = (struct neighbour **)
 		      __get_free_pages(GFP_ATOMIC|__GFP_ZERO, get_order(size));
 	}
-	return ret;
+	if (!nht->hash_buckets) {
+		kfree(nht);
+		return NULL;
+	}
+	nht->hash_mask = entries - 1;
+	get_random_bytes(&nht->hash_rnd, sizeof(nht->hash_rnd));
+	return nht;
 }
 
-static void neigh_hash_free(struct neighbour **hash, unsigned int entries)
+static void neigh_hash_free_rcu(struct rcu_head *head)
 {
-	unsigned long size = entries * sizeof(struct neighbour *);
+	struct neigh_hash_table *nht = container_of(head,
+						    struct neigh_hash_table,
+						    rcu);
+	unsigned long size = (nht->hash_mask + 1) * sizeof(struct neighbour *);
 
 	if (size <= PAGE_SIZE)
-		kfree(hash);
+		kfree(nht->hash_buckets);
 	else
-		free_pages((unsigned long)hash, get_order(size));
+		free_pages((unsigned long)nht->hash_buckets, get_order(size));
+	kfree(nht);
 }
 
+/*
+ * Entries are relinked into the new table in place, so a lookup racing
+ * with the grow may follow a chain into the new table and miss.  That is
+ * harmless: callers fall back to neigh_create(), which rechecks under
+ * tbl->lock.  Lookups never block on the grow.
+ */
 static void neigh_hash_grow(struct neigh_table *tbl, unsigned long new_entries)
 {
-	struct neighbour **new_hash, **old_hash;
-	unsigned int i, new_hash_mask, old_entries;
+	struct neigh_hash_table *new_nht, *old_nht = tbl->nht;
+	unsigned int i;
 
 	NEIGH_CACHE_STAT_INC(tbl, hash_grows);
 
 	BUG_ON(new_entries & (new_entries - 1));
-	new_hash = neigh_hash_alloc(new_entries);
-	if (!new_hash)
+	new_nht = neigh_hash_alloc(new_entries);
+	if (!new_nht)
 		return;
 
-	old_entries = tbl->hash_mask + 1;
-	new_hash_mask = new_entries - 1;
-	old_hash = tbl->hash_buckets;
-
-	get_random_bytes(&tbl->hash_rnd, sizeof(tbl->hash_rnd));
-	for (i = 0; i < old_entries; i++) {
+	for (i = 0; i <= old_nht->hash_mask; i++) {
 		struct neighbour *n, *next;
 
-		for (n = old_hash[i]; n; n = next) {
-			unsigned int hash_val = tbl->hash(n->primary_key, n->dev);
+		for (n = old_nht->hash_buckets[i]; n; n = next) {
+			unsigned int hash_val = tbl->hash(n->primary_key, n->dev,
+							  new_nht->hash_rnd);
 
-			hash_val &= new_hash_mask;
+			hash_val &= new_nht->hash_mask;
 			next = n->next;
 
-			n->next = new_hash[hash_val];
-			new_hash[hash_val] = n;
+			rcu_assign_pointer(n->next,
+					   new_nht->hash_buckets[hash_val]);
+			rcu_assign_pointer(new_nht->hash_buckets[hash_val], n);
 		}
 	}
-	tbl->hash_buckets = new_hash;
-	tbl->hash_mask = new_hash_mask;
-
-	neigh_hash_free(old_hash, old_entries);
+	rcu_assign_pointer(tbl->nht, new_nht);
+	call_rcu_bh(&old_nht->rcu, neigh_hash_free_rcu);
 }
 
 struct neighbour *neigh_lookup(struct neigh_table *tbl, const void *pkey,
 			       struct net_device *dev)
 {
+	struct neigh_hash_table *nht;
 	struct neighbour *n;
 	int key_len = tbl->key_len;
-	u32 hash_val = tbl->hash(pkey, dev);
+	u32 hash_val;
 	
 	NEIGH_CACHE_STAT_INC(tbl, lookups);
 
-	read_lock_bh(&tbl->lock);
-	for (n = tbl->hash_buckets[hash_val & tbl->hash_mask]; n; n = n->next) {
+	rcu_read_lock_bh();
+	nht = rcu_dereference(tbl->nht);
+	hash_val = tbl->hash(pkey, dev, nht->hash_rnd) & nht->hash_mask;
+	for (n = rcu_dereference(nht->hash_buckets[hash_val]); n;
+	     n = rcu_dereference(n->next)) {
 		if (dev == n->dev && !memcmp(n->primary_key, pkey, key_len)) {
-			neigh_hold(n);
+			if (!atomic_inc_not_zero(&n->refcnt))
+				n = NULL;
 			NEIGH_CACHE_STAT_INC(tbl, hits);
 			break;
 		}
 	}
-	read_unlock_bh(&tbl->lock);
+	rcu_read_unlock_bh();
 	return n;
 }
 
 struct neighbour *neigh_lookup_nodev(struct neigh_table *tbl, const void *pkey)
 {
+	struct neigh_hash_table *nht;
 	struct neighbour *n;
 	int key_len = tbl->key_len;
-	u32 hash_val = tbl->hash(pkey, NULL);
+	u32 hash_val;
 
 	NEIGH_CACHE_STAT_INC(tbl, lookups);
 
-	read_lock_bh(&tbl->lock);
-	for (n = tbl->hash_buckets[hash_val & tbl->hash_mask]; n; n = n->next) {
+	rcu_read_lock_bh();
+	nht = rcu_dereference(tbl->nht);
+	hash_val = tbl->hash(pkey, NULL, nht->hash_rnd) & nht->hash_mask;
+	for (n = rcu_dereference(nht->hash_buckets[hash_val]); n;
+	     n = rcu_dereference(n->next)) {
 		if (!memcmp(n->primary_key, pkey, key_len)) {
-			neigh_hold(n);
+			if (!atomic_inc_not_zero(&n->refcnt))
+				n = NULL;
 			NEIGH_CACHE_STAT_INC(tbl, hits);
 			break;
 		}
 	}
-	read_unlock_bh(&tbl->lock);
+	rcu_read_unlock_bh();
 	return n;
 }
 
@@ -386,6 +425,7 @@ struct neighbour *neigh_create(struct neigh_table *tbl, const void *pkey,
 	u32 hash_val;
 	int key_len = tbl->key_len;
 	int error;
+	struct neigh_hash_table *nht;
 	struct neighbour *n1, *rc, *n = neigh_alloc(tbl);
 
 	if (!n) {
@@ -414,17 +454,20 @@ struct neighbour *neigh_create(struct neigh_table *tbl, const void *pkey,
 
 	write_lock_bh(&tbl->lock);
 
-	if (atomic_read(&tbl->entries) > (tbl->hash_mask + 1))
-		neigh_hash_grow(tbl, (tbl->hash_mask + 1) << 1);
+	nht = tbl->nht;
+	if (atomic_read(&tbl->entries) > (nht->hash_mask + 1)) {
+		neigh_hash_grow(tbl, (nht->hash_mask + 1) << 1);
+		nht = tbl->nht;
+	}
 
-	hash_val = tbl->hash(pkey, dev) & tbl->hash_mask;
+	hash_val = tbl->hash(pkey, dev, nht->hash_rnd) & nht->hash_mask;
 
 	if (n->parms->dead) {
 		rc = ERR_PTR(-EINVAL);
 		goto out_tbl_unlock;
 	}
 
-	for (n1 = tbl->hash_buckets[hash_val]; n1; n1 = n1->next) {
+	for (n1 = nht->hash_buckets[hash_val]; n1; n1 = n1->next) {
 		if (dev == n1->dev && !memcmp(n1->primary_key, pkey, key_len)) {
 			neigh_hold(n1);
 			rc = n1;
@@ -432,10 +475,10 @@ struct neighbour *neigh_create(struct neigh_table *tbl, const void *pkey,
 		}
 	}
 
-	n->next = tbl->hash_buckets[hash_val];
-	tbl->hash_buckets[hash_val] = n;
 	n->dead = 0;
 	neigh_hold(n);
+	n->next = nht->hash_buckets[hash_val];
+	rcu_assign_pointer(nht->hash_buckets[hash_val], n);
 	write_unlock_bh(&tbl->lock);
 	NEIGH_PRINTK2("neigh %p is created.\n", n);
 	rc = n;
@@ -554,6 +597,13 @@ static int pneigh_ifdown(struct neigh_table *tbl, struct net_device *dev)
 }
 
 
+static void neigh_free_rcu(struct rcu_head *head)
+{
+	struct neighbour *neigh = container_of(head, struct neighbour, rcu);
+
+	kmem_cache_free(neigh->tbl->kmem_cachep, neigh);
+}
+
 /*
  *	neighbour must already be out of the table;
  *
@@ -596,7 +646,7 @@ void neigh_destroy(struct neighbour *neigh)
 	NEIGH_PRINTK2("neigh %p is destroyed.\n", neigh);
 
 	atomic_dec(&neigh->tbl->entries);
-	kmem_cache_free(neigh->tbl->kmem_cachep, neigh);
+	call_rcu_bh(&neigh->rcu, neigh_free_rcu);
 }
 
 /* Neighbour state is suspicious;
@@ -636,6 +686,7 @@ static void neigh_connect(struct neighbour *neigh)
 static void neigh_periodic_timer(unsigned long arg)
 {
 	struct neigh_table *tbl = (struct neigh_table *)arg;
+	struct neigh_hash_table *nht;
 	struct neighbour *n, **np;
 	unsigned long expire, now = jiffies;
 
@@ -655,8 +706,9 @@ static void neigh_periodic_timer(unsigned long arg)
 				neigh_rand_reach_time(p->base_reachable_time);
 	}
 
-	np = &tbl->hash_buckets[tbl->hash_chain_gc];
-	tbl->hash_chain_gc = ((tbl->hash_chain_gc + 1) & tbl->hash_mask);
+	nht = tbl->nht;
+	np = &nht->hash_buckets[tbl->hash_chain_gc & nht->hash_mask];
+	tbl->hash_chain_gc = ((tbl->hash_chain_gc + 1) & nht->hash_mask);
 
 	while ((n = *np) != NULL) {
 		unsigned int state;
@@ -692,7 +744,7 @@ next_elt:
  	 * base_reachable_time.
 	 */
 	expire = tbl->parms.base_reachable_time >> 1;
-	expire /= (tbl->hash_mask + 1);
+	expire /= (nht->hash_mask + 1);
 	if (!expire)
 		expire = 1;
 
@@ -1020,7 +1072,9 @@ int neigh_update(struct neighbour *neigh, const u8 *lladdr, u8 new,
 	}
 
 	if (lladdr != neigh->ha) {
+		write_seqlock(&neigh->ha_lock);
 		memcpy(&neigh->ha, lladdr, dev->addr_len);
+		write_sequnlock(&neigh->ha_lock);
 		neigh_update_hhs(neigh);
 		if (!(new & NUD_CONNECTED))
 			neigh->confirmed = jiffies -
@@ -1157,10 +1211,16 @@ int neigh_resolve_output(struct sk_buff *skb)
 					       neigh->ha, NULL, skb->len);
 			write_unlock_bh(&neigh->lock);
 		} else {
-			read_lock_bh(&neigh->lock);
-			err = dev->hard_header(skb, dev, ntohs(skb->protocol),
-					       neigh->ha, NULL, skb->len);
-			read_unlock_bh(&neigh->lock);
+			unsigned int seq;
+
+			do {
+				__skb_pull(skb, skb->nh.raw - skb->data);
+				seq = read_seqbegin(&neigh->ha_lock);
+				err = dev->hard_header(skb, dev,
+						       ntohs(skb->protocol),
+						       neigh->ha, NULL,
+						       skb->len);
+			} while (read_seqretry(&neigh->ha_lock, seq));
 		}
 		if (err >= 0)
 			rc = neigh->ops->queue_xmit(skb);
@@ -1186,13 +1246,15 @@ int neigh_connected_output(struct sk_buff *skb)
 	struct dst_entry *dst = skb->dst;
 	struct neighbour *neigh = dst->neighbour;
 	struct net_device *dev = neigh->dev;
-
-	__skb_pull(skb, skb->nh.raw - skb->data);
-
-	read_lock_bh(&neigh->lock);
-	err = dev->hard_header(skb, dev, ntohs(skb->protocol),
-			       neigh->ha, NULL, skb->len);
-	read_unlock_bh(&neigh->lock);
+	unsigned int seq;
+
+	/* Lockless against neigh_update(); retry if ha changed under us */
+	do {
+		__skb_pull(skb, skb->nh.raw - skb->data);
+		seq = read_seqbegin(&neigh->ha_lock);
+		err = dev->hard_header(skb, dev, ntohs(skb->protocol),
+				       neigh->ha, NULL, skb->len);
+	} while (read_seqretry(&neigh->ha_lock, seq));
 	if (err >= 0)
 		err = neigh->ops->queue_xmit(skb);
 	else {
@@ -1355,17 +1417,14 @@ void neigh_table_init_no_netlink(struct neigh_table *tbl)
 	tbl->pde->data = tbl;
 #endif
 
-	tbl->hash_mask = 1;
-	tbl->hash_buckets = neigh_hash_alloc(tbl->hash_mask + 1);
+	tbl->nht = neigh_hash_alloc(2);
 
 	phsize = (PNEIGH_HASHMASK + 1) * sizeof(struct pneigh_entry *);
 	tbl->phash_buckets = kzalloc(phsize, GFP_KERNEL);
 
-	if (!tbl->hash_buckets || !tbl->phash_buckets)
+	if (!tbl->nht || !tbl->phash_buckets)
 		panic("cannot allocate neighbour cache hashes");
 
-	get_random_bytes(&tbl->hash_rnd, sizeof(tbl->hash_rnd));
-
 	rwlock_init(&tbl->lock);
 	init_timer(&tbl->gc_timer);
 	tbl->gc_timer.data     = (unsigned long)tbl;
@@ -1423,8 +1482,8 @@ int neigh_table_clear(struct neigh_table *tbl)
 	}
 	write_unlock(&neigh_tbl_lock);
 
-	neigh_hash_free(tbl->hash_buckets, tbl->hash_mask + 1);
-	tbl->hash_buckets = NULL;
+	call_rcu_bh(&tbl->nht->rcu, neigh_hash_free_rcu);
+	tbl->nht = NULL;
 
 	kfree(tbl->phash_buckets);
 	tbl->phash_buckets = NULL;
@@ -1432,6 +1491,9 @@ int neigh_table_clear(struct neigh_table *tbl)
 	free_percpu(tbl->stats);
 	tbl->stats = NULL;
 
+	/* neigh_free_rcu() still needs tbl, which may be module data */
+	rcu_barrier_bh();
+
 	return 0;
 }
 
@@ -1663,8 +1725,8 @@ static int neightbl_fill_info(struct sk_buff *skb, struct neigh_table *tbl,
 			.ndtc_entries		= atomic_read(&tbl->entries),
 			.ndtc_last_flush	= jiffies_to_msecs(flush_delta),
 			.ndtc_last_rand		= jiffies_to_msecs(rand_delta),
-			.ndtc_hash_rnd		= tbl->hash_rnd,
-			.ndtc_hash_mask		= tbl->hash_mask,
+			.ndtc_hash_rnd		= tbl->nht->hash_rnd,
+			.ndtc_hash_mask		= tbl->nht->hash_mask,
 			.ndtc_hash_chain_gc	= tbl->hash_chain_gc,
 			.ndtc_proxy_qlen	= tbl->proxy_queue.qlen,
 		};
@@ -1994,17 +2056,19 @@ nla_put_failure:
 static int neigh_dump_table(struct neigh_table *tbl, struct sk_buff *skb,
 			    struct netlink_callback *cb)
 {
+	struct neigh_hash_table *nht;
 	struct neighbour *n;
 	int rc, h, s_h = cb->args[1];
 	int idx, s_idx = idx = cb->args[2];
 
 	read_lock_bh(&tbl->lock);
-	for (h = 0; h <= tbl->hash_mask; h++) {
+	nht = tbl->nht;
+	for (h = 0; h <= nht->hash_mask; h++) {
 		if (h < s_h)
 			continue;
 		if (h > s_h)
 			s_idx = 0;
-		for (n = tbl->hash_buckets[h], idx = 0; n; n = n->next, idx++) {
+		for (n = nht->hash_buckets[h], idx = 0; n; n = n->next, idx++) {
 			if (idx < s_idx)
 				continue;
 			if (neigh_fill_info(skb, n, NETLINK_CB(cb->skb).pid,
@@ -2051,13 +2115,15 @@ int neigh_dump_info(struct sk_buff *skb, struct netlink_callback *cb)
 
 void neigh_for_each(struct neigh_table *tbl, void (*cb)(struct neighbour *, void *), void *cookie)
 {
+	struct neigh_hash_table *nht;
 	int chain;
 
 	read_lock_bh(&tbl->lock);
-	for (chain = 0; chain <= tbl->hash_mask; chain++) {
+	nht = tbl->nht;
+	for (chain = 0; chain <= nht->hash_mask; chain++) {
 		struct neighbour *n;
 
-		for (n = tbl->hash_buckets[chain]; n; n = n->next)
+		for (n = nht->hash_buckets[chain]; n; n = n->next)
 			cb(n, cookie);
 	}
 	read_unlock_bh(&tbl->lock);
@@ -2068,12 +2134,13 @@ EXPORT_SYMBOL(neigh_for_each);
 void __neigh_for_each_release(struct neigh_table *tbl,
 			      int (*cb)(struct neighbour *))
 {
+	struct neigh_hash_table *nht = tbl->nht;
 	int chain;
 
-	for (chain = 0; chain <= tbl->hash_mask; chain++) {
+	for (chain = 0; chain <= nht->hash_mask; chain++) {
 		struct neighbour *n, **np;
 
-		np = &tbl->hash_buckets[chain];
+		np = &nht->hash_buckets[chain];
 		while ((n = *np) != NULL) {
 			int release;
 
@@ -2102,8 +2169,8 @@ static struct neighbour *neigh_get_first(struct seq_file *seq)
 	int bucket = state->bucket;
 
 	state->flags &= ~NEIGH_SEQ_IS_PNEIGH;
-	for (bucket = 0; bucket <= tbl->hash_mask; bucket++) {
-		n = tbl->hash_buckets[bucket];
+	for (bucket = 0; bucket <= tbl->nht->hash_mask; bucket++) {
+		n = tbl->nht->hash_buckets[bucket];
 
 		while (n) {
 			if (state->neigh_sub_iter) {
@@ -2164,10 +2231,10 @@ static struct neighbour *neigh_get_next(struct seq_file *seq,
 		if (n)
 			break;
 
-		if (++state->bucket > tbl->hash_mask)
+		if (++state->bucket > tbl->nht->hash_mask)
 			break;
 
-		n = tbl->hash_buckets[state->bucket];
+		n = tbl->nht->hash_buckets[state->bucket];
 	}
 
 	if (n && pos)
@@ -39,6 +39,7 @@ int reqsk_queue_alloc(struct request_sock_queue *queue,
 {
 	size_t lopt_size = sizeof(struct listen_sock);
 	struct listen_sock *lopt;
+	int i;
 
 	nr_table_entries = min_t(u32, nr_table_entries, sysctl_max_syn_backlog);
 	nr_table_entries = max_t(u32, nr_table_entries, 8);
@@ -57,13 +58,16 @@ int reqsk_queue_alloc(struct request_sock_queue *queue,
 	     (1 << lopt->max_qlen_log) < nr_table_entries;
 	     lopt->max_qlen_log++);
 
+	for (i = 0; i < LISTEN_SOCK_LOCKS; i++)
+		spin_lock_init(&lopt->syn_lock[i]);
+
 	get_random_bytes(&lopt->hash_rnd, sizeof(lopt->hash_rnd));
 	rwlock_init(&queue->syn_wait_lock);
 	queue->rskq_accept_head = NULL;
 	lopt->nr_table_entries = nr_table_entries;
 
 	write_lock_bh(&queue->syn_wait_lock);
-	queue->listen_opt = lopt;
+	rcu_assign_pointer(queue->listen_opt, lopt);
 	write_unlock_bh(&queue->syn_wait_lock);
 
 	return 0;
@@ -71,32 +75,58 @@ int reqsk_queue_alloc(struct request_sock_queue *queue,
 
 EXPORT_SYMBOL(reqsk_queue_alloc);
 
-void reqsk_queue_destroy(struct request_sock_queue *queue)
+static void reqsk_queue_free_work(struct work_struct *work)
 {
-	/* make all the listen_opt local to us */
-	struct listen_sock *lopt = reqsk_queue_yank_listen_sk(queue);
+	vfree(container_of(work, struct listen_sock, free_work));
+}
+
+static void reqsk_queue_free_rcu(struct rcu_head *head)
+{
+	struct listen_sock *lopt = container_of(head, struct listen_sock, rcu);
 	size_t lopt_size = sizeof(struct listen_sock) +
 		lopt->nr_table_entries * sizeof(struct request_sock *);
 
-	if (lopt->qlen != 0) {
-		unsigned int i;
-
-		for (i = 0; i < lopt->nr_table_entries; i++) {
-			struct request_sock *req;
+	if (lopt_size > PAGE_SIZE) {
+		INIT_WORK(&lopt->free_work, reqsk_queue_free_work);
+		schedule_work(&lopt->free_work);
+	} else
+		kfree(lopt);
+}
 
+void reqsk_queue_destroy(struct request_sock_queue *queue)
+{
+	/* make all the listen_opt local to us */
+	struct listen_sock *lopt = reqsk_queue_yank_listen_sk(queue);
+	unsigned int i, l;
+
+	/*
+	 * SYNs handled without the listener lock may still be queueing
+	 * requests: close each chain to them under its lock, free what
+	 * was queued, and the listen_sock once they are all gone.
+	 */
+	lopt->dead = 1;
+	for (l = 0; l < LISTEN_SOCK_LOCKS; l++) {
+		struct request_sock *req, *list = NULL;
+
+		spin_lock_bh(&lopt->syn_lock[l]);
+		for (i = l; i < lopt->nr_table_entries; i += LISTEN_SOCK_LOCKS) {
 			while ((req = lopt->syn_table[i]) != NULL) {
 				lopt->syn_table[i] = req->dl_next;
-				lopt->qlen--;
-				reqsk_free(req);
+				req->dl_next = list;
+				list = req;
 			}
 		}
+		spin_unlock_bh(&lopt->syn_lock[l]);
+
+		while ((req = list) != NULL) {
+			list = req->dl_next;
+			atomic_dec(&lopt->qlen);
+			reqsk_free(req);
+		}
 	}
 
-	BUG_TRAP(lopt->qlen == 0);
-	if (lopt_size > PAGE_SIZE)
-		vfree(lopt);
-	else
-		kfree(lopt);
+	BUG_TRAP(atomic_read(&lopt->qlen) == 0);
+	call_rcu(&lopt->rcu, reqsk_queue_free_rcu);
 }
 
 EXPORT_SYMBOL(reqsk_queue_destroy);
@@ -62,6 +62,7 @@
 #include <net/sock.h>
 #include <net/checksum.h>
 #include <net/xfrm.h>
+#include <linux/errqueue.h>
 
 #include <asm/uaccess.h>
 #include <asm/system.h>
@@ -179,6 +180,7 @@ struct sk_buff *__alloc_skb(unsigned int size, gfp_t gfp_mask,
 	shinfo->gso_type = 0;
 	shinfo->ip6_frag_id = 0;
 	shinfo->frag_list = NULL;
+	shinfo->zerocopy = NULL;
 
 	if (fclone) {
 		struct sk_buff *child = skb + 1;
@@ -244,6 +246,7 @@ struct sk_buff *alloc_skb_from_cache(struct kmem_cache *cp,
 	skb_shinfo(skb)->gso_segs = 0;
 	skb_shinfo(skb)->gso_type = 0;
 	skb_shinfo(skb)->frag_list = NULL;
+	skb_shinfo(skb)->zerocopy = NULL;
 out:
 	return skb;
 nodata:
@@ -305,6 +308,20 @@ static void skb_clone_fraglist(struct sk_buff *skb)
 		skb_get(list);
 }
 
+/* Make @skb hold the zerocopy notification of @orig, if any.  Used
+ * whenever frags are shared into a fresh skb_shared_info.
+ */
+static inline void skb_zerocopy_clone(struct sk_buff *skb,
+				      struct sk_buff *orig)
+{
+	struct sk_buff *zskb = skb_shinfo(orig)->zerocopy;
+
+	if (zskb && !skb_shinfo(skb)->zerocopy) {
+		skb_zerocopy_get(zskb);
+		skb_shinfo(skb)->zerocopy = zskb;
+	}
+}
+
 static void skb_release_data(struct sk_buff *skb)
 {
 	if (!skb->cloned ||
@@ -319,6 +336,9 @@ static void skb_release_data(struct sk_buff *skb)
 		if (skb_shinfo(skb)->frag_list)
 			skb_drop_fraglist(skb);
 
+		if (skb_shinfo(skb)->zerocopy)
+			skb_zerocopy_put(skb_shinfo(skb)->zerocopy);
+
 		kfree(skb->head);
 	}
 }
@@ -654,6 +674,7 @@ struct sk_buff *pskb_copy(struct sk_buff *skb, gfp_t gfp_mask)
 			get_page(skb_shinfo(n)->frags[i].page);
 		}
 		skb_shinfo(n)->nr_frags = i;
+		skb_zerocopy_clone(n, skb);
 	}
 
 	if (skb_shinfo(skb)->frag_list) {
@@ -710,6 +731,9 @@ int pskb_expand_head(struct sk_buff *skb, int nhead, int ntail,
 	if (skb_shinfo(skb)->frag_list)
 		skb_clone_fraglist(skb);
 
+	if (skb_shinfo(skb)->zerocopy)
+		skb_zerocopy_get(skb_shinfo(skb)->zerocopy);
+
 	skb_release_data(skb);
 
 	off = (data + nhead) - skb->head;
@@ -1662,6 +1686,7 @@ void skb_split(struct sk_buff *skb, struct sk_buff *skb1, const u32 len)
 {
 	int pos = skb_headlen(skb);
 
+	skb_zerocopy_clone(skb1, skb);
 	if (len < pos)	/* Split line is inside header. */
 		skb_split_inside_header(skb, skb1, len, pos);
 	else		/* Second chunk has no header, nothing to copy. */
@@ -2028,6 +2053,8 @@ struct sk_buff *skb_segment(struct sk_buff *skb, int features)
 		}
 
 		skb_shinfo(nskb)->nr_frags = k;
+		if (k)
+			skb_zerocopy_clone(nskb, skb);
 		nskb->data_len = len - hsize;
 		nskb->len += nskb->data_len;
 		nskb->truesize += nskb->data_len;
@@ -2045,6 +2072,131 @@ err:
 
 EXPORT_SYMBOL_GPL(skb_segment);
 
+/**
+ *	skb_zerocopy_alloc - allocate a zerocopy completion notification
+ *	@sk: socket the user data is sent on
+ *
+ *	Allocate the notification skb for one %MSG_ZEROCOPY send and assign
+ *	it the next id of @sk.  The caller owns the only reference and must
+ *	hold the socket lock.  Returns %NULL on allocation failure.
+ */
+struct sk_buff *skb_zerocopy_alloc(struct sock *sk)
+{
+	struct skb_zerocopy_cb *zc;
+	struct sk_buff *zskb;
+
+	zskb = alloc_skb(0, sk->sk_allocation);
+	if (!zskb)
+		return NULL;
+
+	zc = SKB_ZEROCOPY_CB(zskb);
+	atomic_set(&zc->refcnt, 1);
+	zc->id = sk->sk_zckey++;
+	zc->copied = 0;
+
+	sock_hold(sk);
+	zskb->sk = sk;
+	return zskb;
+}
+
+EXPORT_SYMBOL_GPL(skb_zerocopy_alloc);
+
+/* Try to extend the range of the notification at the tail of the error
+ * queue instead of queueing another one.
+ */
+static int skb_zerocopy_merge(struct sock *sk, u32 id, u8 code)
+{
+	struct sk_buff *tail;
+	struct sock_exterr_skb *serr;
+	unsigned long flags;
+	int merged = 0;
+
+	spin_lock_irqsave(&sk->sk_error_queue.lock, flags);
+	tail = skb_peek_tail(&sk->sk_error_queue);
+	if (tail) {
+		serr = SKB_EXT_ERR(tail);
+		if (serr->ee.ee_origin == SO_EE_ORIGIN_ZEROCOPY &&
+		    serr->ee.ee_code == code && serr->ee.ee_data + 1 == id) {
+			serr->ee.ee_data = id;
+			merged = 1;
+		}
+	}
+	spin_unlock_irqrestore(&sk->sk_error_queue.lock, flags);
+	return merged;
+}
+
+/**
+ *	skb_zerocopy_put - release a reference to a zerocopy notification
+ *	@zskb: notification from skb_zerocopy_alloc()
+ *
+ *	When the last reference is gone the user pages are no longer used
+ *	by the stack and the notification is queued on the socket error
+ *	queue, with the send id in both ee_info and ee_data.  Consecutive
+ *	completions are merged into one [ee_info, ee_data] range.
+ */
+void skb_zerocopy_put(struct sk_buff *zskb)
+{
+	struct skb_zerocopy_cb *zc = SKB_ZEROCOPY_CB(zskb);
+	struct sock_exterr_skb *serr;
+	struct sock *sk = zskb->sk;
+	u32 id;
+	u8 code;
+
+	if (!atomic_dec_and_test(&zc->refcnt))
+		return;
+
+	id = zc->id;
+	code = zc->copied ? SO_EE_CODE_ZEROCOPY_COPIED : 0;
+	zskb->sk = NULL;
+
+	if (skb_zerocopy_merge(sk, id, code)) {
+		kfree_skb(zskb);
+		goto out;
+	}
+
+	serr = SKB_EXT_ERR(zskb);
+	memset(serr, 0, sizeof(*serr));
+	serr->ee.ee_errno = 0;
+	serr->ee.ee_origin = SO_EE_ORIGIN_ZEROCOPY;
+	serr->ee.ee_code = code;
+	serr->ee.ee_info = id;
+	serr->ee.ee_data = id;
+
+	/* Not sock_queue_err_skb(): a full receive buffer must not lose
+	 * a completion, or the user could never reuse the pages.  There
+	 * is one per send at most, and merging keeps the queue short.
+	 */
+	skb_set_owner_r(zskb, sk);
+	skb_queue_tail(&sk->sk_error_queue, zskb);
+	if (!sock_flag(sk, SOCK_DEAD))
+		sk->sk_data_ready(sk, zskb->len);
+out:
+	sock_put(sk);
+}
+
+EXPORT_SYMBOL_GPL(skb_zerocopy_put);
+
+/**
+ *	skb_zerocopy_abort - drop a notification for a send that did nothing
+ *	@zskb: notification from skb_zerocopy_alloc()
+ *
+ *	No data was queued, so no skb references @zskb.  Give its id back
+ *	to the socket so notified ranges stay contiguous.  The caller must
+ *	still hold the socket lock taken for skb_zerocopy_alloc().
+ */
+void skb_zerocopy_abort(struct sk_buff *zskb)
+{
+	struct sock *sk = zskb->sk;
+
+	WARN_ON(atomic_read(&SKB_ZEROCOPY_CB(zskb)->refcnt) != 1);
+	sk->sk_zckey--;
+	zskb->sk = NULL;
+	kfree_skb(zskb);
+	sock_put(sk);
+}
+
+EXPORT_SYMBOL_GPL(skb_zerocopy_abort);
+
 void __init skb_init(void)
 {
 	skbuff_head_cache = kmem_cache_create("skbuff_head_cache",
@@ -125,6 +125,7 @@
 #include <linux/ipsec.h>
 
 #include <linux/filter.h>
+#include <linux/errqueue.h>
 
 #ifdef CONFIG_INET
 #include <net/tcp.h>
@@ -863,6 +864,26 @@ out_free:
 	return NULL;
 }
 
+static void __sk_prot_free(struct sock *sk, struct module *owner)
+{
+	if (sk->sk_prot_creator->slab != NULL)
+		kmem_cache_free(sk->sk_prot_creator->slab, sk);
+	else
+		kfree(sk);
+	module_put(owner);
+}
+
+/* Lookups that walk a hash under rcu_read_lock() may still be looking
+ * at the socket; they take a reference with atomic_inc_not_zero() and
+ * so never resurrect it, but the memory must stay put until they finish.
+ */
+static void __sk_free_rcu(struct rcu_head *head)
+{
+	struct sock *sk = container_of(head, struct sock, sk_rcu);
+
+	__sk_prot_free(sk, sk->sk_prot_creator->owner);
+}
+
 void sk_free(struct sock *sk)
 {
 	struct sk_filter *filter;
@@ -884,11 +905,10 @@ void sk_free(struct sock *sk)
 		       __FUNCTION__, atomic_read(&sk->sk_omem_alloc));
 
 	security_sk_free(sk);
-	if (sk->sk_prot_creator->slab != NULL)
-		kmem_cache_free(sk->sk_prot_creator->slab, sk);
+	if (sock_flag(sk, SOCK_RCU_FREE))
+		call_rcu(&sk->sk_rcu, __sk_free_rcu);
 	else
-		kfree(sk);
-	module_put(owner);
+		__sk_prot_free(sk, owner);
 }
 
 struct sock *sk_clone(const struct sock *sk, const gfp_t priority)
@@ -1444,6 +1464,58 @@ void sk_send_sigurg(struct sock *sk)
 			sk_wake_async(sk, 3, POLL_PRI);
 }
 
+/*
+ *	Dequeue one error queue entry that carries no offending packet,
+ *	such as a zerocopy completion, and pass its extended error to the
+ *	user as a @level/@type control message.
+ */
+int sock_recv_errqueue(struct sock *sk, struct msghdr *msg, int len,
+		       int level, int type)
+{
+	struct sock_exterr_skb *serr;
+	struct sk_buff *skb, *skb2;
+	int copied, err;
+
+	err = -EAGAIN;
+	skb = skb_dequeue(&sk->sk_error_queue);
+	if (skb == NULL)
+		goto out;
+
+	copied = skb->len;
+	if (copied > len) {
+		msg->msg_flags |= MSG_TRUNC;
+		copied = len;
+	}
+	err = skb_copy_datagram_iovec(skb, 0, msg->msg_iov, copied);
+	if (err)
+		goto out_free_skb;
+
+	sock_recv_timestamp(msg, sk, skb);
+
+	serr = SKB_EXT_ERR(skb);
+	put_cmsg(msg, level, type, sizeof(serr->ee), &serr->ee);
+
+	msg->msg_flags |= MSG_ERRQUEUE;
+	err = copied;
+
+	/* Reset and regenerate socket error */
+	spin_lock_bh(&sk->sk_error_queue.lock);
+	sk->sk_err = 0;
+	if ((skb2 = skb_peek(&sk->sk_error_queue)) != NULL) {
+		sk->sk_err = SKB_EXT_ERR(skb2)->ee.ee_errno;
+		spin_unlock_bh(&sk->sk_error_queue.lock);
+		sk->sk_error_report(sk);
+	} else
+		spin_unlock_bh(&sk->sk_error_queue.lock);
+
+out_free_skb:
+	kfree_skb(skb);
+out:
+	return err;
+}
+
+EXPORT_SYMBOL(sock_recv_errqueue);
+
 void sk_reset_timer(struct sock *sk, struct timer_list* timer,
 		    unsigned long expires)
 {
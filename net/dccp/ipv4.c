@@ -660,7 +660,8 @@ int dccp_v4_conn_request(struct sock *sk, struct sk_buff *skb)
 	if (dccp_v4_send_response(sk, req, NULL))
 		goto drop_and_free;
 
-	inet_csk_reqsk_queue_hash_add(sk, req, DCCP_TIMEOUT_INIT);
+	if (inet_csk_reqsk_queue_hash_add(sk, req, DCCP_TIMEOUT_INIT))
+		goto drop_and_free;
 	return 0;
 
 drop_and_free:
@@ -1064,10 +1064,14 @@ static int __init dccp_init(void)
 		INIT_HLIST_HEAD(&dccp_hashinfo.bhash[i].chain);
 	}
 
-	rc = dccp_mib_init();
+	rc = inet_twdr_init(&dccp_death_row);
 	if (rc)
 		goto out_free_dccp_bhash;
 
+	rc = dccp_mib_init();
+	if (rc)
+		goto out_twdr_destroy;
+
 	rc = dccp_ackvec_init();
 	if (rc)
 		goto out_free_dccp_mib;
@@ -1081,6 +1085,8 @@ out_ackvec_exit:
 	dccp_ackvec_exit();
 out_free_dccp_mib:
 	dccp_mib_exit();
+out_twdr_destroy:
+	inet_twdr_destroy(&dccp_death_row);
 out_free_dccp_bhash:
 	free_pages((unsigned long)dccp_hashinfo.bhash, bhash_order);
 	dccp_hashinfo.bhash = NULL;
@@ -1096,6 +1102,7 @@ out_free_bind_bucket_cachep:
 static void __exit dccp_fini(void)
 {
 	dccp_mib_exit();
+	inet_twdr_destroy(&dccp_death_row);
 	free_pages((unsigned long)dccp_hashinfo.bhash,
 		   get_order(dccp_hashinfo.bhash_size *
 			     sizeof(struct inet_bind_hashbucket)));
@@ -46,7 +46,8 @@
 #include <net/dn_neigh.h>
 #include <net/dn_route.h>
 
-static u32 dn_neigh_hash(const void *pkey, const struct net_device *dev);
+static u32 dn_neigh_hash(const void *pkey, const struct net_device *dev,
+			 u32 hash_rnd);
 static int dn_neigh_construct(struct neighbour *);
 static void dn_long_error_report(struct neighbour *, struct sk_buff *);
 static void dn_short_error_report(struct neighbour *, struct sk_buff *);
@@ -120,9 +121,10 @@ struct neigh_table dn_neigh_table = {
 	.gc_thresh3 =			1024,
 };
 
-static u32 dn_neigh_hash(const void *pkey, const struct net_device *dev)
+static u32 dn_neigh_hash(const void *pkey, const struct net_device *dev,
+			 u32 hash_rnd)
 {
-	return jhash_2words(*(__u16 *)pkey, 0, dn_neigh_table.hash_rnd);
+	return jhash_2words(*(__u16 *)pkey, 0, hash_rnd);
 }
 
 static int dn_neigh_construct(struct neighbour *neigh)
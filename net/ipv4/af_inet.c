@@ -152,6 +152,7 @@ void inet_sock_destruct(struct sock *sk)
 
 	kfree(inet->opt);
 	dst_release(sk->sk_dst_cache);
+	dst_release(inet->rx_dst);
 	sk_refcnt_debug_dec(sk);
 }
 
@@ -805,7 +806,7 @@ const struct proto_ops inet_stream_ops = {
 	.getsockopt	   = sock_common_getsockopt,
 	.sendmsg	   = inet_sendmsg,
 	.recvmsg	   = sock_common_recvmsg,
-	.mmap		   = sock_no_mmap,
+	.mmap		   = tcp_mmap,
 	.sendpage	   = tcp_sendpage,
 #ifdef CONFIG_COMPAT
 	.compat_setsockopt = compat_sock_common_setsockopt,
@@ -1146,6 +1147,7 @@ static struct sk_buff *inet_gso_segment(struct sk_buff *skb, int features)
 		       SKB_GSO_UDP |
 		       SKB_GSO_DODGY |
 		       SKB_GSO_TCP_ECN |
+		       SKB_GSO_UDP_L4 |
 		       0)))
 		goto out;
 
@@ -1195,6 +1197,7 @@ static struct net_protocol igmp_protocol = {
 #endif
 
 static struct net_protocol tcp_protocol = {
+	.early_demux =	tcp_v4_early_demux,
 	.handler =	tcp_v4_rcv,
 	.err_handler =	tcp_v4_err,
 	.gso_send_check = tcp_v4_gso_send_check,
@@ -1205,6 +1208,8 @@ static struct net_protocol tcp_protocol = {
 static struct net_protocol udp_protocol = {
 	.handler =	udp_rcv,
 	.err_handler =	udp_err,
+	.gso_send_check = udp4_gso_send_check,
+	.gso_segment =	udp4_gso_segment,
 	.no_policy =	1,
 };
 
@@ -1264,6 +1269,7 @@ static int __init inet_init(void)
 	if (rc)
 		goto out;
 
+	udp_table_init(&udp_table, "UDP");
 	rc = proto_register(&udp_prot, 1);
 	if (rc)
 		goto out_unregister_tcp_proto;
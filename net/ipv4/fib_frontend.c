@@ -488,7 +488,8 @@ static int rtm_to_fib_config(struct sk_buff *skb, struct nlmsghdr *nlh,
 	cfg->fc_protocol = rtm->rtm_protocol;
 	cfg->fc_scope = rtm->rtm_scope;
 	cfg->fc_type = rtm->rtm_type;
-	cfg->fc_flags = rtm->rtm_flags;
+	cfg->fc_flags = rtm->rtm_flags & ~RTM_F_BATCH;
+	cfg->fc_batch = !!(rtm->rtm_flags & RTM_F_BATCH);
 	cfg->fc_nlflags = nlh->nlmsg_flags;
 
 	cfg->fc_nlinfo.pid = NETLINK_CB(skb).pid;
@@ -862,6 +863,7 @@ static int fib_netdev_event(struct notifier_block *this, unsigned long event, vo
 
 	if (event == NETDEV_UNREGISTER) {
 		fib_disable_ip(dev, 2);
+		rt_flush_dev(dev);
 		return NOTIFY_DONE;
 	}
 
@@ -34,6 +34,8 @@
 #include <linux/proc_fs.h>
 #include <linux/skbuff.h>
 #include <linux/init.h>
+#include <linux/jhash.h>
+#include <linux/random.h>
 
 #include <net/arp.h>
 #include <net/ip.h>
@@ -62,7 +64,7 @@ static struct hlist_head fib_info_devhash[DEVINDEX_HASHSIZE];
 
 #ifdef CONFIG_IP_ROUTE_MULTIPATH
 
-static DEFINE_SPINLOCK(fib_multipath_lock);
+static u32 fib_multipath_secret;
 
 #define for_nexthops(fi) { int nhsel; const struct fib_nh * nh; \
 for (nhsel=0, nh = (fi)->fib_nh; nhsel < (fi)->fib_nhs; nh++, nhsel++)
@@ -153,6 +155,18 @@ void free_fib_info(struct fib_info *fi)
 		if (nh->nh_dev)
 			dev_put(nh->nh_dev);
 		nh->nh_dev = NULL;
+		if (nh->nh_rth_input)
+			dst_release(&nh->nh_rth_input->u.dst);
+		nh->nh_rth_input = NULL;
+		if (nh->nh_rth_onlink) {
+			int i;
+
+			for (i = 0; i < FIB_NH_ONLINK_SLOTS; i++)
+				if (nh->nh_rth_onlink[i])
+					dst_release(&nh->nh_rth_onlink[i]->u.dst);
+			kfree(nh->nh_rth_onlink);
+		}
+		nh->nh_rth_onlink = NULL;
 	} endfor_nexthops(fi);
 	fib_info_cnt--;
 	kfree(fi);
@@ -411,6 +425,35 @@ static int fib_get_nhs(struct fib_info *fi, struct rtnexthop *rtnh,
 	return 0;
 }
 
+/*
+ * Split the 31-bit hash space between the nexthops in proportion to
+ * their weights.  Dead nexthops keep their share: flows that hash there
+ * are spread over the live ones by fib_select_multipath(), so a nexthop
+ * going down or coming back never moves flows between the others.
+ */
+static void fib_rebalance(struct fib_info *fi)
+{
+	int total = 0;
+	int w = 0;
+
+	if (unlikely(!fib_multipath_secret))
+		get_random_bytes(&fib_multipath_secret,
+				 sizeof(fib_multipath_secret));
+
+	for_nexthops(fi) {
+		total += nh->nh_weight;
+	} endfor_nexthops(fi);
+
+	change_nexthops(fi) {
+		u64 bound;
+
+		w += nh->nh_weight;
+		bound = (u64)w << 31;
+		do_div(bound, total);
+		nh->nh_upper_bound = (int)(bound - 1);
+	} endfor_nexthops(fi);
+}
+
 #endif
 
 int fib_nh_match(struct fib_config *cfg, struct fib_info *fi)
@@ -787,6 +830,9 @@ struct fib_info *fib_create_info(struct fib_config *cfg)
 #endif
 	}
 
+#ifdef CONFIG_IP_ROUTE_MULTIPATH
+	fib_rebalance(fi);
+#endif
 #ifdef CONFIG_IP_ROUTE_MULTIPATH_CACHED
 	fi->fib_mp_alg = cfg->fc_mp_alg;
 #endif
@@ -1085,12 +1131,6 @@ int fib_sync_down(__be32 local, struct net_device *dev, int force)
 				else if (nh->nh_dev == dev &&
 					 nh->nh_scope != scope) {
 					nh->nh_flags |= RTNH_F_DEAD;
-#ifdef CONFIG_IP_ROUTE_MULTIPATH
-					spin_lock_bh(&fib_multipath_lock);
-					fi->fib_power -= nh->nh_power;
-					nh->nh_power = 0;
-					spin_unlock_bh(&fib_multipath_lock);
-#endif
 					dead++;
 				}
 #ifdef CONFIG_IP_ROUTE_MULTIPATH
@@ -1154,10 +1194,7 @@ int fib_sync_up(struct net_device *dev)
 			if (nh->nh_dev != dev || !__in_dev_get_rtnl(dev))
 				continue;
 			alive++;
-			spin_lock_bh(&fib_multipath_lock);
-			nh->nh_power = 0;
 			nh->nh_flags &= ~RTNH_F_DEAD;
-			spin_unlock_bh(&fib_multipath_lock);
 		} endfor_nexthops(fi)
 
 		if (alive > 0) {
@@ -1170,54 +1207,57 @@ int fib_sync_up(struct net_device *dev)
 }
 
 /*
-   The algorithm is suboptimal, but it provides really
-   fair weighted route distribution.
+ * Hash-threshold nexthop selection (RFC 2992) on the source and
+ * destination addresses.  Those are exactly what the route cache is
+ * keyed on, so every cache entry for a flow resolves to the same nexthop
+ * and nothing has to be remembered per packet or per flow.  A flow whose
+ * nexthop is dead is hashed again over the live nexthops by weight,
+ * which leaves flows on live nexthops where they were.
  */
 
+static inline u32 fib_multipath_hash(const struct flowi *flp)
+{
+	return jhash_2words((__force u32)flp->fl4_src,
+			    (__force u32)flp->fl4_dst, fib_multipath_secret);
+}
+
 void fib_select_multipath(const struct flowi *flp, struct fib_result *res)
 {
 	struct fib_info *fi = res->fi;
-	int w;
+	u32 hash = fib_multipath_hash(flp);
+	int h = hash >> 1;
+	int alive = 0;
+	u32 w;
 
-	spin_lock_bh(&fib_multipath_lock);
-	if (fi->fib_power <= 0) {
-		int power = 0;
-		change_nexthops(fi) {
-			if (!(nh->nh_flags&RTNH_F_DEAD)) {
-				power += nh->nh_weight;
-				nh->nh_power = nh->nh_weight;
-			}
-		} endfor_nexthops(fi);
-		fi->fib_power = power;
-		if (power <= 0) {
-			spin_unlock_bh(&fib_multipath_lock);
-			/* Race condition: route has just become dead. */
-			res->nh_sel = 0;
+	for_nexthops(fi) {
+		if (h > nh->nh_upper_bound)
+			continue;
+		if (!(nh->nh_flags&RTNH_F_DEAD)) {
+			res->nh_sel = nhsel;
 			return;
 		}
-	}
-
+		break;
+	} endfor_nexthops(fi);
 
-	/* w should be random number [0..fi->fib_power-1],
-	   it is pretty bad approximation.
-	 */
+	for_nexthops(fi) {
+		if (!(nh->nh_flags&RTNH_F_DEAD))
+			alive += nh->nh_weight;
+	} endfor_nexthops(fi);
 
-	w = jiffies % fi->fib_power;
+	res->nh_sel = 0;
+	if (alive <= 0)
+		/* Race condition: route has just become dead. */
+		return;
 
-	change_nexthops(fi) {
-		if (!(nh->nh_flags&RTNH_F_DEAD) && nh->nh_power) {
-			if ((w -= nh->nh_power) <= 0) {
-				nh->nh_power--;
-				fi->fib_power--;
-				res->nh_sel = nhsel;
-				spin_unlock_bh(&fib_multipath_lock);
-				return;
-			}
+	w = ((u64)jhash_1word(hash, fib_multipath_secret) * alive) >> 32;
+	for_nexthops(fi) {
+		if (nh->nh_flags&RTNH_F_DEAD)
+			continue;
+		if (w < nh->nh_weight) {
+			res->nh_sel = nhsel;
+			return;
 		}
+		w -= nh->nh_weight;
 	} endfor_nexthops(fi);
-
-	/* Race condition: route has just become dead. */
-	res->nh_sel = 0;
-	spin_unlock_bh(&fib_multipath_lock);
 }
 #endif
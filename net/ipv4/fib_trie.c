@@ -74,6 +74,8 @@
 #include <linux/netlink.h>
 #include <linux/init.h>
 #include <linux/list.h>
+#include <linux/workqueue.h>
+#include <linux/rtnetlink.h>
 #include <net/ip.h>
 #include <net/protocol.h>
 #include <net/route.h>
@@ -111,6 +113,7 @@ struct node {
 	unsigned long parent;
 };
 
+/* Lookups touch only the fields before rcu, which share a cache line */
 struct leaf {
 	t_key key;
 	unsigned long parent;
@@ -163,8 +166,17 @@ struct trie {
 #endif
 	int size;
 	unsigned int revision;
+	int unbalanced;
+	struct delayed_work rebalance_work;
 };
 
+/*
+ * Batched updates (RTM_F_BATCH) skip the per-route rebalance; the whole
+ * trie is resized once when the batch ends, or this long after the last
+ * batched update if no closing non-batched update ever arrives.
+ */
+#define TRIE_REBALANCE_DELAY	HZ
+
 static void put_child(struct trie *t, struct tnode *tn, int i, struct node *n);
 static void tnode_put_child_reorg(struct tnode *tn, int i, struct node *n, int wasfull);
 static struct node *resize(struct trie *t, struct tnode *tn);
@@ -173,6 +185,7 @@ static struct tnode *halve(struct trie *t, struct tnode *tn);
 static void tnode_free(struct tnode *tn);
 
 static struct kmem_cache *fn_alias_kmem __read_mostly;
+static struct kmem_cache *trie_leaf_kmem __read_mostly;
 static struct trie *trie_local = NULL, *trie_main = NULL;
 
 
@@ -310,7 +323,7 @@ static inline void alias_free_mem_rcu(struct fib_alias *fa)
 
 static void __leaf_free_rcu(struct rcu_head *head)
 {
-	kfree(container_of(head, struct leaf, rcu));
+	kmem_cache_free(trie_leaf_kmem, container_of(head, struct leaf, rcu));
 }
 
 static void __leaf_info_free_rcu(struct rcu_head *head)
@@ -353,7 +366,7 @@ static inline void tnode_free(struct tnode *tn)
 {
 	if(IS_LEAF(tn)) {
 		struct leaf *l = (struct leaf *) tn;
-		call_rcu_bh(&l->rcu, __leaf_free_rcu);
+		call_rcu(&l->rcu, __leaf_free_rcu);
 	}
         else
 		call_rcu(&tn->rcu, __tnode_free_rcu);
@@ -361,7 +374,7 @@ static inline void tnode_free(struct tnode *tn)
 
 static struct leaf *leaf_new(void)
 {
-	struct leaf *l = kmalloc(sizeof(struct leaf),  GFP_KERNEL);
+	struct leaf *l = kmem_cache_alloc(trie_leaf_kmem, GFP_KERNEL);
 	if (l) {
 		l->parent = T_LEAF;
 		INIT_HLIST_HEAD(&l->list);
@@ -849,6 +862,8 @@ nomem:
 	}
 }
 
+static void trie_rebalance_work(struct work_struct *work);
+
 static void trie_init(struct trie *t)
 {
 	if (!t)
@@ -857,6 +872,8 @@ static void trie_init(struct trie *t)
 	t->size = 0;
 	rcu_assign_pointer(t->trie, NULL);
 	t->revision = 0;
+	t->unbalanced = 0;
+	INIT_DELAYED_WORK(&t->rebalance_work, trie_rebalance_work);
 #ifdef CONFIG_IP_FIB_TRIE_STATS
 	memset(&t->stats, 0, sizeof(struct trie_use_stats));
 #endif
@@ -968,10 +985,71 @@ static struct node *trie_rebalance(struct trie *t, struct tnode *tn)
 	return (struct node*) tn;
 }
 
+/*
+ * Resize every tnode below tn, children before their parent, and return
+ * the node that should replace tn.  Used once per batch instead of the
+ * per-route walk done by trie_rebalance().
+ */
+static struct node *trie_rebalance_subtree(struct trie *t, struct tnode *tn)
+{
+	int i, wasfull;
+	struct node *n;
+
+	for (i = 0; i < tnode_child_length(tn); i++) {
+		n = tn->child[i];
+		if (n == NULL || IS_LEAF(n))
+			continue;
+
+		wasfull = tnode_full(tn, n);
+		n = trie_rebalance_subtree(t, (struct tnode *)n);
+		tnode_put_child_reorg(tn, i, n, wasfull);
+	}
+
+	return resize(t, tn);
+}
+
+static void trie_rebalance_all(struct trie *t)
+{
+	struct node *n = t->trie;
+
+	t->unbalanced = 0;
+	if (n && IS_TNODE(n))
+		rcu_assign_pointer(t->trie,
+				   trie_rebalance_subtree(t, (struct tnode *)n));
+}
+
+/*
+ * Called after every update.  A batched update only pushes back the
+ * fallback timer; the first non-batched one rebalances whatever is
+ * outstanding.
+ */
+static void trie_batch_update(struct trie *t, int batch)
+{
+	if (!t->unbalanced)
+		return;
+
+	if (batch) {
+		cancel_delayed_work(&t->rebalance_work);
+		schedule_delayed_work(&t->rebalance_work, TRIE_REBALANCE_DELAY);
+	} else {
+		trie_rebalance_all(t);
+	}
+}
+
+static void trie_rebalance_work(struct work_struct *work)
+{
+	struct trie *t = container_of(work, struct trie, rebalance_work.work);
+
+	rtnl_lock();
+	if (t->unbalanced)
+		trie_rebalance_all(t);
+	rtnl_unlock();
+}
+
 /* only used from updater-side */
 
 static  struct list_head *
-fib_insert_node(struct trie *t, int *err, u32 key, int plen)
+fib_insert_node(struct trie *t, int *err, u32 key, int plen, int batch)
 {
 	int pos, newpos;
 	struct tnode *tp = NULL, *tn = NULL;
@@ -1115,9 +1193,12 @@ fib_insert_node(struct trie *t, int *err, u32 key, int plen)
 		printk(KERN_WARNING "fib_trie tp=%p pos=%d, bits=%d, key=%0x plen=%d\n",
 		       tp, tp->pos, tp->bits, key, plen);
 
-	/* Rebalance the trie */
+	/* Rebalance the trie, or leave it to the end of the batch */
 
-	rcu_assign_pointer(t->trie, trie_rebalance(t, tp));
+	if (batch)
+		t->unbalanced = 1;
+	else
+		rcu_assign_pointer(t->trie, trie_rebalance(t, tp));
 done:
 	t->revision++;
 err:
@@ -1247,7 +1328,7 @@ static int fn_trie_insert(struct fib_table *tb, struct fib_config *cfg)
 
 	if (!fa_head) {
 		err = 0;
-		fa_head = fib_insert_node(t, &err, key, plen);
+		fa_head = fib_insert_node(t, &err, key, plen, cfg->fc_batch);
 		if (err)
 			goto out_free_new_fa;
 	}
@@ -1259,6 +1340,7 @@ static int fn_trie_insert(struct fib_table *tb, struct fib_config *cfg)
 	rtmsg_fib(RTM_NEWROUTE, htonl(key), new_fa, plen, tb->tb_id,
 		  &cfg->fc_nlinfo);
 succeeded:
+	trie_batch_update(t, cfg->fc_batch);
 	return 0;
 
 out_free_new_fa:
@@ -1494,7 +1576,7 @@ found:
 }
 
 /* only called from updater side */
-static int trie_leaf_remove(struct trie *t, t_key key)
+static int trie_leaf_remove(struct trie *t, t_key key, int batch)
 {
 	t_key cindex;
 	struct tnode *tp = NULL;
@@ -1535,7 +1617,10 @@ static int trie_leaf_remove(struct trie *t, t_key key)
 	if (tp) {
 		cindex = tkey_extract_bits(key, tp->pos, tp->bits);
 		put_child(t, (struct tnode *)tp, cindex, NULL);
-		rcu_assign_pointer(t->trie, trie_rebalance(t, tp));
+		if (batch)
+			t->unbalanced = 1;
+		else
+			rcu_assign_pointer(t->trie, trie_rebalance(t, tp));
 	} else
 		rcu_assign_pointer(t->trie, NULL);
 	preempt_enable();
@@ -1615,7 +1700,9 @@ static int fn_trie_delete(struct fib_table *tb, struct fib_config *cfg)
 	}
 
 	if (hlist_empty(&l->list))
-		trie_leaf_remove(t, key);
+		trie_leaf_remove(t, key, cfg->fc_batch);
+
+	trie_batch_update(t, cfg->fc_batch);
 
 	if (fa->fa_state & FA_S_ACCESSED)
 		rt_cache_flush(-1);
@@ -1733,12 +1820,14 @@ static int fn_trie_flush(struct fib_table *tb)
 		found += trie_flush_leaf(t, l);
 
 		if (ll && hlist_empty(&ll->list))
-			trie_leaf_remove(t, ll->key);
+			trie_leaf_remove(t, ll->key, 1);
 		ll = l;
 	}
 
 	if (ll && hlist_empty(&ll->list))
-		trie_leaf_remove(t, ll->key);
+		trie_leaf_remove(t, ll->key, 1);
+
+	trie_batch_update(t, 0);
 
 	pr_debug("trie_flush found=%d\n", found);
 	return found;
@@ -1945,6 +2034,12 @@ struct fib_table * __init fib_hash_init(u32 id)
 						  0, SLAB_HWCACHE_ALIGN,
 						  NULL, NULL);
 
+	if (trie_leaf_kmem == NULL)
+		trie_leaf_kmem = kmem_cache_create("ip_fib_trie",
+						   sizeof(struct leaf), 0,
+						   SLAB_HWCACHE_ALIGN|SLAB_PANIC,
+						   NULL, NULL);
+
 	tb = kmalloc(sizeof(struct fib_table) + sizeof(struct trie),
 		     GFP_KERNEL);
 	if (tb == NULL)
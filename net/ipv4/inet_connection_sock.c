@@ -384,16 +384,115 @@ struct request_sock *inet_csk_search_req(const struct sock *sk,
 
 EXPORT_SYMBOL_GPL(inet_csk_search_req);
 
-void inet_csk_reqsk_queue_hash_add(struct sock *sk, struct request_sock *req,
-				   unsigned long timeout)
+/*
+ * Like inet_csk_search_req(), for callers not holding the listener lock.
+ * A request found is returned with its chain locked in *lockp, which
+ * keeps it from being unlinked and freed until spin_unlock_bh(*lockp).
+ */
+struct request_sock *inet_csk_search_req_lock(const struct sock *sk,
+					      spinlock_t **lockp,
+					      const __be16 rport,
+					      const __be32 raddr,
+					      const __be32 laddr)
+{
+	const struct inet_connection_sock *icsk = inet_csk(sk);
+	struct listen_sock *lopt;
+	struct request_sock *req;
+	spinlock_t *lock;
+	u32 h;
+
+	/* NULL once the listener has stopped */
+	lopt = rcu_dereference(icsk->icsk_accept_queue.listen_opt);
+	if (lopt == NULL)
+		return NULL;
+
+	h = inet_synq_hash(raddr, rport, lopt->hash_rnd, lopt->nr_table_entries);
+	lock = &lopt->syn_lock[listen_sock_lock_index(h)];
+
+	spin_lock_bh(lock);
+	for (req = lopt->syn_table[h]; req != NULL; req = req->dl_next) {
+		const struct inet_request_sock *ireq = inet_rsk(req);
+
+		if (ireq->rmt_port == rport &&
+		    ireq->rmt_addr == raddr &&
+		    ireq->loc_addr == laddr &&
+		    AF_INET_FAMILY(req->rsk_ops->family)) {
+			*lockp = lock;
+			return req;
+		}
+	}
+	spin_unlock_bh(lock);
+	return NULL;
+}
+
+EXPORT_SYMBOL_GPL(inet_csk_search_req_lock);
+
+/*
+ * Queue a new request, unless one for the same connection is already
+ * queued or the listener has stopped.  The search and the insert are
+ * done under one chain lock, so that SYNs processed in parallel without
+ * the listener lock cannot queue two requests for one connection.  On
+ * success the chain lock is returned held in *lockp, which keeps the
+ * request from being unlinked while the caller sends the SYN-ACK.
+ * Returns 0, -EEXIST or -ENOENT.
+ */
+int inet_csk_reqsk_queue_hash_add_lock(struct sock *sk,
+				       struct request_sock *req,
+				       unsigned long timeout,
+				       spinlock_t **lockp)
 {
 	struct inet_connection_sock *icsk = inet_csk(sk);
-	struct listen_sock *lopt = icsk->icsk_accept_queue.listen_opt;
-	const u32 h = inet_synq_hash(inet_rsk(req)->rmt_addr, inet_rsk(req)->rmt_port,
-				     lopt->hash_rnd, lopt->nr_table_entries);
+	const struct inet_request_sock *ireq = inet_rsk(req);
+	struct listen_sock *lopt;
+	struct request_sock *r;
+	spinlock_t *lock;
+	u32 h;
+
+	lopt = rcu_dereference(icsk->icsk_accept_queue.listen_opt);
+	if (lopt == NULL)
+		return -ENOENT;
+
+	h = inet_synq_hash(ireq->rmt_addr, ireq->rmt_port,
+			   lopt->hash_rnd, lopt->nr_table_entries);
+	lock = &lopt->syn_lock[listen_sock_lock_index(h)];
+
+	spin_lock_bh(lock);
+	if (lopt->dead) {
+		spin_unlock_bh(lock);
+		return -ENOENT;
+	}
+	for (r = lopt->syn_table[h]; r != NULL; r = r->dl_next) {
+		const struct inet_request_sock *ir = inet_rsk(r);
+
+		if (ir->rmt_port == ireq->rmt_port &&
+		    ir->rmt_addr == ireq->rmt_addr &&
+		    ir->loc_addr == ireq->loc_addr &&
+		    AF_INET_FAMILY(r->rsk_ops->family)) {
+			spin_unlock_bh(lock);
+			return -EEXIST;
+		}
+	}
 
-	reqsk_queue_hash_req(&icsk->icsk_accept_queue, h, req, timeout);
-	inet_csk_reqsk_queue_added(sk, timeout);
+	__reqsk_queue_hash_req(lopt, h, req, timeout);
+	if (__reqsk_queue_added(lopt) == 0)
+		inet_csk_reset_keepalive_timer(sk, timeout);
+
+	*lockp = lock;
+	return 0;
+}
+
+EXPORT_SYMBOL_GPL(inet_csk_reqsk_queue_hash_add_lock);
+
+int inet_csk_reqsk_queue_hash_add(struct sock *sk, struct request_sock *req,
+				  unsigned long timeout)
+{
+	spinlock_t *lock;
+	int err;
+
+	err = inet_csk_reqsk_queue_hash_add_lock(sk, req, timeout, &lock);
+	if (!err)
+		spin_unlock_bh(lock);
+	return err;
 }
 
 /* Only thing we need from tcp.h */
@@ -415,7 +514,7 @@ void inet_csk_reqsk_queue_prune(struct sock *parent,
 	struct request_sock **reqp, *req;
 	int i, budget;
 
-	if (lopt == NULL || lopt->qlen == 0)
+	if (lopt == NULL || atomic_read(&lopt->qlen) == 0)
 		return;
 
 	/* Normally all the openreqs are young and become mature
@@ -435,11 +534,11 @@ void inet_csk_reqsk_queue_prune(struct sock *parent,
 	 * embrions; and abort old ones without pity, if old
 	 * ones are about to clog our table.
 	 */
-	if (lopt->qlen>>(lopt->max_qlen_log-1)) {
-		int young = (lopt->qlen_young<<1);
+	if (atomic_read(&lopt->qlen)>>(lopt->max_qlen_log-1)) {
+		int young = (atomic_read(&lopt->qlen_young)<<1);
 
 		while (thresh > 2) {
-			if (lopt->qlen < young)
+			if (atomic_read(&lopt->qlen) < young)
 				break;
 			thresh--;
 			young <<= 1;
@@ -462,7 +561,7 @@ void inet_csk_reqsk_queue_prune(struct sock *parent,
 					unsigned long timeo;
 
 					if (req->retrans++ == 0)
-						lopt->qlen_young--;
+						atomic_dec(&lopt->qlen_young);
 					timeo = min((timeout << req->retrans), max_rto);
 					req->expires = now + timeo;
 					reqp = &req->dl_next;
@@ -484,7 +583,7 @@ void inet_csk_reqsk_queue_prune(struct sock *parent,
 
 	lopt->clock_hand = i;
 
-	if (lopt->qlen)
+	if (atomic_read(&lopt->qlen))
 		inet_csk_reset_keepalive_timer(parent, interval);
 }
 
@@ -500,6 +599,7 @@ struct sock *inet_csk_clone(struct sock *sk, const struct request_sock *req,
 
 		newsk->sk_state = TCP_SYN_RECV;
 		newicsk->icsk_bind_hash = NULL;
+		inet_sk(newsk)->rx_dst = NULL;
 
 		inet_sk(newsk)->dport = inet_rsk(req)->rmt_port;
 		newsk->sk_write_space = sk_stream_write_space;
@@ -0,0 +1,486 @@
+/*
+ * inet fragments management
+ *
+ *		This program is free software; you can redistribute it and/or
+ *		modify it under the terms of the GNU General Public License
+ *		as published by the Free Software Foundation; either version
+ *		2 of the License, or (at your option) any later version.
+ *
+ *		Fragment queue bookkeeping shared by ip_fragment.c,
+ *		ipv6/reassembly.c and nf_conntrack_reasm.c.  The protocols
+ *		only deal with ordering fragments inside one queue; lookup,
+ *		hashing, expiry, memory accounting and eviction live here.
+ */
+
+#include <linux/module.h>
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/random.h>
+#include <linux/skbuff.h>
+#include <linux/interrupt.h>
+#include <linux/delay.h>
+#include <linux/rtnetlink.h>
+
+#include <net/inet_frag.h>
+
+/*
+ *  Locking.
+ *
+ *  Each queue hangs off one bucket of f->table and is linked/unlinked
+ *  under that bucket's chain_lock.  Which bucket a queue is on depends on
+ *  f->table and f->rnd, both of which only the rebuild worker changes,
+ *  inside f->rnd_seqlock.  Users pick a bucket under read_seqbegin(),
+ *  lock it and confirm with read_seqretry(); the worker holds every old
+ *  bucket lock while it moves that bucket's queues, so a confirmed lock
+ *  is stable.  Replaced tables are freed after an RCU-bh grace period.
+ *
+ *  All entry points expect BH to be disabled.
+ *
+ *  Lock order: q->lock, then chain_lock.
+ */
+
+static struct inet_frag_table *inet_frag_table_alloc(unsigned int size)
+{
+	struct inet_frag_table *t;
+	size_t sz = sizeof(*t) + size * sizeof(struct inet_frag_bucket);
+	unsigned int i;
+
+	if (sz <= PAGE_SIZE)
+		t = kmalloc(sz, GFP_KERNEL);
+	else
+		t = (struct inet_frag_table *)
+			__get_free_pages(GFP_KERNEL, get_order(sz));
+	if (!t)
+		return NULL;
+
+	t->mask = size - 1;
+	for (i = 0; i < size; i++) {
+		INIT_HLIST_HEAD(&t->buckets[i].chain);
+		spin_lock_init(&t->buckets[i].chain_lock);
+	}
+	return t;
+}
+
+static void inet_frag_table_free(struct inet_frag_table *t)
+{
+	size_t sz = sizeof(*t) + (t->mask + 1) * sizeof(struct inet_frag_bucket);
+
+	if (sz <= PAGE_SIZE)
+		kfree(t);
+	else
+		free_pages((unsigned long)t, get_order(sz));
+}
+
+static void inet_frag_table_free_rcu(struct rcu_head *head)
+{
+	inet_frag_table_free(container_of(head, struct inet_frag_table, rcu));
+}
+
+/* Lock the bucket that queue q (q != NULL) or key would hash to. */
+static struct inet_frag_bucket *
+inet_frag_lock_bucket(struct inet_frags *f, struct inet_frag_queue *q,
+		      void *key)
+{
+	struct inet_frag_table *t;
+	struct inet_frag_bucket *hb;
+	unsigned int seq, hash;
+
+	for (;;) {
+		seq = read_seqbegin(&f->rnd_seqlock);
+		t = f->table;
+		hash = q ? f->hashfn(q, f->rnd) : f->keyhash(key, f->rnd);
+		hb = &t->buckets[hash & t->mask];
+
+		spin_lock(&hb->chain_lock);
+		if (!read_seqretry(&f->rnd_seqlock, seq))
+			return hb;
+		spin_unlock(&hb->chain_lock);
+	}
+}
+
+static void inet_frag_rebuild_work(struct work_struct *work)
+{
+	struct inet_frags *f = container_of(work, struct inet_frags,
+					    rebuild_work);
+	struct inet_frag_table *old, *new;
+	unsigned int size, nq, i;
+	u32 rnd;
+
+	old = f->table;
+	size = old->mask + 1;
+	nq = atomic_read(&f->nqueues);
+	while (size < nq && size < INETFRAGS_HASHSZ_MAX)
+		size <<= 1;
+
+	new = inet_frag_table_alloc(size);
+	if (!new)
+		goto out;
+	get_random_bytes(&rnd, sizeof(rnd));
+
+	local_bh_disable();
+	write_seqlock(&f->rnd_seqlock);
+	if (f->table != old) {
+		/* Lost a race with another CPU running this work. */
+		write_sequnlock(&f->rnd_seqlock);
+		local_bh_enable();
+		inet_frag_table_free(new);
+		goto out;
+	}
+
+	f->rnd = rnd;
+	for (i = 0; i <= old->mask; i++) {
+		struct inet_frag_bucket *hb = &old->buckets[i];
+		struct inet_frag_queue *q;
+		struct hlist_node *p, *n;
+
+		spin_lock(&hb->chain_lock);
+		hlist_for_each_entry_safe(q, p, n, &hb->chain, list) {
+			unsigned int hval = f->hashfn(q, rnd) & new->mask;
+
+			hlist_del(&q->list);
+			hlist_add_head(&q->list, &new->buckets[hval].chain);
+		}
+		spin_unlock(&hb->chain_lock);
+	}
+	f->table = new;
+	write_sequnlock(&f->rnd_seqlock);
+	local_bh_enable();
+
+	call_rcu_bh(&old->rcu, inet_frag_table_free_rcu);
+out:
+	mod_timer(&f->secret_timer, jiffies + f->ctl->secret_interval);
+}
+
+static void inet_frag_secret_rebuild(unsigned long data)
+{
+	struct inet_frags *f = (struct inet_frags *)data;
+
+	schedule_work(&f->rebuild_work);
+}
+
+int inet_frag_mem_sum(struct inet_frags *f)
+{
+	int cpu, sum = atomic_read(&f->mem);
+
+	for_each_possible_cpu(cpu)
+		sum += *per_cpu_ptr(f->mem_pcpu, cpu);
+	return sum < 0 ? 0 : sum;
+}
+
+EXPORT_SYMBOL(inet_frag_mem_sum);
+
+/* Size the per-CPU batches for @thresh, keeping the error of f->mem
+ * within a quarter of it.  Redone whenever the sysctl changes; deltas
+ * gathered under a larger batch fold on their CPU's next fragment.
+ */
+static void inet_frag_mem_tune(struct inet_frags *f, int thresh)
+{
+	int batch = thresh / (4 * (int)num_possible_cpus());
+
+	if (batch > INETFRAGS_MEM_BATCH)
+		batch = INETFRAGS_MEM_BATCH;
+	if (batch < 0)
+		batch = 0;
+	f->mem_batch = batch;
+	f->mem_slack = batch * num_possible_cpus();
+	f->mem_thresh = thresh;
+}
+
+/* Is usage past high_thresh?  The shared counter is good enough while
+ * it is further than its error from the limit; closer, sum exactly.
+ */
+static int inet_frag_over_limit(struct inet_frags *f)
+{
+	int thresh = f->ctl->high_thresh;
+
+	if (unlikely(thresh != f->mem_thresh))
+		inet_frag_mem_tune(f, thresh);
+	if (inet_frag_mem(f) + f->mem_slack <= thresh)
+		return 0;
+	return inet_frag_mem_sum(f) > thresh;
+}
+
+/* Claim up to INETFRAGS_EVICT_BATCH queues of one bucket by stealing
+ * their timers, then run the protocol expire handler on each with
+ * INET_FRAG_EVICTED set so it skips the ICMP error.
+ */
+static int inet_frag_evict_bucket(struct inet_frags *f,
+				  struct inet_frag_bucket *hb)
+{
+	struct inet_frag_queue *q, *batch[INETFRAGS_EVICT_BATCH];
+	struct hlist_node *n;
+	int i, count = 0;
+
+	spin_lock(&hb->chain_lock);
+	hlist_for_each_entry(q, n, &hb->chain, list) {
+		/* A running timer will unlink the queue by itself. */
+		if (!del_timer(&q->timer))
+			continue;
+		batch[count++] = q;
+		if (count == INETFRAGS_EVICT_BATCH)
+			break;
+	}
+	spin_unlock(&hb->chain_lock);
+
+	for (i = 0; i < count; i++) {
+		q = batch[i];
+		spin_lock(&q->lock);
+		q->last_in |= INET_FRAG_EVICTED;
+		spin_unlock(&q->lock);
+		/* Consumes the timer's reference. */
+		f->frag_expire((unsigned long)q);
+	}
+	return count;
+}
+
+static void inet_frag_evict_work(struct work_struct *work)
+{
+	struct inet_frags *f = container_of(work, struct inet_frags,
+					    evict_work);
+	unsigned int i, budget = INETFRAGS_EVICT_BUCKETS;
+	int evicted = 0, n;
+
+	local_bh_disable();
+	i = f->next_bucket;
+	while (budget-- && inet_frag_mem_sum(f) > f->ctl->low_thresh) {
+		struct inet_frag_table *t = f->table;
+
+		do {
+			n = inet_frag_evict_bucket(f,
+						   &t->buckets[i & t->mask]);
+			evicted += n;
+		} while (n == INETFRAGS_EVICT_BATCH);
+		i++;
+	}
+	f->next_bucket = i;
+	local_bh_enable();
+
+	if (evicted && inet_frag_mem_sum(f) > f->ctl->low_thresh)
+		schedule_work(&f->evict_work);
+}
+
+/* Over the limit on the receive path: free one batch of queues now so
+ * the fragment in hand may fit, and leave the rest to the worker.
+ */
+static void inet_frag_evict(struct inet_frags *f)
+{
+	struct inet_frag_table *t = f->table;
+	unsigned int budget = INETFRAGS_EVICT_BUCKETS;
+	unsigned int i = f->next_bucket;
+
+	while (budget-- &&
+	       !inet_frag_evict_bucket(f, &t->buckets[i & t->mask]))
+		i++;
+	f->next_bucket = i + 1;
+	schedule_work(&f->evict_work);
+}
+
+int inet_frags_init(struct inet_frags *f)
+{
+	f->table = inet_frag_table_alloc(INETFRAGS_HASHSZ_MIN);
+	if (!f->table)
+		return -ENOMEM;
+	f->mem_pcpu = alloc_percpu(int);
+	if (!f->mem_pcpu) {
+		inet_frag_table_free(f->table);
+		return -ENOMEM;
+	}
+
+	seqlock_init(&f->rnd_seqlock);
+	f->rnd = (u32) ((num_physpages ^ (num_physpages>>7)) ^
+			(jiffies ^ (jiffies >> 6)));
+	atomic_set(&f->nqueues, 0);
+	atomic_set(&f->mem, 0);
+	inet_frag_mem_tune(f, f->ctl->high_thresh);
+	f->next_bucket = 0;
+
+	INIT_WORK(&f->rebuild_work, inet_frag_rebuild_work);
+	INIT_WORK(&f->evict_work, inet_frag_evict_work);
+
+	init_timer(&f->secret_timer);
+	f->secret_timer.function = inet_frag_secret_rebuild;
+	f->secret_timer.data = (unsigned long)f;
+	f->secret_timer.expires = jiffies + f->ctl->secret_interval;
+	add_timer(&f->secret_timer);
+	return 0;
+}
+
+EXPORT_SYMBOL(inet_frags_init);
+
+/* Tear down a fragment engine whose users are gone (module unload). */
+void inet_frags_fini(struct inet_frags *f)
+{
+	unsigned int i;
+
+	del_timer_sync(&f->secret_timer);
+	flush_scheduled_work();
+	del_timer_sync(&f->secret_timer);
+
+	while (atomic_read(&f->nqueues)) {
+		local_bh_disable();
+		for (i = 0; i <= f->table->mask; i++)
+			while (inet_frag_evict_bucket(f, &f->table->buckets[i]))
+				;
+		local_bh_enable();
+		/* Queues whose timer was already running. */
+		if (atomic_read(&f->nqueues))
+			msleep(1);
+	}
+	flush_scheduled_work();
+
+	synchronize_rcu();
+	inet_frag_table_free(f->table);
+	free_percpu(f->mem_pcpu);
+}
+
+EXPORT_SYMBOL(inet_frags_fini);
+
+/* Kill queue. It is not destroyed immediately,
+ * because caller (and someone more) holds reference count.
+ * Called with q->lock held.
+ */
+void inet_frag_kill(struct inet_frag_queue *q, struct inet_frags *f)
+{
+	if (del_timer(&q->timer))
+		atomic_dec(&q->refcnt);
+
+	if (!(q->last_in & INET_FRAG_COMPLETE)) {
+		struct inet_frag_bucket *hb = inet_frag_lock_bucket(f, q, NULL);
+
+		hlist_del(&q->list);
+		spin_unlock(&hb->chain_lock);
+		atomic_dec(&f->nqueues);
+		atomic_dec(&q->refcnt);
+		q->last_in |= INET_FRAG_COMPLETE;
+	}
+}
+
+EXPORT_SYMBOL(inet_frag_kill);
+
+/* Complete destruction of q, once the last reference is gone. */
+void inet_frag_destroy(struct inet_frag_queue *q, struct inet_frags *f)
+{
+	struct sk_buff *fp;
+	int sum = f->qsize;
+
+	BUG_TRAP(q->last_in & INET_FRAG_COMPLETE);
+	BUG_TRAP(del_timer(&q->timer) == 0);
+
+	/* Release all fragment data. */
+	fp = q->fragments;
+	while (fp) {
+		struct sk_buff *xp = fp->next;
+
+		sum += fp->truesize;
+		if (f->skb_free)
+			f->skb_free(fp);
+		kfree_skb(fp);
+		fp = xp;
+	}
+
+	if (f->destructor)
+		f->destructor(q);
+	inet_frag_mem_sub(f, sum);
+	kfree(q);
+}
+
+EXPORT_SYMBOL(inet_frag_destroy);
+
+static struct inet_frag_queue *inet_frag_intern(struct inet_frag_queue *qp_in,
+						struct inet_frags *f, void *key)
+{
+	struct inet_frag_bucket *hb;
+	struct inet_frag_queue *qp;
+#ifdef CONFIG_SMP
+	struct hlist_node *n;
+#endif
+
+	hb = inet_frag_lock_bucket(f, NULL, key);
+#ifdef CONFIG_SMP
+	/* With SMP race we have to recheck hash table, because
+	 * such entry could be created on other cpu, while we
+	 * were allocating ours outside the bucket lock.
+	 */
+	hlist_for_each_entry(qp, n, &hb->chain, list) {
+		if (f->match(qp, key)) {
+			atomic_inc(&qp->refcnt);
+			spin_unlock(&hb->chain_lock);
+			qp_in->last_in |= INET_FRAG_COMPLETE;
+			inet_frag_put(qp_in, f);
+			return qp;
+		}
+	}
+#endif
+	qp = qp_in;
+
+	if (!mod_timer(&qp->timer, jiffies + f->ctl->timeout))
+		atomic_inc(&qp->refcnt);
+
+	atomic_inc(&qp->refcnt);
+	hlist_add_head(&qp->list, &hb->chain);
+	spin_unlock(&hb->chain_lock);
+
+	/* Keep chains around one entry deep; the table is only read
+	 * here, the worker does the resize under the seqlock.
+	 */
+	if (atomic_inc_return(&f->nqueues) > f->table->mask + 1 &&
+	    f->table->mask + 1 < INETFRAGS_HASHSZ_MAX)
+		schedule_work(&f->rebuild_work);
+	return qp;
+}
+
+static struct inet_frag_queue *inet_frag_create(struct inet_frags *f,
+						void *key)
+{
+	struct inet_frag_queue *q;
+
+	q = kzalloc(f->qsize, GFP_ATOMIC);
+	if (q == NULL)
+		return NULL;
+
+	f->constructor(q, key);
+	inet_frag_mem_add(f, f->qsize);
+
+	init_timer(&q->timer);
+	q->timer.data = (unsigned long) q;
+	q->timer.function = f->frag_expire;
+	spin_lock_init(&q->lock);
+	atomic_set(&q->refcnt, 1);
+
+	return inet_frag_intern(q, f, key);
+}
+
+/* Find the queue matching key, creating it if nothing is found.
+ * Returns it with a reference held, or NULL.
+ */
+struct inet_frag_queue *inet_frag_find(struct inet_frags *f, void *key)
+{
+	struct inet_frag_bucket *hb;
+	struct inet_frag_queue *q;
+	struct hlist_node *n;
+
+	/* Every fragment counts, not only the first of a datagram: make
+	 * room, and drop this one if that was not enough.
+	 */
+	if (inet_frag_over_limit(f)) {
+		inet_frag_evict(f);
+		if (inet_frag_over_limit(f))
+			return NULL;
+	}
+
+	hb = inet_frag_lock_bucket(f, NULL, key);
+	hlist_for_each_entry(q, n, &hb->chain, list) {
+		if (f->match(q, key)) {
+			atomic_inc(&q->refcnt);
+			spin_unlock(&hb->chain_lock);
+			return q;
+		}
+	}
+	spin_unlock(&hb->chain_lock);
+
+	return inet_frag_create(f, key);
+}
+
+EXPORT_SYMBOL(inet_frag_find);
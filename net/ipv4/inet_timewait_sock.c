@@ -108,6 +108,7 @@ struct inet_timewait_sock *inet_twsk_alloc(const struct sock *sk, const int stat
 		tw->tw_reuse	    = sk->sk_reuse;
 		tw->tw_hash	    = sk->sk_hash;
 		tw->tw_ipv6only	    = 0;
+		tw->tw_cpu	    = raw_smp_processor_id();
 		tw->tw_prot	    = sk->sk_prot_creator;
 		atomic_set(&tw->tw_refcnt, 1);
 		inet_twsk_dead_node_init(tw);
@@ -119,113 +120,111 @@ struct inet_timewait_sock *inet_twsk_alloc(const struct sock *sk, const int stat
 
 EXPORT_SYMBOL_GPL(inet_twsk_alloc);
 
-/* Returns non-zero if quota exceeded.  */
-static int inet_twdr_do_twkill_work(struct inet_timewait_death_row *twdr,
-				    const int slot)
+/*
+ * Pick the queue for a TIME_WAIT sock with the given timeout.  Short
+ * timeouts are rounded up to a power of two so that each queue stays
+ * sorted.
+ */
+static int inet_twdr_queue(int *timeo, const int timewait_len)
 {
-	struct inet_timewait_sock *tw;
-	struct hlist_node *node;
-	unsigned int killed;
-	int ret;
-
-	/* NOTE: compare this to previous version where lock
-	 * was released after detaching chain. It was racy,
-	 * because tw buckets are scheduled in not serialized context
-	 * in 2.3 (with netfilter), and with softnet it is common, because
-	 * soft irqs are not sequenced.
-	 */
-	killed = 0;
-	ret = 0;
-rescan:
-	inet_twsk_for_each_inmate(tw, node, &twdr->cells[slot]) {
-		__inet_twsk_del_dead_node(tw);
-		spin_unlock(&twdr->death_lock);
-		__inet_twsk_kill(tw, twdr->hashinfo);
-		inet_twsk_put(tw);
-		killed++;
-		spin_lock(&twdr->death_lock);
-		if (killed > INET_TWDR_TWKILL_QUOTA) {
-			ret = 1;
-			break;
+	int q;
+
+	if (*timeo < timewait_len) {
+		q = *timeo > 1 ? fls(*timeo - 1) : 0;
+		if ((1 << q) < timewait_len) {
+			*timeo = 1 << q;
+			return q + 1;
 		}
+	}
+	*timeo = timewait_len;
+	return 0;
+}
+
+static void inet_twdr_reap(unsigned long data)
+{
+	struct inet_twdr_cpu *row = (struct inet_twdr_cpu *)data;
+	struct inet_timewait_death_row *twdr = row->twdr;
+	struct inet_hashinfo *hashinfo = twdr->hashinfo;
+	unsigned long now = jiffies, next = 0;
+	int killed = 0, recycled = 0;
+	int q;
+
+	spin_lock(&row->lock);
+	for (q = 0; q < INET_TWDR_QUEUES; q++) {
+		struct list_head *head = &row->queue[q];
+
+		while (!list_empty(head)) {
+			struct inet_timewait_sock *tw;
+
+			tw = list_entry(head->next, struct inet_timewait_sock,
+					tw_death_node);
+			if (time_before(now, tw->tw_ttd)) {
+				if (!next || time_before(tw->tw_ttd, next))
+					next = tw->tw_ttd;
+				break;
+			}
+
+			/* Leave the rest to the next tick. */
+			if (killed + recycled >= INET_TWDR_TWKILL_QUOTA) {
+				next = now + 1;
+				goto out;
+			}
 
-		/* While we dropped twdr->death_lock, another cpu may have
-		 * killed off the next TW bucket in the list, therefore
-		 * do a fresh re-read of the hlist head node with the
-		 * lock reacquired.  We still use the hlist traversal
-		 * macro in order to get the prefetches.
-		 */
-		goto rescan;
+			__inet_twsk_del_dead_node(tw);
+			__inet_twsk_kill(tw, hashinfo);
+			inet_twsk_put(tw);
+			if (q)
+				recycled++;
+			else
+				killed++;
+		}
 	}
+out:
+	percpu_counter_mod(&twdr->tw_count, -(killed + recycled));
+	if (next)
+		mod_timer(&row->timer, next);
+	spin_unlock(&row->lock);
 
-	twdr->tw_count -= killed;
 	NET_ADD_STATS_BH(LINUX_MIB_TIMEWAITED, killed);
-
-	return ret;
+	NET_ADD_STATS_BH(LINUX_MIB_TIMEWAITKILLED, recycled);
 }
 
-void inet_twdr_hangman(unsigned long data)
+int inet_twdr_init(struct inet_timewait_death_row *twdr)
 {
-	struct inet_timewait_death_row *twdr;
-	int unsigned need_timer;
-
-	twdr = (struct inet_timewait_death_row *)data;
-	spin_lock(&twdr->death_lock);
-
-	if (twdr->tw_count == 0)
-		goto out;
-
-	need_timer = 0;
-	if (inet_twdr_do_twkill_work(twdr, twdr->slot)) {
-		twdr->thread_slots |= (1 << twdr->slot);
-		schedule_work(&twdr->twkill_work);
-		need_timer = 1;
-	} else {
-		/* We purged the entire slot, anything left?  */
-		if (twdr->tw_count)
-			need_timer = 1;
+	int cpu, q;
+
+	twdr->rows = alloc_percpu(struct inet_twdr_cpu);
+	if (twdr->rows == NULL)
+		return -ENOMEM;
+	percpu_counter_init(&twdr->tw_count, 0);
+
+	for_each_possible_cpu(cpu) {
+		struct inet_twdr_cpu *row = per_cpu_ptr(twdr->rows, cpu);
+
+		spin_lock_init(&row->lock);
+		row->twdr = twdr;
+		setup_timer(&row->timer, inet_twdr_reap, (unsigned long)row);
+		for (q = 0; q < INET_TWDR_QUEUES; q++)
+			INIT_LIST_HEAD(&row->queue[q]);
 	}
-	twdr->slot = ((twdr->slot + 1) & (INET_TWDR_TWKILL_SLOTS - 1));
-	if (need_timer)
-		mod_timer(&twdr->tw_timer, jiffies + twdr->period);
-out:
-	spin_unlock(&twdr->death_lock);
+	return 0;
 }
 
-EXPORT_SYMBOL_GPL(inet_twdr_hangman);
+EXPORT_SYMBOL_GPL(inet_twdr_init);
 
-extern void twkill_slots_invalid(void);
-
-void inet_twdr_twkill_work(struct work_struct *work)
+/* All TIME_WAIT socks must be gone, they pin the protocol module. */
+void inet_twdr_destroy(struct inet_timewait_death_row *twdr)
 {
-	struct inet_timewait_death_row *twdr =
-		container_of(work, struct inet_timewait_death_row, twkill_work);
-	int i;
-
-	if ((INET_TWDR_TWKILL_SLOTS - 1) > (sizeof(twdr->thread_slots) * 8))
-		twkill_slots_invalid();
-
-	while (twdr->thread_slots) {
-		spin_lock_bh(&twdr->death_lock);
-		for (i = 0; i < INET_TWDR_TWKILL_SLOTS; i++) {
-			if (!(twdr->thread_slots & (1 << i)))
-				continue;
-
-			while (inet_twdr_do_twkill_work(twdr, i) != 0) {
-				if (need_resched()) {
-					spin_unlock_bh(&twdr->death_lock);
-					schedule();
-					spin_lock_bh(&twdr->death_lock);
-				}
-			}
+	int cpu;
 
-			twdr->thread_slots &= ~(1 << i);
-		}
-		spin_unlock_bh(&twdr->death_lock);
-	}
+	for_each_possible_cpu(cpu)
+		del_timer_sync(&per_cpu_ptr(twdr->rows, cpu)->timer);
+	free_percpu(twdr->rows);
+	twdr->rows = NULL;
+	percpu_counter_destroy(&twdr->tw_count);
 }
 
-EXPORT_SYMBOL_GPL(inet_twdr_twkill_work);
+EXPORT_SYMBOL_GPL(inet_twdr_destroy);
 
 /* These are always called from BH context.  See callers in
  * tcp_input.c to verify this.
@@ -235,13 +234,14 @@ EXPORT_SYMBOL_GPL(inet_twdr_twkill_work);
 void inet_twsk_deschedule(struct inet_timewait_sock *tw,
 			  struct inet_timewait_death_row *twdr)
 {
-	spin_lock(&twdr->death_lock);
+	struct inet_twdr_cpu *row = per_cpu_ptr(twdr->rows, tw->tw_cpu);
+
+	spin_lock(&row->lock);
 	if (inet_twsk_del_dead_node(tw)) {
 		inet_twsk_put(tw);
-		if (--twdr->tw_count == 0)
-			del_timer(&twdr->tw_timer);
+		percpu_counter_dec(&twdr->tw_count);
 	}
-	spin_unlock(&twdr->death_lock);
+	spin_unlock(&row->lock);
 	__inet_twsk_kill(tw, twdr->hashinfo);
 }
 
@@ -251,8 +251,9 @@ void inet_twsk_schedule(struct inet_timewait_sock *tw,
 		       struct inet_timewait_death_row *twdr,
 		       const int timeo, const int timewait_len)
 {
-	struct hlist_head *list;
-	int slot;
+	struct inet_twdr_cpu *row = per_cpu_ptr(twdr->rows, tw->tw_cpu);
+	int len = timeo;
+	int q;
 
 	/* timeout := RTO * 3.5
 	 *
@@ -278,108 +279,23 @@ void inet_twsk_schedule(struct inet_timewait_sock *tw,
 	 * is greater than TS tick!) and detect old duplicates with help
 	 * of PAWS.
 	 */
-	slot = (timeo + (1 << INET_TWDR_RECYCLE_TICK) - 1) >> INET_TWDR_RECYCLE_TICK;
+	q = inet_twdr_queue(&len, timewait_len);
 
-	spin_lock(&twdr->death_lock);
+	spin_lock(&row->lock);
 
 	/* Unlink it, if it was scheduled */
-	if (inet_twsk_del_dead_node(tw))
-		twdr->tw_count--;
-	else
+	if (!inet_twsk_del_dead_node(tw)) {
 		atomic_inc(&tw->tw_refcnt);
-
-	if (slot >= INET_TWDR_RECYCLE_SLOTS) {
-		/* Schedule to slow timer */
-		if (timeo >= timewait_len) {
-			slot = INET_TWDR_TWKILL_SLOTS - 1;
-		} else {
-			slot = (timeo + twdr->period - 1) / twdr->period;
-			if (slot >= INET_TWDR_TWKILL_SLOTS)
-				slot = INET_TWDR_TWKILL_SLOTS - 1;
-		}
-		tw->tw_ttd = jiffies + timeo;
-		slot = (twdr->slot + slot) & (INET_TWDR_TWKILL_SLOTS - 1);
-		list = &twdr->cells[slot];
-	} else {
-		tw->tw_ttd = jiffies + (slot << INET_TWDR_RECYCLE_TICK);
-
-		if (twdr->twcal_hand < 0) {
-			twdr->twcal_hand = 0;
-			twdr->twcal_jiffie = jiffies;
-			twdr->twcal_timer.expires = twdr->twcal_jiffie +
-					      (slot << INET_TWDR_RECYCLE_TICK);
-			add_timer(&twdr->twcal_timer);
-		} else {
-			if (time_after(twdr->twcal_timer.expires,
-				       jiffies + (slot << INET_TWDR_RECYCLE_TICK)))
-				mod_timer(&twdr->twcal_timer,
-					  jiffies + (slot << INET_TWDR_RECYCLE_TICK));
-			slot = (twdr->twcal_hand + slot) & (INET_TWDR_RECYCLE_SLOTS - 1);
-		}
-		list = &twdr->twcal_row[slot];
+		percpu_counter_inc(&twdr->tw_count);
 	}
 
-	hlist_add_head(&tw->tw_death_node, list);
+	tw->tw_ttd = jiffies + len;
+	list_add_tail(&tw->tw_death_node, &row->queue[q]);
 
-	if (twdr->tw_count++ == 0)
-		mod_timer(&twdr->tw_timer, jiffies + twdr->period);
-	spin_unlock(&twdr->death_lock);
+	if (!timer_pending(&row->timer) ||
+	    time_after(row->timer.expires, tw->tw_ttd))
+		mod_timer(&row->timer, tw->tw_ttd);
+	spin_unlock(&row->lock);
 }
 
 EXPORT_SYMBOL_GPL(inet_twsk_schedule);
-
-void inet_twdr_twcal_tick(unsigned long data)
-{
-	struct inet_timewait_death_row *twdr;
-	int n, slot;
-	unsigned long j;
-	unsigned long now = jiffies;
-	int killed = 0;
-	int adv = 0;
-
-	twdr = (struct inet_timewait_death_row *)data;
-
-	spin_lock(&twdr->death_lock);
-	if (twdr->twcal_hand < 0)
-		goto out;
-
-	slot = twdr->twcal_hand;
-	j = twdr->twcal_jiffie;
-
-	for (n = 0; n < INET_TWDR_RECYCLE_SLOTS; n++) {
-		if (time_before_eq(j, now)) {
-			struct hlist_node *node, *safe;
-			struct inet_timewait_sock *tw;
-
-			inet_twsk_for_each_inmate_safe(tw, node, safe,
-						       &twdr->twcal_row[slot]) {
-				__inet_twsk_del_dead_node(tw);
-				__inet_twsk_kill(tw, twdr->hashinfo);
-				inet_twsk_put(tw);
-				killed++;
-			}
-		} else {
-			if (!adv) {
-				adv = 1;
-				twdr->twcal_jiffie = j;
-				twdr->twcal_hand = slot;
-			}
-
-			if (!hlist_empty(&twdr->twcal_row[slot])) {
-				mod_timer(&twdr->twcal_timer, j);
-				goto out;
-			}
-		}
-		j += 1 << INET_TWDR_RECYCLE_TICK;
-		slot = (slot + 1) & (INET_TWDR_RECYCLE_SLOTS - 1);
-	}
-	twdr->twcal_hand = -1;
-
-out:
-	if ((twdr->tw_count -= killed) == 0)
-		del_timer(&twdr->tw_timer);
-	NET_ADD_STATS_BH(LINUX_MIB_TIMEWAITKILLED, killed);
-	spin_unlock(&twdr->death_lock);
-}
-
-EXPORT_SYMBOL_GPL(inet_twdr_twcal_tick);
@@ -20,6 +20,9 @@
 #include <linux/kernel.h>
 #include <linux/mm.h>
 #include <linux/net.h>
+#include <linux/bootmem.h>
+#include <linux/jhash.h>
+#include <linux/rcupdate.h>
 #include <net/ip.h>
 #include <net/inetpeer.h>
 
@@ -38,65 +41,56 @@
  *
  *  Route cache entries hold references to our nodes.
  *  New cache entries get references via lookup by destination IP address in
- *  the avl tree.  The reference is grabbed only when it's needed i.e. only
+ *  the peer hash.  The reference is grabbed only when it's needed i.e. only
  *  when we try to output IP packet which needs an unpredictable ID (see
  *  __ip_select_ident() in net/ipv4/route.c).
  *  Nodes are removed only when reference counter goes to 0.
  *  When it's happened the node may be removed when a sufficient amount of
- *  time has been passed since its last use.  The less-recently-used entry can
- *  also be removed if the pool is overloaded i.e. if the total amount of
- *  entries is greater-or-equal than the threshold.
+ *  time has been passed since its last use.  If the pool is overloaded i.e.
+ *  the total amount of entries is greater-or-equal than the threshold, any
+ *  unreferenced entry may be removed.
  *
- *  Node pool is organised as an AVL tree.
- *  Such an implementation has been chosen not just for fun.  It's a way to
- *  prevent easy and efficient DoS attacks by creating hash collisions.  A huge
- *  amount of long living nodes in a single hash slot would significantly delay
- *  lookups performed with disabled BHs.
+ *  Node pool is organised as a hash table keyed with a random secret, so
+ *  that remote hosts cannot aim for a single chain.  Lookups walk the chain
+ *  under rcu_read_lock_bh() and take no lock at all.  Each bucket has its
+ *  own spinlock for insertion and removal.  There is no unused list:
+ *  expiry is lazy.  Stale entries are reaped from a chain whenever a new
+ *  entry is linked into it, and a periodic timer sweeps a slice of the
+ *  table per run.
  *
  *  Serialisation issues.
- *  1.  Nodes may appear in the tree only with the pool write lock held.
- *  2.  Nodes may disappear from the tree only with the pool write lock held
- *      AND reference count being 0.
- *  3.  Nodes appears and disappears from unused node list only under
- *      "inet_peer_unused_lock".
- *  4.  Global variable peer_total is modified under the pool lock.
- *  5.  struct inet_peer fields modification:
- *		avl_left, avl_right, avl_parent, avl_height: pool lock
- *		unused_next, unused_prevp: unused node list lock
- *		refcnt: atomically against modifications on other CPU;
- *		   usually under some other lock to prevent node disappearing
- *		dtime: unused node list lock
+ *  1.  Nodes may appear in a chain only with the bucket lock held.
+ *  2.  Nodes may disappear from a chain only with the bucket lock held
+ *      AND after switching the reference count from 0 to -1.  Lookups never
+ *      take a reference on a node whose count is -1, and the node memory is
+ *      released only after an RCU-bh grace period.
+ *  3.  struct inet_peer fields modification:
+ *		hash_node: bucket lock
+ *		refcnt: atomically
+ *		dtime: written before the last reference is dropped
  *		v4daddr: unchangeable
- *		ip_id_count: idlock
+ *		ip_id_count: atomically
  */
 
-/* Exported for inet_getid inline function.  */
-DEFINE_SPINLOCK(inet_peer_idlock);
-
 static struct kmem_cache *peer_cachep __read_mostly;
 
-#define node_height(x) x->avl_height
-static struct inet_peer peer_fake_node = {
-	.avl_left	= &peer_fake_node,
-	.avl_right	= &peer_fake_node,
-	.avl_height	= 0
+struct inet_peer_bucket {
+	struct hlist_head	chain;
+	spinlock_t		lock;
 };
-#define peer_avl_empty (&peer_fake_node)
-static struct inet_peer *peer_root = peer_avl_empty;
-static DEFINE_RWLOCK(peer_pool_lock);
-#define PEER_MAXDEPTH 40 /* sufficient for about 2^27 nodes */
 
-static int peer_total;
+static struct inet_peer_bucket *peer_hash __read_mostly;
+static unsigned int peer_hash_mask __read_mostly;
+static u32 peer_hash_rnd __read_mostly;
+static unsigned int peer_gc_bucket;
+
+static atomic_t peer_total = ATOMIC_INIT(0);
 /* Exported for sysctl_net_ipv4.  */
 int inet_peer_threshold = 65536 + 128;	/* start to throw entries more
 					 * aggressively at this stage */
 int inet_peer_minttl = 120 * HZ;	/* TTL under high load: 120 sec */
 int inet_peer_maxttl = 10 * 60 * HZ;	/* usual time to live: 10 min */
 
-static struct inet_peer *inet_peer_unused_head;
-static struct inet_peer **inet_peer_unused_tailp = &inet_peer_unused_head;
-static DEFINE_SPINLOCK(inet_peer_unused_lock);
-
 static void peer_check_expire(unsigned long dummy);
 static DEFINE_TIMER(peer_periodic_timer, peer_check_expire, 0, 0);
 
@@ -108,6 +102,7 @@ int inet_peer_gc_mintime = 10 * HZ,
 void __init inet_initpeers(void)
 {
 	struct sysinfo si;
+	unsigned int i;
 
 	/* Use the straight interface to information about memory. */
 	si_meminfo(&si);
@@ -127,6 +122,21 @@ void __init inet_initpeers(void)
 			0, SLAB_HWCACHE_ALIGN|SLAB_PANIC,
 			NULL, NULL);
 
+	peer_hash = alloc_large_system_hash("inet_peer",
+					    sizeof(struct inet_peer_bucket),
+					    0,
+					    (num_physpages >= 128 * 1024) ?
+					    15 : 17,
+					    0,
+					    NULL,
+					    &peer_hash_mask,
+					    0);
+	for (i = 0; i <= peer_hash_mask; i++) {
+		INIT_HLIST_HEAD(&peer_hash[i].chain);
+		spin_lock_init(&peer_hash[i].lock);
+	}
+	get_random_bytes(&peer_hash_rnd, sizeof(peer_hash_rnd));
+
 	/* All the timers, started at system startup tend
 	   to synchronize. Perturb it a bit.
 	 */
@@ -136,258 +146,81 @@ void __init inet_initpeers(void)
 	add_timer(&peer_periodic_timer);
 }
 
-/* Called with or without local BH being disabled. */
-static void unlink_from_unused(struct inet_peer *p)
+static inline struct inet_peer_bucket *peer_bucket(__be32 daddr)
 {
-	spin_lock_bh(&inet_peer_unused_lock);
-	if (p->unused_prevp != NULL) {
-		/* On unused list. */
-		*p->unused_prevp = p->unused_next;
-		if (p->unused_next != NULL)
-			p->unused_next->unused_prevp = p->unused_prevp;
-		else
-			inet_peer_unused_tailp = p->unused_prevp;
-		p->unused_prevp = NULL; /* mark it as removed */
-	}
-	spin_unlock_bh(&inet_peer_unused_lock);
+	return &peer_hash[jhash_1word((__force u32)daddr, peer_hash_rnd) &
+			  peer_hash_mask];
 }
 
-/* Called with local BH disabled and the pool lock held. */
-#define lookup(daddr) 						\
-({								\
-	struct inet_peer *u, **v;				\
-	stackptr = stack;					\
-	*stackptr++ = &peer_root;				\
-	for (u = peer_root; u != peer_avl_empty; ) {		\
-		if (daddr == u->v4daddr)			\
-			break;					\
-		if ((__force __u32)daddr < (__force __u32)u->v4daddr)	\
-			v = &u->avl_left;			\
-		else						\
-			v = &u->avl_right;			\
-		*stackptr++ = v;				\
-		u = *v;						\
-	}							\
-	u;							\
-})
-
-/* Called with local BH disabled and the pool write lock held. */
-#define lookup_rightempty(start)				\
-({								\
-	struct inet_peer *u, **v;				\
-	*stackptr++ = &start->avl_left;				\
-	v = &start->avl_left;					\
-	for (u = *v; u->avl_right != peer_avl_empty; ) {	\
-		v = &u->avl_right;				\
-		*stackptr++ = v;				\
-		u = *v;						\
-	}							\
-	u;							\
-})
-
-/* Called with local BH disabled and the pool write lock held.
- * Variable names are the proof of operation correctness.
- * Look into mm/map_avl.c for more detail description of the ideas.  */
-static void peer_avl_rebalance(struct inet_peer **stack[],
-		struct inet_peer ***stackend)
+/* Current time to live of unused entries, shorter as the pool fills up. */
+static unsigned long peer_ttl(void)
 {
-	struct inet_peer **nodep, *node, *l, *r;
-	int lh, rh;
-
-	while (stackend > stack) {
-		nodep = *--stackend;
-		node = *nodep;
-		l = node->avl_left;
-		r = node->avl_right;
-		lh = node_height(l);
-		rh = node_height(r);
-		if (lh > rh + 1) { /* l: RH+2 */
-			struct inet_peer *ll, *lr, *lrl, *lrr;
-			int lrh;
-			ll = l->avl_left;
-			lr = l->avl_right;
-			lrh = node_height(lr);
-			if (lrh <= node_height(ll)) {	/* ll: RH+1 */
-				node->avl_left = lr;	/* lr: RH or RH+1 */
-				node->avl_right = r;	/* r: RH */
-				node->avl_height = lrh + 1; /* RH+1 or RH+2 */
-				l->avl_left = ll;	/* ll: RH+1 */
-				l->avl_right = node;	/* node: RH+1 or RH+2 */
-				l->avl_height = node->avl_height + 1;
-				*nodep = l;
-			} else { /* ll: RH, lr: RH+1 */
-				lrl = lr->avl_left;	/* lrl: RH or RH-1 */
-				lrr = lr->avl_right;	/* lrr: RH or RH-1 */
-				node->avl_left = lrr;	/* lrr: RH or RH-1 */
-				node->avl_right = r;	/* r: RH */
-				node->avl_height = rh + 1; /* node: RH+1 */
-				l->avl_left = ll;	/* ll: RH */
-				l->avl_right = lrl;	/* lrl: RH or RH-1 */
-				l->avl_height = rh + 1;	/* l: RH+1 */
-				lr->avl_left = l;	/* l: RH+1 */
-				lr->avl_right = node;	/* node: RH+1 */
-				lr->avl_height = rh + 2;
-				*nodep = lr;
-			}
-		} else if (rh > lh + 1) { /* r: LH+2 */
-			struct inet_peer *rr, *rl, *rlr, *rll;
-			int rlh;
-			rr = r->avl_right;
-			rl = r->avl_left;
-			rlh = node_height(rl);
-			if (rlh <= node_height(rr)) {	/* rr: LH+1 */
-				node->avl_right = rl;	/* rl: LH or LH+1 */
-				node->avl_left = l;	/* l: LH */
-				node->avl_height = rlh + 1; /* LH+1 or LH+2 */
-				r->avl_right = rr;	/* rr: LH+1 */
-				r->avl_left = node;	/* node: LH+1 or LH+2 */
-				r->avl_height = node->avl_height + 1;
-				*nodep = r;
-			} else { /* rr: RH, rl: RH+1 */
-				rlr = rl->avl_right;	/* rlr: LH or LH-1 */
-				rll = rl->avl_left;	/* rll: LH or LH-1 */
-				node->avl_right = rll;	/* rll: LH or LH-1 */
-				node->avl_left = l;	/* l: LH */
-				node->avl_height = lh + 1; /* node: LH+1 */
-				r->avl_right = rr;	/* rr: LH */
-				r->avl_left = rlr;	/* rlr: LH or LH-1 */
-				r->avl_height = lh + 1;	/* r: LH+1 */
-				rl->avl_right = r;	/* r: LH+1 */
-				rl->avl_left = node;	/* node: LH+1 */
-				rl->avl_height = lh + 2;
-				*nodep = rl;
-			}
-		} else {
-			node->avl_height = (lh > rh ? lh : rh) + 1;
-		}
-	}
+	int total = atomic_read(&peer_total);
+
+	if (total >= inet_peer_threshold)
+		return 0;
+	return inet_peer_maxttl
+		- (inet_peer_maxttl - inet_peer_minttl) / HZ *
+			total / inet_peer_threshold * HZ;
 }
 
-/* Called with local BH disabled and the pool write lock held. */
-#define link_to_pool(n)						\
-do {								\
-	n->avl_height = 1;					\
-	n->avl_left = peer_avl_empty;				\
-	n->avl_right = peer_avl_empty;				\
-	**--stackptr = n;					\
-	peer_avl_rebalance(stack, stackptr);			\
-} while(0)
-
-/* May be called with local BH enabled. */
-static void unlink_from_pool(struct inet_peer *p)
+static void inet_peer_free_rcu(struct rcu_head *head)
 {
-	int do_free;
-
-	do_free = 0;
-
-	write_lock_bh(&peer_pool_lock);
-	/* Check the reference counter.  It was artificially incremented by 1
-	 * in cleanup() function to prevent sudden disappearing.  If the
-	 * reference count is still 1 then the node is referenced only as `p'
-	 * here and from the pool.  So under the exclusive pool lock it's safe
-	 * to remove the node and free it later. */
-	if (atomic_read(&p->refcnt) == 1) {
-		struct inet_peer **stack[PEER_MAXDEPTH];
-		struct inet_peer ***stackptr, ***delp;
-		if (lookup(p->v4daddr) != p)
-			BUG();
-		delp = stackptr - 1; /* *delp[0] == p */
-		if (p->avl_left == peer_avl_empty) {
-			*delp[0] = p->avl_right;
-			--stackptr;
-		} else {
-			/* look for a node to insert instead of p */
-			struct inet_peer *t;
-			t = lookup_rightempty(p);
-			BUG_ON(*stackptr[-1] != t);
-			**--stackptr = t->avl_left;
-			/* t is removed, t->v4daddr > x->v4daddr for any
-			 * x in p->avl_left subtree.
-			 * Put t in the old place of p. */
-			*delp[0] = t;
-			t->avl_left = p->avl_left;
-			t->avl_right = p->avl_right;
-			t->avl_height = p->avl_height;
-			BUG_ON(delp[1] != &p->avl_left);
-			delp[1] = &t->avl_left; /* was &p->avl_left */
-		}
-		peer_avl_rebalance(stack, stackptr);
-		peer_total--;
-		do_free = 1;
-	}
-	write_unlock_bh(&peer_pool_lock);
+	kmem_cache_free(peer_cachep, container_of(head, struct inet_peer, rcu));
+}
 
-	if (do_free)
-		kmem_cache_free(peer_cachep, p);
-	else
-		/* The node is used again.  Decrease the reference counter
-		 * back.  The loop "cleanup -> unlink_from_unused
-		 *   -> unlink_from_pool -> putpeer -> link_to_unused
-		 *   -> cleanup (for the same node)"
-		 * doesn't really exist because the entry will have a
-		 * recent deletion time and will not be cleaned again soon. */
-		inet_putpeer(p);
+/* Called with the bucket lock held.  Returns the number of entries freed. */
+static int peer_expire_chain(struct inet_peer_bucket *b, unsigned long ttl)
+{
+	struct inet_peer *p;
+	struct hlist_node *node, *tmp;
+	int freed = 0;
+
+	hlist_for_each_entry_safe(p, node, tmp, &b->chain, hash_node) {
+		if ((__u32)jiffies - p->dtime < ttl)
+			continue;
+		/* Claim it; a concurrent lookup either got in first or
+		 * will see -1 and leave the node alone. */
+		if (atomic_cmpxchg(&p->refcnt, 0, -1) != 0)
+			continue;
+		hlist_del_rcu(&p->hash_node);
+		call_rcu_bh(&p->rcu, inet_peer_free_rcu);
+		freed++;
+	}
+	if (freed)
+		atomic_sub(freed, &peer_total);
+	return freed;
 }
 
-/* May be called with local BH enabled. */
-static int cleanup_once(unsigned long ttl)
+/* Called under rcu_read_lock_bh() or with the bucket lock held. */
+static struct inet_peer *lookup(__be32 daddr, struct inet_peer_bucket *b)
 {
 	struct inet_peer *p;
+	struct hlist_node *node;
 
-	/* Remove the first entry from the list of unused nodes. */
-	spin_lock_bh(&inet_peer_unused_lock);
-	p = inet_peer_unused_head;
-	if (p != NULL) {
-		__u32 delta = (__u32)jiffies - p->dtime;
-		if (delta < ttl) {
-			/* Do not prune fresh entries. */
-			spin_unlock_bh(&inet_peer_unused_lock);
-			return -1;
+	hlist_for_each_entry_rcu(p, node, &b->chain, hash_node) {
+		if (p->v4daddr == daddr) {
+			if (atomic_add_unless(&p->refcnt, 1, -1))
+				return p;
+			break;
 		}
-		inet_peer_unused_head = p->unused_next;
-		if (p->unused_next != NULL)
-			p->unused_next->unused_prevp = p->unused_prevp;
-		else
-			inet_peer_unused_tailp = p->unused_prevp;
-		p->unused_prevp = NULL; /* mark as not on the list */
-		/* Grab an extra reference to prevent node disappearing
-		 * before unlink_from_pool() call. */
-		atomic_inc(&p->refcnt);
 	}
-	spin_unlock_bh(&inet_peer_unused_lock);
-
-	if (p == NULL)
-		/* It means that the total number of USED entries has
-		 * grown over inet_peer_threshold.  It shouldn't really
-		 * happen because of entry limits in route cache. */
-		return -1;
-
-	unlink_from_pool(p);
-	return 0;
+	return NULL;
 }
 
 /* Called with or without local BH being disabled. */
 struct inet_peer *inet_getpeer(__be32 daddr, int create)
 {
+	struct inet_peer_bucket *b = peer_bucket(daddr);
 	struct inet_peer *p, *n;
-	struct inet_peer **stack[PEER_MAXDEPTH], ***stackptr;
 
 	/* Look up for the address quickly. */
-	read_lock_bh(&peer_pool_lock);
-	p = lookup(daddr);
-	if (p != peer_avl_empty)
-		atomic_inc(&p->refcnt);
-	read_unlock_bh(&peer_pool_lock);
-
-	if (p != peer_avl_empty) {
-		/* The existing node has been found. */
-		/* Remove the entry from unused list if it was there. */
-		unlink_from_unused(p);
-		return p;
-	}
+	rcu_read_lock_bh();
+	p = lookup(daddr, b);
+	rcu_read_unlock_bh();
 
-	if (!create)
-		return NULL;
+	if (p != NULL || !create)
+		return p;
 
 	/* Allocate the space outside the locked region. */
 	n = kmem_cache_alloc(peer_cachep, GFP_ATOMIC);
@@ -396,33 +229,28 @@ struct inet_peer *inet_getpeer(__be32 daddr, int create)
 	n->v4daddr = daddr;
 	atomic_set(&n->refcnt, 1);
 	atomic_set(&n->rid, 0);
-	n->ip_id_count = secure_ip_id(daddr);
+	atomic_set(&n->ip_id_count, secure_ip_id(daddr));
+	n->dtime = (__u32)jiffies;
 	n->tcp_ts_stamp = 0;
 
-	write_lock_bh(&peer_pool_lock);
+	spin_lock_bh(&b->lock);
 	/* Check if an entry has suddenly appeared. */
-	p = lookup(daddr);
-	if (p != peer_avl_empty)
+	p = lookup(daddr, b);
+	if (p != NULL)
 		goto out_free;
 
-	/* Link the node. */
-	link_to_pool(n);
-	n->unused_prevp = NULL; /* not on the list */
-	peer_total++;
-	write_unlock_bh(&peer_pool_lock);
+	/* Lazy expiry: reap whatever has gone stale in this chain. */
+	peer_expire_chain(b, peer_ttl());
 
-	if (peer_total >= inet_peer_threshold)
-		/* Remove one less-recently-used entry. */
-		cleanup_once(0);
+	hlist_add_head_rcu(&n->hash_node, &b->chain);
+	atomic_inc(&peer_total);
+	spin_unlock_bh(&b->lock);
 
 	return n;
 
 out_free:
 	/* The appropriate node is already in the pool. */
-	atomic_inc(&p->refcnt);
-	write_unlock_bh(&peer_pool_lock);
-	/* Remove the entry from unused list if it was there. */
-	unlink_from_unused(p);
+	spin_unlock_bh(&b->lock);
 	/* Free preallocated the preallocated node. */
 	kmem_cache_free(peer_cachep, n);
 	return p;
@@ -432,15 +260,21 @@ out_free:
 static void peer_check_expire(unsigned long dummy)
 {
 	unsigned long now = jiffies;
-	int ttl;
-
-	if (peer_total >= inet_peer_threshold)
-		ttl = inet_peer_minttl;
-	else
-		ttl = inet_peer_maxttl
-				- (inet_peer_maxttl - inet_peer_minttl) / HZ *
-					peer_total / inet_peer_threshold * HZ;
-	while (!cleanup_once(ttl)) {
+	unsigned long ttl = peer_ttl();
+	unsigned int i;
+	int total;
+
+	/* Sweep buckets from where the last run stopped, until either the
+	 * whole table has been seen or a jiffy has gone by. */
+	for (i = 0; i <= peer_hash_mask; i++) {
+		struct inet_peer_bucket *b = &peer_hash[peer_gc_bucket];
+
+		peer_gc_bucket = (peer_gc_bucket + 1) & peer_hash_mask;
+		if (hlist_empty(&b->chain))
+			continue;
+		spin_lock(&b->lock);
+		peer_expire_chain(b, ttl);
+		spin_unlock(&b->lock);
 		if (jiffies != now)
 			break;
 	}
@@ -448,25 +282,20 @@ static void peer_check_expire(unsigned long dummy)
 	/* Trigger the timer after inet_peer_gc_mintime .. inet_peer_gc_maxtime
 	 * interval depending on the total number of entries (more entries,
 	 * less interval). */
-	if (peer_total >= inet_peer_threshold)
+	total = atomic_read(&peer_total);
+	if (total >= inet_peer_threshold)
 		peer_periodic_timer.expires = jiffies + inet_peer_gc_mintime;
 	else
 		peer_periodic_timer.expires = jiffies
 			+ inet_peer_gc_maxtime
 			- (inet_peer_gc_maxtime - inet_peer_gc_mintime) / HZ *
-				peer_total / inet_peer_threshold * HZ;
+				total / inet_peer_threshold * HZ;
 	add_timer(&peer_periodic_timer);
 }
 
 void inet_putpeer(struct inet_peer *p)
 {
-	spin_lock_bh(&inet_peer_unused_lock);
-	if (atomic_dec_and_test(&p->refcnt)) {
-		p->unused_prevp = inet_peer_unused_tailp;
-		p->unused_next = NULL;
-		*inet_peer_unused_tailp = p;
-		inet_peer_unused_tailp = &p->unused_next;
-		p->dtime = (__u32)jiffies;
-	}
-	spin_unlock_bh(&inet_peer_unused_lock);
+	p->dtime = (__u32)jiffies;
+	smp_mb__before_atomic_dec();
+	atomic_dec(&p->refcnt);
 }
@@ -152,6 +152,8 @@
 
 DEFINE_SNMP_STAT(struct ipstats_mib, ip_statistics) __read_mostly;
 
+int sysctl_ip_early_demux __read_mostly = 1;
+
 /*
  *	Process Router Attention IP option
  */ 
@@ -332,6 +334,26 @@ static inline int ip_rcv_finish(struct sk_buff *skb)
 {
 	struct iphdr *iph = skb->nh.iph;
 
+	/*
+	 *	Let the transport protocol find an established socket
+	 *	before routing.  It may attach the socket to the skb and
+	 *	supply the input route it cached, which saves us the route
+	 *	cache lookup below.  Fragments are left to reassembly.
+	 */
+	if (sysctl_ip_early_demux && skb->dst == NULL && skb->sk == NULL &&
+	    !(iph->frag_off & htons(IP_MF|IP_OFFSET))) {
+		struct net_protocol *ipprot;
+
+		rcu_read_lock();
+		ipprot = rcu_dereference(inet_protos[iph->protocol & (MAX_INET_PROTOS - 1)]);
+		if (ipprot && ipprot->early_demux) {
+			ipprot->early_demux(skb);
+			/* The handler may have reallocated the header. */
+			iph = skb->nh.iph;
+		}
+		rcu_read_unlock();
+	}
+
 	/*
 	 *	Initialise the virtual path cache for the packet. It describes
 	 *	how the packet travels inside Linux networking.
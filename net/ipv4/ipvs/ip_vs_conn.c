@@ -30,6 +30,7 @@
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/vmalloc.h>
+#include <linux/mm.h>			/* for num_physpages */
 #include <linux/proc_fs.h>		/* for proc_net_* */
 #include <linux/seq_file.h>
 #include <linux/jhash.h>
@@ -40,8 +41,23 @@
 
 /*
  *  Connection hash table: for input and output packets lookups of IPVS
+ *
+ *  Lookups walk the chains under rcu_read_lock() and take a reference
+ *  with atomic_inc_not_zero(); ip_vs_conn_expire() drops the last one
+ *  with atomic_cmpxchg() and frees the entry after a grace period.
+ *  Chains are hlists so that a lookup racing with an entry being
+ *  rehashed to another chain still ends; it may miss the entry, as it
+ *  would have a moment earlier.
  */
-static struct list_head *ip_vs_conn_tab;
+static struct hlist_head *ip_vs_conn_tab;
+
+/* size of the table, as a power of 2: 0 sizes it from memory */
+static int ip_vs_conn_tab_bits;
+module_param_named(conn_tab_bits, ip_vs_conn_tab_bits, int, 0444);
+MODULE_PARM_DESC(conn_tab_bits, "Set connections' hash size");
+
+int ip_vs_conn_tab_size;
+static int ip_vs_conn_tab_mask;
 
 /*  SLAB cache for IPVS connections */
 static struct kmem_cache *ip_vs_conn_cachep __read_mostly;
@@ -56,59 +72,30 @@ static atomic_t ip_vs_conn_no_cport_cnt = ATOMIC_INIT(0);
 static unsigned int ip_vs_conn_rnd;
 
 /*
- *  Fine locking granularity for big connection hash table
+ *  Fine locking granularity for big connection hash table: the locks
+ *  only serialize changes to the chains
  */
-#define CT_LOCKARRAY_BITS  4
+#define CT_LOCKARRAY_BITS  8
 #define CT_LOCKARRAY_SIZE  (1<<CT_LOCKARRAY_BITS)
 #define CT_LOCKARRAY_MASK  (CT_LOCKARRAY_SIZE-1)
 
 struct ip_vs_aligned_lock
 {
-	rwlock_t	l;
+	spinlock_t	l;
 } __attribute__((__aligned__(SMP_CACHE_BYTES)));
 
 /* lock array for conn table */
 static struct ip_vs_aligned_lock
 __ip_vs_conntbl_lock_array[CT_LOCKARRAY_SIZE] __cacheline_aligned;
 
-static inline void ct_read_lock(unsigned key)
-{
-	read_lock(&__ip_vs_conntbl_lock_array[key&CT_LOCKARRAY_MASK].l);
-}
-
-static inline void ct_read_unlock(unsigned key)
-{
-	read_unlock(&__ip_vs_conntbl_lock_array[key&CT_LOCKARRAY_MASK].l);
-}
-
 static inline void ct_write_lock(unsigned key)
 {
-	write_lock(&__ip_vs_conntbl_lock_array[key&CT_LOCKARRAY_MASK].l);
+	spin_lock(&__ip_vs_conntbl_lock_array[key&CT_LOCKARRAY_MASK].l);
 }
 
 static inline void ct_write_unlock(unsigned key)
 {
-	write_unlock(&__ip_vs_conntbl_lock_array[key&CT_LOCKARRAY_MASK].l);
-}
-
-static inline void ct_read_lock_bh(unsigned key)
-{
-	read_lock_bh(&__ip_vs_conntbl_lock_array[key&CT_LOCKARRAY_MASK].l);
-}
-
-static inline void ct_read_unlock_bh(unsigned key)
-{
-	read_unlock_bh(&__ip_vs_conntbl_lock_array[key&CT_LOCKARRAY_MASK].l);
-}
-
-static inline void ct_write_lock_bh(unsigned key)
-{
-	write_lock_bh(&__ip_vs_conntbl_lock_array[key&CT_LOCKARRAY_MASK].l);
-}
-
-static inline void ct_write_unlock_bh(unsigned key)
-{
-	write_unlock_bh(&__ip_vs_conntbl_lock_array[key&CT_LOCKARRAY_MASK].l);
+	spin_unlock(&__ip_vs_conntbl_lock_array[key&CT_LOCKARRAY_MASK].l);
 }
 
 
@@ -118,7 +105,7 @@ static inline void ct_write_unlock_bh(unsigned key)
 static unsigned int ip_vs_conn_hashkey(unsigned proto, __be32 addr, __be16 port)
 {
 	return jhash_3words((__force u32)addr, (__force u32)port, proto, ip_vs_conn_rnd)
-		& IP_VS_CONN_TAB_MASK;
+		& ip_vs_conn_tab_mask;
 }
 
 
@@ -137,9 +124,9 @@ static inline int ip_vs_conn_hash(struct ip_vs_conn *cp)
 	ct_write_lock(hash);
 
 	if (!(cp->flags & IP_VS_CONN_F_HASHED)) {
-		list_add(&cp->c_list, &ip_vs_conn_tab[hash]);
-		cp->flags |= IP_VS_CONN_F_HASHED;
 		atomic_inc(&cp->refcnt);
+		cp->flags |= IP_VS_CONN_F_HASHED;
+		hlist_add_head_rcu(&cp->c_list, &ip_vs_conn_tab[hash]);
 		ret = 1;
 	} else {
 		IP_VS_ERR("ip_vs_conn_hash(): request for already hashed, "
@@ -168,7 +155,7 @@ static inline int ip_vs_conn_unhash(struct ip_vs_conn *cp)
 	ct_write_lock(hash);
 
 	if (cp->flags & IP_VS_CONN_F_HASHED) {
-		list_del(&cp->c_list);
+		hlist_del_rcu(&cp->c_list);
 		cp->flags &= ~IP_VS_CONN_F_HASHED;
 		atomic_dec(&cp->refcnt);
 		ret = 1;
@@ -192,24 +179,26 @@ static inline struct ip_vs_conn *__ip_vs_conn_in_get
 {
 	unsigned hash;
 	struct ip_vs_conn *cp;
+	struct hlist_node *n;
 
 	hash = ip_vs_conn_hashkey(protocol, s_addr, s_port);
 
-	ct_read_lock(hash);
+	rcu_read_lock();
 
-	list_for_each_entry(cp, &ip_vs_conn_tab[hash], c_list) {
+	hlist_for_each_entry_rcu(cp, n, &ip_vs_conn_tab[hash], c_list) {
 		if (s_addr==cp->caddr && s_port==cp->cport &&
 		    d_port==cp->vport && d_addr==cp->vaddr &&
 		    ((!s_port) ^ (!(cp->flags & IP_VS_CONN_F_NO_CPORT))) &&
 		    protocol==cp->protocol) {
-			/* HIT */
-			atomic_inc(&cp->refcnt);
-			ct_read_unlock(hash);
+			/* HIT, unless it is being freed */
+			if (!atomic_inc_not_zero(&cp->refcnt))
+				continue;
+			rcu_read_unlock();
 			return cp;
 		}
 	}
 
-	ct_read_unlock(hash);
+	rcu_read_unlock();
 
 	return NULL;
 }
@@ -238,25 +227,27 @@ struct ip_vs_conn *ip_vs_ct_in_get
 {
 	unsigned hash;
 	struct ip_vs_conn *cp;
+	struct hlist_node *n;
 
 	hash = ip_vs_conn_hashkey(protocol, s_addr, s_port);
 
-	ct_read_lock(hash);
+	rcu_read_lock();
 
-	list_for_each_entry(cp, &ip_vs_conn_tab[hash], c_list) {
+	hlist_for_each_entry_rcu(cp, n, &ip_vs_conn_tab[hash], c_list) {
 		if (s_addr==cp->caddr && s_port==cp->cport &&
 		    d_port==cp->vport && d_addr==cp->vaddr &&
 		    cp->flags & IP_VS_CONN_F_TEMPLATE &&
 		    protocol==cp->protocol) {
 			/* HIT */
-			atomic_inc(&cp->refcnt);
+			if (!atomic_inc_not_zero(&cp->refcnt))
+				continue;
 			goto out;
 		}
 	}
 	cp = NULL;
 
   out:
-	ct_read_unlock(hash);
+	rcu_read_unlock();
 
 	IP_VS_DBG(9, "template lookup/in %s %u.%u.%u.%u:%d->%u.%u.%u.%u:%d %s\n",
 		  ip_vs_proto_name(protocol),
@@ -278,26 +269,28 @@ struct ip_vs_conn *ip_vs_conn_out_get
 {
 	unsigned hash;
 	struct ip_vs_conn *cp, *ret=NULL;
+	struct hlist_node *n;
 
 	/*
 	 *	Check for "full" addressed entries
 	 */
 	hash = ip_vs_conn_hashkey(protocol, d_addr, d_port);
 
-	ct_read_lock(hash);
+	rcu_read_lock();
 
-	list_for_each_entry(cp, &ip_vs_conn_tab[hash], c_list) {
+	hlist_for_each_entry_rcu(cp, n, &ip_vs_conn_tab[hash], c_list) {
 		if (d_addr == cp->caddr && d_port == cp->cport &&
 		    s_port == cp->dport && s_addr == cp->daddr &&
 		    protocol == cp->protocol) {
 			/* HIT */
-			atomic_inc(&cp->refcnt);
+			if (!atomic_inc_not_zero(&cp->refcnt))
+				continue;
 			ret = cp;
 			break;
 		}
 	}
 
-	ct_read_unlock(hash);
+	rcu_read_unlock();
 
 	IP_VS_DBG(9, "lookup/out %s %u.%u.%u.%u:%d->%u.%u.%u.%u:%d %s\n",
 		  ip_vs_proto_name(protocol),
@@ -371,10 +364,15 @@ static inline void ip_vs_bind_xmit(struct ip_vs_conn *cp)
 }
 
 
+/*
+ *	Exact, for the connection thresholds: the batched counters may be
+ *	off by more than a small limit on a box with many CPUs.  Only
+ *	called for destinations that have a threshold set.
+ */
 static inline int ip_vs_dest_totalconns(struct ip_vs_dest *dest)
 {
-	return atomic_read(&dest->activeconns)
-		+ atomic_read(&dest->inactconns);
+	return ip_vs_dest_conns_sum(dest, active)
+		+ ip_vs_dest_conns_sum(dest, inact);
 }
 
 /*
@@ -411,11 +409,11 @@ ip_vs_bind_dest(struct ip_vs_conn *cp, struct ip_vs_dest *dest)
 		/* It is a normal connection, so increase the inactive
 		   connection counter because it is in TCP SYNRECV
 		   state (inactive) or other protocol inacive state */
-		atomic_inc(&dest->inactconns);
+		ip_vs_dest_conns_add(dest, inact, 1);
 	} else {
 		/* It is a persistent connection/template, so increase
 		   the peristent connection counter */
-		atomic_inc(&dest->persistconns);
+		ip_vs_dest_conns_add(dest, persist, 1);
 	}
 
 	if (dest->u_threshold != 0 &&
@@ -451,14 +449,14 @@ static inline void ip_vs_unbind_dest(struct ip_vs_conn *cp)
 		/* It is a normal connection, so decrease the inactconns
 		   or activeconns counter */
 		if (cp->flags & IP_VS_CONN_F_INACTIVE) {
-			atomic_dec(&dest->inactconns);
+			ip_vs_dest_conns_add(dest, inact, -1);
 		} else {
-			atomic_dec(&dest->activeconns);
+			ip_vs_dest_conns_add(dest, active, -1);
 		}
 	} else {
 		/* It is a persistent connection/template, so decrease
 		   the peristent connection counter */
-		atomic_dec(&dest->persistconns);
+		ip_vs_dest_conns_add(dest, persist, -1);
 	}
 
 	if (dest->l_threshold != 0) {
@@ -527,6 +525,14 @@ int ip_vs_check_template(struct ip_vs_conn *ct)
 	return 1;
 }
 
+static void ip_vs_conn_rcu_free(struct rcu_head *head)
+{
+	struct ip_vs_conn *cp = container_of(head, struct ip_vs_conn,
+					     rcu_head);
+
+	kmem_cache_free(ip_vs_conn_cachep, cp);
+}
+
 static void ip_vs_conn_expire(unsigned long data)
 {
 	struct ip_vs_conn *cp = (struct ip_vs_conn *)data;
@@ -551,9 +557,10 @@ static void ip_vs_conn_expire(unsigned long data)
 		goto expire_later;
 
 	/*
-	 *	refcnt==1 implies I'm the only one referrer
+	 *	refcnt==1 implies I'm the only one referrer, and 0 keeps
+	 *	lookups still walking past it from taking a reference
 	 */
-	if (likely(atomic_read(&cp->refcnt) == 1)) {
+	if (likely(atomic_cmpxchg(&cp->refcnt, 1, 0) == 1)) {
 		/* delete the timer if it is activated by other users */
 		if (timer_pending(&cp->timer))
 			del_timer(&cp->timer);
@@ -569,7 +576,7 @@ static void ip_vs_conn_expire(unsigned long data)
 			atomic_dec(&ip_vs_conn_no_cport_cnt);
 		atomic_dec(&ip_vs_conn_count);
 
-		kmem_cache_free(ip_vs_conn_cachep, cp);
+		call_rcu(&cp->rcu_head, ip_vs_conn_rcu_free);
 		return;
 	}
 
@@ -610,7 +617,7 @@ ip_vs_conn_new(int proto, __be32 caddr, __be16 cport, __be32 vaddr, __be16 vport
 	}
 
 	memset(cp, 0, sizeof(*cp));
-	INIT_LIST_HEAD(&cp->c_list);
+	INIT_HLIST_NODE(&cp->c_list);
 	init_timer(&cp->timer);
 	cp->timer.data     = (unsigned long)cp;
 	cp->timer.function = ip_vs_conn_expire;
@@ -667,16 +674,15 @@ static void *ip_vs_conn_array(struct seq_file *seq, loff_t pos)
 {
 	int idx;
 	struct ip_vs_conn *cp;
+	struct hlist_node *n;
 	
-	for(idx = 0; idx < IP_VS_CONN_TAB_SIZE; idx++) {
-		ct_read_lock_bh(idx);
-		list_for_each_entry(cp, &ip_vs_conn_tab[idx], c_list) {
+	for(idx = 0; idx < ip_vs_conn_tab_size; idx++) {
+		hlist_for_each_entry_rcu(cp, n, &ip_vs_conn_tab[idx], c_list) {
 			if (pos-- == 0) {
 				seq->private = &ip_vs_conn_tab[idx];
 				return cp;
 			}
 		}
-		ct_read_unlock_bh(idx);
 	}
 
 	return NULL;
@@ -685,13 +691,15 @@ static void *ip_vs_conn_array(struct seq_file *seq, loff_t pos)
 static void *ip_vs_conn_seq_start(struct seq_file *seq, loff_t *pos)
 {
 	seq->private = NULL;
+	rcu_read_lock();
 	return *pos ? ip_vs_conn_array(seq, *pos - 1) :SEQ_START_TOKEN;
 }
 
 static void *ip_vs_conn_seq_next(struct seq_file *seq, void *v, loff_t *pos)
 {
 	struct ip_vs_conn *cp = v;
-	struct list_head *e, *l = seq->private;
+	struct hlist_head *l = seq->private;
+	struct hlist_node *e, *n;
 	int idx;
 
 	++*pos;
@@ -699,19 +707,15 @@ static void *ip_vs_conn_seq_next(struct seq_file *seq, void *v, loff_t *pos)
 		return ip_vs_conn_array(seq, 0);
 
 	/* more on same hash chain? */
-	if ((e = cp->c_list.next) != l)
-		return list_entry(e, struct ip_vs_conn, c_list);
+	if ((e = rcu_dereference(cp->c_list.next)))
+		return hlist_entry(e, struct ip_vs_conn, c_list);
 
 	idx = l - ip_vs_conn_tab;
-	ct_read_unlock_bh(idx);
-
-	while (++idx < IP_VS_CONN_TAB_SIZE) {
-		ct_read_lock_bh(idx);
-		list_for_each_entry(cp, &ip_vs_conn_tab[idx], c_list) {
+	while (++idx < ip_vs_conn_tab_size) {
+		hlist_for_each_entry_rcu(cp, n, &ip_vs_conn_tab[idx], c_list) {
 			seq->private = &ip_vs_conn_tab[idx];
 			return cp;
 		}	
-		ct_read_unlock_bh(idx);
 	}
 	seq->private = NULL;
 	return NULL;
@@ -719,10 +723,7 @@ static void *ip_vs_conn_seq_next(struct seq_file *seq, void *v, loff_t *pos)
 
 static void ip_vs_conn_seq_stop(struct seq_file *seq, void *v)
 {
-	struct list_head *l = seq->private;
-
-	if (l)
-		ct_read_unlock_bh(l - ip_vs_conn_tab);
+	rcu_read_unlock();
 }
 
 static int ip_vs_conn_seq_show(struct seq_file *seq, void *v)
@@ -804,19 +805,21 @@ void ip_vs_random_dropentry(void)
 {
 	int idx;
 	struct ip_vs_conn *cp;
+	struct hlist_node *n;
 
 	/*
 	 * Randomly scan 1/32 of the whole table every second
 	 */
-	for (idx = 0; idx < (IP_VS_CONN_TAB_SIZE>>5); idx++) {
-		unsigned hash = net_random() & IP_VS_CONN_TAB_MASK;
+	for (idx = 0; idx < (ip_vs_conn_tab_size>>5); idx++) {
+		unsigned hash = net_random() & ip_vs_conn_tab_mask;
 
 		/*
-		 *  Lock is actually needed in this loop.
+		 *  The chain may change under us, the entries stay
 		 */
-		ct_write_lock_bh(hash);
+		local_bh_disable();
+		rcu_read_lock();
 
-		list_for_each_entry(cp, &ip_vs_conn_tab[hash], c_list) {
+		hlist_for_each_entry_rcu(cp, n, &ip_vs_conn_tab[hash], c_list) {
 			if (cp->flags & IP_VS_CONN_F_TEMPLATE)
 				/* connection template */
 				continue;
@@ -847,7 +850,8 @@ void ip_vs_random_dropentry(void)
 				ip_vs_conn_expire_now(cp->control);
 			}
 		}
-		ct_write_unlock_bh(hash);
+		rcu_read_unlock();
+		local_bh_enable();
 	}
 }
 
@@ -859,15 +863,17 @@ static void ip_vs_conn_flush(void)
 {
 	int idx;
 	struct ip_vs_conn *cp;
+	struct hlist_node *n;
 
   flush_again:
-	for (idx=0; idx<IP_VS_CONN_TAB_SIZE; idx++) {
+	for (idx=0; idx<ip_vs_conn_tab_size; idx++) {
 		/*
-		 *  Lock is actually needed in this loop.
+		 *  The chain may change under us, the entries stay
 		 */
-		ct_write_lock_bh(idx);
+		local_bh_disable();
+		rcu_read_lock();
 
-		list_for_each_entry(cp, &ip_vs_conn_tab[idx], c_list) {
+		hlist_for_each_entry_rcu(cp, n, &ip_vs_conn_tab[idx], c_list) {
 
 			IP_VS_DBG(4, "del connection\n");
 			ip_vs_conn_expire_now(cp);
@@ -876,7 +882,8 @@ static void ip_vs_conn_flush(void)
 				ip_vs_conn_expire_now(cp->control);
 			}
 		}
-		ct_write_unlock_bh(idx);
+		rcu_read_unlock();
+		local_bh_enable();
 	}
 
 	/* the counter may be not NULL, because maybe some conn entries
@@ -892,10 +899,30 @@ int ip_vs_conn_init(void)
 {
 	int idx;
 
+	/*
+	 * Size the table like the conntrack one, 1/16384 of memory,
+	 * but never below the configured size
+	 */
+	if (ip_vs_conn_tab_bits <= 0) {
+		u64 buckets = ((u64)num_physpages << PAGE_SHIFT) / 16384
+			      / sizeof(struct hlist_head);
+
+		ip_vs_conn_tab_bits = IP_VS_CONN_TAB_BITS;
+		while (ip_vs_conn_tab_bits < IP_VS_CONN_TAB_BITS_MAX &&
+		       (2ULL << ip_vs_conn_tab_bits) <= buckets)
+			ip_vs_conn_tab_bits++;
+	}
+	if (ip_vs_conn_tab_bits < 8)
+		ip_vs_conn_tab_bits = 8;
+	if (ip_vs_conn_tab_bits > IP_VS_CONN_TAB_BITS_MAX)
+		ip_vs_conn_tab_bits = IP_VS_CONN_TAB_BITS_MAX;
+	ip_vs_conn_tab_size = 1 << ip_vs_conn_tab_bits;
+	ip_vs_conn_tab_mask = ip_vs_conn_tab_size - 1;
+
 	/*
 	 * Allocate the connection hash table and initialize its list heads
 	 */
-	ip_vs_conn_tab = vmalloc(IP_VS_CONN_TAB_SIZE*sizeof(struct list_head));
+	ip_vs_conn_tab = vmalloc(ip_vs_conn_tab_size*sizeof(struct hlist_head));
 	if (!ip_vs_conn_tab)
 		return -ENOMEM;
 
@@ -910,17 +937,17 @@ int ip_vs_conn_init(void)
 
 	IP_VS_INFO("Connection hash table configured "
 		   "(size=%d, memory=%ldKbytes)\n",
-		   IP_VS_CONN_TAB_SIZE,
-		   (long)(IP_VS_CONN_TAB_SIZE*sizeof(struct list_head))/1024);
+		   ip_vs_conn_tab_size,
+		   (long)(ip_vs_conn_tab_size*sizeof(struct hlist_head))/1024);
 	IP_VS_DBG(0, "Each connection entry needs %Zd bytes at least\n",
 		  sizeof(struct ip_vs_conn));
 
-	for (idx = 0; idx < IP_VS_CONN_TAB_SIZE; idx++) {
-		INIT_LIST_HEAD(&ip_vs_conn_tab[idx]);
+	for (idx = 0; idx < ip_vs_conn_tab_size; idx++) {
+		INIT_HLIST_HEAD(&ip_vs_conn_tab[idx]);
 	}
 
 	for (idx = 0; idx < CT_LOCKARRAY_SIZE; idx++)  {
-		rwlock_init(&__ip_vs_conntbl_lock_array[idx].l);
+		spin_lock_init(&__ip_vs_conntbl_lock_array[idx].l);
 	}
 
 	proc_net_fops_create("ip_vs_conn", 0, &ip_vs_conn_fops);
@@ -937,6 +964,9 @@ void ip_vs_conn_cleanup(void)
 	/* flush all the connection entries first */
 	ip_vs_conn_flush();
 
+	/* wait for the entries still waiting for a grace period */
+	rcu_barrier();
+
 	/* Release the empty cache */
 	kmem_cache_destroy(ip_vs_conn_cachep);
 	proc_net_remove("ip_vs_conn");
@@ -580,6 +580,13 @@ ip_vs_lookup_dest(struct ip_vs_service *svc, __be32 daddr, __be16 dport)
 }
 
 
+static void ip_vs_free_dest(struct ip_vs_dest *dest)
+{
+	free_percpu(dest->conns);
+	kfree(dest);
+}
+
+
 /*
  *  Lookup dest by {svc,addr,port} in the destination trash.
  *  The destination trash is used to hold the destinations that are removed
@@ -626,7 +633,7 @@ ip_vs_trash_get_dest(struct ip_vs_service *svc, __be32 daddr, __be16 dport)
 			list_del(&dest->n_list);
 			ip_vs_dst_reset(dest);
 			__ip_vs_unbind_svc(dest);
-			kfree(dest);
+			ip_vs_free_dest(dest);
 		}
 	}
 
@@ -651,7 +658,7 @@ static void ip_vs_trash_cleanup(void)
 		list_del(&dest->n_list);
 		ip_vs_dst_reset(dest);
 		__ip_vs_unbind_svc(dest);
-		kfree(dest);
+		ip_vs_free_dest(dest);
 	}
 }
 
@@ -740,6 +747,12 @@ ip_vs_new_dest(struct ip_vs_service *svc, struct ip_vs_dest_user *udest,
 		IP_VS_ERR("ip_vs_new_dest: kmalloc failed.\n");
 		return -ENOMEM;
 	}
+	dest->conns = alloc_percpu(struct ip_vs_dest_conns);
+	if (dest->conns == NULL) {
+		IP_VS_ERR("ip_vs_new_dest: alloc_percpu failed.\n");
+		kfree(dest);
+		return -ENOMEM;
+	}
 
 	dest->protocol = svc->protocol;
 	dest->vaddr = svc->addr;
@@ -949,7 +962,7 @@ static void __ip_vs_del_dest(struct ip_vs_dest *dest)
 		   and only one user context can update virtual service at a
 		   time, so the operation here is OK */
 		atomic_dec(&dest->svc->refcnt);
-		kfree(dest);
+		ip_vs_free_dest(dest);
 	} else {
 		IP_VS_DBG(3, "Moving dest %u.%u.%u.%u:%u into trash, "
 			  "dest->refcnt=%d\n",
@@ -1743,7 +1756,7 @@ static int ip_vs_info_seq_show(struct seq_file *seq, void *v)
 	if (v == SEQ_START_TOKEN) {
 		seq_printf(seq,
 			"IP Virtual Server version %d.%d.%d (size=%d)\n",
-			NVERSION(IP_VS_VERSION_CODE), IP_VS_CONN_TAB_SIZE);
+			NVERSION(IP_VS_VERSION_CODE), ip_vs_conn_tab_size);
 		seq_puts(seq,
 			 "Prot LocalAddress:Port Scheduler Flags\n");
 		seq_puts(seq,
@@ -1776,8 +1789,8 @@ static int ip_vs_info_seq_show(struct seq_file *seq, void *v)
 				   ntohl(dest->addr), ntohs(dest->port),
 				   ip_vs_fwd_name(atomic_read(&dest->conn_flags)),
 				   atomic_read(&dest->weight),
-				   atomic_read(&dest->activeconns),
-				   atomic_read(&dest->inactconns));
+				   ip_vs_dest_conns_sum(dest, active),
+				   ip_vs_dest_conns_sum(dest, inact));
 		}
 	}
 	return 0;
@@ -2139,9 +2152,9 @@ __ip_vs_get_dest_entries(const struct ip_vs_get_dests *get,
 			entry.weight = atomic_read(&dest->weight);
 			entry.u_threshold = dest->u_threshold;
 			entry.l_threshold = dest->l_threshold;
-			entry.activeconns = atomic_read(&dest->activeconns);
-			entry.inactconns = atomic_read(&dest->inactconns);
-			entry.persistconns = atomic_read(&dest->persistconns);
+			entry.activeconns = ip_vs_dest_conns_sum(dest, active);
+			entry.inactconns = ip_vs_dest_conns_sum(dest, inact);
+			entry.persistconns = ip_vs_dest_conns_sum(dest, persist);
 			ip_vs_copy_stats(&entry.stats, &dest->stats);
 			if (copy_to_user(&uptr->entrytable[count],
 					 &entry, sizeof(entry))) {
@@ -2217,7 +2230,7 @@ do_ip_vs_get_ctl(struct sock *sk, int cmd, void __user *user, int *len)
 		char buf[64];
 
 		sprintf(buf, "IP Virtual Server version %d.%d.%d (size=%d)",
-			NVERSION(IP_VS_VERSION_CODE), IP_VS_CONN_TAB_SIZE);
+			NVERSION(IP_VS_VERSION_CODE), ip_vs_conn_tab_size);
 		if (copy_to_user(user, buf, strlen(buf)+1) != 0) {
 			ret = -EFAULT;
 			goto out;
@@ -2230,7 +2243,7 @@ do_ip_vs_get_ctl(struct sock *sk, int cmd, void __user *user, int *len)
 	{
 		struct ip_vs_getinfo info;
 		info.version = IP_VS_VERSION_CODE;
-		info.size = IP_VS_CONN_TAB_SIZE;
+		info.size = ip_vs_conn_tab_size;
 		info.num_services = ip_vs_num_services;
 		if (copy_to_user(user, &info, sizeof(info)) != 0)
 			ret = -EFAULT;
@@ -456,8 +456,8 @@ __ip_vs_wlc_schedule(struct ip_vs_service *svc, struct iphdr *iph)
 			continue;
 		if (atomic_read(&dest->weight) > 0) {
 			least = dest;
-			loh = atomic_read(&least->activeconns) * 50
-				+ atomic_read(&least->inactconns);
+			loh = ip_vs_dest_conns_read(least, active) * 50
+				+ ip_vs_dest_conns_read(least, inact);
 			goto nextstage;
 		}
 	}
@@ -471,8 +471,8 @@ __ip_vs_wlc_schedule(struct ip_vs_service *svc, struct iphdr *iph)
 		if (dest->flags & IP_VS_DEST_F_OVERLOAD)
 			continue;
 
-		doh = atomic_read(&dest->activeconns) * 50
-			+ atomic_read(&dest->inactconns);
+		doh = ip_vs_dest_conns_read(dest, active) * 50
+			+ ip_vs_dest_conns_read(dest, inact);
 		if (loh * atomic_read(&dest->weight) >
 		    doh * atomic_read(&least->weight)) {
 			least = dest;
@@ -483,7 +483,7 @@ __ip_vs_wlc_schedule(struct ip_vs_service *svc, struct iphdr *iph)
 	IP_VS_DBG(6, "LBLC: server %d.%d.%d.%d:%d "
 		  "activeconns %d refcnt %d weight %d overhead %d\n",
 		  NIPQUAD(least->addr), ntohs(least->port),
-		  atomic_read(&least->activeconns),
+		  ip_vs_dest_conns_read(least, active),
 		  atomic_read(&least->refcnt),
 		  atomic_read(&least->weight), loh);
 
@@ -498,11 +498,11 @@ __ip_vs_wlc_schedule(struct ip_vs_service *svc, struct iphdr *iph)
 static inline int
 is_overloaded(struct ip_vs_dest *dest, struct ip_vs_service *svc)
 {
-	if (atomic_read(&dest->activeconns) > atomic_read(&dest->weight)) {
+	if (ip_vs_dest_conns_read(dest, active) > atomic_read(&dest->weight)) {
 		struct ip_vs_dest *d;
 
 		list_for_each_entry(d, &svc->destinations, n_list) {
-			if (atomic_read(&d->activeconns)*2
+			if (ip_vs_dest_conns_read(d, active)*2
 			    < atomic_read(&d->weight)) {
 				return 1;
 			}
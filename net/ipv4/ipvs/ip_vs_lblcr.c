@@ -186,8 +186,8 @@ static inline struct ip_vs_dest *ip_vs_dest_set_min(struct ip_vs_dest_set *set)
 
 		if ((atomic_read(&least->weight) > 0)
 		    && (least->flags & IP_VS_DEST_F_AVAILABLE)) {
-			loh = atomic_read(&least->activeconns) * 50
-				+ atomic_read(&least->inactconns);
+			loh = ip_vs_dest_conns_read(least, active) * 50
+				+ ip_vs_dest_conns_read(least, inact);
 			goto nextstage;
 		}
 	}
@@ -201,8 +201,8 @@ static inline struct ip_vs_dest *ip_vs_dest_set_min(struct ip_vs_dest_set *set)
 		if (dest->flags & IP_VS_DEST_F_OVERLOAD)
 			continue;
 
-		doh = atomic_read(&dest->activeconns) * 50
-			+ atomic_read(&dest->inactconns);
+		doh = ip_vs_dest_conns_read(dest, active) * 50
+			+ ip_vs_dest_conns_read(dest, inact);
 		if ((loh * atomic_read(&dest->weight) >
 		     doh * atomic_read(&least->weight))
 		    && (dest->flags & IP_VS_DEST_F_AVAILABLE)) {
@@ -215,7 +215,7 @@ static inline struct ip_vs_dest *ip_vs_dest_set_min(struct ip_vs_dest_set *set)
 	IP_VS_DBG(6, "ip_vs_dest_set_min: server %d.%d.%d.%d:%d "
 		  "activeconns %d refcnt %d weight %d overhead %d\n",
 		  NIPQUAD(least->addr), ntohs(least->port),
-		  atomic_read(&least->activeconns),
+		  ip_vs_dest_conns_read(least, active),
 		  atomic_read(&least->refcnt),
 		  atomic_read(&least->weight), loh);
 	return least;
@@ -237,8 +237,8 @@ static inline struct ip_vs_dest *ip_vs_dest_set_max(struct ip_vs_dest_set *set)
 	for (e=set->list; e!=NULL; e=e->next) {
 		most = e->dest;
 		if (atomic_read(&most->weight) > 0) {
-			moh = atomic_read(&most->activeconns) * 50
-				+ atomic_read(&most->inactconns);
+			moh = ip_vs_dest_conns_read(most, active) * 50
+				+ ip_vs_dest_conns_read(most, inact);
 			goto nextstage;
 		}
 	}
@@ -249,8 +249,8 @@ static inline struct ip_vs_dest *ip_vs_dest_set_max(struct ip_vs_dest_set *set)
   nextstage:
 	for (e=e->next; e!=NULL; e=e->next) {
 		dest = e->dest;
-		doh = atomic_read(&dest->activeconns) * 50
-			+ atomic_read(&dest->inactconns);
+		doh = ip_vs_dest_conns_read(dest, active) * 50
+			+ ip_vs_dest_conns_read(dest, inact);
 		/* moh/mw < doh/dw ==> moh*dw < doh*mw, where mw,dw>0 */
 		if ((moh * atomic_read(&dest->weight) <
 		     doh * atomic_read(&most->weight))
@@ -264,7 +264,7 @@ static inline struct ip_vs_dest *ip_vs_dest_set_max(struct ip_vs_dest_set *set)
 	IP_VS_DBG(6, "ip_vs_dest_set_max: server %d.%d.%d.%d:%d "
 		  "activeconns %d refcnt %d weight %d overhead %d\n",
 		  NIPQUAD(most->addr), ntohs(most->port),
-		  atomic_read(&most->activeconns),
+		  ip_vs_dest_conns_read(most, active),
 		  atomic_read(&most->refcnt),
 		  atomic_read(&most->weight), moh);
 	return most;
@@ -710,8 +710,8 @@ __ip_vs_wlc_schedule(struct ip_vs_service *svc, struct iphdr *iph)
 
 		if (atomic_read(&dest->weight) > 0) {
 			least = dest;
-			loh = atomic_read(&least->activeconns) * 50
-				+ atomic_read(&least->inactconns);
+			loh = ip_vs_dest_conns_read(least, active) * 50
+				+ ip_vs_dest_conns_read(least, inact);
 			goto nextstage;
 		}
 	}
@@ -725,8 +725,8 @@ __ip_vs_wlc_schedule(struct ip_vs_service *svc, struct iphdr *iph)
 		if (dest->flags & IP_VS_DEST_F_OVERLOAD)
 			continue;
 
-		doh = atomic_read(&dest->activeconns) * 50
-			+ atomic_read(&dest->inactconns);
+		doh = ip_vs_dest_conns_read(dest, active) * 50
+			+ ip_vs_dest_conns_read(dest, inact);
 		if (loh * atomic_read(&dest->weight) >
 		    doh * atomic_read(&least->weight)) {
 			least = dest;
@@ -737,7 +737,7 @@ __ip_vs_wlc_schedule(struct ip_vs_service *svc, struct iphdr *iph)
 	IP_VS_DBG(6, "LBLCR: server %d.%d.%d.%d:%d "
 		  "activeconns %d refcnt %d weight %d overhead %d\n",
 		  NIPQUAD(least->addr), ntohs(least->port),
-		  atomic_read(&least->activeconns),
+		  ip_vs_dest_conns_read(least, active),
 		  atomic_read(&least->refcnt),
 		  atomic_read(&least->weight), loh);
 
@@ -752,11 +752,11 @@ __ip_vs_wlc_schedule(struct ip_vs_service *svc, struct iphdr *iph)
 static inline int
 is_overloaded(struct ip_vs_dest *dest, struct ip_vs_service *svc)
 {
-	if (atomic_read(&dest->activeconns) > atomic_read(&dest->weight)) {
+	if (ip_vs_dest_conns_read(dest, active) > atomic_read(&dest->weight)) {
 		struct ip_vs_dest *d;
 
 		list_for_each_entry(d, &svc->destinations, n_list) {
-			if (atomic_read(&d->activeconns)*2
+			if (ip_vs_dest_conns_read(d, active)*2
 			    < atomic_read(&d->weight)) {
 				return 1;
 			}
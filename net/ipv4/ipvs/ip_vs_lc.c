@@ -50,8 +50,8 @@ ip_vs_lc_dest_overhead(struct ip_vs_dest *dest)
 	 * use the following formula to estimate the overhead now:
 	 *		  dest->activeconns*256 + dest->inactconns
 	 */
-	return (atomic_read(&dest->activeconns) << 8) +
-		atomic_read(&dest->inactconns);
+	return (ip_vs_dest_conns_read(dest, active) << 8) +
+		ip_vs_dest_conns_read(dest, inact);
 }
 
 
@@ -89,8 +89,8 @@ ip_vs_lc_schedule(struct ip_vs_service *svc, const struct sk_buff *skb)
 	if (least)
 	IP_VS_DBG(6, "LC: server %u.%u.%u.%u:%u activeconns %d inactconns %d\n",
 		  NIPQUAD(least->addr), ntohs(least->port),
-		  atomic_read(&least->activeconns),
-		  atomic_read(&least->inactconns));
+		  ip_vs_dest_conns_read(least, active),
+		  ip_vs_dest_conns_read(least, inact));
 
 	return least;
 }
@@ -0,0 +1,469 @@
+/*
+ * IPVS:        Maglev Hashing scheduling module
+ *
+ *              This program is free software; you can redistribute it and/or
+ *              modify it under the terms of the GNU General Public License
+ *              as published by the Free Software Foundation; either version
+ *              2 of the License, or (at your option) any later version.
+ *
+ * Changes:
+ *
+ */
+
+/*
+ * The mh algorithm selects the server by looking up the hash of the
+ * source address, or of the whole address/port tuple when the service
+ * has IP_VS_SVC_F_SCHED_MH_PORT set, in a table built the way Maglev
+ * does it:
+ *
+ *       every server gets a permutation of the table slots, derived
+ *       from its address and port only;
+ *       in turns, every server claims the next slot of its permutation
+ *       that is still free, as many times per turn as its weight asks,
+ *       until the table is full.
+ *
+ * The table size is a prime, 65537 by default, so every permutation
+ * visits every slot.  Adding or removing one of N servers moves about
+ * 1/N of the slots, and directors with the same servers build the same
+ * table, so several of them behind ECMP send a flow to the same server
+ * without sharing any state.
+ *
+ * A server that is not available, overloaded or quiesced in the table
+ * is skipped by hashing again with another seed, which again gives the
+ * same answer on every director.
+ *
+ * Building a table takes a few milliseconds, so it is not done in
+ * update_service(), which runs with the service locked: that only
+ * takes a copy of the servers, and a work queue builds the new table
+ * and swaps it in under RCU.  The old table serves until then.
+ */
+
+#include <linux/ip.h>
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/skbuff.h>
+#include <linux/jhash.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+#include <linux/rcupdate.h>
+#include <linux/sort.h>
+
+#include <net/ip_vs.h>
+
+
+static unsigned int ip_vs_mh_tab_size __read_mostly = 65537;
+module_param_named(table_size, ip_vs_mh_tab_size, uint, 0444);
+MODULE_PARM_DESC(table_size, "lookup table size, a prime");
+
+/*
+ * Fixed seeds: every director must compute the same permutations and
+ * flow hashes.
+ */
+#define IP_VS_MH_OFFSET_SEED	0x7a3d1c55
+#define IP_VS_MH_SKIP_SEED	0x2f6e9b01
+#define IP_VS_MH_FLOW_SEED	0x5bd1e995
+
+/*
+ *      A server as the table sees it, with a reference held on the dest
+ */
+struct ip_vs_mh_dest {
+	struct ip_vs_dest	*dest;
+	__be32			addr;
+	__be16			port;
+	int			weight;
+	u32			perm;		/* next slot of its permutation */
+	u32			skip;
+};
+
+struct ip_vs_mh_dests {
+	int			n;
+	struct ip_vs_mh_dest	d[0];
+};
+
+struct ip_vs_mh_table {
+	unsigned int		size;
+	struct ip_vs_mh_dests	*dests;		/* what the buckets point to */
+	struct ip_vs_dest	*buckets[0];
+};
+
+/*
+ *      Per service: the table in use and the servers to build the next
+ *      one from
+ */
+struct ip_vs_mh_state {
+	struct ip_vs_mh_table	*table;		/* RCU, NULL until built */
+	spinlock_t		lock;		/* for pending and dead */
+	struct ip_vs_mh_dests	*pending;
+	int			dead;		/* service gone, free us */
+	struct work_struct	work;
+};
+
+static struct workqueue_struct *ip_vs_mh_wq;
+
+
+static void ip_vs_mh_put_dests(struct ip_vs_mh_dests *dests)
+{
+	int i;
+
+	for (i = 0; i < dests->n; i++)
+		atomic_dec(&dests->d[i].dest->refcnt);
+	kfree(dests);
+}
+
+
+/*
+ *      Copy the servers that take connections, with the service locked
+ */
+static struct ip_vs_mh_dests *ip_vs_mh_get_dests(struct ip_vs_service *svc)
+{
+	struct ip_vs_mh_dests *dests;
+	struct ip_vs_dest *dest;
+	int n = 0;
+
+	list_for_each_entry(dest, &svc->destinations, n_list)
+		if (atomic_read(&dest->weight) > 0)
+			n++;
+
+	dests = kmalloc(sizeof(*dests) + n * sizeof(dests->d[0]), GFP_ATOMIC);
+	if (dests == NULL)
+		return NULL;
+
+	dests->n = 0;
+	list_for_each_entry(dest, &svc->destinations, n_list) {
+		struct ip_vs_mh_dest *d = &dests->d[dests->n];
+
+		d->weight = atomic_read(&dest->weight);
+		if (d->weight <= 0)
+			continue;
+		if (dests->n == n)
+			break;
+		atomic_inc(&dest->refcnt);
+		d->dest = dest;
+		d->addr = dest->addr;
+		d->port = dest->port;
+		dests->n++;
+	}
+	return dests;
+}
+
+
+static int ip_vs_mh_cmp(const void *a, const void *b)
+{
+	const struct ip_vs_mh_dest *x = a, *y = b;
+
+	if (x->addr != y->addr)
+		return ntohl(x->addr) < ntohl(y->addr) ? -1 : 1;
+	if (x->port != y->port)
+		return ntohs(x->port) < ntohs(y->port) ? -1 : 1;
+	return 0;
+}
+
+
+static int gcd(int a, int b)
+{
+	int c;
+
+	while ((c = a % b)) {
+		a = b;
+		b = c;
+	}
+	return b;
+}
+
+
+static inline void ip_vs_mh_next(struct ip_vs_mh_dest *d, u32 size)
+{
+	d->perm += d->skip;
+	if (d->perm >= size)
+		d->perm -= size;
+}
+
+
+/*
+ *      Fill a new table from @dests, which it then owns
+ */
+static struct ip_vs_mh_table *ip_vs_mh_build(struct ip_vs_mh_dests *dests)
+{
+	u32 size = ip_vs_mh_tab_size, filled = 0;
+	struct ip_vs_mh_table *t;
+	struct ip_vs_mh_dest *d;
+	int g = 0, turns, i;
+
+	t = vmalloc(sizeof(*t) + size * sizeof(t->buckets[0]));
+	if (t == NULL)
+		return NULL;
+	memset(t->buckets, 0, size * sizeof(t->buckets[0]));
+	t->size = size;
+	t->dests = dests;
+
+	/* the order the servers were added in must not matter */
+	sort(dests->d, dests->n, sizeof(dests->d[0]), ip_vs_mh_cmp, NULL);
+
+	for (i = 0; i < dests->n; i++) {
+		u32 addr = ntohl(dests->d[i].addr);
+		u32 port = ntohs(dests->d[i].port);
+
+		d = &dests->d[i];
+		d->perm = jhash_2words(addr, port, IP_VS_MH_OFFSET_SEED) % size;
+		d->skip = jhash_2words(addr, port, IP_VS_MH_SKIP_SEED)
+			  % (size - 1) + 1;
+		g = g ? gcd(d->weight, g) : d->weight;
+	}
+
+	while (dests->n) {
+		for (i = 0; i < dests->n; i++) {
+			d = &dests->d[i];
+			for (turns = d->weight / g; turns; turns--) {
+				while (t->buckets[d->perm])
+					ip_vs_mh_next(d, size);
+				t->buckets[d->perm] = d->dest;
+				ip_vs_mh_next(d, size);
+				if (++filled == size)
+					return t;
+			}
+		}
+	}
+	return t;
+}
+
+
+static void ip_vs_mh_free_table(struct ip_vs_mh_table *t)
+{
+	ip_vs_mh_put_dests(t->dests);
+	vfree(t);
+}
+
+
+static void ip_vs_mh_rebuild(struct work_struct *work)
+{
+	struct ip_vs_mh_state *s = container_of(work, struct ip_vs_mh_state,
+						work);
+	struct ip_vs_mh_table *old, *new = NULL;
+	struct ip_vs_mh_dests *dests;
+	int dead, last;
+
+	spin_lock_bh(&s->lock);
+	dests = s->pending;
+	s->pending = NULL;
+	dead = s->dead;
+	/* done_service() may have queued us again while we run */
+	last = dead && !work_pending(&s->work);
+	spin_unlock_bh(&s->lock);
+
+	if (dests != NULL) {
+		if (!dead)
+			new = ip_vs_mh_build(dests);
+		if (new == NULL) {
+			if (!dead)
+				IP_VS_ERR("ip_vs_mh_rebuild(): no memory, "
+					  "keeping the old table\n");
+			ip_vs_mh_put_dests(dests);
+		}
+	}
+	if (new == NULL && !last)
+		return;
+
+	old = s->table;
+	rcu_assign_pointer(s->table, new);
+	if (old != NULL) {
+		synchronize_rcu();
+		ip_vs_mh_free_table(old);
+	}
+	if (last)
+		kfree(s);
+}
+
+
+/*
+ *      Have the table rebuilt from the current servers
+ */
+static int ip_vs_mh_reassign(struct ip_vs_service *svc)
+{
+	struct ip_vs_mh_state *s = svc->sched_data;
+	struct ip_vs_mh_dests *dests, *old;
+
+	dests = ip_vs_mh_get_dests(svc);
+	if (dests == NULL) {
+		IP_VS_ERR("ip_vs_mh_reassign(): no memory\n");
+		return -ENOMEM;
+	}
+
+	spin_lock_bh(&s->lock);
+	old = s->pending;
+	s->pending = dests;
+	queue_work(ip_vs_mh_wq, &s->work);
+	spin_unlock_bh(&s->lock);
+
+	if (old != NULL)
+		ip_vs_mh_put_dests(old);
+	return 0;
+}
+
+
+static int ip_vs_mh_init_svc(struct ip_vs_service *svc)
+{
+	struct ip_vs_mh_state *s;
+
+	s = kzalloc(sizeof(*s), GFP_ATOMIC);
+	if (s == NULL) {
+		IP_VS_ERR("ip_vs_mh_init_svc(): no memory\n");
+		return -ENOMEM;
+	}
+	spin_lock_init(&s->lock);
+	INIT_WORK(&s->work, ip_vs_mh_rebuild);
+	svc->sched_data = s;
+
+	return ip_vs_mh_reassign(svc);
+}
+
+
+static int ip_vs_mh_done_svc(struct ip_vs_service *svc)
+{
+	struct ip_vs_mh_state *s = svc->sched_data;
+
+	/* the work queue frees the table and us */
+	spin_lock_bh(&s->lock);
+	s->dead = 1;
+	queue_work(ip_vs_mh_wq, &s->work);
+	spin_unlock_bh(&s->lock);
+
+	return 0;
+}
+
+
+static int ip_vs_mh_update_svc(struct ip_vs_service *svc)
+{
+	return ip_vs_mh_reassign(svc);
+}
+
+
+static inline int ip_vs_mh_usable(struct ip_vs_dest *dest)
+{
+	return dest != NULL &&
+	       (dest->flags & IP_VS_DEST_F_AVAILABLE) &&
+	       !(dest->flags & IP_VS_DEST_F_OVERLOAD) &&
+	       atomic_read(&dest->weight) > 0;
+}
+
+
+/*
+ *      Returns hash value of the flow, in host order so that directors
+ *      of any byte order agree
+ */
+static inline u32
+ip_vs_mh_hashkey(const struct iphdr *iph, const __be16 *ports, u32 seed)
+{
+	if (ports)
+		return jhash_3words(ntohl(iph->saddr), ntohl(iph->daddr),
+				    (ntohs(ports[0]) << 16) | ntohs(ports[1]),
+				    seed ^ iph->protocol);
+	return jhash_1word(ntohl(iph->saddr), seed);
+}
+
+
+/*
+ *      Maglev Hashing scheduling
+ */
+static struct ip_vs_dest *
+ip_vs_mh_schedule(struct ip_vs_service *svc, const struct sk_buff *skb)
+{
+	struct ip_vs_mh_state *s = svc->sched_data;
+	struct iphdr *iph = skb->nh.iph;
+	struct ip_vs_mh_table *t;
+	struct ip_vs_dest *dest = NULL;
+	__be16 _ports[2], *ports = NULL;
+	int i;
+
+	IP_VS_DBG(6, "ip_vs_mh_schedule(): Scheduling...\n");
+
+	if (svc->flags & IP_VS_SVC_F_SCHED_MH_PORT) {
+		ports = skb_header_pointer(skb, iph->ihl*4,
+					   sizeof(_ports), _ports);
+		if (ports == NULL)
+			return NULL;
+	}
+
+	rcu_read_lock();
+	t = rcu_dereference(s->table);
+	if (t != NULL) {
+		for (i = 0; i < t->dests->n; i++) {
+			u32 hash = ip_vs_mh_hashkey(iph, ports,
+						    IP_VS_MH_FLOW_SEED + i);
+
+			dest = t->buckets[hash % t->size];
+			if (ip_vs_mh_usable(dest))
+				break;
+			dest = NULL;
+		}
+	}
+	rcu_read_unlock();
+
+	if (dest == NULL)
+		return NULL;
+
+	IP_VS_DBG(6, "MH: source IP address %u.%u.%u.%u "
+		  "--> server %u.%u.%u.%u:%d\n",
+		  NIPQUAD(iph->saddr),
+		  NIPQUAD(dest->addr),
+		  ntohs(dest->port));
+
+	return dest;
+}
+
+
+/*
+ *      IPVS MH Scheduler structure
+ */
+static struct ip_vs_scheduler ip_vs_mh_scheduler =
+{
+	.name =			"mh",
+	.refcnt =		ATOMIC_INIT(0),
+	.module =		THIS_MODULE,
+	.init_service =		ip_vs_mh_init_svc,
+	.done_service =		ip_vs_mh_done_svc,
+	.update_service =	ip_vs_mh_update_svc,
+	.schedule =		ip_vs_mh_schedule,
+};
+
+
+static int __init ip_vs_mh_init(void)
+{
+	unsigned int i;
+	int ret;
+
+	if (ip_vs_mh_tab_size < 3 || ip_vs_mh_tab_size > (1 << 24)) {
+		IP_VS_ERR("mh: table_size %u out of range\n",
+			  ip_vs_mh_tab_size);
+		return -EINVAL;
+	}
+	for (i = 2; i * i <= ip_vs_mh_tab_size; i++) {
+		if (ip_vs_mh_tab_size % i == 0) {
+			IP_VS_ERR("mh: table_size %u is not a prime\n",
+				  ip_vs_mh_tab_size);
+			return -EINVAL;
+		}
+	}
+
+	ip_vs_mh_wq = create_singlethread_workqueue("ip_vs_mh");
+	if (ip_vs_mh_wq == NULL)
+		return -ENOMEM;
+
+	INIT_LIST_HEAD(&ip_vs_mh_scheduler.n_list);
+	ret = register_ip_vs_scheduler(&ip_vs_mh_scheduler);
+	if (ret < 0)
+		destroy_workqueue(ip_vs_mh_wq);
+	return ret;
+}
+
+
+static void __exit ip_vs_mh_cleanup(void)
+{
+	unregister_ip_vs_scheduler(&ip_vs_mh_scheduler);
+	/* lets the work of the last services free them */
+	destroy_workqueue(ip_vs_mh_wq);
+}
+
+
+module_init(ip_vs_mh_init);
+module_exit(ip_vs_mh_cleanup);
+MODULE_LICENSE("GPL");
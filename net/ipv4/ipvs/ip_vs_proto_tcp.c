@@ -441,13 +441,13 @@ set_tcp_state(struct ip_vs_protocol *pp, struct ip_vs_conn *cp,
 		if (dest) {
 			if (!(cp->flags & IP_VS_CONN_F_INACTIVE) &&
 			    (new_state != IP_VS_TCP_S_ESTABLISHED)) {
-				atomic_dec(&dest->activeconns);
-				atomic_inc(&dest->inactconns);
+				ip_vs_dest_conns_add(dest, active, -1);
+				ip_vs_dest_conns_add(dest, inact, 1);
 				cp->flags |= IP_VS_CONN_F_INACTIVE;
 			} else if ((cp->flags & IP_VS_CONN_F_INACTIVE) &&
 				   (new_state == IP_VS_TCP_S_ESTABLISHED)) {
-				atomic_inc(&dest->activeconns);
-				atomic_dec(&dest->inactconns);
+				ip_vs_dest_conns_add(dest, active, 1);
+				ip_vs_dest_conns_add(dest, inact, -1);
 				cp->flags &= ~IP_VS_CONN_F_INACTIVE;
 			}
 		}
@@ -27,22 +27,53 @@
 #include <net/ip_vs.h>
 
 
+/*
+ * Each CPU goes round the destination list from its own position, so
+ * CPUs scheduling at the same time share neither a lock nor a cache
+ * line.  The positions start spread over the list; together the CPUs
+ * still give every server its turn.
+ */
+struct ip_vs_rr_pos {
+	struct list_head *p;
+} ____cacheline_aligned_in_smp;
+
+
+static void ip_vs_rr_reset(struct ip_vs_service *svc)
+{
+	struct ip_vs_rr_pos *pos = svc->sched_data;
+	struct list_head *p = &svc->destinations;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		pos[cpu].p = p;
+		p = p->next;
+	}
+}
+
+
 static int ip_vs_rr_init_svc(struct ip_vs_service *svc)
 {
-	svc->sched_data = &svc->destinations;
+	svc->sched_data = kcalloc(highest_possible_processor_id() + 1,
+				  sizeof(struct ip_vs_rr_pos), GFP_ATOMIC);
+	if (svc->sched_data == NULL) {
+		IP_VS_ERR("ip_vs_rr_init_svc(): no memory\n");
+		return -ENOMEM;
+	}
+	ip_vs_rr_reset(svc);
 	return 0;
 }
 
 
 static int ip_vs_rr_done_svc(struct ip_vs_service *svc)
 {
+	kfree(svc->sched_data);
 	return 0;
 }
 
 
 static int ip_vs_rr_update_svc(struct ip_vs_service *svc)
 {
-	svc->sched_data = &svc->destinations;
+	ip_vs_rr_reset(svc);
 	return 0;
 }
 
@@ -53,13 +84,16 @@ static int ip_vs_rr_update_svc(struct ip_vs_service *svc)
 static struct ip_vs_dest *
 ip_vs_rr_schedule(struct ip_vs_service *svc, const struct sk_buff *skb)
 {
+	struct ip_vs_rr_pos *pos = svc->sched_data;
 	struct list_head *p, *q;
 	struct ip_vs_dest *dest;
 
 	IP_VS_DBG(6, "ip_vs_rr_schedule(): Scheduling...\n");
 
-	write_lock(&svc->sched_lock);
-	p = (struct list_head *)svc->sched_data;
+	/* from process context we may move to another CPU: that only
+	   costs a little fairness */
+	pos += raw_smp_processor_id();
+	p = pos->p;
 	p = p->next;
 	q = p;
 	do {
@@ -76,16 +110,14 @@ ip_vs_rr_schedule(struct ip_vs_service *svc, const struct sk_buff *skb)
 			goto out;
 		q = q->next;
 	} while (q != p);
-	write_unlock(&svc->sched_lock);
 	return NULL;
 
   out:
-	svc->sched_data = q;
-	write_unlock(&svc->sched_lock);
+	pos->p = q;
 	IP_VS_DBG(6, "RR: server %u.%u.%u.%u:%u "
 		  "activeconns %d refcnt %d weight %d\n",
 		  NIPQUAD(dest->addr), ntohs(dest->port),
-		  atomic_read(&dest->activeconns),
+		  ip_vs_dest_conns_read(dest, active),
 		  atomic_read(&dest->refcnt), atomic_read(&dest->weight));
 
 	return dest;
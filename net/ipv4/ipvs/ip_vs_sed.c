@@ -71,7 +71,7 @@ ip_vs_sed_dest_overhead(struct ip_vs_dest *dest)
 	 * We only use the active connection number in the cost
 	 * calculation here.
 	 */
-	return atomic_read(&dest->activeconns) + 1;
+	return ip_vs_dest_conns_read(dest, active) + 1;
 }
 
 
@@ -127,7 +127,7 @@ ip_vs_sed_schedule(struct ip_vs_service *svc, const struct sk_buff *skb)
 	IP_VS_DBG(6, "SED: server %u.%u.%u.%u:%u "
 		  "activeconns %d refcnt %d weight %d overhead %d\n",
 		  NIPQUAD(least->addr), ntohs(least->port),
-		  atomic_read(&least->activeconns),
+		  ip_vs_dest_conns_read(least, active),
 		  atomic_read(&least->refcnt),
 		  atomic_read(&least->weight), loh);
 
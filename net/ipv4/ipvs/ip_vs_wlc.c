@@ -58,8 +58,8 @@ ip_vs_wlc_dest_overhead(struct ip_vs_dest *dest)
 	 * use the following formula to estimate the overhead now:
 	 *		  dest->activeconns*256 + dest->inactconns
 	 */
-	return (atomic_read(&dest->activeconns) << 8) +
-		atomic_read(&dest->inactconns);
+	return (ip_vs_dest_conns_read(dest, active) << 8) +
+		ip_vs_dest_conns_read(dest, inact);
 }
 
 
@@ -115,7 +115,7 @@ ip_vs_wlc_schedule(struct ip_vs_service *svc, const struct sk_buff *skb)
 	IP_VS_DBG(6, "WLC: server %u.%u.%u.%u:%u "
 		  "activeconns %d refcnt %d weight %d overhead %d\n",
 		  NIPQUAD(least->addr), ntohs(least->port),
-		  atomic_read(&least->activeconns),
+		  ip_vs_dest_conns_read(least, active),
 		  atomic_read(&least->refcnt),
 		  atomic_read(&least->weight), loh);
 
@@ -26,13 +26,19 @@
 #include <net/ip_vs.h>
 
 /*
- * current destination pointer for weighted round-robin scheduling
+ * current destination pointer for weighted round-robin scheduling,
+ * one per CPU so that CPUs scheduling at the same time share neither
+ * a lock nor a cache line; each runs through the whole sequence
  */
-struct ip_vs_wrr_mark {
+struct ip_vs_wrr_pos {
 	struct list_head *cl;	/* current list head */
 	int cw;			/* current weight */
+} ____cacheline_aligned_in_smp;
+
+struct ip_vs_wrr_mark {
 	int mw;			/* maximum weight */
 	int di;			/* decreasing interval */
+	struct ip_vs_wrr_pos pos[0];
 };
 
 
@@ -86,6 +92,24 @@ static int ip_vs_wrr_max_weight(struct ip_vs_service *svc)
 }
 
 
+/*
+ *    Start the CPUs at different servers, the sequence is the same
+ */
+static void ip_vs_wrr_reset(struct ip_vs_service *svc,
+			    struct ip_vs_wrr_mark *mark)
+{
+	struct list_head *p = &svc->destinations;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		mark->pos[cpu].cl = p;
+		if (mark->pos[cpu].cw > mark->mw)
+			mark->pos[cpu].cw = 0;
+		p = p->next;
+	}
+}
+
+
 static int ip_vs_wrr_init_svc(struct ip_vs_service *svc)
 {
 	struct ip_vs_wrr_mark *mark;
@@ -93,15 +117,16 @@ static int ip_vs_wrr_init_svc(struct ip_vs_service *svc)
 	/*
 	 *    Allocate the mark variable for WRR scheduling
 	 */
-	mark = kmalloc(sizeof(struct ip_vs_wrr_mark), GFP_ATOMIC);
+	mark = kzalloc(sizeof(struct ip_vs_wrr_mark) +
+		       (highest_possible_processor_id() + 1) *
+		       sizeof(struct ip_vs_wrr_pos), GFP_ATOMIC);
 	if (mark == NULL) {
 		IP_VS_ERR("ip_vs_wrr_init_svc(): no memory\n");
 		return -ENOMEM;
 	}
-	mark->cl = &svc->destinations;
-	mark->cw = 0;
 	mark->mw = ip_vs_wrr_max_weight(svc);
 	mark->di = ip_vs_wrr_gcd_weight(svc);
+	ip_vs_wrr_reset(svc, mark);
 	svc->sched_data = mark;
 
 	return 0;
@@ -123,11 +148,9 @@ static int ip_vs_wrr_update_svc(struct ip_vs_service *svc)
 {
 	struct ip_vs_wrr_mark *mark = svc->sched_data;
 
-	mark->cl = &svc->destinations;
 	mark->mw = ip_vs_wrr_max_weight(svc);
 	mark->di = ip_vs_wrr_gcd_weight(svc);
-	if (mark->cw > mark->mw)
-		mark->cw = 0;
+	ip_vs_wrr_reset(svc, mark);
 	return 0;
 }
 
@@ -140,35 +163,41 @@ ip_vs_wrr_schedule(struct ip_vs_service *svc, const struct sk_buff *skb)
 {
 	struct ip_vs_dest *dest;
 	struct ip_vs_wrr_mark *mark = svc->sched_data;
+	struct ip_vs_wrr_pos *pos;
 	struct list_head *p;
 
 	IP_VS_DBG(6, "ip_vs_wrr_schedule(): Scheduling...\n");
 
 	/*
-	 * This loop will always terminate, because mark->cw in (0, max_weight]
+	 * From process context we may move to another CPU: that only
+	 * costs a little fairness.
+	 */
+	pos = &mark->pos[raw_smp_processor_id()];
+
+	/*
+	 * This loop will always terminate, because pos->cw in (0, max_weight]
 	 * and at least one server has its weight equal to max_weight.
 	 */
-	write_lock(&svc->sched_lock);
-	p = mark->cl;
+	p = pos->cl;
 	while (1) {
-		if (mark->cl == &svc->destinations) {
+		if (pos->cl == &svc->destinations) {
 			/* it is at the head of the destination list */
 
-			if (mark->cl == mark->cl->next) {
+			if (pos->cl == pos->cl->next) {
 				/* no dest entry */
 				dest = NULL;
 				goto out;
 			}
 
-			mark->cl = svc->destinations.next;
-			mark->cw -= mark->di;
-			if (mark->cw <= 0) {
-				mark->cw = mark->mw;
+			pos->cl = svc->destinations.next;
+			pos->cw -= mark->di;
+			if (pos->cw <= 0) {
+				pos->cw = mark->mw;
 				/*
 				 * Still zero, which means no available servers.
 				 */
-				if (mark->cw == 0) {
-					mark->cl = &svc->destinations;
+				if (pos->cw == 0) {
+					pos->cl = &svc->destinations;
 					IP_VS_INFO("ip_vs_wrr_schedule(): "
 						   "no available servers\n");
 					dest = NULL;
@@ -176,19 +205,19 @@ ip_vs_wrr_schedule(struct ip_vs_service *svc, const struct sk_buff *skb)
 				}
 			}
 		} else
-			mark->cl = mark->cl->next;
+			pos->cl = pos->cl->next;
 
-		if (mark->cl != &svc->destinations) {
+		if (pos->cl != &svc->destinations) {
 			/* not at the head of the list */
-			dest = list_entry(mark->cl, struct ip_vs_dest, n_list);
+			dest = list_entry(pos->cl, struct ip_vs_dest, n_list);
 			if (!(dest->flags & IP_VS_DEST_F_OVERLOAD) &&
-			    atomic_read(&dest->weight) >= mark->cw) {
+			    atomic_read(&dest->weight) >= pos->cw) {
 				/* got it */
 				break;
 			}
 		}
 
-		if (mark->cl == p && mark->cw == mark->di) {
+		if (pos->cl == p && pos->cw == mark->di) {
 			/* back to the start, and no dest is found.
 			   It is only possible when all dests are OVERLOADED */
 			dest = NULL;
@@ -199,12 +228,11 @@ ip_vs_wrr_schedule(struct ip_vs_service *svc, const struct sk_buff *skb)
 	IP_VS_DBG(6, "WRR: server %u.%u.%u.%u:%u "
 		  "activeconns %d refcnt %d weight %d\n",
 		  NIPQUAD(dest->addr), ntohs(dest->port),
-		  atomic_read(&dest->activeconns),
+		  ip_vs_dest_conns_read(dest, active),
 		  atomic_read(&dest->refcnt),
 		  atomic_read(&dest->weight));
 
   out:
-	write_unlock(&svc->sched_lock);
 	return dest;
 }
 
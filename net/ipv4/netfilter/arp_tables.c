@@ -229,10 +229,13 @@ unsigned int arpt_do_table(struct sk_buff **pskb,
 	unsigned int verdict = NF_DROP;
 	struct arphdr *arp;
 	int hotdrop = 0;
-	struct arpt_entry *e, *back;
+	struct arpt_entry *e;
 	const char *indev, *outdev;
 	void *table_base;
 	struct xt_table_info *private;
+	struct xt_counters *counters;
+	void **jumpstack;
+	unsigned int *stackptr, origptr, addend;
 
 	/* ARP header, plus 2 device addresses, plus 2 IP addresses.  */
 	if (!pskb_may_pull((*pskb), (sizeof(struct arphdr) +
@@ -243,11 +246,15 @@ unsigned int arpt_do_table(struct sk_buff **pskb,
 	indev = in ? in->name : nulldevname;
 	outdev = out ? out->name : nulldevname;
 
-	read_lock_bh(&table->lock);
-	private = table->private;
-	table_base = (void *)private->entries[smp_processor_id()];
+	rcu_read_lock_bh();
+	private = rcu_dereference(table->private);
+	table_base = (void *)private->entries;
+	counters = private->counters[smp_processor_id()];
+	jumpstack = private->jumpstack[smp_processor_id()];
+	stackptr = per_cpu_ptr(private->stackptr, smp_processor_id());
+	origptr = *stackptr;
+	addend = xt_write_recseq_begin();
 	e = get_entry(table_base, private->hook_entry[hook]);
-	back = get_entry(table_base, private->underflow[hook]);
 
 	arp = (*pskb)->nh.arph;
 	do {
@@ -257,7 +264,7 @@ unsigned int arpt_do_table(struct sk_buff **pskb,
 
 			hdr_len = sizeof(*arp) + (2 * sizeof(struct in_addr)) +
 				(2 * (*pskb)->dev->addr_len);
-			ADD_COUNTER(e->counters, hdr_len, 1);
+			ADD_COUNTER(counters[e->counters.pcnt], hdr_len, 1);
 
 			t = arpt_get_target(e);
 
@@ -272,21 +279,24 @@ unsigned int arpt_do_table(struct sk_buff **pskb,
 						verdict = (unsigned)(-v) - 1;
 						break;
 					}
-					e = back;
-					back = get_entry(table_base,
-							 back->comefrom);
+					/* Return from builtin chain */
+					if (*stackptr <= origptr) {
+						e = get_entry(table_base,
+							private->underflow[hook]);
+						continue;
+					}
+					e = jumpstack[--*stackptr];
+					e = (void *)e + e->next_offset;
 					continue;
 				}
 				if (table_base + v
 				    != (void *)e + e->next_offset) {
-					/* Save old back ptr in next entry */
-					struct arpt_entry *next
-						= (void *)e + e->next_offset;
-					next->comefrom =
-						(void *)back - table_base;
-
-					/* set back pointer to next entry */
-					back = next;
+					/* Push the jump, return after it */
+					if (*stackptr >= private->stacksize) {
+						verdict = NF_DROP;
+						break;
+					}
+					jumpstack[(*stackptr)++] = e;
 				}
 
 				e = get_entry(table_base, v);
@@ -313,7 +323,10 @@ unsigned int arpt_do_table(struct sk_buff **pskb,
 			e = (void *)e + e->next_offset;
 		}
 	} while (!hotdrop);
-	read_unlock_bh(&table->lock);
+
+	*stackptr = origptr;
+	xt_write_recseq_end(addend);
+	rcu_read_unlock_bh();
 
 	if (hotdrop)
 		return NF_DROP;
@@ -568,6 +581,31 @@ static inline int cleanup_entry(struct arpt_entry *e, unsigned int *i)
 	return 0;
 }
 
+/* Give each rule its number, which indexes its per-CPU counters, and
+ * count the chains, which bounds the depth of the jump stack.
+ */
+static inline int index_entry(struct arpt_entry *e,
+			      struct xt_table_info *newinfo,
+			      unsigned int *i)
+{
+	struct arpt_entry_target *t = arpt_get_target(e);
+
+	e->counters.pcnt = (*i)++;
+	e->counters.bcnt = 0;
+	if (strcmp(t->u.kernel.target->name, ARPT_ERROR_TARGET) == 0)
+		newinfo->stacksize++;
+	return 0;
+}
+
+static int index_entries(struct xt_table_info *newinfo, void *entry0)
+{
+	unsigned int i = 0;
+
+	newinfo->stacksize = 0;
+	ARPT_ENTRY_ITERATE(entry0, newinfo->size, index_entry, newinfo, &i);
+	return xt_alloc_table_percpu(newinfo);
+}
+
 /* Checks and translates the user-supplied table segment (held in
  * newinfo).
  */
@@ -645,69 +683,13 @@ static int translate_table(const char *name,
 		return ret;
 	}
 
-	/* And one copy for every other CPU */
-	for_each_possible_cpu(i) {
-		if (newinfo->entries[i] && newinfo->entries[i] != entry0)
-			memcpy(newinfo->entries[i], entry0, newinfo->size);
-	}
-
+	ret = index_entries(newinfo, entry0);
+	if (ret != 0)
+		ARPT_ENTRY_ITERATE(entry0, newinfo->size,
+				   cleanup_entry, NULL);
 	return ret;
 }
 
-/* Gets counters. */
-static inline int add_entry_to_counter(const struct arpt_entry *e,
-				       struct xt_counters total[],
-				       unsigned int *i)
-{
-	ADD_COUNTER(total[*i], e->counters.bcnt, e->counters.pcnt);
-
-	(*i)++;
-	return 0;
-}
-
-static inline int set_entry_to_counter(const struct arpt_entry *e,
-				       struct xt_counters total[],
-				       unsigned int *i)
-{
-	SET_COUNTER(total[*i], e->counters.bcnt, e->counters.pcnt);
-
-	(*i)++;
-	return 0;
-}
-
-static void get_counters(const struct xt_table_info *t,
-			 struct xt_counters counters[])
-{
-	unsigned int cpu;
-	unsigned int i;
-	unsigned int curcpu;
-
-	/* Instead of clearing (by a previous call to memset())
-	 * the counters and using adds, we set the counters
-	 * with data used by 'current' CPU
-	 * We dont care about preemption here.
-	 */
-	curcpu = raw_smp_processor_id();
-
-	i = 0;
-	ARPT_ENTRY_ITERATE(t->entries[curcpu],
-			   t->size,
-			   set_entry_to_counter,
-			   counters,
-			   &i);
-
-	for_each_possible_cpu(cpu) {
-		if (cpu == curcpu)
-			continue;
-		i = 0;
-		ARPT_ENTRY_ITERATE(t->entries[cpu],
-				   t->size,
-				   add_entry_to_counter,
-				   counters,
-				   &i);
-	}
-}
-
 static int copy_entries_to_user(unsigned int total_size,
 				struct arpt_table *table,
 				void __user *userptr)
@@ -719,9 +701,8 @@ static int copy_entries_to_user(unsigned int total_size,
 	int ret = 0;
 	void *loc_cpu_entry;
 
-	/* We need atomic snapshot of counters: rest doesn't change
-	 * (other than comefrom, which userspace doesn't care
-	 * about).
+	/* The rules don't change under the table mutex, and the
+	 * counters are snapshotted per CPU without stopping packets.
 	 */
 	countersize = sizeof(struct xt_counters) * private->number;
 	counters = vmalloc_node(countersize, numa_node_id());
@@ -729,12 +710,9 @@ static int copy_entries_to_user(unsigned int total_size,
 	if (counters == NULL)
 		return -ENOMEM;
 
-	/* First, sum counters... */
-	write_lock_bh(&table->lock);
-	get_counters(private, counters);
-	write_unlock_bh(&table->lock);
+	xt_get_counters(private, counters);
 
-	loc_cpu_entry = private->entries[raw_smp_processor_id()];
+	loc_cpu_entry = private->entries;
 	/* ... then copy entire thing ... */
 	if (copy_to_user(userptr, loc_cpu_entry, total_size) != 0) {
 		ret = -EFAULT;
@@ -825,8 +803,7 @@ static int do_replace(void __user *user, unsigned int len)
 	if (!newinfo)
 		return -ENOMEM;
 
-	/* choose the copy that is on our node/cpu */
-	loc_cpu_entry = newinfo->entries[raw_smp_processor_id()];
+	loc_cpu_entry = newinfo->entries;
 	if (copy_from_user(loc_cpu_entry, user + sizeof(tmp),
 			   tmp.size) != 0) {
 		ret = -EFAULT;
@@ -877,9 +854,9 @@ static int do_replace(void __user *user, unsigned int len)
 		module_put(t->me);
 
 	/* Get the old counters. */
-	get_counters(oldinfo, counters);
+	xt_get_counters(oldinfo, counters);
 	/* Decrease module usage counts and free resource */
-	loc_cpu_old_entry = oldinfo->entries[raw_smp_processor_id()];
+	loc_cpu_old_entry = oldinfo->entries;
 	ARPT_ENTRY_ITERATE(loc_cpu_old_entry, oldinfo->size, cleanup_entry,NULL);
 
 	xt_free_table_info(oldinfo);
@@ -902,28 +879,12 @@ static int do_replace(void __user *user, unsigned int len)
 	return ret;
 }
 
-/* We're lazy, and add to the first CPU; overflow works its fey magic
- * and everything is OK.
- */
-static inline int add_counter_to_entry(struct arpt_entry *e,
-				       const struct xt_counters addme[],
-				       unsigned int *i)
-{
-
-	ADD_COUNTER(e->counters, addme[*i].bcnt, addme[*i].pcnt);
-
-	(*i)++;
-	return 0;
-}
-
 static int do_add_counters(void __user *user, unsigned int len)
 {
-	unsigned int i;
 	struct xt_counters_info tmp, *paddc;
 	struct arpt_table *t;
 	struct xt_table_info *private;
 	int ret = 0;
-	void *loc_cpu_entry;
 
 	if (copy_from_user(&tmp, user, sizeof(tmp)) != 0)
 		return -EFAULT;
@@ -946,23 +907,14 @@ static int do_add_counters(void __user *user, unsigned int len)
 		goto free;
 	}
 
-	write_lock_bh(&t->lock);
 	private = t->private;
 	if (private->number != tmp.num_counters) {
 		ret = -EINVAL;
 		goto unlock_up_free;
 	}
 
-	i = 0;
-	/* Choose the copy that is on our node */
-	loc_cpu_entry = private->entries[smp_processor_id()];
-	ARPT_ENTRY_ITERATE(loc_cpu_entry,
-			   private->size,
-			   add_counter_to_entry,
-			   paddc->counters,
-			   &i);
+	xt_add_counters(private, paddc->counters);
  unlock_up_free:
-	write_unlock_bh(&t->lock);
 	xt_table_unlock(t);
 	module_put(t->me);
  free:
@@ -1095,7 +1047,7 @@ int arpt_register_table(struct arpt_table *table,
 	int ret;
 	struct xt_table_info *newinfo;
 	static struct xt_table_info bootstrap
-		= { 0, 0, 0, { 0 }, { 0 }, { } };
+		= { 0, 0, 0, { 0 }, { 0 } };
 	void *loc_cpu_entry;
 
 	newinfo = xt_alloc_table_info(repl->size);
@@ -1104,8 +1056,7 @@ int arpt_register_table(struct arpt_table *table,
 		return ret;
 	}
 
-	/* choose the copy on our node/cpu */
-	loc_cpu_entry = newinfo->entries[raw_smp_processor_id()];
+	loc_cpu_entry = newinfo->entries;
 	memcpy(loc_cpu_entry, repl->entries, repl->size);
 
 	ret = translate_table(table->name, table->valid_hooks,
@@ -1137,7 +1088,7 @@ void arpt_unregister_table(struct arpt_table *table)
 	private = xt_unregister_table(table);
 
 	/* Decrease module usage counts and free resources */
-	loc_cpu_entry = private->entries[raw_smp_processor_id()];
+	loc_cpu_entry = private->entries;
 	ARPT_ENTRY_ITERATE(loc_cpu_entry, private->size,
 			   cleanup_entry, NULL);
 	xt_free_table_info(private);
@@ -29,6 +29,8 @@
 #include <linux/proc_fs.h>
 #include <linux/err.h>
 #include <linux/cpumask.h>
+#include <linux/jhash.h>
+#include <linux/log2.h>
 
 #include <linux/netfilter/x_tables.h>
 #include <linux/netfilter_ipv4/ip_tables.h>
@@ -71,13 +73,13 @@ do {								\
 #endif
 
 /*
-   We keep a set of rules for each CPU, so we can avoid write-locking
-   them in the softirq when updating the counters and therefore
-   only need to read-lock in the softirq; doing a write_lock_bh() in user
-   context stops packets coming through and allows user context to read
-   the counters or update the rules.
+   All CPUs share one read-only copy of the rules, found under RCU;
+   each CPU counts into its own array, indexed by rule number, so the
+   softirq never writes to the rules and takes no lock.  A replace
+   swaps in the new table and waits for readers to leave the old one.
+*/
 
-   Hence the start of any table is given by get_table() below.  */
+unsigned int ipt_table_gen __read_mostly;
 
 /* Returns whether matches rule or not. */
 static inline int
@@ -210,6 +212,166 @@ get_entry(void *base, unsigned int offset)
 	return (struct ipt_entry *)(base + offset);
 }
 
+/*
+ * Ruleset classifier.
+ *
+ * Long runs of rules are compiled into a tuple space: the rules of a
+ * run are grouped by the masks they apply to the source address, the
+ * destination address and the protocol, and each group is hashed on
+ * the masked values.  For a packet, each group then yields, in rule
+ * order, the only rules whose address and protocol part it can match,
+ * and ipt_do_table() skips straight to the first of them instead of
+ * trying ip_packet_match() on every rule in between.  Skipped rules
+ * could not have matched, so counters, jumps and verdicts come out
+ * exactly as with the linear walk.  Interfaces, fragments and the
+ * extension matches are still checked on each candidate.
+ */
+
+/* Shortest run worth compiling; 0 turns the classifier off. */
+static unsigned int compile_min_rules = 16;
+module_param(compile_min_rules, uint, 0600);
+MODULE_PARM_DESC(compile_min_rules, "shortest run of rules to compile");
+
+/* Mask groups per run; a rule that would need another starts a new run. */
+#define IPT_CLF_MAX_TUPLES	8
+#define IPT_CLF_NORUN		(~0U)
+
+struct ipt_clf_node {
+	__be32 src, dst;
+	u_int8_t proto;
+	unsigned int rule;
+};
+
+struct ipt_clf_tuple {
+	__be32 smsk, dmsk;
+	u_int8_t pmsk;
+	unsigned int hmask;
+	/* node[bucket[h]] up to node[bucket[h + 1]] hash to h, in rule order */
+	unsigned int *bucket;
+	struct ipt_clf_node *node;
+};
+
+struct ipt_clf_run {
+	unsigned int first, last;
+	unsigned int ntuples;
+	struct ipt_clf_tuple tuple[IPT_CLF_MAX_TUPLES];
+};
+
+/* One allocation, shared by all CPUs: offsets are the same in each copy. */
+struct ipt_clf {
+	unsigned int size;
+	unsigned int nrules;
+	unsigned int *offset;		/* of each rule, ascending */
+	unsigned int *run;		/* run of each rule, or IPT_CLF_NORUN */
+	struct ipt_clf_run *runs;
+};
+
+/* Where ipt_do_table() stands in the classifier, kept on its stack. */
+struct ipt_clf_state {
+	const struct ipt_clf_run *run;	/* cursors are for this run... */
+	unsigned int from;		/* ...and rules from here on */
+	unsigned int rule;		/* rule last handed out */
+	struct ipt_clf_cursor {
+		const struct ipt_clf_node *pos, *end;
+		__be32 src, dst;
+		u_int8_t proto;
+	} cur[IPT_CLF_MAX_TUPLES];
+};
+
+static inline u_int32_t
+ipt_clf_hash(__be32 src, __be32 dst, u_int8_t proto, unsigned int hmask)
+{
+	return jhash_3words((__force u32)src, (__force u32)dst, proto, 0)
+		& hmask;
+}
+
+/* Rule number of the entry at @off, which must start a rule. */
+static unsigned int ipt_clf_rule(const struct ipt_clf *clf, unsigned int off)
+{
+	unsigned int lo = 0, hi = clf->nrules - 1, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (clf->offset[mid] < off)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	IP_NF_ASSERT(clf->offset[lo] == off);
+	return lo;
+}
+
+static void ipt_clf_enter(const struct ipt_clf_run *run,
+			  struct ipt_clf_state *st, const struct iphdr *ip)
+{
+	const struct ipt_clf_tuple *t;
+	struct ipt_clf_cursor *c;
+	unsigned int i, h;
+
+	for (i = 0; i < run->ntuples; i++) {
+		t = &run->tuple[i];
+		c = &st->cur[i];
+		c->src = ip->saddr & t->smsk;
+		c->dst = ip->daddr & t->dmsk;
+		c->proto = ip->protocol & t->pmsk;
+		h = ipt_clf_hash(c->src, c->dst, c->proto, t->hmask);
+		c->pos = t->node + t->bucket[h];
+		c->end = t->node + t->bucket[h + 1];
+	}
+	st->run = run;
+}
+
+/* First rule of the run from @from on that the packet may match, or the
+ * rule right after the run. */
+static unsigned int ipt_clf_candidate(const struct ipt_clf_run *run,
+				      struct ipt_clf_state *st,
+				      unsigned int from)
+{
+	unsigned int i, best = run->last + 1;
+	struct ipt_clf_cursor *c;
+
+	for (i = 0; i < run->ntuples; i++) {
+		c = &st->cur[i];
+		while (c->pos < c->end
+		       && (c->pos->rule < from
+			   || c->pos->src != c->src
+			   || c->pos->dst != c->dst
+			   || c->pos->proto != c->proto))
+			c->pos++;
+		if (c->pos < c->end && c->pos->rule < best)
+			best = c->pos->rule;
+	}
+	return best;
+}
+
+/* The walk is about to look at @e: skip the rules that cannot match. */
+static inline struct ipt_entry *
+ipt_clf_next(const struct ipt_clf *clf, struct ipt_clf_state *st,
+	     void *table_base, struct ipt_entry *e, const struct iphdr *ip)
+{
+	unsigned int off = (void *)e - table_base;
+	unsigned int rule, r;
+	const struct ipt_clf_run *run;
+
+	/* Falling through to the next rule is the common case. */
+	rule = st->rule + 1;
+	if (rule >= clf->nrules || clf->offset[rule] != off)
+		rule = ipt_clf_rule(clf, off);
+
+	r = clf->run[rule];
+	if (r != IPT_CLF_NORUN) {
+		run = &clf->runs[r];
+		/* A jump may take us back up into the same run. */
+		if (run != st->run || rule < st->from)
+			ipt_clf_enter(run, st, ip);
+		st->from = rule;
+		rule = ipt_clf_candidate(run, st, rule);
+		e = get_entry(table_base, clf->offset[rule]);
+	}
+	st->rule = rule;
+	return e;
+}
+
 /* Returns one of the generic firewall policies, like NF_ACCEPT. */
 unsigned int
 ipt_do_table(struct sk_buff **pskb,
@@ -227,8 +389,13 @@ ipt_do_table(struct sk_buff **pskb,
 	unsigned int verdict = NF_DROP;
 	const char *indev, *outdev;
 	void *table_base;
-	struct ipt_entry *e, *back;
+	struct ipt_entry *e;
 	struct xt_table_info *private;
+	struct xt_counters *counters;
+	void **jumpstack;
+	unsigned int *stackptr, origptr, addend;
+	const struct ipt_clf *clf;
+	struct ipt_clf_state clf_state;
 
 	/* Initialization */
 	ip = (*pskb)->nh.iph;
@@ -243,18 +410,24 @@ ipt_do_table(struct sk_buff **pskb,
 	 * match it. */
 	offset = ntohs(ip->frag_off) & IP_OFFSET;
 
-	read_lock_bh(&table->lock);
+	rcu_read_lock_bh();
 	IP_NF_ASSERT(table->valid_hooks & (1 << hook));
-	private = table->private;
-	table_base = (void *)private->entries[smp_processor_id()];
+	private = rcu_dereference(table->private);
+	table_base = (void *)private->entries;
+	counters = private->counters[smp_processor_id()];
+	jumpstack = private->jumpstack[smp_processor_id()];
+	stackptr = per_cpu_ptr(private->stackptr, smp_processor_id());
+	origptr = *stackptr;
+	addend = xt_write_recseq_begin();
 	e = get_entry(table_base, private->hook_entry[hook]);
-
-	/* For return from builtin chain */
-	back = get_entry(table_base, private->underflow[hook]);
+	clf = private->compiled;
+	clf_state.run = NULL;
+	clf_state.rule = ~0U;
 
 	do {
+		if (clf)
+			e = ipt_clf_next(clf, &clf_state, table_base, e, ip);
 		IP_NF_ASSERT(e);
-		IP_NF_ASSERT(back);
 		if (ip_packet_match(ip, indev, outdev, &e->ip, offset)) {
 			struct ipt_entry_target *t;
 
@@ -263,7 +436,8 @@ ipt_do_table(struct sk_buff **pskb,
 					      offset, &hotdrop) != 0)
 				goto no_match;
 
-			ADD_COUNTER(e->counters, ntohs(ip->tot_len), 1);
+			ADD_COUNTER(counters[e->counters.pcnt],
+				    ntohs(ip->tot_len), 1);
 
 			t = ipt_get_target(e);
 			IP_NF_ASSERT(t->u.kernel.target);
@@ -278,50 +452,40 @@ ipt_do_table(struct sk_buff **pskb,
 						verdict = (unsigned)(-v) - 1;
 						break;
 					}
-					e = back;
-					back = get_entry(table_base,
-							 back->comefrom);
+					/* Return from builtin chain */
+					if (*stackptr <= origptr) {
+						e = get_entry(table_base,
+							private->underflow[hook]);
+						continue;
+					}
+					e = jumpstack[--*stackptr];
+					e = (void *)e + e->next_offset;
 					continue;
 				}
 				if (table_base + v != (void *)e + e->next_offset
 				    && !(e->ip.flags & IPT_F_GOTO)) {
-					/* Save old back ptr in next entry */
-					struct ipt_entry *next
-						= (void *)e + e->next_offset;
-					next->comefrom
-						= (void *)back - table_base;
-					/* set back pointer to next entry */
-					back = next;
+					/* Push the jump, return after it */
+					if (*stackptr >= private->stacksize) {
+						verdict = NF_DROP;
+						break;
+					}
+					jumpstack[(*stackptr)++] = e;
 				}
 
 				e = get_entry(table_base, v);
 			} else {
 				/* Targets which reenter must return
                                    abs. verdicts */
-#ifdef CONFIG_NETFILTER_DEBUG
-				((struct ipt_entry *)table_base)->comefrom
-					= 0xeeeeeeec;
-#endif
 				verdict = t->u.kernel.target->target(pskb,
 								     in, out,
 								     hook,
 								     t->u.kernel.target,
 								     t->data);
 
-#ifdef CONFIG_NETFILTER_DEBUG
-				if (((struct ipt_entry *)table_base)->comefrom
-				    != 0xeeeeeeec
-				    && verdict == IPT_CONTINUE) {
-					printk("Target %s reentered!\n",
-					       t->u.kernel.target->name);
-					verdict = NF_DROP;
-				}
-				((struct ipt_entry *)table_base)->comefrom
-					= 0x57acc001;
-#endif
 				/* Target might have changed stuff. */
 				ip = (*pskb)->nh.iph;
 				datalen = (*pskb)->len - ip->ihl * 4;
+				clf_state.run = NULL;
 
 				if (verdict == IPT_CONTINUE)
 					e = (void *)e + e->next_offset;
@@ -336,7 +500,9 @@ ipt_do_table(struct sk_buff **pskb,
 		}
 	} while (!hotdrop);
 
-	read_unlock_bh(&table->lock);
+	*stackptr = origptr;
+	xt_write_recseq_end(addend);
+	rcu_read_unlock_bh();
 
 #ifdef DEBUG_ALLOW_ALL
 	return NF_ACCEPT;
@@ -679,6 +845,242 @@ cleanup_entry(struct ipt_entry *e, unsigned int *i)
 	return 0;
 }
 
+/* Give each rule its number, which indexes its per-CPU counters, and
+ * count the chains, which bounds the depth of the jump stack. */
+static inline int
+index_entry(struct ipt_entry *e, struct xt_table_info *newinfo,
+	    unsigned int *i)
+{
+	struct ipt_entry_target *t = ipt_get_target(e);
+
+	e->counters.pcnt = (*i)++;
+	e->counters.bcnt = 0;
+	if (strcmp(t->u.kernel.target->name, IPT_ERROR_TARGET) == 0)
+		newinfo->stacksize++;
+	return 0;
+}
+
+static int
+index_entries(struct xt_table_info *newinfo, void *entry0)
+{
+	unsigned int i = 0;
+
+	newinfo->stacksize = 0;
+	IPT_ENTRY_ITERATE(entry0, newinfo->size, index_entry, newinfo, &i);
+	return xt_alloc_table_percpu(newinfo);
+}
+
+/* What the classifier needs to know about each rule while compiling. */
+struct ipt_clf_rule {
+	unsigned int offset;
+	__be32 src, dst, smsk, dmsk;
+	u_int8_t proto, pmsk;
+	unsigned int tuple;
+	unsigned int run;
+};
+
+static void *ipt_clf_alloc(unsigned int size)
+{
+	if (size <= PAGE_SIZE)
+		return kmalloc(size, GFP_KERNEL);
+	return vmalloc(size);
+}
+
+static void ipt_clf_release(void *p, unsigned int size)
+{
+	if (size <= PAGE_SIZE)
+		kfree(p);
+	else
+		vfree(p);
+}
+
+static void ipt_clf_free(void *compiled)
+{
+	struct ipt_clf *clf = compiled;
+
+	ipt_clf_release(clf, clf->size);
+}
+
+/* Inverted address or protocol tests can match anything: wildcard them. */
+static inline int
+ipt_clf_get_rule(struct ipt_entry *e, void *entry0,
+		 struct ipt_clf_rule *rules, unsigned int *i)
+{
+	const struct ipt_ip *ip = &e->ip;
+	struct ipt_clf_rule *r = &rules[(*i)++];
+
+	memset(r, 0, sizeof(*r));
+	r->offset = (void *)e - entry0;
+	if (!(ip->invflags & IPT_INV_SRCIP)) {
+		r->src = ip->src.s_addr;
+		r->smsk = ip->smsk.s_addr;
+	}
+	if (!(ip->invflags & IPT_INV_DSTIP)) {
+		r->dst = ip->dst.s_addr;
+		r->dmsk = ip->dmsk.s_addr;
+	}
+	if (ip->proto && !(ip->invflags & IPT_INV_PROTO)) {
+		r->proto = ip->proto;
+		r->pmsk = 0xFF;
+	}
+	return 0;
+}
+
+static inline int
+ipt_clf_same_tuple(const struct ipt_clf_rule *a, const struct ipt_clf_rule *b)
+{
+	return a->smsk == b->smsk && a->dmsk == b->dmsk && a->pmsk == b->pmsk;
+}
+
+/*
+ * Compile @newinfo for ipt_do_table().  This is purely an optimisation:
+ * if memory is short the table is simply walked linearly.
+ */
+static void ipt_clf_build(struct xt_table_info *newinfo, void *entry0)
+{
+	unsigned int number = newinfo->number;
+	unsigned int rep[IPT_CLF_MAX_TUPLES], count[IPT_CLF_MAX_TUPLES];
+	unsigned int i, j, k, n, h, nruns, nnodes, nbuckets, rsize, size;
+	struct ipt_clf_rule *rules, *r;
+	struct ipt_clf_node *node, *nd;
+	struct ipt_clf_tuple *t;
+	struct ipt_clf_run *run;
+	struct ipt_clf *clf;
+	unsigned int *bucket;
+
+	if (!compile_min_rules || number <= compile_min_rules)
+		return;
+
+	rsize = number * sizeof(*rules);
+	rules = ipt_clf_alloc(rsize);
+	if (!rules)
+		return;
+	i = 0;
+	IPT_ENTRY_ITERATE(entry0, newinfo->size, ipt_clf_get_rule,
+			  entry0, rules, &i);
+
+	/* Cut the rules into runs of at most IPT_CLF_MAX_TUPLES mask
+	 * groups.  The last rule stays out, so a run is always followed
+	 * by one. */
+	nruns = nnodes = nbuckets = 0;
+	for (i = 0; i < number - 1; i = j) {
+		n = 0;
+		for (j = i; j < number - 1; j++) {
+			for (k = 0; k < n; k++)
+				if (ipt_clf_same_tuple(&rules[rep[k]], &rules[j]))
+					break;
+			if (k == n) {
+				if (n == IPT_CLF_MAX_TUPLES)
+					break;
+				rep[n] = j;
+				count[n++] = 0;
+			}
+			rules[j].tuple = k;
+			count[k]++;
+		}
+		if (j - i < compile_min_rules) {
+			for (k = i; k < j; k++)
+				rules[k].run = IPT_CLF_NORUN;
+			continue;
+		}
+		for (k = i; k < j; k++)
+			rules[k].run = nruns;
+		for (k = 0; k < n; k++)
+			nbuckets += roundup_pow_of_two(count[k]) + 1;
+		nnodes += j - i;
+		nruns++;
+	}
+	rules[number - 1].run = IPT_CLF_NORUN;
+	if (!nruns)
+		goto out;
+
+	size = sizeof(*clf) + nruns * sizeof(*run) + nnodes * sizeof(*node)
+		+ (2 * number + nbuckets) * sizeof(unsigned int);
+	clf = ipt_clf_alloc(size);
+	if (!clf)
+		goto out;
+
+	clf->size = size;
+	clf->nrules = number;
+	clf->runs = (void *)(clf + 1);
+	node = (void *)(clf->runs + nruns);
+	clf->offset = (void *)(node + nnodes);
+	clf->run = clf->offset + number;
+	bucket = clf->run + number;
+
+	for (i = 0; i < number; i++) {
+		clf->offset[i] = rules[i].offset;
+		clf->run[i] = rules[i].run;
+	}
+
+	for (i = 0; i < number; i = j) {
+		for (j = i + 1; j < number && rules[j].run == rules[i].run; j++)
+			;
+		if (rules[i].run == IPT_CLF_NORUN)
+			continue;
+
+		run = &clf->runs[rules[i].run];
+		run->first = i;
+		run->last = j - 1;
+		run->ntuples = 0;
+		for (k = i; k < j; k++) {
+			r = &rules[k];
+			if (r->tuple == run->ntuples) {
+				t = &run->tuple[run->ntuples++];
+				t->smsk = r->smsk;
+				t->dmsk = r->dmsk;
+				t->pmsk = r->pmsk;
+				count[r->tuple] = 0;
+			}
+			count[r->tuple]++;
+		}
+		for (k = 0; k < run->ntuples; k++) {
+			t = &run->tuple[k];
+			t->hmask = roundup_pow_of_two(count[k]) - 1;
+			t->bucket = bucket;
+			bucket += t->hmask + 2;
+			t->node = node;
+			node += count[k];
+			memset(t->bucket, 0, (t->hmask + 2) * sizeof(unsigned int));
+		}
+
+		/* Counting sort into the buckets, keeping rule order. */
+		for (k = i; k < j; k++) {
+			r = &rules[k];
+			t = &run->tuple[r->tuple];
+			h = ipt_clf_hash(r->src, r->dst, r->proto, t->hmask);
+			t->bucket[h + 1]++;
+		}
+		for (k = 0; k < run->ntuples; k++) {
+			t = &run->tuple[k];
+			for (h = 1; h <= t->hmask + 1; h++)
+				t->bucket[h] += t->bucket[h - 1];
+		}
+		for (k = i; k < j; k++) {
+			r = &rules[k];
+			t = &run->tuple[r->tuple];
+			h = ipt_clf_hash(r->src, r->dst, r->proto, t->hmask);
+			nd = &t->node[t->bucket[h]++];
+			nd->src = r->src;
+			nd->dst = r->dst;
+			nd->proto = r->proto;
+			nd->rule = k;
+		}
+		/* Each bucket[h] now holds the start of h + 1: shift back. */
+		for (k = 0; k < run->ntuples; k++) {
+			t = &run->tuple[k];
+			for (h = t->hmask; h > 0; h--)
+				t->bucket[h] = t->bucket[h - 1];
+			t->bucket[0] = 0;
+		}
+	}
+
+	newinfo->compiled = clf;
+	newinfo->free_compiled = ipt_clf_free;
+out:
+	ipt_clf_release(rules, rsize);
+}
+
 /* Checks and translates the user-supplied table segment (held in
    newinfo) */
 static int
@@ -752,70 +1154,16 @@ translate_table(const char *name,
 		return ret;
 	}
 
-	/* And one copy for every other CPU */
-	for_each_possible_cpu(i) {
-		if (newinfo->entries[i] && newinfo->entries[i] != entry0)
-			memcpy(newinfo->entries[i], entry0, newinfo->size);
+	ret = index_entries(newinfo, entry0);
+	if (ret != 0) {
+		IPT_ENTRY_ITERATE(entry0, newinfo->size,
+				cleanup_entry, NULL);
+		return ret;
 	}
 
-	return ret;
-}
-
-/* Gets counters. */
-static inline int
-add_entry_to_counter(const struct ipt_entry *e,
-		     struct xt_counters total[],
-		     unsigned int *i)
-{
-	ADD_COUNTER(total[*i], e->counters.bcnt, e->counters.pcnt);
-
-	(*i)++;
-	return 0;
-}
-
-static inline int
-set_entry_to_counter(const struct ipt_entry *e,
-		     struct ipt_counters total[],
-		     unsigned int *i)
-{
-	SET_COUNTER(total[*i], e->counters.bcnt, e->counters.pcnt);
-
-	(*i)++;
-	return 0;
-}
-
-static void
-get_counters(const struct xt_table_info *t,
-	     struct xt_counters counters[])
-{
-	unsigned int cpu;
-	unsigned int i;
-	unsigned int curcpu;
-
-	/* Instead of clearing (by a previous call to memset())
-	 * the counters and using adds, we set the counters
-	 * with data used by 'current' CPU
-	 * We dont care about preemption here.
-	 */
-	curcpu = raw_smp_processor_id();
+	ipt_clf_build(newinfo, entry0);
 
-	i = 0;
-	IPT_ENTRY_ITERATE(t->entries[curcpu],
-			  t->size,
-			  set_entry_to_counter,
-			  counters,
-			  &i);
-
-	for_each_possible_cpu(cpu) {
-		if (cpu == curcpu)
-			continue;
-		i = 0;
-		IPT_ENTRY_ITERATE(t->entries[cpu],
-				  t->size,
-				  add_entry_to_counter,
-				  counters,
-				  &i);
-	}
+	return ret;
 }
 
 static inline struct xt_counters * alloc_counters(struct ipt_table *table)
@@ -824,19 +1172,15 @@ static inline struct xt_counters * alloc_counters(struct ipt_table *table)
 	struct xt_counters *counters;
 	struct xt_table_info *private = table->private;
 
-	/* We need atomic snapshot of counters: rest doesn't change
-	   (other than comefrom, which userspace doesn't care
-	   about). */
+	/* The rules don't change under the table mutex, and the
+	   counters are snapshotted per CPU without stopping packets. */
 	countersize = sizeof(struct xt_counters) * private->number;
 	counters = vmalloc_node(countersize, numa_node_id());
 
 	if (counters == NULL)
 		return ERR_PTR(-ENOMEM);
 
-	/* First, sum counters... */
-	write_lock_bh(&table->lock);
-	get_counters(private, counters);
-	write_unlock_bh(&table->lock);
+	xt_get_counters(private, counters);
 
 	return counters;
 }
@@ -857,11 +1201,7 @@ copy_entries_to_user(unsigned int total_size,
 	if (IS_ERR(counters))
 		return PTR_ERR(counters);
 
-	/* choose the copy that is on our node/cpu, ...
-	 * This choice is lazy (because current thread is
-	 * allowed to migrate to another cpu)
-	 */
-	loc_cpu_entry = private->entries[raw_smp_processor_id()];
+	loc_cpu_entry = private->entries;
 	/* ... then copy entire thing ... */
 	if (copy_to_user(userptr, loc_cpu_entry, total_size) != 0) {
 		ret = -EFAULT;
@@ -1037,7 +1377,7 @@ static int compat_table_info(struct xt_table_info *info,
 		newinfo->hook_entry[i] = info->hook_entry[i];
 		newinfo->underflow[i] = info->underflow[i];
 	}
-	loc_cpu_entry = info->entries[raw_smp_processor_id()];
+	loc_cpu_entry = info->entries;
 	return IPT_ENTRY_ITERATE(loc_cpu_entry, info->size,
 			compat_calc_entry, info, loc_cpu_entry, newinfo);
 }
@@ -1181,6 +1521,7 @@ __do_replace(const char *name, unsigned int valid_hooks,
 	oldinfo = xt_replace_table(t, num_counters, newinfo, &ret);
 	if (!oldinfo)
 		goto put_module;
+	ipt_table_gen++;
 
 	/* Update module usage count based on number of rules */
 	duprintf("do_replace: oldnum=%u, initnum=%u, newnum=%u\n",
@@ -1193,9 +1534,9 @@ __do_replace(const char *name, unsigned int valid_hooks,
 		module_put(t->me);
 
 	/* Get the old counters. */
-	get_counters(oldinfo, counters);
+	xt_get_counters(oldinfo, counters);
 	/* Decrease module usage counts and free resource */
-	loc_cpu_old_entry = oldinfo->entries[raw_smp_processor_id()];
+	loc_cpu_old_entry = oldinfo->entries;
 	IPT_ENTRY_ITERATE(loc_cpu_old_entry, oldinfo->size, cleanup_entry,NULL);
 	xt_free_table_info(oldinfo);
 	if (copy_to_user(counters_ptr, counters,
@@ -1240,8 +1581,7 @@ do_replace(void __user *user, unsigned int len)
 	if (!newinfo)
 		return -ENOMEM;
 
-	/* choose the copy that is our node/cpu */
-	loc_cpu_entry = newinfo->entries[raw_smp_processor_id()];
+	loc_cpu_entry = newinfo->entries;
 	if (copy_from_user(loc_cpu_entry, user + sizeof(tmp),
 			   tmp.size) != 0) {
 		ret = -EFAULT;
@@ -1270,32 +1610,9 @@ do_replace(void __user *user, unsigned int len)
 	return ret;
 }
 
-/* We're lazy, and add to the first CPU; overflow works its fey magic
- * and everything is OK. */
-static inline int
-add_counter_to_entry(struct ipt_entry *e,
-		     const struct xt_counters addme[],
-		     unsigned int *i)
-{
-#if 0
-	duprintf("add_counter: Entry %u %lu/%lu + %lu/%lu\n",
-		 *i,
-		 (long unsigned int)e->counters.pcnt,
-		 (long unsigned int)e->counters.bcnt,
-		 (long unsigned int)addme[*i].pcnt,
-		 (long unsigned int)addme[*i].bcnt);
-#endif
-
-	ADD_COUNTER(e->counters, addme[*i].bcnt, addme[*i].pcnt);
-
-	(*i)++;
-	return 0;
-}
-
 static int
 do_add_counters(void __user *user, unsigned int len, int compat)
 {
-	unsigned int i;
 	struct xt_counters_info tmp;
 	struct xt_counters *paddc;
 	unsigned int num_counters;
@@ -1305,7 +1622,6 @@ do_add_counters(void __user *user, unsigned int len, int compat)
 	struct ipt_table *t;
 	struct xt_table_info *private;
 	int ret = 0;
-	void *loc_cpu_entry;
 #ifdef CONFIG_COMPAT
 	struct compat_xt_counters_info compat_tmp;
 
@@ -1351,23 +1667,14 @@ do_add_counters(void __user *user, unsigned int len, int compat)
 		goto free;
 	}
 
-	write_lock_bh(&t->lock);
 	private = t->private;
 	if (private->number != num_counters) {
 		ret = -EINVAL;
 		goto unlock_up_free;
 	}
 
-	i = 0;
-	/* Choose the copy that is on our node */
-	loc_cpu_entry = private->entries[raw_smp_processor_id()];
-	IPT_ENTRY_ITERATE(loc_cpu_entry,
-			  private->size,
-			  add_counter_to_entry,
-			  paddc,
-			  &i);
+	xt_add_counters(private, paddc);
  unlock_up_free:
-	write_unlock_bh(&t->lock);
 	xt_table_unlock(t);
 	module_put(t->me);
  free:
@@ -1664,7 +1971,7 @@ translate_compat_table(const char *name,
 		newinfo->hook_entry[i] = info->hook_entry[i];
 		newinfo->underflow[i] = info->underflow[i];
 	}
-	entry1 = newinfo->entries[raw_smp_processor_id()];
+	entry1 = newinfo->entries;
 	pos = entry1;
 	size =  total_size;
 	ret = IPT_ENTRY_ITERATE(entry0, total_size,
@@ -1679,15 +1986,16 @@ translate_compat_table(const char *name,
 	if (!mark_source_chains(newinfo, valid_hooks, entry1))
 		goto free_newinfo;
 
+	ret = index_entries(newinfo, entry1);
+	if (ret)
+		goto free_newinfo;
+
 	ret = IPT_ENTRY_ITERATE(entry1, newinfo->size, compat_check_entry,
 									name);
 	if (ret)
 		goto free_newinfo;
 
-	/* And one copy for every other CPU */
-	for_each_possible_cpu(i)
-		if (newinfo->entries[i] && newinfo->entries[i] != entry1)
-			memcpy(newinfo->entries[i], entry1, newinfo->size);
+	ipt_clf_build(newinfo, entry1);
 
 	*pinfo = newinfo;
 	*pentry0 = entry1;
@@ -1731,8 +2039,7 @@ compat_do_replace(void __user *user, unsigned int len)
 	if (!newinfo)
 		return -ENOMEM;
 
-	/* choose the copy that is our node/cpu */
-	loc_cpu_entry = newinfo->entries[raw_smp_processor_id()];
+	loc_cpu_entry = newinfo->entries;
 	if (copy_from_user(loc_cpu_entry, user + sizeof(tmp),
 			   tmp.size) != 0) {
 		ret = -EFAULT;
@@ -1810,11 +2117,7 @@ static int compat_copy_entries_to_user(unsigned int total_size,
 	if (IS_ERR(counters))
 		return PTR_ERR(counters);
 
-	/* choose the copy that is on our node/cpu, ...
-	 * This choice is lazy (because current thread is
-	 * allowed to migrate to another cpu)
-	 */
-	loc_cpu_entry = private->entries[raw_smp_processor_id()];
+	loc_cpu_entry = private->entries;
 	pos = userptr;
 	size = total_size;
 	ret = IPT_ENTRY_ITERATE(loc_cpu_entry, total_size,
@@ -2020,17 +2323,14 @@ int ipt_register_table(struct xt_table *table, const struct ipt_replace *repl)
 	int ret;
 	struct xt_table_info *newinfo;
 	static struct xt_table_info bootstrap
-		= { 0, 0, 0, { 0 }, { 0 }, { } };
+		= { 0, 0, 0, { 0 }, { 0 } };
 	void *loc_cpu_entry;
 
 	newinfo = xt_alloc_table_info(repl->size);
 	if (!newinfo)
 		return -ENOMEM;
 
-	/* choose the copy on our node/cpu
-	 * but dont care of preemption
-	 */
-	loc_cpu_entry = newinfo->entries[raw_smp_processor_id()];
+	loc_cpu_entry = newinfo->entries;
 	memcpy(loc_cpu_entry, repl->entries, repl->size);
 
 	ret = translate_table(table->name, table->valid_hooks,
@@ -2048,6 +2348,7 @@ int ipt_register_table(struct xt_table *table, const struct ipt_replace *repl)
 		xt_free_table_info(newinfo);
 		return ret;
 	}
+	ipt_table_gen++;
 
 	return 0;
 }
@@ -2060,7 +2361,7 @@ void ipt_unregister_table(struct ipt_table *table)
  	private = xt_unregister_table(table);
 
 	/* Decrease module usage counts and free resources */
-	loc_cpu_entry = private->entries[raw_smp_processor_id()];
+	loc_cpu_entry = private->entries;
 	IPT_ENTRY_ITERATE(loc_cpu_entry, private->size, cleanup_entry, NULL);
 	xt_free_table_info(private);
 }
@@ -2220,5 +2521,6 @@ static void __exit ip_tables_fini(void)
 EXPORT_SYMBOL(ipt_register_table);
 EXPORT_SYMBOL(ipt_unregister_table);
 EXPORT_SYMBOL(ipt_do_table);
+EXPORT_SYMBOL_GPL(ipt_table_gen);
 module_init(ip_tables_init);
 module_exit(ip_tables_fini);
@@ -38,38 +38,43 @@ seq_print_counters(struct seq_file *s,
 #endif
 
 struct ct_iter_state {
+	struct hlist_head *hash;
+	unsigned int htable_size;
 	unsigned int bucket;
 };
 
-static struct list_head *ct_get_first(struct seq_file *seq)
+static struct hlist_node *ct_get_first(struct seq_file *seq)
 {
 	struct ct_iter_state *st = seq->private;
+	struct hlist_node *n;
 
 	for (st->bucket = 0;
-	     st->bucket < nf_conntrack_htable_size;
+	     st->bucket < st->htable_size;
 	     st->bucket++) {
-		if (!list_empty(&nf_conntrack_hash[st->bucket]))
-			return nf_conntrack_hash[st->bucket].next;
+		n = rcu_dereference(st->hash[st->bucket].first);
+		if (n)
+			return n;
 	}
 	return NULL;
 }
 
-static struct list_head *ct_get_next(struct seq_file *seq, struct list_head *head)
+static struct hlist_node *ct_get_next(struct seq_file *seq,
+				      struct hlist_node *head)
 {
 	struct ct_iter_state *st = seq->private;
 
-	head = head->next;
-	while (head == &nf_conntrack_hash[st->bucket]) {
-		if (++st->bucket >= nf_conntrack_htable_size)
+	head = rcu_dereference(head->next);
+	while (head == NULL) {
+		if (++st->bucket >= st->htable_size)
 			return NULL;
-		head = nf_conntrack_hash[st->bucket].next;
+		head = rcu_dereference(st->hash[st->bucket].first);
 	}
 	return head;
 }
 
-static struct list_head *ct_get_idx(struct seq_file *seq, loff_t pos)
+static struct hlist_node *ct_get_idx(struct seq_file *seq, loff_t pos)
 {
-	struct list_head *head = ct_get_first(seq);
+	struct hlist_node *head = ct_get_first(seq);
 
 	if (head)
 		while (pos && (head = ct_get_next(seq, head)))
@@ -79,7 +84,11 @@ static struct list_head *ct_get_idx(struct seq_file *seq, loff_t pos)
 
 static void *ct_seq_start(struct seq_file *seq, loff_t *pos)
 {
-	read_lock_bh(&nf_conntrack_lock);
+	struct ct_iter_state *st = seq->private;
+
+	mutex_lock(&nf_conntrack_hash_mutex);
+	rcu_read_lock();
+	st->hash = nf_conntrack_get_ht(&st->htable_size);
 	return ct_get_idx(seq, *pos);
 }
 
@@ -91,12 +100,14 @@ static void *ct_seq_next(struct seq_file *s, void *v, loff_t *pos)
 
 static void ct_seq_stop(struct seq_file *s, void *v)
 {
-	read_unlock_bh(&nf_conntrack_lock);
+	rcu_read_unlock();
+	mutex_unlock(&nf_conntrack_hash_mutex);
 }
 
 static int ct_seq_show(struct seq_file *s, void *v)
 {
-	const struct nf_conntrack_tuple_hash *hash = v;
+	const struct nf_conntrack_tuple_hash *hash =
+		hlist_entry(v, struct nf_conntrack_tuple_hash, hnode);
 	const struct nf_conn *ct = nf_ct_tuplehash_to_ctrack(hash);
 	struct nf_conntrack_l3proto *l3proto;
 	struct nf_conntrack_l4proto *l4proto;
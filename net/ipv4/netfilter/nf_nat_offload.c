@@ -0,0 +1,634 @@
+/* NAT fast path for established flows.
+ *
+ * Once a forwarded TCP or UDP connection is assured, the NAT rewrite and
+ * output route of each direction are cached in a small flow entry.  A
+ * hook at the very start of PRE_ROUTING looks packets up in the flow
+ * table and, on a hit, rewrites addresses and ports, decrements the TTL
+ * and hands the packet to the neighbour layer: conntrack, NAT, routing
+ * and the FORWARD and POST_ROUTING hooks are all skipped.
+ *
+ * A TCP FIN, RST or SYN, a route change, new iptables rules, an IPsec
+ * packet or a flow going idle sends the connection back to the slow
+ * path.  While a flow is cached, its conntrack timeout is refreshed
+ * from the flow table.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <linux/module.h>
+#include <linux/types.h>
+#include <linux/timer.h>
+#include <linux/skbuff.h>
+#include <linux/netdevice.h>
+#include <linux/ip.h>
+#include <linux/tcp.h>
+#include <linux/udp.h>
+#include <linux/jhash.h>
+#include <linux/random.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/rcupdate.h>
+#include <net/ip.h>
+#include <net/route.h>
+#include <net/neighbour.h>
+#include <net/checksum.h>
+
+#include <linux/netfilter.h>
+#include <linux/netfilter_ipv4.h>
+#include <linux/netfilter_ipv4/ip_tables.h>
+#include <net/netfilter/nf_conntrack.h>
+#include <net/netfilter/nf_conntrack_core.h>
+
+#if 0
+#define DEBUGP printk
+#else
+#define DEBUGP(format, args...)
+#endif
+
+static unsigned int nf_nat_flow_hashsize __read_mostly = 16384;
+module_param_named(hashsize, nf_nat_flow_hashsize, uint, 0400);
+MODULE_PARM_DESC(hashsize, "number of flow table buckets");
+
+static unsigned int nf_nat_flow_max __read_mostly = 65536;
+module_param_named(max_flows, nf_nat_flow_max, uint, 0600);
+MODULE_PARM_DESC(max_flows, "maximum number of cached flows");
+
+static unsigned int nf_nat_flow_timeout __read_mostly = 30;
+module_param_named(timeout, nf_nat_flow_timeout, uint, 0600);
+MODULE_PARM_DESC(timeout, "seconds an idle flow stays cached");
+
+/* The packet header of one direction, as it arrives */
+struct nf_nat_flow_tuple {
+	__be32 src;
+	__be32 dst;
+	__be16 sport;
+	__be16 dport;
+	u_int8_t protonum;
+};
+
+struct nf_nat_flow_dir {
+	struct hlist_node hnode;
+	struct nf_nat_flow_tuple tuple;
+
+	/* The header as it leaves */
+	__be32 new_src;
+	__be32 new_dst;
+	__be16 new_sport;
+	__be16 new_dport;
+
+	/* The forwarding decision: only packets from the same device with
+	 * the same TOS take the cached route. */
+	int iif;
+	u_int8_t tos;
+	u_int8_t dirnum;
+	struct dst_entry *dst;		/* NULL until this direction is cached */
+
+	unsigned long packets;
+	unsigned long bytes;
+};
+
+struct nf_nat_flow {
+	struct nf_nat_flow_dir dir[IP_CT_DIR_MAX];
+	struct nf_conn *ct;		/* holds a reference */
+	unsigned long ct_timeout;	/* what conntrack refreshes by */
+	unsigned long last;		/* jiffies of the last fast packet */
+	unsigned long refreshed;	/* last time the conntrack was refreshed */
+	unsigned int table_gen;		/* ipt_table_gen when cached */
+	int teardown;			/* back to the slow path */
+	int unhashed;
+	struct rcu_head rcu;
+};
+
+static struct hlist_head *nf_nat_flow_hash __read_mostly;
+static int nf_nat_flow_vmalloced;
+static u_int32_t nf_nat_flow_rnd __read_mostly;
+static DEFINE_SPINLOCK(nf_nat_flow_lock);
+static atomic_t nf_nat_flow_count = ATOMIC_INIT(0);
+static struct kmem_cache *nf_nat_flow_cachep __read_mostly;
+static struct timer_list nf_nat_flow_gc_timer;
+
+static inline struct nf_nat_flow *
+dir_to_flow(struct nf_nat_flow_dir *d)
+{
+	return container_of(d - d->dirnum, struct nf_nat_flow, dir[0]);
+}
+
+static inline unsigned int
+hash_tuple(const struct nf_nat_flow_tuple *t)
+{
+	return jhash_3words((__force u32)t->src, (__force u32)t->dst,
+			    ((__force u32)t->sport << 16 |
+			     (__force u32)t->dport) ^ t->protonum,
+			    nf_nat_flow_rnd) % nf_nat_flow_hashsize;
+}
+
+static inline int
+tuple_equal(const struct nf_nat_flow_tuple *a,
+	    const struct nf_nat_flow_tuple *b)
+{
+	return a->src == b->src && a->dst == b->dst &&
+	       a->sport == b->sport && a->dport == b->dport &&
+	       a->protonum == b->protonum;
+}
+
+/* Caller holds rcu_read_lock() or nf_nat_flow_lock */
+static struct nf_nat_flow_dir *
+nf_nat_flow_find(const struct nf_nat_flow_tuple *t)
+{
+	struct nf_nat_flow_dir *d;
+	struct hlist_node *n;
+
+	hlist_for_each_entry_rcu(d, n, &nf_nat_flow_hash[hash_tuple(t)],
+				 hnode) {
+		if (tuple_equal(&d->tuple, t))
+			return d;
+	}
+	return NULL;
+}
+
+static void nf_nat_flow_free_rcu(struct rcu_head *head)
+{
+	struct nf_nat_flow *flow = container_of(head, struct nf_nat_flow, rcu);
+	int i;
+
+	for (i = 0; i < IP_CT_DIR_MAX; i++)
+		dst_release(flow->dir[i].dst);
+	nf_ct_put(flow->ct);
+	kmem_cache_free(nf_nat_flow_cachep, flow);
+	atomic_dec(&nf_nat_flow_count);
+}
+
+/* Hand the accumulated traffic to conntrack: keep it alive for as long
+ * as it would have been had it seen the packets itself. */
+static void nf_nat_flow_sync(struct nf_nat_flow *flow)
+{
+	struct nf_conn *ct = flow->ct;
+	unsigned long last = flow->last;
+
+	if (time_after(last, flow->refreshed) &&
+	    jiffies - last < flow->ct_timeout) {
+		flow->refreshed = last;
+		nf_ct_refresh(ct, NULL, flow->ct_timeout - (jiffies - last));
+	}
+#ifdef CONFIG_NF_CT_ACCT
+	{
+		int i;
+
+		spin_lock_bh(&ct->lock);
+		for (i = 0; i < IP_CT_DIR_MAX; i++) {
+			ct->counters[i].packets += flow->dir[i].packets;
+			ct->counters[i].bytes += flow->dir[i].bytes;
+			flow->dir[i].packets = 0;
+			flow->dir[i].bytes = 0;
+		}
+		spin_unlock_bh(&ct->lock);
+	}
+#endif
+}
+
+/* Caller holds nf_nat_flow_lock */
+static void nf_nat_flow_unhash(struct nf_nat_flow *flow)
+{
+	int i;
+
+	flow->unhashed = 1;
+	for (i = 0; i < IP_CT_DIR_MAX; i++)
+		if (flow->dir[i].dst)
+			hlist_del_rcu(&flow->dir[i].hnode);
+	nf_nat_flow_sync(flow);
+	call_rcu(&flow->rcu, nf_nat_flow_free_rcu);
+}
+
+static int nf_nat_flow_expired(struct nf_nat_flow *flow)
+{
+	int i;
+
+	if (flow->teardown || flow->table_gen != ipt_table_gen ||
+	    nf_ct_is_dying(flow->ct) || !timer_pending(&flow->ct->timeout) ||
+	    time_after(jiffies, flow->last + nf_nat_flow_timeout * HZ))
+		return 1;
+	for (i = 0; i < IP_CT_DIR_MAX; i++)
+		if (flow->dir[i].dst && flow->dir[i].dst->obsolete > 0)
+			return 1;
+	return 0;
+}
+
+static void nf_nat_flow_gc(unsigned long all)
+{
+	struct nf_nat_flow_dir *d;
+	struct hlist_node *n, *next;
+	unsigned int i;
+
+	spin_lock_bh(&nf_nat_flow_lock);
+	for (i = 0; i < nf_nat_flow_hashsize; i++) {
+		hlist_for_each_entry_safe(d, n, next, &nf_nat_flow_hash[i],
+					  hnode) {
+			struct nf_nat_flow *flow = dir_to_flow(d);
+
+			if (flow->unhashed)
+				continue;
+			if (all || nf_nat_flow_expired(flow))
+				nf_nat_flow_unhash(flow);
+			else if (d->dirnum == IP_CT_DIR_ORIGINAL ||
+				 !flow->dir[IP_CT_DIR_ORIGINAL].dst)
+				nf_nat_flow_sync(flow);
+		}
+	}
+	spin_unlock_bh(&nf_nat_flow_lock);
+
+	if (!all)
+		mod_timer(&nf_nat_flow_gc_timer, jiffies + HZ);
+}
+
+static inline void
+flow_tuple_fill(struct nf_nat_flow_tuple *t, const struct nf_conn *ct,
+		enum ip_conntrack_dir dir)
+{
+	const struct nf_conntrack_tuple *ctt = &ct->tuplehash[dir].tuple;
+
+	t->src = ctt->src.u3.ip;
+	t->dst = ctt->dst.u3.ip;
+	t->sport = ctt->src.u.all;
+	t->dport = ctt->dst.u.all;
+	t->protonum = ctt->dst.protonum;
+}
+
+/* Can this connection bypass conntrack and NAT from now on? */
+static int nf_nat_flow_offloadable(const struct nf_conn *ct)
+{
+	const struct nf_conn_help *help = nfct_help(ct);
+
+	if (ct == &nf_conntrack_untracked ||
+	    !test_bit(IPS_ASSURED_BIT, &ct->status) ||
+	    !test_bit(IPS_CONFIRMED_BIT, &ct->status) ||
+	    test_bit(IPS_SEQ_ADJUST_BIT, &ct->status) ||
+	    test_bit(IPS_FIXED_TIMEOUT_BIT, &ct->status))
+		return 0;
+	if (help && help->helper)
+		return 0;
+	if (ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.l3num != AF_INET)
+		return 0;
+
+	switch (ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.dst.protonum) {
+	case IPPROTO_TCP:
+		return ct->proto.tcp.state == TCP_CONNTRACK_ESTABLISHED;
+	case IPPROTO_UDP:
+		return 1;
+	}
+	return 0;
+}
+
+/* POST_ROUTING, after NAT: the packet shows us where this direction
+ * of the connection goes, so cache it. */
+static unsigned int
+nf_nat_flow_offload(unsigned int hooknum,
+		    struct sk_buff **pskb,
+		    const struct net_device *in,
+		    const struct net_device *out,
+		    int (*okfn)(struct sk_buff *))
+{
+	struct sk_buff *skb = *pskb;
+	struct rtable *rt = (struct rtable *)skb->dst;
+	enum ip_conntrack_info ctinfo;
+	enum ip_conntrack_dir dir;
+	struct nf_conntrack_tuple *reply;
+	struct nf_nat_flow_tuple t, other;
+	struct nf_nat_flow_dir *d;
+	struct nf_nat_flow *flow;
+	struct nf_conn *ct;
+
+	ct = nf_ct_get(skb, &ctinfo);
+	if (ct == NULL || !nf_nat_flow_offloadable(ct))
+		return NF_ACCEPT;
+
+	/* Forwarded unicast only: local traffic has an output route */
+	if (rt == NULL || rt->fl.iif == 0 || rt->rt_type != RTN_UNICAST ||
+	    skb->nh.iph->ihl != 5)
+		return NF_ACCEPT;
+
+	/* An IPsec bundle: the transform comes after us, and the fast
+	 * path would send the packet out in clear. */
+	if (skb->dst->xfrm || skb->dst->output != ip_output)
+		return NF_ACCEPT;
+#ifdef CONFIG_XFRM
+	/* Came in over IPsec: only the slow path checks the policy */
+	if (skb->sp)
+		return NF_ACCEPT;
+#endif
+
+	dir = CTINFO2DIR(ctinfo);
+	flow_tuple_fill(&t, ct, dir);
+
+	rcu_read_lock();
+	d = nf_nat_flow_find(&t);
+	rcu_read_unlock();
+	if (d)
+		return NF_ACCEPT;
+
+	spin_lock_bh(&nf_nat_flow_lock);
+	if (nf_nat_flow_find(&t))
+		goto out;
+
+	flow_tuple_fill(&other, ct, !dir);
+	d = nf_nat_flow_find(&other);
+	if (d) {
+		flow = dir_to_flow(d);
+		if (flow->ct != ct || flow->teardown)
+			goto out;
+	} else {
+		if (atomic_read(&nf_nat_flow_count) >= nf_nat_flow_max)
+			goto out;
+		flow = kmem_cache_alloc(nf_nat_flow_cachep, GFP_ATOMIC);
+		if (flow == NULL)
+			goto out;
+		memset(flow, 0, sizeof(*flow));
+		flow->dir[IP_CT_DIR_ORIGINAL].dirnum = IP_CT_DIR_ORIGINAL;
+		flow->dir[IP_CT_DIR_REPLY].dirnum = IP_CT_DIR_REPLY;
+		nf_conntrack_get(&ct->ct_general);
+		flow->ct = ct;
+		/* conntrack has just been refreshed by this packet */
+		flow->ct_timeout = ct->timeout.expires - jiffies;
+		flow->last = flow->refreshed = jiffies;
+		flow->table_gen = ipt_table_gen;
+		atomic_inc(&nf_nat_flow_count);
+
+		/* Conntrack no longer sees every segment: don't let stale
+		 * windows mark the connection's packets invalid when it
+		 * returns to the slow path. */
+		if (t.protonum == IPPROTO_TCP)
+			nf_conntrack_tcp_be_liberal(ct);
+	}
+
+	d = &flow->dir[dir];
+	d->tuple = t;
+	reply = &ct->tuplehash[!dir].tuple;
+	d->new_src = reply->dst.u3.ip;
+	d->new_dst = reply->src.u3.ip;
+	d->new_sport = reply->dst.u.all;
+	d->new_dport = reply->src.u.all;
+	d->iif = rt->fl.iif;
+	d->tos = skb->nh.iph->tos;
+	d->dst = dst_clone(skb->dst);
+	hlist_add_head_rcu(&d->hnode, &nf_nat_flow_hash[hash_tuple(&t)]);
+
+	DEBUGP("nf_nat_offload: cached %u.%u.%u.%u:%u -> %u.%u.%u.%u:%u\n",
+	       NIPQUAD(t.src), ntohs(t.sport), NIPQUAD(t.dst), ntohs(t.dport));
+out:
+	spin_unlock_bh(&nf_nat_flow_lock);
+	return NF_ACCEPT;
+}
+
+static inline void
+nf_nat_flow_mangle(struct sk_buff *skb, struct iphdr *iph, __sum16 *check,
+		   __be16 *sport, __be16 *dport, const struct nf_nat_flow_dir *d)
+{
+	if (check) {
+		nf_proto_csum_replace4(check, skb, iph->saddr, d->new_src, 1);
+		nf_proto_csum_replace4(check, skb, iph->daddr, d->new_dst, 1);
+		nf_proto_csum_replace2(check, skb, *sport, d->new_sport, 0);
+		nf_proto_csum_replace2(check, skb, *dport, d->new_dport, 0);
+	}
+	nf_csum_replace4(&iph->check, iph->saddr, d->new_src);
+	nf_csum_replace4(&iph->check, iph->daddr, d->new_dst);
+	iph->saddr = d->new_src;
+	iph->daddr = d->new_dst;
+	*sport = d->new_sport;
+	*dport = d->new_dport;
+}
+
+/* What ip_finish_output2 does, less the hooks already passed */
+static int nf_nat_flow_xmit(struct sk_buff *skb)
+{
+	struct dst_entry *dst = skb->dst;
+	struct net_device *dev = dst->dev;
+
+	if (unlikely(skb_headroom(skb) < LL_RESERVED_SPACE(dev) &&
+		     dev->hard_header)) {
+		struct sk_buff *skb2;
+
+		skb2 = skb_realloc_headroom(skb, LL_RESERVED_SPACE(dev));
+		kfree_skb(skb);
+		if (skb2 == NULL)
+			return -ENOMEM;
+		skb = skb2;
+	}
+
+	if (dst->hh)
+		return neigh_hh_output(dst->hh, skb);
+	else if (dst->neighbour)
+		return dst->neighbour->output(skb);
+
+	kfree_skb(skb);
+	return -EINVAL;
+}
+
+/* PRE_ROUTING, before defragmentation and conntrack */
+static unsigned int
+nf_nat_flow_in(unsigned int hooknum,
+	       struct sk_buff **pskb,
+	       const struct net_device *in,
+	       const struct net_device *out,
+	       int (*okfn)(struct sk_buff *))
+{
+	struct sk_buff *skb = *pskb;
+	struct iphdr *iph = skb->nh.iph;
+	unsigned int thoff = iph->ihl * 4;
+	struct nf_nat_flow_tuple t;
+	struct nf_nat_flow_dir *d;
+	struct nf_nat_flow *flow;
+	struct dst_entry *dst;
+	__sum16 *check;
+	__be16 *ports;
+	unsigned int hdrsize;
+
+	if (skb->nfct || skb->pkt_type != PACKET_HOST ||
+	    iph->ihl != 5 || iph->frag_off & htons(IP_MF|IP_OFFSET))
+		return NF_ACCEPT;
+#ifdef CONFIG_BRIDGE_NETFILTER
+	if (skb->nf_bridge)
+		return NF_ACCEPT;
+#endif
+
+	switch (iph->protocol) {
+	case IPPROTO_TCP:
+		hdrsize = sizeof(struct tcphdr);
+		break;
+	case IPPROTO_UDP:
+		hdrsize = sizeof(struct udphdr);
+		break;
+	default:
+		return NF_ACCEPT;
+	}
+	if (!pskb_may_pull(skb, thoff + hdrsize))
+		return NF_ACCEPT;
+	iph = skb->nh.iph;
+	ports = (__be16 *)(skb->data + thoff);
+
+	t.src = iph->saddr;
+	t.dst = iph->daddr;
+	t.sport = ports[0];
+	t.dport = ports[1];
+	t.protonum = iph->protocol;
+
+	rcu_read_lock();
+	d = nf_nat_flow_find(&t);
+	if (d == NULL)
+		goto slow;
+	flow = dir_to_flow(d);
+	dst = d->dst;
+#ifdef CONFIG_XFRM
+	/* The flow now comes in over IPsec: the policy check is ours to
+	 * skip no longer */
+	if (skb->sp) {
+		flow->teardown = 1;
+		goto slow;
+	}
+#endif
+	if (flow->teardown || flow->table_gen != ipt_table_gen) {
+		flow->teardown = 1;
+		goto slow;
+	}
+	if (d->iif != skb->dev->ifindex || d->tos != iph->tos)
+		goto slow;
+
+	if (iph->protocol == IPPROTO_TCP) {
+		struct tcphdr *th = (struct tcphdr *)ports;
+
+		if (th->fin || th->rst || th->syn) {
+			flow->teardown = 1;
+			goto slow;
+		}
+	}
+
+	/* Let the slow path send ICMP errors and fragment */
+	if (iph->ttl <= 1 || skb->len > dst_mtu(dst))
+		goto slow;
+	if (dst->obsolete > 0) {
+		flow->teardown = 1;
+		goto slow;
+	}
+
+	if (!skb_make_writable(pskb, thoff + hdrsize))
+		goto slow;
+	skb = *pskb;
+	iph = skb->nh.iph;
+	ports = (__be16 *)(skb->data + thoff);
+
+	if (iph->protocol == IPPROTO_TCP)
+		check = &((struct tcphdr *)ports)->check;
+	else {
+		check = &((struct udphdr *)ports)->check;
+		if (*check == 0 && skb->ip_summed != CHECKSUM_PARTIAL)
+			check = NULL;
+	}
+	nf_nat_flow_mangle(skb, iph, check, &ports[0], &ports[1], d);
+	if (check && iph->protocol == IPPROTO_UDP && *check == 0)
+		*check = CSUM_MANGLED_0;
+	ip_decrease_ttl(iph);
+
+	flow->last = jiffies;
+	d->packets++;
+	d->bytes += skb->len;
+
+	skb->priority = rt_tos2priority(iph->tos);
+	skb->dst = dst_clone(dst);
+	skb->dev = dst->dev;
+	skb->protocol = htons(ETH_P_IP);
+	rcu_read_unlock();
+
+	nf_nat_flow_xmit(skb);
+	return NF_STOLEN;
+
+slow:
+	rcu_read_unlock();
+	return NF_ACCEPT;
+}
+
+static struct nf_hook_ops nf_nat_flow_ops[] = {
+	{
+		.hook		= nf_nat_flow_in,
+		.owner		= THIS_MODULE,
+		.pf		= PF_INET,
+		.hooknum	= NF_IP_PRE_ROUTING,
+		.priority	= NF_IP_PRI_FIRST,
+	},
+	{
+		.hook		= nf_nat_flow_offload,
+		.owner		= THIS_MODULE,
+		.pf		= PF_INET,
+		.hooknum	= NF_IP_POST_ROUTING,
+		.priority	= NF_IP_PRI_LAST,
+	},
+};
+
+static int __init nf_nat_offload_init(void)
+{
+	size_t size;
+	unsigned int i;
+	int ret;
+
+	if (nf_nat_flow_hashsize == 0)
+		return -EINVAL;
+
+	nf_nat_flow_cachep = kmem_cache_create("nf_nat_flow",
+					       sizeof(struct nf_nat_flow),
+					       0, 0, NULL, NULL);
+	if (nf_nat_flow_cachep == NULL)
+		return -ENOMEM;
+
+	size = nf_nat_flow_hashsize * sizeof(struct hlist_head);
+	nf_nat_flow_hash = kmalloc(size, GFP_KERNEL);
+	if (nf_nat_flow_hash == NULL) {
+		nf_nat_flow_vmalloced = 1;
+		nf_nat_flow_hash = vmalloc(size);
+	}
+	if (nf_nat_flow_hash == NULL) {
+		ret = -ENOMEM;
+		goto cleanup_cache;
+	}
+	for (i = 0; i < nf_nat_flow_hashsize; i++)
+		INIT_HLIST_HEAD(&nf_nat_flow_hash[i]);
+	get_random_bytes(&nf_nat_flow_rnd, sizeof(nf_nat_flow_rnd));
+
+	setup_timer(&nf_nat_flow_gc_timer, nf_nat_flow_gc, 0);
+	mod_timer(&nf_nat_flow_gc_timer, jiffies + HZ);
+
+	ret = nf_register_hooks(nf_nat_flow_ops, ARRAY_SIZE(nf_nat_flow_ops));
+	if (ret < 0) {
+		printk(KERN_ERR "nf_nat_offload: can't register hooks.\n");
+		goto cleanup_hash;
+	}
+	return 0;
+
+cleanup_hash:
+	del_timer_sync(&nf_nat_flow_gc_timer);
+	if (nf_nat_flow_vmalloced)
+		vfree(nf_nat_flow_hash);
+	else
+		kfree(nf_nat_flow_hash);
+cleanup_cache:
+	kmem_cache_destroy(nf_nat_flow_cachep);
+	return ret;
+}
+
+static void __exit nf_nat_offload_fini(void)
+{
+	nf_unregister_hooks(nf_nat_flow_ops, ARRAY_SIZE(nf_nat_flow_ops));
+	del_timer_sync(&nf_nat_flow_gc_timer);
+	nf_nat_flow_gc(1);
+	rcu_barrier();
+
+	if (nf_nat_flow_vmalloced)
+		vfree(nf_nat_flow_hash);
+	else
+		kfree(nf_nat_flow_hash);
+	kmem_cache_destroy(nf_nat_flow_cachep);
+}
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("NAT fast path for established flows");
+
+module_init(nf_nat_offload_init);
+module_exit(nf_nat_offload_fini);
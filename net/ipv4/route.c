@@ -132,6 +132,7 @@ static int ip_rt_mtu_expires		= 10 * 60 * HZ;
 static int ip_rt_min_pmtu		= 512 + 20 + 20;
 static int ip_rt_min_advmss		= 256;
 static int ip_rt_secret_interval	= 10 * 60 * HZ;
+static int ip_rt_nocache		__read_mostly;
 static unsigned long rt_deadline;
 
 #define RTprint(a...)	printk(KERN_DEBUG a)
@@ -507,6 +508,89 @@ static __inline__ void rt_drop(struct rtable *rt)
 	call_rcu_bh(&rt->u.dst.rcu_head, dst_rcu_free);
 }
 
+/*
+ * Uncached routes.
+ *
+ * With ip_rt_nocache set nothing is entered into rt_hash_table; the
+ * route built by the slow path is handed to its user as a DST_NOCACHE
+ * entry that is freed on its last release.  Forwarded traffic instead
+ * reuses one such entry per FIB nexthop (fib_nh->nh_rth_input), so its
+ * cost no longer depends on the number of flows.  An on-link nexthop
+ * reaches each host through that host's own neighbour, so it keeps one
+ * entry per destination in a small table (fib_nh->nh_rth_onlink).
+ *
+ * Uncached routes sit on a per-CPU rt_uncached_list only so that they
+ * can give up a device that is going away; rt_genid, bumped by every
+ * cache flush, tells their holders (via ipv4_dst_check) when to look
+ * again.  The list is the one of the CPU that built the route, and the
+ * route remembers it for its removal.
+ */
+static atomic_t rt_genid = ATOMIC_INIT(0);
+
+struct rt_uncached_list {
+	spinlock_t		lock;
+	struct list_head	head;
+};
+
+static DEFINE_PER_CPU(struct rt_uncached_list, rt_uncached_list);
+
+static int rt_set_nocache(struct rtable *rt, struct rtable **rp)
+{
+	struct rt_uncached_list *ul;
+
+	/* Same binding rule as rt_intern_hash(). */
+	if (rt->rt_type == RTN_UNICAST || rt->fl.iif == 0) {
+		int err = arp_bind_neighbour(&rt->u.dst);
+		if (err) {
+			if (err == -ENOBUFS && net_ratelimit())
+				printk(KERN_WARNING "Neighbour table overflow.\n");
+			rt_drop(rt);
+			return err;
+		}
+	}
+
+	rt->rt_genid = atomic_read(&rt_genid);
+	rt->u.dst.obsolete = -1;
+	rt->u.dst.flags |= DST_NOCACHE;
+
+	ul = &per_cpu(rt_uncached_list, raw_smp_processor_id());
+	rt->rt_uncached_list = ul;
+	spin_lock_bh(&ul->lock);
+	list_add_tail(&rt->rt_uncached, &ul->head);
+	spin_unlock_bh(&ul->lock);
+
+	*rp = rt;
+	return 0;
+}
+
+static inline int rt_nocache_valid(struct rtable *rt)
+{
+	return rt->rt_genid == atomic_read(&rt_genid) &&
+	       (!rt->u.dst.expires || time_before(jiffies, rt->u.dst.expires));
+}
+
+void rt_flush_dev(struct net_device *dev)
+{
+	struct rt_uncached_list *ul;
+	struct rtable *rt;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		ul = &per_cpu(rt_uncached_list, cpu);
+		spin_lock_bh(&ul->lock);
+		list_for_each_entry(rt, &ul->head, rt_uncached) {
+			/* Shared by a nexthop, it may still be handed out:
+			 * nothing may reach the device through it. */
+			if (rt->u.dst.dev == dev) {
+				rt->u.dst.input = dst_discard;
+				rt->u.dst.output = dst_discard;
+			}
+			dst_ifdown(&rt->u.dst, dev, 1);
+		}
+		spin_unlock_bh(&ul->lock);
+	}
+}
+
 static __inline__ int rt_fast_clean(struct rtable *rth)
 {
 	/* Kill broadcast/multicast entries very aggresively, if they
@@ -697,6 +781,7 @@ static void rt_run_flush(unsigned long dummy)
 	rt_deadline = 0;
 
 	get_random_bytes(&rt_hash_rnd, 4);
+	atomic_inc(&rt_genid);
 
 	for (i = rt_hash_mask; i >= 0; i--) {
 		spin_lock_bh(rt_hash_lock_addr(i));
@@ -929,6 +1014,14 @@ static int rt_intern_hash(unsigned hash, struct rtable *rt, struct rtable **rp)
 	int		chain_length;
 	int attempts = !in_softirq();
 
+	/* Already uncached, e.g. a nexthop's shared forwarding route. */
+	if (rt->u.dst.flags & DST_NOCACHE) {
+		*rp = rt;
+		return 0;
+	}
+	if (ip_rt_nocache)
+		return rt_set_nocache(rt, rp);
+
 restart:
 	chain_length = 0;
 	min_score = ~(u32)0;
@@ -1472,6 +1565,9 @@ static void ip_rt_update_pmtu(struct dst_entry *dst, u32 mtu)
 
 static struct dst_entry *ipv4_dst_check(struct dst_entry *dst, u32 cookie)
 {
+	/* Uncached routes stay good until the next flush. */
+	if (dst->obsolete < 0 && rt_nocache_valid((struct rtable *)dst))
+		return dst;
 	return NULL;
 }
 
@@ -1490,6 +1586,14 @@ static void ipv4_dst_destroy(struct dst_entry *dst)
 		rt->idev = NULL;
 		in_dev_put(idev);
 	}
+
+	if (dst->flags & DST_NOCACHE) {
+		struct rt_uncached_list *ul = rt->rt_uncached_list;
+
+		spin_lock_bh(&ul->lock);
+		list_del(&rt->rt_uncached);
+		spin_unlock_bh(&ul->lock);
+	}
 }
 
 static void ipv4_dst_ifdown(struct dst_entry *dst, struct net_device *dev,
@@ -1714,6 +1818,82 @@ static void ip_handle_martian_source(struct net_device *dev,
 #endif
 }
 
+/* Can this forwarded packet use its nexthop's shared route?  Only when
+ * nothing in the route depends on the flow but the destination host:
+ * a gatewayed or on-link nexthop, no redirect or realm decisions keyed
+ * on the source, and no IP options that would read rt_spec_dst.
+ */
+static inline int rt_nh_cacheable(struct sk_buff *skb, struct fib_result *res,
+				  unsigned flags, u32 itag)
+{
+	return ip_rt_nocache && res->fi && !flags && !itag &&
+	       skb->protocol == htons(ETH_P_IP) && skb->nh.iph->ihl == 5 &&
+#ifdef CONFIG_IP_ROUTE_MULTIPATH_CACHED
+	       res->fi->fib_nhs < 2 &&
+#endif
+	       (!FIB_RES_GW(*res) ||
+		FIB_RES_NH(*res).nh_scope == RT_SCOPE_LINK);
+}
+
+static DEFINE_SPINLOCK(rt_nh_onlink_lock);
+
+/* Where the shared route of @nh to @daddr lives.  A gatewayed nexthop
+ * has one for every destination.  An on-link one binds a neighbour per
+ * host, so each destination gets the slot of a table that its address
+ * picks; NULL if there is no memory for the table. */
+static struct rtable **rt_nh_input_slot(struct fib_nh *nh, __be32 daddr)
+{
+	struct rtable **tbl;
+
+	if (nh->nh_gw)
+		return &nh->nh_rth_input;
+
+	tbl = rcu_dereference(nh->nh_rth_onlink);
+	if (tbl == NULL) {
+		tbl = kcalloc(FIB_NH_ONLINK_SLOTS, sizeof(*tbl), GFP_ATOMIC);
+		if (tbl == NULL)
+			return NULL;
+		spin_lock_bh(&rt_nh_onlink_lock);
+		if (nh->nh_rth_onlink == NULL) {
+			rcu_assign_pointer(nh->nh_rth_onlink, tbl);
+			tbl = NULL;
+		}
+		spin_unlock_bh(&rt_nh_onlink_lock);
+		kfree(tbl);
+		tbl = nh->nh_rth_onlink;
+	}
+	return &tbl[ntohl(daddr) & (FIB_NH_ONLINK_SLOTS - 1)];
+}
+
+static struct rtable *rt_nh_input_get(struct fib_nh *nh, struct rtable **slot,
+				      int iif, __be32 daddr)
+{
+	struct rtable *rth;
+
+	rcu_read_lock_bh();
+	rth = rcu_dereference(*slot);
+	if (rth && rth->rt_iif == iif && rt_nocache_valid(rth) &&
+	    (nh->nh_gw || rth->rt_dst == daddr) &&
+	    atomic_inc_not_zero(&rth->u.dst.__refcnt)) {
+		rth->u.dst.lastuse = jiffies;
+		rth->u.dst.__use++;
+		RT_CACHE_STAT_INC(in_hit);
+	} else
+		rth = NULL;
+	rcu_read_unlock_bh();
+	return rth;
+}
+
+static void rt_nh_input_set(struct rtable **slot, struct rtable *rth)
+{
+	struct rtable *old;
+
+	dst_hold(&rth->u.dst);
+	old = xchg(slot, rth);
+	if (old)
+		dst_release(&old->u.dst);
+}
+
 static inline int __mkroute_input(struct sk_buff *skb, 
 				  struct fib_result* res, 
 				  struct in_device *in_dev, 
@@ -1727,6 +1907,7 @@ static inline int __mkroute_input(struct sk_buff *skb,
 	unsigned flags = 0;
 	__be32 spec_dst;
 	u32 itag;
+	struct rtable **nh_slot = NULL;
 
 	/* get a working reference to the output device */
 	out_dev = in_dev_get(FIB_RES_DEV(*res));
@@ -1766,6 +1947,18 @@ static inline int __mkroute_input(struct sk_buff *skb,
 		}
 	}
 
+	if (rt_nh_cacheable(skb, res, flags, itag))
+		nh_slot = rt_nh_input_slot(&FIB_RES_NH(*res), daddr);
+	if (nh_slot) {
+		rth = rt_nh_input_get(&FIB_RES_NH(*res), nh_slot,
+				      in_dev->dev->ifindex, daddr);
+		if (rth) {
+			*result = rth;
+			err = 0;
+			goto cleanup;
+		}
+	}
+
 
 	rth = dst_alloc(&ipv4_dst_ops);
 	if (!rth) {
@@ -1805,6 +1998,13 @@ static inline int __mkroute_input(struct sk_buff *skb,
 
 	rth->rt_flags = flags;
 
+	if (nh_slot) {
+		err = rt_set_nocache(rth, &rth);
+		if (err)
+			goto cleanup;
+		rt_nh_input_set(nh_slot, rth);
+	}
+
 	*result = rth;
 	err = 0;
  cleanup:
@@ -2097,6 +2297,9 @@ int ip_route_input(struct sk_buff *skb, __be32 daddr, __be32 saddr,
 	tos &= IPTOS_RT_MASK;
 	hash = rt_hash(daddr, saddr, iif);
 
+	if (ip_rt_nocache)
+		goto skip_cache;
+
 	rcu_read_lock();
 	for (rth = rcu_dereference(rt_hash_table[hash].chain); rth;
 	     rth = rcu_dereference(rth->u.rt_next)) {
@@ -2118,6 +2321,7 @@ int ip_route_input(struct sk_buff *skb, __be32 daddr, __be32 saddr,
 	}
 	rcu_read_unlock();
 
+skip_cache:
 	/* Multicast recognition logic is moved from route cache to here.
 	   The problem was that too many Ethernet cards have broken/missing
 	   hardware multicast filters :-( As result the host on multicasting
@@ -2559,6 +2763,9 @@ int __ip_route_output_key(struct rtable **rp, const struct flowi *flp)
 	unsigned hash;
 	struct rtable *rth;
 
+	if (ip_rt_nocache)
+		return ip_route_output_slow(rp, flp);
+
 	hash = rt_hash(flp->fl4_dst, flp->fl4_src, flp->oif);
 
 	rcu_read_lock_bh();
@@ -2681,7 +2888,7 @@ static int rt_fill_info(struct sk_buff *skb, u32 pid, u32 seq, int event,
 	error = rt->u.dst.error;
 	expires = rt->u.dst.expires ? rt->u.dst.expires - jiffies : 0;
 	if (rt->peer) {
-		id = rt->peer->ip_id_count;
+		id = atomic_read(&rt->peer->ip_id_count) & 0xffff;
 		if (rt->peer->tcp_ts_stamp) {
 			ts = rt->peer->tcp_ts;
 			tsage = xtime.tv_sec - rt->peer->tcp_ts_stamp;
@@ -3048,6 +3255,14 @@ ctl_table ipv4_route_table[] = {
 		.proc_handler	= &proc_dointvec_jiffies,
 		.strategy	= &sysctl_jiffies,
 	},
+	{
+		.ctl_name	= NET_IPV4_ROUTE_NOCACHE,
+		.procname	= "nocache",
+		.data		= &ip_rt_nocache,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= &proc_dointvec,
+	},
 	{ .ctl_name = 0 }
 };
 #endif
@@ -3117,6 +3332,14 @@ __setup("rhash_entries=", set_rhash_entries);
 int __init ip_rt_init(void)
 {
 	int rc = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct rt_uncached_list *ul = &per_cpu(rt_uncached_list, cpu);
+
+		spin_lock_init(&ul->lock);
+		INIT_LIST_HEAD(&ul->head);
+	}
 
 	rt_hash_rnd = (int) ((num_physpages ^ (num_physpages>>8)) ^
 			     (jiffies ^ (jiffies >> 7)));
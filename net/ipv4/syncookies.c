@@ -169,6 +169,27 @@ static inline int cookie_check(struct sk_buff *skb, __u32 cookie)
 	return mssind < NUM_MSS ? msstab[mssind] + 1 : 0;
 }
 
+/*
+ * Validate the cookie carried by an ACK to a listener.  Only reads the
+ * listener, so it is safe without the socket lock.  Returns the mss
+ * encoded in the cookie, or 0 if the ACK is not a valid cookie reply.
+ */
+int cookie_v4_check_ack(struct sock *sk, struct sk_buff *skb)
+{
+	__u32 cookie = ntohl(skb->h.th->ack_seq) - 1;
+	int mss;
+
+	if (!sysctl_tcp_syncookies || !skb->h.th->ack)
+		return 0;
+
+  	if (time_after(jiffies, tcp_sk(sk)->last_synq_overflow + TCP_TIMEOUT_INIT) ||
+	    (mss = cookie_check(skb, cookie)) == 0) {
+	 	NET_INC_STATS_BH(LINUX_MIB_SYNCOOKIESFAILED);
+		return 0;
+	}
+	return mss;
+}
+
 static inline struct sock *get_cookie_sock(struct sock *sk, struct sk_buff *skb,
 					   struct request_sock *req,
 					   struct dst_entry *dst)
@@ -190,7 +211,6 @@ struct sock *cookie_v4_check(struct sock *sk, struct sk_buff *skb,
 {
 	struct inet_request_sock *ireq;
 	struct tcp_request_sock *treq;
-	struct tcp_sock *tp = tcp_sk(sk);
 	__u32 cookie = ntohl(skb->h.th->ack_seq) - 1; 
 	struct sock *ret = sk;
 	struct request_sock *req; 
@@ -198,15 +218,10 @@ struct sock *cookie_v4_check(struct sock *sk, struct sk_buff *skb,
 	struct rtable *rt; 
 	__u8 rcv_wscale;
 
-	if (!sysctl_tcp_syncookies || !skb->h.th->ack)
+	mss = cookie_v4_check_ack(sk, skb);
+	if (mss == 0)
 		goto out;
 
-  	if (time_after(jiffies, tp->last_synq_overflow + TCP_TIMEOUT_INIT) ||
-	    (mss = cookie_check(skb, cookie)) == 0) {
-	 	NET_INC_STATS_BH(LINUX_MIB_SYNCOOKIESFAILED);
-		goto out;
-	}
-
 	NET_INC_STATS_BH(LINUX_MIB_SYNCOOKIESRECV);
 
 	ret = NULL;
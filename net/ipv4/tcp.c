@@ -334,7 +334,7 @@ unsigned int tcp_poll(struct file *file, struct socket *sock, poll_table *wait)
 	 */
 
 	mask = 0;
-	if (sk->sk_err)
+	if (sk->sk_err || !skb_queue_empty(&sk->sk_error_queue))
 		mask = POLLERR;
 
 	/*
@@ -502,7 +502,7 @@ static inline void tcp_push(struct sock *sk, struct tcp_sock *tp, int flags,
 }
 
 static ssize_t do_tcp_sendpages(struct sock *sk, struct page **pages, int poffset,
-			 size_t psize, int flags)
+			 size_t psize, int flags, struct sk_buff *zskb)
 {
 	struct tcp_sock *tp = tcp_sk(sk);
 	int mss_now, size_goal;
@@ -532,7 +532,10 @@ static ssize_t do_tcp_sendpages(struct sock *sk, struct page **pages, int poffse
 		int offset = poffset % PAGE_SIZE;
 		int size = min_t(size_t, psize, PAGE_SIZE - offset);
 
-		if (!sk->sk_send_head || (copy = size_goal - skb->len) <= 0) {
+		/* An skb completes at most one zerocopy send. */
+		if (!sk->sk_send_head || (copy = size_goal - skb->len) <= 0 ||
+		    (zskb && skb_shinfo(skb)->zerocopy &&
+		     skb_shinfo(skb)->zerocopy != zskb)) {
 new_segment:
 			if (!sk_stream_memory_free(sk))
 				goto wait_for_sndbuf;
@@ -564,6 +567,10 @@ new_segment:
 			get_page(page);
 			skb_fill_page_desc(skb, i, page, offset, copy);
 		}
+		if (zskb && !skb_shinfo(skb)->zerocopy) {
+			skb_zerocopy_get(zskb);
+			skb_shinfo(skb)->zerocopy = zskb;
+		}
 
 		skb->len += copy;
 		skb->data_len += copy;
@@ -630,7 +637,7 @@ ssize_t tcp_sendpage(struct socket *sock, struct page *page, int offset,
 
 	lock_sock(sk);
 	TCP_CHECK_TIMER(sk);
-	res = do_tcp_sendpages(sk, &page, offset, size, flags);
+	res = do_tcp_sendpages(sk, &page, offset, size, flags, NULL);
 	TCP_CHECK_TIMER(sk);
 	release_sock(sk);
 	return res;
@@ -639,6 +646,91 @@ ssize_t tcp_sendpage(struct socket *sock, struct page *page, int offset,
 #define TCP_PAGE(sk)	(sk->sk_sndmsg_page)
 #define TCP_OFF(sk)	(sk->sk_sndmsg_off)
 
+/* Pinning pages only pays off for larger sends; smaller ones are copied
+ * and completed at once.  Locally delivered data is copied too: the
+ * pages would end up on the peer's receive queue, and with mmap()
+ * receive in its address space, long after we reported them free.
+ */
+#define TCP_ZEROCOPY_COPYBREAK	(2 * PAGE_SIZE)
+#define TCP_ZEROCOPY_BATCH	16
+
+static inline int tcp_zerocopy_ok(struct sock *sk, size_t size)
+{
+	struct dst_entry *dst = __sk_dst_get(sk);
+
+	return (sk->sk_route_caps & NETIF_F_SG) &&
+	       (sk->sk_route_caps & NETIF_F_ALL_CSUM) &&
+	       size >= TCP_ZEROCOPY_COPYBREAK &&
+	       dst && !(dst->dev->flags & IFF_LOOPBACK);
+}
+
+/*
+ * Send the user buffer without copying: pin its pages a batch at a time
+ * and hang them off the write queue as page frags.  Each skb that takes
+ * a frag holds a reference on @zskb, so the user is notified only after
+ * the last skb carrying the data (including retransmit clones and GSO
+ * segments) has been freed.
+ */
+static ssize_t tcp_sendmsg_zerocopy(struct sock *sk, struct msghdr *msg,
+				    struct sk_buff *zskb)
+{
+	struct iovec *iov = msg->msg_iov;
+	int iovlen = msg->msg_iovlen;
+	int flags = msg->msg_flags;
+	ssize_t copied = 0;
+	ssize_t res = 0;
+
+	while (--iovlen >= 0) {
+		unsigned long from = (unsigned long)iov->iov_base;
+		size_t seglen = iov->iov_len;
+
+		iov++;
+
+		while (seglen > 0) {
+			struct page *pages[TCP_ZEROCOPY_BATCH];
+			int offset = from & ~PAGE_MASK;
+			int npages, i;
+			size_t len;
+
+			npages = min_t(size_t, TCP_ZEROCOPY_BATCH,
+				       PAGE_ALIGN(offset + seglen) >> PAGE_SHIFT);
+
+			down_read(&current->mm->mmap_sem);
+			res = get_user_pages(current, current->mm,
+					     from & PAGE_MASK, npages, 0, 0,
+					     pages, NULL);
+			up_read(&current->mm->mmap_sem);
+			if (res <= 0) {
+				if (!res)
+					res = -EFAULT;
+				goto out;
+			}
+			npages = res;
+			len = min_t(size_t, seglen,
+				    (npages << PAGE_SHIFT) - offset);
+
+			res = do_tcp_sendpages(sk, pages, offset, len,
+					       (len < seglen || iovlen) ?
+					       flags | MSG_MORE : flags, zskb);
+
+			for (i = 0; i < npages; i++)
+				put_page(pages[i]);
+
+			if (res <= 0)
+				goto out;
+			copied += res;
+			if (res < len)
+				goto out;
+
+			from += len;
+			seglen -= len;
+		}
+	}
+
+out:
+	return copied ? copied : res;
+}
+
 static inline int select_size(struct sock *sk, struct tcp_sock *tp)
 {
 	int tmp = tp->mss_cache;
@@ -663,7 +755,7 @@ int tcp_sendmsg(struct kiocb *iocb, struct sock *sk, struct msghdr *msg,
 {
 	struct iovec *iov;
 	struct tcp_sock *tp = tcp_sk(sk);
-	struct sk_buff *skb;
+	struct sk_buff *skb, *zskb = NULL;
 	int iovlen, flags;
 	int mss_now, size_goal;
 	int err, copied;
@@ -675,6 +767,28 @@ int tcp_sendmsg(struct kiocb *iocb, struct sock *sk, struct msghdr *msg,
 	flags = msg->msg_flags;
 	timeo = sock_sndtimeo(sk, flags & MSG_DONTWAIT);
 
+	if (flags & MSG_ZEROCOPY) {
+		zskb = skb_zerocopy_alloc(sk);
+		if (!zskb) {
+			err = -ENOBUFS;
+			goto out_err;
+		}
+
+		if (tcp_zerocopy_ok(sk, size)) {
+			copied = tcp_sendmsg_zerocopy(sk, msg, zskb);
+			if (copied > 0)
+				skb_zerocopy_put(zskb);
+			else
+				skb_zerocopy_abort(zskb);
+			TCP_CHECK_TIMER(sk);
+			release_sock(sk);
+			return copied;
+		}
+
+		/* Copy fallback: the data is ours once we return. */
+		SKB_ZEROCOPY_CB(zskb)->copied = 1;
+	}
+
 	/* Wait for a connection to finish. */
 	if ((1 << sk->sk_state) & ~(TCPF_ESTABLISHED | TCPF_CLOSE_WAIT))
 		if ((err = sk_stream_wait_connect(sk, &timeo)) != 0)
@@ -854,6 +968,8 @@ wait_for_memory:
 out:
 	if (copied)
 		tcp_push(sk, tp, flags, mss_now, tp->nonagle);
+	if (zskb)
+		skb_zerocopy_put(zskb);
 	TCP_CHECK_TIMER(sk);
 	release_sock(sk);
 	return copied;
@@ -870,6 +986,8 @@ do_error:
 	if (copied)
 		goto out;
 out_err:
+	if (zskb)
+		skb_zerocopy_abort(zskb);
 	err = sk_stream_error(sk, flags, err);
 	TCP_CHECK_TIMER(sk);
 	release_sock(sk);
@@ -1089,6 +1207,187 @@ int tcp_read_sock(struct sock *sk, read_descriptor_t *desc,
 	return copied;
 }
 
+/*
+ *	Zero copy receive.
+ *
+ *	The socket is mmap()ed read-only; TCP_ZEROCOPY_RECEIVE then maps
+ *	whole-page payload frags of the receive queue into that region in
+ *	place of a copy.  Pages mapped by the previous call are unmapped
+ *	first, which is how the user hands them back.  Data that does not
+ *	sit in aligned full pages (headers in the linear area, partial
+ *	frags) is left to recvmsg(); recv_skip_hint says how much.
+ */
+
+static struct page *tcp_vm_nopage(struct vm_area_struct *vma,
+				  unsigned long address, int *type)
+{
+	return NOPAGE_SIGBUS;
+}
+
+static struct vm_operations_struct tcp_vm_ops = {
+	.nopage	= tcp_vm_nopage,
+};
+
+int tcp_mmap(struct file *file, struct socket *sock,
+	     struct vm_area_struct *vma)
+{
+	if (vma->vm_flags & (VM_WRITE | VM_EXEC))
+		return -EPERM;
+	vma->vm_flags &= ~(VM_MAYWRITE | VM_MAYEXEC);
+	/* Receives only hold mmap_sem for read: vm_insert_page() must find
+	 * VM_INSERTPAGE already set. */
+	vma->vm_flags |= VM_INSERTPAGE | VM_DONTEXPAND;
+	vma->vm_ops = &tcp_vm_ops;
+	return 0;
+}
+
+struct tcp_zc_map {
+	struct vm_area_struct	*vma;
+	unsigned long		address;
+};
+
+/* Find the frag holding byte @offset of @skb; -1 if it is not at a frag start. */
+static int tcp_zc_frag(const struct sk_buff *skb, unsigned int offset)
+{
+	int i;
+
+	if (offset < skb_headlen(skb))
+		return -1;
+	offset -= skb_headlen(skb);
+
+	for (i = 0; i < skb_shinfo(skb)->nr_frags; i++) {
+		if (!offset)
+			return i;
+		if (offset < skb_shinfo(skb)->frags[i].size)
+			return -1;
+		offset -= skb_shinfo(skb)->frags[i].size;
+	}
+	return -1;
+}
+
+static inline int tcp_zc_page(const skb_frag_t *frag)
+{
+	return frag->page_offset == 0 && frag->size == PAGE_SIZE;
+}
+
+static int tcp_zc_recv_actor(read_descriptor_t *desc, struct sk_buff *skb,
+			     unsigned int offset, size_t len)
+{
+	struct tcp_zc_map *map = desc->arg.data;
+	int i = tcp_zc_frag(skb, offset);
+	size_t used = 0;
+
+	/* Pages of a local MSG_ZEROCOPY send still belong to the sender */
+	if (i < 0 || skb_shinfo(skb)->frag_list || skb_shinfo(skb)->zerocopy)
+		return 0;
+
+	while (i < skb_shinfo(skb)->nr_frags &&
+	       len - used >= PAGE_SIZE && desc->count >= PAGE_SIZE) {
+		skb_frag_t *frag = &skb_shinfo(skb)->frags[i++];
+
+		if (!tcp_zc_page(frag))
+			break;
+		desc->error = vm_insert_page(map->vma, map->address,
+					     frag->page);
+		if (desc->error)
+			break;
+		map->address += PAGE_SIZE;
+		desc->count -= PAGE_SIZE;
+		used += PAGE_SIZE;
+	}
+	return used;
+}
+
+/* Bytes at copied_seq the user must read before the next mappable page. */
+static u32 tcp_zc_skip_hint(struct sock *sk)
+{
+	struct sk_buff *skb;
+	u32 offset, skip;
+	int i;
+
+	skb = tcp_recv_skb(sk, tcp_sk(sk)->copied_seq, &offset);
+	if (!skb || offset >= skb->len)
+		return 0;
+
+	skip = skb->len - offset;
+	if (skb_shinfo(skb)->frag_list || skb_shinfo(skb)->zerocopy)
+		return skip;
+
+	skip = 0;
+	if (offset < skb_headlen(skb)) {
+		skip = skb_headlen(skb) - offset;
+		offset = 0;
+	} else
+		offset -= skb_headlen(skb);
+
+	for (i = 0; i < skb_shinfo(skb)->nr_frags; i++) {
+		const skb_frag_t *frag = &skb_shinfo(skb)->frags[i];
+
+		if (offset >= frag->size) {
+			offset -= frag->size;
+			continue;
+		}
+		if (!offset && tcp_zc_page(frag))
+			break;
+		skip += frag->size - offset;
+		offset = 0;
+	}
+	return skip;
+}
+
+/* Called with the socket locked. */
+static int tcp_zerocopy_receive(struct sock *sk,
+				struct tcp_zerocopy_receive *zc)
+{
+	unsigned long address = (unsigned long)zc->address;
+	struct vm_area_struct *vma;
+	struct tcp_zc_map map;
+	read_descriptor_t desc;
+	unsigned long length;
+	int copied;
+
+	if (address != zc->address || (address & ~PAGE_MASK))
+		return -EINVAL;
+
+	if (sk->sk_state == TCP_LISTEN)
+		return -ENOTCONN;
+
+	down_read(&current->mm->mmap_sem);
+
+	vma = find_vma(current->mm, address);
+	if (!vma || vma->vm_start > address || vma->vm_ops != &tcp_vm_ops ||
+	    vma->vm_file != sk->sk_socket->file) {
+		up_read(&current->mm->mmap_sem);
+		return -EINVAL;
+	}
+
+	length = min_t(unsigned long, zc->length, vma->vm_end - address);
+	length &= PAGE_MASK;
+	if (length)
+		zap_page_range(vma, address, length, NULL);
+
+	map.vma = vma;
+	map.address = address;
+	desc.written = 0;
+	desc.count = length;
+	desc.arg.data = &map;
+	desc.error = 0;
+
+	copied = length ? tcp_read_sock(sk, &desc, tcp_zc_recv_actor) : 0;
+
+	up_read(&current->mm->mmap_sem);
+
+	if (copied < 0)
+		return copied;
+	/* Nothing mapped: say why rather than report an empty success */
+	if (!copied && desc.error)
+		return desc.error;
+
+	zc->length = copied;
+	zc->recv_skip_hint = tcp_zc_skip_hint(sk);
+	return 0;
+}
+
 /*
  *	This routine copies from a sock struct into the user buffer.
  *
@@ -1111,6 +1410,13 @@ int tcp_recvmsg(struct kiocb *iocb, struct sock *sk, struct msghdr *msg,
 	struct task_struct *user_recv = NULL;
 	int copied_early = 0;
 
+	if (unlikely(flags & MSG_ERRQUEUE)) {
+		if (sk->sk_family == AF_INET6)
+			return sock_recv_errqueue(sk, msg, len,
+						  SOL_IPV6, IPV6_RECVERR);
+		return sock_recv_errqueue(sk, msg, len, SOL_IP, IP_RECVERR);
+	}
+
 	lock_sock(sk);
 
 	TCP_CHECK_TIMER(sk);
@@ -1710,6 +2016,7 @@ int tcp_disconnect(struct sock *sk, int flags)
 	struct inet_sock *inet = inet_sk(sk);
 	struct inet_connection_sock *icsk = inet_csk(sk);
 	struct tcp_sock *tp = tcp_sk(sk);
+	struct dst_entry *dst;
 	int err = 0;
 	int old_state = sk->sk_state;
 
@@ -1763,6 +2070,13 @@ int tcp_disconnect(struct sock *sk, int flags)
 	tcp_sack_reset(&tp->rx_opt);
 	__sk_dst_reset(sk);
 
+	/* The next peer comes in on its own route */
+	write_lock_bh(&sk->sk_dst_lock);
+	dst = inet->rx_dst;
+	inet->rx_dst = NULL;
+	write_unlock_bh(&sk->sk_dst_lock);
+	dst_release(dst);
+
 	BUG_TRAP(!inet->num || icsk->icsk_bind_hash);
 
 	sk->sk_error_report(sk);
@@ -2122,6 +2436,25 @@ static int do_tcp_getsockopt(struct sock *sk, int level,
 		if (copy_to_user(optval, icsk->icsk_ca_ops->name, len))
 			return -EFAULT;
 		return 0;
+	case TCP_ZEROCOPY_RECEIVE: {
+		struct tcp_zerocopy_receive zc;
+		int err;
+
+		if (get_user(len, optlen))
+			return -EFAULT;
+		if (len != sizeof(zc))
+			return -EINVAL;
+		if (copy_from_user(&zc, optval, len))
+			return -EFAULT;
+
+		lock_sock(sk);
+		err = tcp_zerocopy_receive(sk, &zc);
+		release_sock(sk);
+
+		if (!err && copy_to_user(optval, &zc, len))
+			err = -EFAULT;
+		return err;
+	}
 	default:
 		return -ENOPROTOOPT;
 	};
@@ -2437,6 +2770,9 @@ void __init tcp_init(void)
 		INIT_HLIST_HEAD(&tcp_hashinfo.bhash[i].chain);
 	}
 
+	if (inet_twdr_init(&tcp_death_row))
+		panic("Failed to allocate TCP TIME_WAIT death rows\n");
+
 	/* Try to be a bit smarter and adjust defaults depending
 	 * on available memory.
 	 */
@@ -2489,6 +2825,7 @@ EXPORT_SYMBOL(tcp_read_sock);
 EXPORT_SYMBOL(tcp_recvmsg);
 EXPORT_SYMBOL(tcp_sendmsg);
 EXPORT_SYMBOL(tcp_sendpage);
+EXPORT_SYMBOL(tcp_mmap);
 EXPORT_SYMBOL(tcp_setsockopt);
 EXPORT_SYMBOL(tcp_shutdown);
 EXPORT_SYMBOL(tcp_statistics);
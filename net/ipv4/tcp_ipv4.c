@@ -1255,6 +1255,7 @@ int tcp_v4_conn_request(struct sock *sk, struct sk_buff *skb)
 	__be32 daddr = skb->nh.iph->daddr;
 	__u32 isn = TCP_SKB_CB(skb)->when;
 	struct dst_entry *dst = NULL;
+	spinlock_t *lock;
 #ifdef CONFIG_SYN_COOKIES
 	int want_cookie = 0;
 #else
@@ -1384,14 +1385,25 @@ int tcp_v4_conn_request(struct sock *sk, struct sk_buff *skb)
 	}
 	tcp_rsk(req)->snt_isn = isn;
 
-	if (tcp_v4_send_synack(sk, req, dst))
-		goto drop_and_free;
-
+	/* A cookie answers the SYN in full: nothing failed, nothing queued */
 	if (want_cookie) {
-	   	reqsk_free(req);
-	} else {
-		inet_csk_reqsk_queue_hash_add(sk, req, TCP_TIMEOUT_INIT);
+		tcp_v4_send_synack(sk, req, dst);
+		reqsk_free(req);
+		return 0;
+	}
+
+	/* Queue before answering: a SYN for the same connection may be
+	 * handled on another cpu at the same time, see tcp_v4_rcv_listen().
+	 * The chain lock keeps the request alive while we send; a lost
+	 * SYN-ACK is retransmitted from the queue.
+	 */
+	if (inet_csk_reqsk_queue_hash_add_lock(sk, req, TCP_TIMEOUT_INIT,
+					       &lock)) {
+		dst_release(dst);
+		goto drop_and_free;
 	}
+	tcp_v4_send_synack(sk, req, dst);
+	spin_unlock_bh(lock);
 	return 0;
 
 drop_and_free:
@@ -1511,6 +1523,81 @@ static struct sock *tcp_v4_hnd_req(struct sock *sk, struct sk_buff *skb)
 	return sk;
 }
 
+/*
+ * Handle pure SYNs and bare ACKs to a listener without its socket lock,
+ * so that a SYN flood is spread over all cpus instead of serializing on
+ * one listener.  New requests go to the SYN queue under its per-bucket
+ * locks, retransmitted SYNs are answered from the pending request, and
+ * ACKs carrying invalid cookies are reset here.  Everything else, and
+ * anything completing a handshake, takes the locked path.  We run inside
+ * an RCU read side, which keeps the SYN queue's listen_sock around should
+ * the listener stop meanwhile.  Returns 1 if the segment was consumed.
+ */
+static int tcp_v4_rcv_listen(struct sock *sk, struct sk_buff *skb)
+{
+	struct tcphdr *th = skb->h.th;
+	struct iphdr *iph = skb->nh.iph;
+	struct request_sock *req;
+	spinlock_t *lock;
+	int done = 0;
+
+	if (th->rst || th->fin || th->syn == th->ack)
+		return 0;
+#ifdef CONFIG_TCP_MD5SIG
+	/* Keys change under the socket lock. */
+	if (tcp_sk(sk)->md5sig_info)
+		return 0;
+#endif
+	if (skb->len < (th->doff << 2) || tcp_checksum_complete(skb))
+		return 0;
+
+	rcu_read_lock();
+	if (sk->sk_state != TCP_LISTEN)
+		goto out;
+
+	req = inet_csk_search_req_lock(sk, &lock, th->source,
+				       iph->saddr, iph->daddr);
+	if (req) {
+		/* Anything but a pure retransmission needs tcp_check_req(). */
+		if (th->syn && TCP_SKB_CB(skb)->seq == tcp_rsk(req)->rcv_isn) {
+			req->rsk_ops->rtx_syn_ack(sk, req, NULL);
+			done = 1;
+		}
+		spin_unlock_bh(lock);
+		goto out;
+	}
+
+	if (th->syn) {
+		tcp_v4_conn_request(sk, skb);
+		done = 1;
+	} else {
+		struct sock *nsk;
+
+		/* The child may have been created since our lookup. */
+		nsk = inet_lookup_established(&tcp_hashinfo, iph->saddr,
+					      th->source, iph->daddr,
+					      th->dest, inet_iif(skb));
+		if (nsk) {
+			if (nsk->sk_state == TCP_TIME_WAIT)
+				inet_twsk_put(inet_twsk(nsk));
+			else
+				sock_put(nsk);
+			goto out;
+		}
+#ifdef CONFIG_SYN_COOKIES
+		if (cookie_v4_check_ack(sk, skb))
+			goto out;
+#endif
+		tcp_v4_send_reset(sk, skb);
+		done = 1;
+	}
+out:
+	rcu_read_unlock();
+	if (done)
+		kfree_skb(skb);
+	return done;
+}
+
 static __sum16 tcp_v4_checksum_init(struct sk_buff *skb)
 {
 	if (skb->ip_summed == CHECKSUM_COMPLETE) {
@@ -1531,6 +1618,109 @@ static __sum16 tcp_v4_checksum_init(struct sk_buff *skb)
 }
 
 
+/*
+ *	Early demux support.  An established socket remembers the input
+ *	route of the segments it receives, so that the next segment of
+ *	the flow can skip the route cache lookup in ip_rcv_finish().
+ *	Writers hold the socket lock, readers run in softirq context on
+ *	any cpu, hence the sk_dst_lock.
+ */
+static void tcp_v4_rx_dst_set(struct sock *sk, struct sk_buff *skb)
+{
+	struct inet_sock *inet = inet_sk(sk);
+	struct dst_entry *old, *dst = skb->dst;
+
+	/* Only input routes can be reused, loopback carries output ones. */
+	if (dst && ((struct rtable *)dst)->fl.iif == 0)
+		dst = NULL;
+	if (inet->rx_dst == dst)
+		return;
+
+	write_lock_bh(&sk->sk_dst_lock);
+	old = inet->rx_dst;
+	inet->rx_dst = dst_clone(dst);
+	write_unlock_bh(&sk->sk_dst_lock);
+	dst_release(old);
+}
+
+static struct dst_entry *tcp_v4_rx_dst_get(struct sock *sk,
+					   struct sk_buff *skb)
+{
+	const struct iphdr *iph = skb->nh.iph;
+	struct dst_entry *dst;
+	struct rtable *rt;
+
+	read_lock(&sk->sk_dst_lock);
+	dst = inet_sk(sk)->rx_dst;
+	if (dst) {
+		/* Same keys as the route cache hit in ip_route_input(). */
+		rt = (struct rtable *)dst;
+		if (dst_check(dst, 0) &&
+		    rt->fl.iif == skb->dev->ifindex &&
+		    rt->fl.mark == skb->mark &&
+		    rt->fl.fl4_tos == (iph->tos & IPTOS_RT_MASK)) {
+			dst->lastuse = jiffies;
+			dst_hold(dst);
+			dst->__use++;
+		} else
+			dst = NULL;
+	}
+	read_unlock(&sk->sk_dst_lock);
+	return dst;
+}
+
+static void tcp_v4_edemux_destructor(struct sk_buff *skb)
+{
+	sock_put(skb->sk);
+}
+
+void tcp_v4_early_demux(struct sk_buff *skb)
+{
+	const struct iphdr *iph;
+	const struct tcphdr *th;
+	struct sock *sk;
+
+	if (skb->pkt_type != PACKET_HOST)
+		return;
+
+	if (!pskb_may_pull(skb, skb->nh.iph->ihl * 4 + sizeof(struct tcphdr)))
+		return;
+
+	iph = skb->nh.iph;
+	th = (struct tcphdr *)(skb->nh.raw + iph->ihl * 4);
+	if (th->doff < sizeof(struct tcphdr) / 4)
+		return;
+
+	sk = __inet_lookup_established(&tcp_hashinfo, iph->saddr, th->source,
+				       iph->daddr, ntohs(th->dest),
+				       skb->dev->ifindex);
+	if (!sk)
+		return;
+
+	/* LOCAL_IN hooks take skb->sk for a full socket. */
+	if (sk->sk_state == TCP_TIME_WAIT) {
+		inet_twsk_put(inet_twsk(sk));
+		return;
+	}
+
+	skb->sk = sk;
+	skb->destructor = tcp_v4_edemux_destructor;
+	skb->dst = tcp_v4_rx_dst_get(sk, skb);
+}
+
+/* Take over the socket reference left by tcp_v4_early_demux(). */
+static inline struct sock *tcp_v4_steal_sock(struct sk_buff *skb)
+{
+	struct sock *sk = skb->sk;
+
+	if (sk && skb->destructor == tcp_v4_edemux_destructor) {
+		skb->sk = NULL;
+		skb->destructor = NULL;
+		return sk;
+	}
+	return NULL;
+}
+
 /* The socket must have it's spinlock held when we get
  * here.
  *
@@ -1554,6 +1744,8 @@ int tcp_v4_do_rcv(struct sock *sk, struct sk_buff *skb)
 #endif
 
 	if (sk->sk_state == TCP_ESTABLISHED) { /* Fast path */
+		if (unlikely(inet_sk(sk)->rx_dst != skb->dst))
+			tcp_v4_rx_dst_set(sk, skb);
 		TCP_CHECK_TIMER(sk);
 		if (tcp_rcv_established(sk, skb, skb->h.th, skb->len)) {
 			rsk = sk;
@@ -1647,9 +1839,11 @@ int tcp_v4_rcv(struct sk_buff *skb)
 	TCP_SKB_CB(skb)->flags	 = skb->nh.iph->tos;
 	TCP_SKB_CB(skb)->sacked	 = 0;
 
-	sk = __inet_lookup(&tcp_hashinfo, skb->nh.iph->saddr, th->source,
-			   skb->nh.iph->daddr, th->dest,
-			   inet_iif(skb));
+	sk = tcp_v4_steal_sock(skb);
+	if (!sk)
+		sk = __inet_lookup(&tcp_hashinfo, skb->nh.iph->saddr,
+				   th->source, skb->nh.iph->daddr, th->dest,
+				   inet_iif(skb));
 
 	if (!sk)
 		goto no_tcp_socket;
@@ -1665,6 +1859,11 @@ process:
 	if (sk_filter(sk, skb))
 		goto discard_and_relse;
 
+	if (sk->sk_state == TCP_LISTEN && tcp_v4_rcv_listen(sk, skb)) {
+		sock_put(sk);
+		return 0;
+	}
+
 	skb->dev = NULL;
 
 	bh_lock_sock_nested(sk);
@@ -91,6 +91,8 @@
 #include <linux/errno.h>
 #include <linux/timer.h>
 #include <linux/mm.h>
+#include <linux/bootmem.h>
+#include <linux/log2.h>
 #include <linux/inet.h>
 #include <linux/netdevice.h>
 #include <net/tcp_states.h>
@@ -109,112 +111,132 @@
 
 DEFINE_SNMP_STAT(struct udp_mib, udp_statistics) __read_mostly;
 
-struct hlist_head udp_hash[UDP_HTABLE_SIZE];
-DEFINE_RWLOCK(udp_hash_lock);
+struct udp_table udp_table;
 
-static int udp_port_rover;
+#define MAX_UDP_PORTS		65536
+#define PORTS_PER_CHAIN		(MAX_UDP_PORTS / UDP_HTABLE_SIZE_MIN)
 
-static inline int __udp_lib_lport_inuse(__u16 num, struct hlist_head udptable[])
+static int udp_lib_lport_inuse(__u16 num, const struct udp_hslot *hslot,
+			       struct sock *sk,
+			       int (*saddr_comp)(const struct sock *sk1,
+						 const struct sock *sk2))
 {
-	struct sock *sk;
+	struct sock *sk2;
 	struct hlist_node *node;
 
-	sk_for_each(sk, node, &udptable[num & (UDP_HTABLE_SIZE - 1)])
-		if (inet_sk(sk)->num == num)
+	sk_for_each(sk2, node, &hslot->head)
+		if (inet_sk(sk2)->num == num                         &&
+		    sk2 != sk                                        &&
+		    (!sk2->sk_reuse        || !sk->sk_reuse)         &&
+		    (!sk2->sk_bound_dev_if || !sk->sk_bound_dev_if
+		     || sk2->sk_bound_dev_if == sk->sk_bound_dev_if) &&
+		    (*saddr_comp)(sk, sk2)                             )
 			return 1;
 	return 0;
 }
 
+/*
+ * Mark in @bitmap every port of this slot that some socket already uses.
+ * All the ports of one slot are congruent modulo the table size, so
+ * port >> log indexes them densely.
+ */
+static void udp_lib_lport_mark(const struct udp_hslot *hslot,
+			       unsigned long *bitmap, unsigned int log)
+{
+	struct sock *sk2;
+	struct hlist_node *node;
+
+	sk_for_each(sk2, node, &hslot->head)
+		__set_bit(inet_sk(sk2)->num >> log, bitmap);
+}
+
 /**
  *  __udp_lib_get_port  -  UDP/-Lite port lookup for IPv4 and IPv6
  *
  *  @sk:          socket struct in question
  *  @snum:        port number to look up
- *  @udptable:    hash list table, must be of UDP_HTABLE_SIZE
- *  @port_rover:  pointer to record of last unallocated port
+ *  @udptable:    table the socket is to be hashed in
  *  @saddr_comp:  AF-dependent comparison of bound local IP addresses
+ *
+ *  The caller sets udp_sk(sk)->udp_portaddr_hash to the hash of the bound
+ *  address with a zero port; the port is folded in here once it is known.
+ *
+ *  An ephemeral port is found by scanning one slot at a time: the ports
+ *  in use there are collected in a bitmap, which is then probed with a
+ *  random odd multiple of the table size as stride.  That covers every
+ *  port of the slot, so the cost is one chain walk per slot tried rather
+ *  than one per candidate port.
  */
 int __udp_lib_get_port(struct sock *sk, unsigned short snum,
-		       struct hlist_head udptable[], int *port_rover,
+		       struct udp_table *udptable,
 		       int (*saddr_comp)(const struct sock *sk1,
 					 const struct sock *sk2 )    )
 {
-	struct hlist_node *node;
-	struct hlist_head *head;
-	struct sock *sk2;
+	struct udp_hslot *hslot, *hslot2;
 	int    error = 1;
 
-	write_lock_bh(&udp_hash_lock);
-	if (snum == 0) {
-		int best_size_so_far, best, result, i;
-
-		if (*port_rover > sysctl_local_port_range[1] ||
-		    *port_rover < sysctl_local_port_range[0])
-			*port_rover = sysctl_local_port_range[0];
-		best_size_so_far = 32767;
-		best = result = *port_rover;
-		for (i = 0; i < UDP_HTABLE_SIZE; i++, result++) {
-			int size;
-
-			head = &udptable[result & (UDP_HTABLE_SIZE - 1)];
-			if (hlist_empty(head)) {
-				if (result > sysctl_local_port_range[1])
-					result = sysctl_local_port_range[0] +
-						((result - sysctl_local_port_range[0]) &
-						 (UDP_HTABLE_SIZE - 1));
-				goto gotit;
-			}
-			size = 0;
-			sk_for_each(sk2, node, head) {
-				if (++size >= best_size_so_far)
-					goto next;
-			}
-			best_size_so_far = size;
-			best = result;
-		next:
-			;
-		}
-		result = best;
-		for(i = 0; i < (1 << 16) / UDP_HTABLE_SIZE; i++, result += UDP_HTABLE_SIZE) {
-			if (result > sysctl_local_port_range[1])
-				result = sysctl_local_port_range[0]
-					+ ((result - sysctl_local_port_range[0]) &
-					   (UDP_HTABLE_SIZE - 1));
-			if (! __udp_lib_lport_inuse(result, udptable))
-				break;
-		}
-		if (i >= (1 << 16) / UDP_HTABLE_SIZE)
-			goto fail;
-gotit:
-		*port_rover = snum = result;
+	if (!snum) {
+		int low = sysctl_local_port_range[0];
+		int high = sysctl_local_port_range[1];
+		unsigned int remaining = (high - low) + 1;
+		unsigned short first, last;
+		u32 rand;
+		DECLARE_BITMAP(bitmap, PORTS_PER_CHAIN);
+
+		rand = net_random();
+		first = (((u64)rand * remaining) >> 32) + low;
+		/* an odd multiple of the table size visits every port of a slot */
+		rand = (rand | 1) * (udptable->mask + 1);
+		last = first + udptable->mask + 1;
+		do {
+			hslot = udp_hashslot(udptable, first);
+			bitmap_zero(bitmap, PORTS_PER_CHAIN);
+			spin_lock_bh(&hslot->lock);
+			udp_lib_lport_mark(hslot, bitmap, udptable->log);
+
+			snum = first;
+			do {
+				if (low <= snum && snum <= high &&
+				    !test_bit(snum >> udptable->log, bitmap))
+					goto found;
+				snum += rand;
+			} while (snum != first);
+			spin_unlock_bh(&hslot->lock);
+		} while (++first != last);
+		goto fail;
 	} else {
-		head = &udptable[snum & (UDP_HTABLE_SIZE - 1)];
-
-		sk_for_each(sk2, node, head)
-			if (inet_sk(sk2)->num == snum                        &&
-			    sk2 != sk                                        &&
-			    (!sk2->sk_reuse        || !sk->sk_reuse)         &&
-			    (!sk2->sk_bound_dev_if || !sk->sk_bound_dev_if
-			     || sk2->sk_bound_dev_if == sk->sk_bound_dev_if) &&
-			    (*saddr_comp)(sk, sk2)                             )
-				goto fail;
+		hslot = udp_hashslot(udptable, snum);
+		spin_lock_bh(&hslot->lock);
+		if (udp_lib_lport_inuse(snum, hslot, sk, saddr_comp))
+			goto fail_unlock;
 	}
+found:
 	inet_sk(sk)->num = snum;
+	udp_sk(sk)->udp_portaddr_hash ^= snum;
 	if (sk_unhashed(sk)) {
-		head = &udptable[snum & (UDP_HTABLE_SIZE - 1)];
-		sk_add_node(sk, head);
+		sock_set_flag(sk, SOCK_RCU_FREE);
+		sk_add_node_rcu(sk, &hslot->head);
+		hslot->count++;
 		sock_prot_inc_use(sk->sk_prot);
+
+		hslot2 = udp_hashslot2(udptable, udp_sk(sk)->udp_portaddr_hash);
+		spin_lock(&hslot2->lock);
+		hlist_add_head_rcu(&udp_sk(sk)->udp_portaddr_node,
+				   &hslot2->head);
+		hslot2->count++;
+		spin_unlock(&hslot2->lock);
 	}
 	error = 0;
+fail_unlock:
+	spin_unlock_bh(&hslot->lock);
 fail:
-	write_unlock_bh(&udp_hash_lock);
 	return error;
 }
 
 __inline__ int udp_get_port(struct sock *sk, unsigned short snum,
 			int (*scmp)(const struct sock *, const struct sock *))
 {
-	return  __udp_lib_get_port(sk, snum, udp_hash, &udp_port_rover, scmp);
+	return  __udp_lib_get_port(sk, snum, &udp_table, scmp);
 }
 
 inline int ipv4_rcv_saddr_equal(const struct sock *sk1, const struct sock *sk2)
@@ -228,59 +250,201 @@ inline int ipv4_rcv_saddr_equal(const struct sock *sk1, const struct sock *sk2)
 
 static inline int udp_v4_get_port(struct sock *sk, unsigned short snum)
 {
+	udp_sk(sk)->udp_portaddr_hash =
+		udp4_portaddr_hash(inet_sk(sk)->rcv_saddr, 0);
 	return udp_get_port(sk, snum, ipv4_rcv_saddr_equal);
 }
 
+static inline struct udp_table *udp_sk_table(struct sock *sk)
+{
+	return IS_UDPLITE(sk) ? &udplite_table : &udp_table;
+}
+
+void udp_lib_unhash(struct sock *sk)
+{
+	struct udp_table *udptable = udp_sk_table(sk);
+	struct udp_hslot *hslot, *hslot2;
+
+	hslot = udp_hashslot(udptable, inet_sk(sk)->num);
+	spin_lock_bh(&hslot->lock);
+	if (sk_del_node_init_rcu(sk)) {
+		hslot->count--;
+		inet_sk(sk)->num = 0;
+		sock_prot_dec_use(sk->sk_prot);
+
+		hslot2 = udp_hashslot2(udptable, udp_sk(sk)->udp_portaddr_hash);
+		spin_lock(&hslot2->lock);
+		hlist_del_rcu(&udp_sk(sk)->udp_portaddr_node);
+		hslot2->count--;
+		spin_unlock(&hslot2->lock);
+	}
+	spin_unlock_bh(&hslot->lock);
+}
+
+/*
+ * Move a hashed socket to the secondary slot of its new local address,
+ * after connect() or disconnect() changed it.  A lookup walking the old
+ * slot at that moment may be carried over to the new one and miss a
+ * socket; that costs one datagram, which UDP may lose anyway.
+ */
+void udp_lib_rehash(struct sock *sk, unsigned int newhash)
+{
+	struct udp_table *udptable = udp_sk_table(sk);
+	struct udp_hslot *hslot, *hslot2, *nhslot2;
+
+	hslot = udp_hashslot(udptable, inet_sk(sk)->num);
+	spin_lock_bh(&hslot->lock);
+	if (sk_hashed(sk)) {
+		hslot2 = udp_hashslot2(udptable, udp_sk(sk)->udp_portaddr_hash);
+		nhslot2 = udp_hashslot2(udptable, newhash);
+		if (hslot2 != nhslot2) {
+			spin_lock(&hslot2->lock);
+			hlist_del_rcu(&udp_sk(sk)->udp_portaddr_node);
+			hslot2->count--;
+			spin_unlock(&hslot2->lock);
+
+			spin_lock(&nhslot2->lock);
+			hlist_add_head_rcu(&udp_sk(sk)->udp_portaddr_node,
+					   &nhslot2->head);
+			nhslot2->count++;
+			spin_unlock(&nhslot2->lock);
+		}
+		udp_sk(sk)->udp_portaddr_hash = newhash;
+	}
+	spin_unlock_bh(&hslot->lock);
+}
+
+static void udp_v4_rehash(struct sock *sk)
+{
+	struct inet_sock *inet = inet_sk(sk);
+
+	udp_lib_rehash(sk, udp4_portaddr_hash(inet->rcv_saddr, inet->num));
+}
+
+static inline int compute_score(struct sock *sk, unsigned short hnum,
+				__be32 saddr, __be16 sport,
+				__be32 daddr, int dif)
+{
+	struct inet_sock *inet = inet_sk(sk);
+	int score = -1;
+
+	if (inet->num == hnum && !ipv6_only_sock(sk)) {
+		score = (sk->sk_family == PF_INET ? 1 : 0);
+		if (inet->rcv_saddr) {
+			if (inet->rcv_saddr != daddr)
+				return -1;
+			score += 2;
+		}
+		if (inet->daddr) {
+			if (inet->daddr != saddr)
+				return -1;
+			score += 2;
+		}
+		if (inet->dport) {
+			if (inet->dport != sport)
+				return -1;
+			score += 2;
+		}
+		if (sk->sk_bound_dev_if) {
+			if (sk->sk_bound_dev_if != dif)
+				return -1;
+			score += 2;
+		}
+	}
+	return score;
+}
+
+#define UDP4_SCORE_MAX		9
+
+/* Above this many sockets on a port, look them up by address as well. */
+#define UDP_HSLOT_SCAN_MAX	10
+
+/* Best match in one secondary slot; called under rcu_read_lock(). */
+static struct sock *udp4_lib_lookup2(__be32 saddr, __be16 sport,
+				     __be32 daddr, unsigned short hnum, int dif,
+				     struct udp_hslot *hslot2, int *badness)
+{
+	struct sock *sk, *result = NULL;
+	struct udp_sock *up;
+	struct hlist_node *node;
+	int score;
+
+	hlist_for_each_entry_rcu(up, node, &hslot2->head, udp_portaddr_node) {
+		sk = (struct sock *)up;
+		score = compute_score(sk, hnum, saddr, sport, daddr, dif);
+		if (score > *badness) {
+			result = sk;
+			*badness = score;
+			if (score == UDP4_SCORE_MAX)
+				break;
+		}
+	}
+	return result;
+}
+
 /* UDP is nearly always wildcards out the wazoo, it makes no sense to try
  * harder than this. -DaveM
+ *
+ * Runs without locks: the chains are RCU lists and sockets on them are
+ * freed only after a grace period, so the winner is pinned with
+ * atomic_inc_not_zero() and scored again in case it changed meanwhile.
  */
 static struct sock *__udp4_lib_lookup(__be32 saddr, __be16 sport,
 				      __be32 daddr, __be16 dport,
-				      int dif, struct hlist_head udptable[])
+				      int dif, struct udp_table *udptable)
 {
-	struct sock *sk, *result = NULL;
+	struct sock *sk, *result, *result2;
 	struct hlist_node *node;
 	unsigned short hnum = ntohs(dport);
-	int badness = -1;
-
-	read_lock(&udp_hash_lock);
-	sk_for_each(sk, node, &udptable[hnum & (UDP_HTABLE_SIZE - 1)]) {
-		struct inet_sock *inet = inet_sk(sk);
-
-		if (inet->num == hnum && !ipv6_only_sock(sk)) {
-			int score = (sk->sk_family == PF_INET ? 1 : 0);
-			if (inet->rcv_saddr) {
-				if (inet->rcv_saddr != daddr)
-					continue;
-				score+=2;
-			}
-			if (inet->daddr) {
-				if (inet->daddr != saddr)
-					continue;
-				score+=2;
-			}
-			if (inet->dport) {
-				if (inet->dport != sport)
-					continue;
-				score+=2;
-			}
-			if (sk->sk_bound_dev_if) {
-				if (sk->sk_bound_dev_if != dif)
-					continue;
-				score+=2;
+	struct udp_hslot *hslot = udp_hashslot(udptable, hnum);
+	struct udp_hslot *hslot2, *hslot2_any;
+	int score, badness, badness2;
+
+	rcu_read_lock();
+begin:
+	result = NULL;
+	badness = -1;
+	if (hslot->count > UDP_HSLOT_SCAN_MAX) {
+		hslot2 = udp_hashslot2(udptable, udp4_portaddr_hash(daddr, hnum));
+		hslot2_any = udp_hashslot2(udptable,
+					   udp4_portaddr_hash(INADDR_ANY, hnum));
+		if (hslot2->count + hslot2_any->count <= hslot->count) {
+			result = udp4_lib_lookup2(saddr, sport, daddr, hnum,
+						  dif, hslot2, &badness);
+			if (badness < UDP4_SCORE_MAX && hslot2_any != hslot2) {
+				badness2 = badness;
+				result2 = udp4_lib_lookup2(saddr, sport, daddr,
+							   hnum, dif,
+							   hslot2_any,
+							   &badness2);
+				if (result2) {
+					result = result2;
+					badness = badness2;
+				}
 			}
-			if(score == 9) {
-				result = sk;
+			goto found;
+		}
+	}
+	sk_for_each_rcu(sk, node, &hslot->head) {
+		score = compute_score(sk, hnum, saddr, sport, daddr, dif);
+		if (score > badness) {
+			result = sk;
+			badness = score;
+			if (score == UDP4_SCORE_MAX)
 				break;
-			} else if(score > badness) {
-				result = sk;
-				badness = score;
-			}
 		}
 	}
-	if (result)
-		sock_hold(result);
-	read_unlock(&udp_hash_lock);
+found:
+	if (result) {
+		if (unlikely(!atomic_inc_not_zero(&result->sk_refcnt)))
+			result = NULL;
+		else if (unlikely(compute_score(result, hnum, saddr, sport,
+						daddr, dif) < badness)) {
+			sock_put(result);
+			goto begin;
+		}
+	}
+	rcu_read_unlock();
 	return result;
 }
 
@@ -323,7 +487,7 @@ found:
  * to find the appropriate port.
  */
 
-void __udp4_lib_err(struct sk_buff *skb, u32 info, struct hlist_head udptable[])
+void __udp4_lib_err(struct sk_buff *skb, u32 info, struct udp_table *udptable)
 {
 	struct inet_sock *inet;
 	struct iphdr *iph = (struct iphdr*)skb->data;
@@ -391,7 +555,7 @@ out:
 
 __inline__ void udp_err(struct sk_buff *skb, u32 info)
 {
-	return __udp4_lib_err(skb, info, udp_hash);
+	return __udp4_lib_err(skb, info, &udp_table);
 }
 
 /*
@@ -450,6 +614,10 @@ static void udp4_hwcsum_outgoing(struct sock *sk, struct sk_buff *skb,
 
 /*
  * Push out all pending data as one UDP datagram. Socket is locked.
+ *
+ * With UDP_SEGMENT the datagram is instead marked SKB_GSO_UDP_L4 and
+ * leaves as gso_size-sized datagrams, cut by the device or by
+ * udp4_gso_segment().
  */
 static int udp_push_pending_frames(struct sock *sk)
 {
@@ -474,6 +642,23 @@ static int udp_push_pending_frames(struct sock *sk)
 	uh->len = htons(up->len);
 	uh->check = 0;
 
+	if (inet->cork.gso_size &&
+	    up->len - sizeof(struct udphdr) > inet->cork.gso_size) {
+		unsigned int datalen = up->len - sizeof(struct udphdr);
+		unsigned int mss = inet->cork.gso_size;
+
+		if (skb_queue_len(&sk->sk_write_queue) != 1 ||
+		    skb->ip_summed != CHECKSUM_PARTIAL ||
+		    datalen > mss * UDP_MAX_SEGMENTS) {
+			ip_flush_pending_frames(sk);
+			err = -EINVAL;
+			goto out;
+		}
+		skb_shinfo(skb)->gso_size = mss;
+		skb_shinfo(skb)->gso_type = SKB_GSO_UDP_L4;
+		skb_shinfo(skb)->gso_segs = (datalen + mss - 1) / mss;
+	}
+
 	if (up->pcflag)  				 /*     UDP-Lite      */
 		csum  = udplite_csum_outgoing(sk, skb);
 
@@ -504,6 +689,31 @@ out:
 	return err;
 }
 
+/*
+ * Per-call override of UDP_SEGMENT, passed as a SOL_UDP control message.
+ */
+int udp_cmsg_send(struct msghdr *msg, u16 *gso_size)
+{
+	struct cmsghdr *cmsg;
+
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (!CMSG_OK(msg, cmsg))
+			return -EINVAL;
+		if (cmsg->cmsg_level != SOL_UDP)
+			continue;
+		switch (cmsg->cmsg_type) {
+		case UDP_SEGMENT:
+			if (cmsg->cmsg_len != CMSG_LEN(sizeof(__u16)))
+				return -EINVAL;
+			*gso_size = *(__u16 *)CMSG_DATA(cmsg);
+			break;
+		default:
+			return -EINVAL;
+		}
+	}
+	return 0;
+}
+
 int udp_sendmsg(struct kiocb *iocb, struct sock *sk, struct msghdr *msg,
 		size_t len)
 {
@@ -519,6 +729,7 @@ int udp_sendmsg(struct kiocb *iocb, struct sock *sk, struct msghdr *msg,
 	u8  tos;
 	int err, is_udplite = up->pcflag;
 	int corkreq = up->corkflag || msg->msg_flags&MSG_MORE;
+	u16 gso_size = up->gso_size;
 	int (*getfrag)(void *, char *, int, int, int, struct sk_buff *);
 
 	if (len > 0xFFFF)
@@ -580,6 +791,9 @@ int udp_sendmsg(struct kiocb *iocb, struct sock *sk, struct msghdr *msg,
 
 	ipc.oif = sk->sk_bound_dev_if;
 	if (msg->msg_controllen) {
+		err = udp_cmsg_send(msg, &gso_size);
+		if (err)
+			return err;
 		err = ip_cmsg_send(msg, &ipc);
 		if (err)
 			return err;
@@ -649,6 +863,18 @@ back_from_confirm:
 	if (!ipc.addr)
 		daddr = ipc.addr = rt->rt_dst;
 
+	/* Segments are checksummed on output, one by one, and must each
+	 * fit the path as they are never IP-fragmented.
+	 */
+	if (gso_size) {
+		err = -EINVAL;
+		if (is_udplite || sk->sk_no_check == UDP_CSUM_NOXMIT ||
+		    rt->u.dst.xfrm ||
+		    sizeof(struct iphdr) + (ipc.opt ? ipc.opt->optlen : 0) +
+		    sizeof(struct udphdr) + gso_size > dst_mtu(&rt->u.dst))
+			goto out;
+	}
+
 	lock_sock(sk);
 	if (unlikely(up->pending)) {
 		/* The socket is already corked while preparing it. */
@@ -666,6 +892,7 @@ back_from_confirm:
 	inet->cork.fl.fl_ip_dport = dport;
 	inet->cork.fl.fl4_src = saddr;
 	inet->cork.fl.fl_ip_sport = inet->sport;
+	inet->cork.gso_size = gso_size;
 	up->pending = AF_INET;
 
 do_append_data:
@@ -758,6 +985,225 @@ out:
 	return ret;
 }
 
+/*
+ *	Receive queue handling.
+ *
+ *	Softirq producers keep appending to sk_receive_queue through
+ *	sock_queue_rcv_skb().  udp_recvmsg() does not dequeue from there one
+ *	datagram at a time: once its private reader_queue runs dry it takes
+ *	the producers' lock once and splices everything queued so far over,
+ *	then serves the following reads under the reader lock alone.  The
+ *	receive memory of consumed datagrams is handed back in batches of
+ *	up to a quarter of sk_rcvbuf, instead of one atomic per datagram.
+ */
+
+/* Called with the reader queue locked. */
+static void udp_splice_rcv_queue(struct sock *sk)
+{
+	struct sk_buff_head *sk_queue = &sk->sk_receive_queue;
+	struct sk_buff_head *rq = &udp_sk(sk)->reader_queue;
+	struct sk_buff *first, *last;
+	unsigned long flags;
+
+	if (skb_queue_empty(sk_queue))
+		return;
+
+	spin_lock_irqsave(&sk_queue->lock, flags);
+	if (!skb_queue_empty(sk_queue)) {
+		first = sk_queue->next;
+		last = sk_queue->prev;
+
+		first->prev = rq->prev;
+		rq->prev->next = first;
+		last->next = (struct sk_buff *)rq;
+		rq->prev = last;
+		rq->qlen += sk_queue->qlen;
+
+		sk_queue->next = sk_queue->prev = (struct sk_buff *)sk_queue;
+		sk_queue->qlen = 0;
+	}
+	spin_unlock_irqrestore(&sk_queue->lock, flags);
+}
+
+/*
+ * Uncharge a datagram just unlinked from the reader queue, which is
+ * still locked.  The memory is only given back to sk_rmem_alloc when the
+ * deficit grows large or the reader catches up with the producers, so
+ * the socket never looks more than sk_rcvbuf/4 fuller than it is.
+ */
+static void udp_skb_uncharge(struct sock *sk, struct sk_buff *skb)
+{
+	struct udp_sock *up = udp_sk(sk);
+	int size;
+
+	if (skb->destructor != sock_rfree)
+		return;
+	skb->destructor = NULL;
+
+	size = up->forward_deficit + skb->truesize;
+	if (size < (sk->sk_rcvbuf >> 2) && !skb_queue_empty(&up->reader_queue)) {
+		up->forward_deficit = size;
+		return;
+	}
+	up->forward_deficit = 0;
+	atomic_sub(size, &sk->sk_rmem_alloc);
+}
+
+static int udp_wait_for_packet(struct sock *sk, int *err, long *timeo_p)
+{
+	int error;
+	DEFINE_WAIT(wait);
+
+	prepare_to_wait_exclusive(sk->sk_sleep, &wait, TASK_INTERRUPTIBLE);
+
+	/* Socket errors? */
+	error = sock_error(sk);
+	if (error)
+		goto out_err;
+
+	if (!skb_queue_empty(&sk->sk_receive_queue) ||
+	    !skb_queue_empty(&udp_sk(sk)->reader_queue))
+		goto out;
+
+	/* Socket shut down? */
+	if (sk->sk_shutdown & RCV_SHUTDOWN)
+		goto out_noerr;
+
+	/* handle signals */
+	if (signal_pending(current))
+		goto interrupted;
+
+	error = 0;
+	*timeo_p = schedule_timeout(*timeo_p);
+out:
+	finish_wait(sk->sk_sleep, &wait);
+	return error;
+interrupted:
+	error = sock_intr_errno(*timeo_p);
+out_err:
+	*err = error;
+	goto out;
+out_noerr:
+	*err = 0;
+	error = 1;
+	goto out;
+}
+
+/*
+ * Same contract as skb_recv_datagram(), but served from the reader queue.
+ * A datagram returned without MSG_PEEK has already been uncharged and
+ * belongs to the caller.
+ */
+struct sk_buff *udp_recv_datagram(struct sock *sk, unsigned int flags,
+				  int noblock, int *err)
+{
+	struct sk_buff_head *rq = &udp_sk(sk)->reader_queue;
+	struct sk_buff *skb;
+	long timeo;
+	int error = sock_error(sk);
+
+	if (error)
+		goto no_packet;
+
+	timeo = sock_rcvtimeo(sk, noblock);
+
+	do {
+		spin_lock_bh(&rq->lock);
+		if (skb_queue_empty(rq))
+			udp_splice_rcv_queue(sk);
+		if (flags & MSG_PEEK) {
+			skb = skb_peek(rq);
+			if (skb)
+				atomic_inc(&skb->users);
+		} else {
+			skb = __skb_dequeue(rq);
+			if (skb)
+				udp_skb_uncharge(sk, skb);
+		}
+		spin_unlock_bh(&rq->lock);
+
+		if (skb)
+			return skb;
+
+		/* User doesn't want to wait */
+		error = -EAGAIN;
+		if (!timeo)
+			goto no_packet;
+
+	} while (!udp_wait_for_packet(sk, err, &timeo));
+
+	return NULL;
+
+no_packet:
+	*err = error;
+	return NULL;
+}
+
+/*
+ * Drop a datagram that failed its checksum.  A peeked one is still on
+ * the reader queue and has to come off it first.
+ */
+void udp_kill_datagram(struct sock *sk, struct sk_buff *skb, unsigned int flags)
+{
+	struct sk_buff_head *rq = &udp_sk(sk)->reader_queue;
+
+	if (flags & MSG_PEEK) {
+		spin_lock_bh(&rq->lock);
+		if (skb == skb_peek(rq)) {
+			__skb_unlink(skb, rq);
+			atomic_dec(&skb->users);
+			udp_skb_uncharge(sk, skb);
+		}
+		spin_unlock_bh(&rq->lock);
+	}
+
+	kfree_skb(skb);
+}
+
+/*
+ * Length of the first datagram that will be read, or -1 if there is
+ * none.  Datagrams with bad checksums are dropped on the way.
+ */
+static int udp_first_packet_length(struct sock *sk)
+{
+	struct sk_buff_head *rq = &udp_sk(sk)->reader_queue;
+	struct sk_buff *skb;
+	int res = -1;
+
+	spin_lock_bh(&rq->lock);
+	if (skb_queue_empty(rq))
+		udp_splice_rcv_queue(sk);
+	while ((skb = skb_peek(rq)) != NULL) {
+		if (udp_lib_checksum_complete(skb)) {
+			UDP_INC_STATS_BH(UDP_MIB_INERRORS, IS_UDPLITE(sk));
+			__skb_unlink(skb, rq);
+			udp_skb_uncharge(sk, skb);
+			kfree_skb(skb);
+			if (skb_queue_empty(rq))
+				udp_splice_rcv_queue(sk);
+		} else {
+			skb->ip_summed = CHECKSUM_UNNECESSARY;
+			res = skb->len - sizeof(struct udphdr);
+			break;
+		}
+	}
+	spin_unlock_bh(&rq->lock);
+
+	return res;
+}
+
+/* Called on close: drop what the reader never got to and settle the books. */
+void udp_purge_reader_queue(struct sock *sk)
+{
+	struct udp_sock *up = udp_sk(sk);
+
+	spin_lock_bh(&up->reader_queue.lock);
+	__skb_queue_purge(&up->reader_queue);
+	atomic_sub(up->forward_deficit, &sk->sk_rmem_alloc);
+	up->forward_deficit = 0;
+	spin_unlock_bh(&up->reader_queue.lock);
+}
+
 /*
  *	IOCTL requests applicable to the UDP protocol
  */
@@ -774,21 +1220,15 @@ int udp_ioctl(struct sock *sk, int cmd, unsigned long arg)
 
 		case SIOCINQ:
 		{
-			struct sk_buff *skb;
-			unsigned long amount;
-
-			amount = 0;
-			spin_lock_bh(&sk->sk_receive_queue.lock);
-			skb = skb_peek(&sk->sk_receive_queue);
-			if (skb != NULL) {
-				/*
-				 * We will only return the amount
-				 * of this packet since that is all
-				 * that will be read.
-				 */
-				amount = skb->len - sizeof(struct udphdr);
-			}
-			spin_unlock_bh(&sk->sk_receive_queue.lock);
+			int amount = udp_first_packet_length(sk);
+
+			/*
+			 * We will only return the amount
+			 * of this packet since that is all
+			 * that will be read.
+			 */
+			if (amount < 0)
+				amount = 0;
 			return put_user(amount, (int __user *)arg);
 		}
 
@@ -821,7 +1261,7 @@ int udp_recvmsg(struct kiocb *iocb, struct sock *sk, struct msghdr *msg,
 		return ip_recv_error(sk, msg, len);
 
 try_again:
-	skb = skb_recv_datagram(sk, flags, noblock, &err);
+	skb = udp_recv_datagram(sk, flags, noblock, &err);
 	if (!skb)
 		goto out;
   
@@ -884,7 +1324,7 @@ out:
 csum_copy_err:
 	UDP_INC_STATS_BH(UDP_MIB_INERRORS, is_udplite);
 
-	skb_kill_datagram(sk, skb, flags);
+	udp_kill_datagram(sk, skb, flags);
 
 	if (noblock)
 		return -EAGAIN;	
@@ -909,7 +1349,9 @@ int udp_disconnect(struct sock *sk, int flags)
 	if (!(sk->sk_userlocks & SOCK_BINDPORT_LOCK)) {
 		sk->sk_prot->unhash(sk);
 		inet->sport = 0;
-	}
+	} else if (!(sk->sk_userlocks & SOCK_BINDADDR_LOCK) &&
+		   sk->sk_prot->rehash)
+		sk->sk_prot->rehash(sk);
 	sk_dst_reset(sk);
 	return 0;
 }
@@ -1119,19 +1561,20 @@ drop:
 /*
  *	Multicasts and broadcasts go to each listener.
  *
- *	Note: called only from the BH handler context,
- *	so we don't need to lock the hashes.
+ *	Note: called only from the BH handler context, so the
+ *	slot lock is taken without disabling BHs.
  */
 static int __udp4_lib_mcast_deliver(struct sk_buff *skb,
 				    struct udphdr  *uh,
 				    __be32 saddr, __be32 daddr,
-				    struct hlist_head udptable[])
+				    struct udp_table *udptable)
 {
+	struct udp_hslot *hslot = udp_hashslot(udptable, ntohs(uh->dest));
 	struct sock *sk;
 	int dif;
 
-	read_lock(&udp_hash_lock);
-	sk = sk_head(&udptable[ntohs(uh->dest) & (UDP_HTABLE_SIZE - 1)]);
+	spin_lock(&hslot->lock);
+	sk = sk_head(&hslot->head);
 	dif = skb->dev->ifindex;
 	sk = udp_v4_mcast_next(sk, uh->dest, daddr, uh->source, saddr, dif);
 	if (sk) {
@@ -1156,7 +1599,7 @@ static int __udp4_lib_mcast_deliver(struct sk_buff *skb,
 		} while(sknext);
 	} else
 		kfree_skb(skb);
-	read_unlock(&udp_hash_lock);
+	spin_unlock(&hslot->lock);
 	return 0;
 }
 
@@ -1190,7 +1633,7 @@ static inline void udp4_csum_init(struct sk_buff *skb, struct udphdr *uh)
  *	All we need to do is get the socket, and then do a checksum. 
  */
  
-int __udp4_lib_rcv(struct sk_buff *skb, struct hlist_head udptable[],
+int __udp4_lib_rcv(struct sk_buff *skb, struct udp_table *udptable,
 		   int is_udplite)
 {
   	struct sock *sk;
@@ -1289,7 +1732,96 @@ drop:
 
 __inline__ int udp_rcv(struct sk_buff *skb)
 {
-	return __udp4_lib_rcv(skb, udp_hash, 0);
+	return __udp4_lib_rcv(skb, &udp_table, 0);
+}
+
+int udp4_gso_send_check(struct sk_buff *skb)
+{
+	struct iphdr *iph;
+	struct udphdr *uh;
+
+	if (!(skb_shinfo(skb)->gso_type & SKB_GSO_UDP_L4))
+		return -EPROTONOSUPPORT;
+
+	if (!pskb_may_pull(skb, sizeof(*uh)))
+		return -EINVAL;
+
+	iph = skb->nh.iph;
+	uh = skb->h.uh;
+
+	uh->check = 0;
+	uh->check = ~csum_tcpudp_magic(iph->saddr, iph->daddr, skb->len,
+				       IPPROTO_UDP, 0);
+	skb->csum_offset = offsetof(struct udphdr, check);
+	skb->ip_summed = CHECKSUM_PARTIAL;
+	return 0;
+}
+
+/*
+ * Cut a SKB_GSO_UDP_L4 datagram into gso_size datagrams.  skb_segment()
+ * copies the UDP header to every segment; its length and checksum are
+ * fixed up here and the IP header by inet_gso_segment().
+ */
+struct sk_buff *udp4_gso_segment(struct sk_buff *skb, int features)
+{
+	struct sk_buff *segs = ERR_PTR(-EINVAL);
+	struct udphdr *uh;
+	unsigned int mss;
+	unsigned int oldlen;
+	unsigned int ulen;
+	__be32 delta;
+
+	if (!(skb_shinfo(skb)->gso_type & SKB_GSO_UDP_L4)) {
+		segs = ERR_PTR(-EPROTONOSUPPORT);
+		goto out;
+	}
+
+	if (!pskb_may_pull(skb, sizeof(*uh)))
+		goto out;
+
+	mss = skb_shinfo(skb)->gso_size;
+	if (skb->len <= sizeof(*uh) + mss)
+		goto out;
+
+	oldlen = (u16)~skb->len;
+	__skb_pull(skb, sizeof(*uh));
+
+	if (skb_gso_ok(skb, features | NETIF_F_GSO_ROBUST)) {
+		/* Packet is from an untrusted source, reset gso_segs. */
+		int type = skb_shinfo(skb)->gso_type;
+
+		if (unlikely(type & ~(SKB_GSO_UDP_L4 | SKB_GSO_DODGY)))
+			goto out;
+
+		skb_shinfo(skb)->gso_segs = (skb->len + mss - 1) / mss;
+
+		segs = NULL;
+		goto out;
+	}
+
+	segs = skb_segment(skb, features);
+	if (IS_ERR(segs))
+		goto out;
+
+	for (skb = segs; skb; skb = skb->next) {
+		uh = skb->h.uh;
+		ulen = skb->tail - skb->h.raw + skb->data_len;
+		delta = htonl(oldlen + ulen);
+
+		uh->len = htons(ulen);
+		uh->check = ~csum_fold((__force __wsum)((__force u32)uh->check +
+				       (__force u32)delta));
+		if (skb->ip_summed != CHECKSUM_PARTIAL) {
+			uh->check = csum_fold(csum_partial(skb->h.raw,
+							   sizeof(*uh),
+							   skb->csum));
+			if (uh->check == 0)
+				uh->check = CSUM_MANGLED_0;
+		}
+	}
+
+out:
+	return segs;
 }
 
 int udp_destroy_sock(struct sock *sk)
@@ -1297,6 +1829,7 @@ int udp_destroy_sock(struct sock *sk)
 	lock_sock(sk);
 	udp_flush_pending_frames(sk);
 	release_sock(sk);
+	udp_purge_reader_queue(sk);
 	return 0;
 }
 
@@ -1342,6 +1875,15 @@ int udp_lib_setsockopt(struct sock *sk, int level, int optname,
 		}
 		break;
 
+	/* Only IPv4 output knows how to build a GSO datagram. */
+	case UDP_SEGMENT:
+		if (sk->sk_family != PF_INET || up->pcflag)
+			return -ENOPROTOOPT;
+		if (val < 0 || val > 0xFFFF)
+			return -EINVAL;
+		up->gso_size = val;
+		break;
+
 	/*
 	 * 	UDP-Lite's partial checksum coverage (RFC 3828).
 	 */
@@ -1419,6 +1961,10 @@ int udp_lib_getsockopt(struct sock *sk, int level, int optname,
 		val = up->encap_type;
 		break;
 
+	case UDP_SEGMENT:
+		val = up->gso_size;
+		break;
+
 	/* The following two cannot be changed on UDP sockets, the return is
 	 * always 0 (which corresponds to the full checksum coverage of UDP). */
 	case UDPLITE_SEND_CSCOV:
@@ -1474,32 +2020,18 @@ unsigned int udp_poll(struct file *file, struct socket *sock, poll_table *wait)
 {
 	unsigned int mask = datagram_poll(file, sock, wait);
 	struct sock *sk = sock->sk;
-	int 	is_lite = IS_UDPLITE(sk);
+
+	/* datagram_poll() only looks at the producers' side */
+	if (!skb_queue_empty(&udp_sk(sk)->reader_queue))
+		mask |= POLLIN | POLLRDNORM;
 
 	/* Check for false positives due to checksum errors */
 	if ( (mask & POLLRDNORM) &&
 	     !(file->f_flags & O_NONBLOCK) &&
-	     !(sk->sk_shutdown & RCV_SHUTDOWN)){
-		struct sk_buff_head *rcvq = &sk->sk_receive_queue;
-		struct sk_buff *skb;
-
-		spin_lock_bh(&rcvq->lock);
-		while ((skb = skb_peek(rcvq)) != NULL) {
-			if (udp_lib_checksum_complete(skb)) {
-				UDP_INC_STATS_BH(UDP_MIB_INERRORS, is_lite);
-				__skb_unlink(skb, rcvq);
-				kfree_skb(skb);
-			} else {
-				skb->ip_summed = CHECKSUM_UNNECESSARY;
-				break;
-			}
-		}
-		spin_unlock_bh(&rcvq->lock);
-
+	     !(sk->sk_shutdown & RCV_SHUTDOWN) &&
+	     udp_first_packet_length(sk) == -1)
 		/* nothing to see, move along */
-		if (skb == NULL)
-			mask &= ~(POLLIN | POLLRDNORM);
-	}
+		mask &= ~(POLLIN | POLLRDNORM);
 
 	return mask;
 	
@@ -1512,6 +2044,7 @@ struct proto udp_prot = {
 	.connect	   = ip4_datagram_connect,
 	.disconnect	   = udp_disconnect,
 	.ioctl		   = udp_ioctl,
+	.init		   = udp_lib_init_sock,
 	.destroy	   = udp_destroy_sock,
 	.setsockopt	   = udp_setsockopt,
 	.getsockopt	   = udp_getsockopt,
@@ -1521,6 +2054,7 @@ struct proto udp_prot = {
 	.backlog_rcv	   = udp_queue_rcv_skb,
 	.hash		   = udp_lib_hash,
 	.unhash		   = udp_lib_unhash,
+	.rehash		   = udp_v4_rehash,
 	.get_port	   = udp_v4_get_port,
 	.obj_size	   = sizeof(struct udp_sock),
 #ifdef CONFIG_COMPAT
@@ -1532,17 +2066,30 @@ struct proto udp_prot = {
 /* ------------------------------------------------------------------------ */
 #ifdef CONFIG_PROC_FS
 
-static struct sock *udp_get_first(struct seq_file *seq)
+/*
+ * The slot holding the returned socket stays locked until the walk
+ * moves past it or udp_seq_stop() is called.
+ */
+static struct sock *udp_get_first(struct seq_file *seq, int start)
 {
 	struct sock *sk;
 	struct udp_iter_state *state = seq->private;
+	struct udp_table *udptable = state->udp_table;
 
-	for (state->bucket = 0; state->bucket < UDP_HTABLE_SIZE; ++state->bucket) {
+	for (state->bucket = start; state->bucket <= udptable->mask;
+	     ++state->bucket) {
 		struct hlist_node *node;
-		sk_for_each(sk, node, state->hashtable + state->bucket) {
+		struct udp_hslot *hslot = &udptable->hash[state->bucket];
+
+		if (hlist_empty(&hslot->head))
+			continue;
+
+		spin_lock_bh(&hslot->lock);
+		sk_for_each(sk, node, &hslot->head) {
 			if (sk->sk_family == state->family)
 				goto found;
 		}
+		spin_unlock_bh(&hslot->lock);
 	}
 	sk = NULL;
 found:
@@ -1555,20 +2102,18 @@ static struct sock *udp_get_next(struct seq_file *seq, struct sock *sk)
 
 	do {
 		sk = sk_next(sk);
-try_again:
-		;
 	} while (sk && sk->sk_family != state->family);
 
-	if (!sk && ++state->bucket < UDP_HTABLE_SIZE) {
-		sk = sk_head(state->hashtable + state->bucket);
-		goto try_again;
+	if (!sk) {
+		spin_unlock_bh(&state->udp_table->hash[state->bucket].lock);
+		return udp_get_first(seq, state->bucket + 1);
 	}
 	return sk;
 }
 
 static struct sock *udp_get_idx(struct seq_file *seq, loff_t pos)
 {
-	struct sock *sk = udp_get_first(seq);
+	struct sock *sk = udp_get_first(seq, 0);
 
 	if (sk)
 		while(pos && (sk = udp_get_next(seq, sk)) != NULL)
@@ -1578,7 +2123,10 @@ static struct sock *udp_get_idx(struct seq_file *seq, loff_t pos)
 
 static void *udp_seq_start(struct seq_file *seq, loff_t *pos)
 {
-	read_lock(&udp_hash_lock);
+	struct udp_iter_state *state = seq->private;
+
+	/* no slot locked yet */
+	state->bucket = state->udp_table->mask + 1;
 	return *pos ? udp_get_idx(seq, *pos-1) : (void *)1;
 }
 
@@ -1597,7 +2145,10 @@ static void *udp_seq_next(struct seq_file *seq, void *v, loff_t *pos)
 
 static void udp_seq_stop(struct seq_file *seq, void *v)
 {
-	read_unlock(&udp_hash_lock);
+	struct udp_iter_state *state = seq->private;
+
+	if (state->bucket <= state->udp_table->mask)
+		spin_unlock_bh(&state->udp_table->hash[state->bucket].lock);
 }
 
 static int udp_seq_open(struct inode *inode, struct file *file)
@@ -1610,7 +2161,7 @@ static int udp_seq_open(struct inode *inode, struct file *file)
 	if (!s)
 		goto out;
 	s->family		= afinfo->family;
-	s->hashtable		= afinfo->hashtable;
+	s->udp_table		= afinfo->udp_table;
 	s->seq_ops.start	= udp_seq_start;
 	s->seq_ops.next		= udp_seq_next;
 	s->seq_ops.show		= afinfo->seq_show;
@@ -1700,7 +2251,7 @@ static struct udp_seq_afinfo udp4_seq_afinfo = {
 	.owner		= THIS_MODULE,
 	.name		= "udp",
 	.family		= AF_INET,
-	.hashtable	= udp_hash,
+	.udp_table	= &udp_table,
 	.seq_show	= udp4_seq_show,
 	.seq_fops	= &udp4_seq_fops,
 };
@@ -1716,16 +2267,75 @@ void udp4_proc_exit(void)
 }
 #endif /* CONFIG_PROC_FS */
 
+static __initdata unsigned long uhash_entries;
+static int __init set_uhash_entries(char *str)
+{
+	if (!str)
+		return 0;
+	uhash_entries = simple_strtoul(str, &str, 0);
+	if (uhash_entries && uhash_entries < UDP_HTABLE_SIZE_MIN)
+		uhash_entries = UDP_HTABLE_SIZE_MIN;
+	return 1;
+}
+__setup("uhash_entries=", set_uhash_entries);
+
+/*
+ * One slot per 2MB of low memory, between UDP_HTABLE_SIZE_MIN and 64K
+ * slots; the secondary hash gets as many slots again.  The port
+ * allocator relies on the bounds: PORTS_PER_CHAIN bits cover one slot.
+ */
+void __init udp_table_init(struct udp_table *table, const char *name)
+{
+	unsigned int i;
+
+	if (!CONFIG_BASE_SMALL)
+		table->hash = alloc_large_system_hash(name,
+						      2 * sizeof(struct udp_hslot),
+						      uhash_entries,
+						      21,
+						      0,
+						      &table->log,
+						      &table->mask,
+						      MAX_UDP_PORTS);
+	/*
+	 * Make sure hash table has the minimum size
+	 */
+	if (CONFIG_BASE_SMALL || table->mask < UDP_HTABLE_SIZE_MIN - 1) {
+		table->hash = kmalloc(UDP_HTABLE_SIZE_MIN *
+				      2 * sizeof(struct udp_hslot), GFP_KERNEL);
+		if (!table->hash)
+			panic(name);
+		table->log = ilog2(UDP_HTABLE_SIZE_MIN);
+		table->mask = UDP_HTABLE_SIZE_MIN - 1;
+	}
+	table->hash2 = table->hash + (table->mask + 1);
+	for (i = 0; i <= table->mask; i++) {
+		INIT_HLIST_HEAD(&table->hash[i].head);
+		table->hash[i].count = 0;
+		spin_lock_init(&table->hash[i].lock);
+	}
+	for (i = 0; i <= table->mask; i++) {
+		INIT_HLIST_HEAD(&table->hash2[i].head);
+		table->hash2[i].count = 0;
+		spin_lock_init(&table->hash2[i].lock);
+	}
+}
+
 EXPORT_SYMBOL(udp_disconnect);
-EXPORT_SYMBOL(udp_hash);
-EXPORT_SYMBOL(udp_hash_lock);
+EXPORT_SYMBOL(udp_table);
 EXPORT_SYMBOL(udp_ioctl);
 EXPORT_SYMBOL(udp_get_port);
+EXPORT_SYMBOL(udp_lib_unhash);
+EXPORT_SYMBOL(udp_lib_rehash);
 EXPORT_SYMBOL(udp_prot);
 EXPORT_SYMBOL(udp_sendmsg);
+EXPORT_SYMBOL(udp_cmsg_send);
 EXPORT_SYMBOL(udp_lib_getsockopt);
 EXPORT_SYMBOL(udp_lib_setsockopt);
 EXPORT_SYMBOL(udp_poll);
+EXPORT_SYMBOL(udp_recv_datagram);
+EXPORT_SYMBOL(udp_kill_datagram);
+EXPORT_SYMBOL(udp_purge_reader_queue);
 
 #ifdef CONFIG_PROC_FS
 EXPORT_SYMBOL(udp_proc_register);
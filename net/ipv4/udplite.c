@@ -15,28 +15,36 @@
 #include "udp_impl.h"
 DEFINE_SNMP_STAT(struct udp_mib, udplite_statistics)	__read_mostly;
 
-struct hlist_head 	udplite_hash[UDP_HTABLE_SIZE];
-static int		udplite_port_rover;
+struct udp_table 	udplite_table;
 
 int udplite_get_port(struct sock *sk, unsigned short p,
 		     int (*c)(const struct sock *, const struct sock *))
 {
-	return  __udp_lib_get_port(sk, p, udplite_hash, &udplite_port_rover, c);
+	return  __udp_lib_get_port(sk, p, &udplite_table, c);
 }
 
 static int udplite_v4_get_port(struct sock *sk, unsigned short snum)
 {
+	udp_sk(sk)->udp_portaddr_hash =
+		udp4_portaddr_hash(inet_sk(sk)->rcv_saddr, 0);
 	return udplite_get_port(sk, snum, ipv4_rcv_saddr_equal);
 }
 
+static void udplite_v4_rehash(struct sock *sk)
+{
+	struct inet_sock *inet = inet_sk(sk);
+
+	udp_lib_rehash(sk, udp4_portaddr_hash(inet->rcv_saddr, inet->num));
+}
+
 static int udplite_rcv(struct sk_buff *skb)
 {
-	return __udp4_lib_rcv(skb, udplite_hash, 1);
+	return __udp4_lib_rcv(skb, &udplite_table, 1);
 }
 
 static void udplite_err(struct sk_buff *skb, u32 info)
 {
-	return __udp4_lib_err(skb, info, udplite_hash);
+	return __udp4_lib_err(skb, info, &udplite_table);
 }
 
 static	struct net_protocol udplite_protocol = {
@@ -62,6 +70,7 @@ struct proto 	udplite_prot = {
 	.backlog_rcv	   = udp_queue_rcv_skb,
 	.hash		   = udp_lib_hash,
 	.unhash		   = udp_lib_unhash,
+	.rehash		   = udplite_v4_rehash,
 	.get_port	   = udplite_v4_get_port,
 	.obj_size	   = sizeof(struct udp_sock),
 #ifdef CONFIG_COMPAT
@@ -86,7 +95,7 @@ static struct udp_seq_afinfo udplite4_seq_afinfo = {
 	.owner		= THIS_MODULE,
 	.name		= "udplite",
 	.family		= AF_INET,
-	.hashtable	= udplite_hash,
+	.udp_table	= &udplite_table,
 	.seq_show	= udp4_seq_show,
 	.seq_fops	= &udplite4_seq_fops,
 };
@@ -94,6 +103,7 @@ static struct udp_seq_afinfo udplite4_seq_afinfo = {
 
 void __init udplite4_register(void)
 {
+	udp_table_init(&udplite_table, "UDP-Lite");
 	if (proto_register(&udplite_prot, 1))
 		goto out_register_err;
 
@@ -114,6 +124,6 @@ out_register_err:
 	printk(KERN_CRIT "%s: Cannot add UDP-Lite protocol.\n", __FUNCTION__);
 }
 
-EXPORT_SYMBOL(udplite_hash);
+EXPORT_SYMBOL(udplite_table);
 EXPORT_SYMBOL(udplite_prot);
 EXPORT_SYMBOL(udplite_get_port);
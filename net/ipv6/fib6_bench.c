@@ -0,0 +1,138 @@
+/*
+ *	IPv6 FIB lookup micro benchmark
+ *
+ *	Times fib6_lookup() with the stride index against the plain bit
+ *	at a time radix descent on the same table and the same keys, and
+ *	cross checks that both return the same node.  Results are printed
+ *	when the module is loaded:
+ *
+ *		modprobe fib6_bench table=254 lookups=4000000
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License
+ *	as published by the Free Software Foundation; either version
+ *	2 of the License, or (at your option) any later version.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/moduleparam.h>
+#include <linux/random.h>
+#include <linux/vmalloc.h>
+#include <linux/time.h>
+#include <linux/in6.h>
+#include <asm/div64.h>
+#include <net/ip6_fib.h>
+
+#define FIB6_BENCH_KEYS	4096	/* must be a power of two */
+
+static int table = RT6_TABLE_MAIN;
+module_param(table, int, 0);
+MODULE_PARM_DESC(table, "routing table to benchmark");
+
+static int lookups = 1000000;
+module_param(lookups, int, 0);
+MODULE_PARM_DESC(lookups, "number of lookups per run");
+
+typedef struct fib6_node *(*fib6_bench_fn)(struct fib6_node *root,
+					   struct in6_addr *daddr,
+					   struct in6_addr *saddr);
+
+static struct in6_addr fib6_bench_saddr;
+
+static u64 fib6_bench_run(struct fib6_table *tb, struct in6_addr *keys,
+			  fib6_bench_fn lookup, unsigned long *hits)
+{
+	struct fib6_node *fn;
+	struct timespec start, end;
+	int i;
+
+	*hits = 0;
+	ktime_get_ts(&start);
+	for (i = 0; i < lookups; i++) {
+		read_lock_bh(&tb->tb6_lock);
+		fn = lookup(&tb->tb6_root, &keys[i & (FIB6_BENCH_KEYS - 1)],
+			    &fib6_bench_saddr);
+		if (fn != &tb->tb6_root)
+			(*hits)++;
+		read_unlock_bh(&tb->tb6_lock);
+	}
+	ktime_get_ts(&end);
+
+	return timespec_to_ns(&end) - timespec_to_ns(&start);
+}
+
+static int fib6_bench_verify(struct fib6_table *tb, struct in6_addr *keys)
+{
+	int i, bad = 0;
+
+	read_lock_bh(&tb->tb6_lock);
+	for (i = 0; i < FIB6_BENCH_KEYS; i++)
+		if (fib6_lookup(&tb->tb6_root, &keys[i], &fib6_bench_saddr) !=
+		    fib6_lookup_radix(&tb->tb6_root, &keys[i],
+				      &fib6_bench_saddr))
+			bad++;
+	read_unlock_bh(&tb->tb6_lock);
+
+	return bad;
+}
+
+static int __init fib6_bench_init(void)
+{
+	struct fib6_table *tb;
+	struct in6_addr *keys;
+	unsigned long hits_stride, hits_radix;
+	u64 ns_stride, ns_radix, per_stride, per_radix;
+	int i, bad;
+
+	if (lookups <= 0)
+		return -EINVAL;
+
+	tb = fib6_get_table(table);
+	if (tb == NULL) {
+		printk(KERN_ERR "fib6_bench: no table %d\n", table);
+		return -ENOENT;
+	}
+
+	keys = vmalloc(FIB6_BENCH_KEYS * sizeof(*keys));
+	if (keys == NULL)
+		return -ENOMEM;
+
+	/* Random global unicast destinations (2000::/3) */
+	get_random_bytes(keys, FIB6_BENCH_KEYS * sizeof(*keys));
+	for (i = 0; i < FIB6_BENCH_KEYS; i++)
+		keys[i].s6_addr[0] = (keys[i].s6_addr[0] & 0x1f) | 0x20;
+
+	bad = fib6_bench_verify(tb, keys);
+	ns_radix = fib6_bench_run(tb, keys, fib6_lookup_radix, &hits_radix);
+	ns_stride = fib6_bench_run(tb, keys, fib6_lookup, &hits_stride);
+	per_radix = ns_radix;
+	do_div(per_radix, lookups);
+	per_stride = ns_stride;
+	do_div(per_stride, lookups);
+
+	printk(KERN_INFO "fib6_bench: table %d, %u routes, stride index %s\n",
+	       table, tb->tb6_nroutes,
+	       tb->tb6_stride_valid ? "valid" : "not built");
+	printk(KERN_INFO "fib6_bench: radix  %d lookups %llu ns (%llu ns/lookup), %lu hits\n",
+	       lookups, (unsigned long long)ns_radix,
+	       (unsigned long long)per_radix, hits_radix);
+	printk(KERN_INFO "fib6_bench: stride %d lookups %llu ns (%llu ns/lookup), %lu hits\n",
+	       lookups, (unsigned long long)ns_stride,
+	       (unsigned long long)per_stride, hits_stride);
+	if (bad)
+		printk(KERN_ERR "fib6_bench: %d of %d keys resolved differently\n",
+		       bad, FIB6_BENCH_KEYS);
+
+	vfree(keys);
+	return 0;
+}
+
+static void __exit fib6_bench_exit(void)
+{
+}
+
+module_init(fib6_bench_init);
+module_exit(fib6_bench_exit);
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("IPv6 FIB lookup benchmark");
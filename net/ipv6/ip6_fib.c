@@ -28,6 +28,7 @@
 #include <linux/in6.h>
 #include <linux/init.h>
 #include <linux/list.h>
+#include <linux/vmalloc.h>
 
 #ifdef 	CONFIG_PROC_FS
 #include <linux/proc_fs.h>
@@ -167,6 +168,116 @@ static __inline__ void rt6_release(struct rt6_info *rt)
 		dst_free(&rt->u.dst);
 }
 
+/*
+ *	Stride index.
+ *
+ *	The index only caches where the descent stands after the first
+ *	FIB6_STRIDE_BITS bits, so it goes stale only when a child link of
+ *	a node testing one of those bits changes.  Such changes clear
+ *	tb6_stride_valid under the table write lock and kick a rebuild;
+ *	readers hold the read lock and simply ignore an invalid index.
+ */
+
+static void fib6_stride_fill(struct fib6_table *tb, struct fib6_node **stride)
+{
+	struct fib6_node *fn, *next;
+	struct in6_addr addr;
+	u32 v;
+
+	memset(&addr, 0, sizeof(addr));
+	for (v = 0; v < FIB6_STRIDE_SIZE; v++) {
+		addr.s6_addr32[0] = htonl(v << (32 - FIB6_STRIDE_BITS));
+
+		fn = &tb->tb6_root;
+		while (fn->fn_bit < FIB6_STRIDE_BITS) {
+			next = addr_bit_set(&addr, fn->fn_bit) ?
+			       fn->right : fn->left;
+			if (next == NULL)
+				break;
+			fn = next;
+		}
+		stride[v] = fn;
+	}
+}
+
+static void fib6_stride_work(struct work_struct *work)
+{
+	struct fib6_table *tb = container_of(work, struct fib6_table,
+					     tb6_stride_work);
+	struct fib6_node **stride = tb->tb6_stride;
+	unsigned int gen;
+
+	if (tb->tb6_nroutes < FIB6_STRIDE_MIN_ROUTES)
+		return;
+
+	if (stride == NULL) {
+		stride = vmalloc(FIB6_STRIDE_SIZE * sizeof(*stride));
+		if (stride == NULL)
+			return;
+	}
+
+	/* Nobody reads the array while it is marked invalid. */
+	read_lock_bh(&tb->tb6_lock);
+	gen = tb->tb6_stride_gen;
+	fib6_stride_fill(tb, stride);
+	read_unlock_bh(&tb->tb6_lock);
+
+	write_lock_bh(&tb->tb6_lock);
+	tb->tb6_stride = stride;
+	if (gen == tb->tb6_stride_gen)
+		tb->tb6_stride_valid = 1;
+	write_unlock_bh(&tb->tb6_lock);
+}
+
+static void fib6_stride_invalidate(struct fib6_node *pn)
+{
+	struct fib6_table *tb;
+
+	if (pn->fn_bit >= FIB6_STRIDE_BITS)
+		return;
+
+	/* Subtree roots hang off a main tree node; fresh ones are unlinked */
+	while (pn && !(pn->fn_flags & RTN_TL_ROOT))
+		pn = pn->parent;
+	if (pn == NULL)
+		return;
+
+	tb = container_of(pn, struct fib6_table, tb6_root);
+	tb->tb6_stride_valid = 0;
+	tb->tb6_stride_gen++;
+	if (tb->tb6_nroutes >= FIB6_STRIDE_MIN_ROUTES)
+		schedule_work(&tb->tb6_stride_work);
+}
+
+static __inline__ void fib6_stride_account(struct rt6_info *rt, int delta)
+{
+	struct fib6_table *tb = rt->rt6i_table;
+
+	if (tb == NULL)
+		return;
+
+	tb->tb6_nroutes += delta;
+	if (!tb->tb6_stride_valid &&
+	    tb->tb6_nroutes == FIB6_STRIDE_MIN_ROUTES)
+		schedule_work(&tb->tb6_stride_work);
+}
+
+static __inline__ struct fib6_node *fib6_stride_start(struct fib6_node *root,
+						      struct in6_addr *daddr)
+{
+	struct fib6_table *tb;
+
+	if (daddr == NULL || !(root->fn_flags & RTN_TL_ROOT))
+		return root;
+
+	tb = container_of(root, struct fib6_table, tb6_root);
+	if (!tb->tb6_stride_valid)
+		return root;
+
+	return tb->tb6_stride[ntohl(daddr->s6_addr32[0]) >>
+			      (32 - FIB6_STRIDE_BITS)];
+}
+
 static struct fib6_table fib6_main_tbl = {
 	.tb6_id		= RT6_TABLE_MAIN,
 	.tb6_root	= {
@@ -191,6 +302,7 @@ static void fib6_link_table(struct fib6_table *tb)
 	 * tables aren't visible prior to being linked to the list.
 	 */
 	rwlock_init(&tb->tb6_lock);
+	INIT_WORK(&tb->tb6_stride_work, fib6_stride_work);
 
 	h = tb->tb6_id & (FIB_TABLE_HASHSZ - 1);
 
@@ -498,6 +610,7 @@ static struct fib6_node * fib6_add_1(struct fib6_node *root, void *addr,
 		pn->right = ln;
 	else
 		pn->left  = ln;
+	fib6_stride_invalidate(pn);
 
 	return ln;
 
@@ -559,6 +672,7 @@ insert_above:
 			pn->right = in;
 		else
 			pn->left  = in;
+		fib6_stride_invalidate(pn);
 
 		ln->fn_bit = plen;
 
@@ -597,6 +711,7 @@ insert_above:
 			pn->right = ln;
 		else
 			pn->left  = ln;
+		fib6_stride_invalidate(pn);
 
 		if (addr_bit_set(&key->addr, plen))
 			ln->right = fn;
@@ -670,6 +785,7 @@ out:
 	atomic_inc(&rt->rt6i_ref);
 	inet6_rt_notify(RTM_NEWROUTE, rt, info);
 	rt6_stats.fib_rt_entries++;
+	fib6_stride_account(rt, 1);
 
 	if ((fn->fn_flags & RTN_RTINFO) == 0) {
 		rt6_stats.fib_route_nodes++;
@@ -881,8 +997,10 @@ static struct fib6_node * fib6_lookup_1(struct fib6_node *root,
 	return NULL;
 }
 
-struct fib6_node * fib6_lookup(struct fib6_node *root, struct in6_addr *daddr,
-			       struct in6_addr *saddr)
+static struct fib6_node *__fib6_lookup(struct fib6_node *root,
+				       struct fib6_node *start,
+				       struct in6_addr *daddr,
+				       struct in6_addr *saddr)
 {
 	struct fib6_node *fn;
 	struct lookup_args args[] = {
@@ -901,7 +1019,8 @@ struct fib6_node * fib6_lookup(struct fib6_node *root, struct in6_addr *daddr,
 		}
 	};
 
-	fn = fib6_lookup_1(root, daddr ? args : args + 1);
+	/* Backtracking stops at RTN_ROOT, so a deeper start is harmless */
+	fn = fib6_lookup_1(start, daddr ? args : args + 1);
 
 	if (fn == NULL || fn->fn_flags & RTN_TL_ROOT)
 		fn = root;
@@ -909,6 +1028,21 @@ struct fib6_node * fib6_lookup(struct fib6_node *root, struct in6_addr *daddr,
 	return fn;
 }
 
+struct fib6_node * fib6_lookup(struct fib6_node *root, struct in6_addr *daddr,
+			       struct in6_addr *saddr)
+{
+	return __fib6_lookup(root, fib6_stride_start(root, daddr),
+			     daddr, saddr);
+}
+
+/* Plain radix tree descent, bypassing the stride index. */
+struct fib6_node *fib6_lookup_radix(struct fib6_node *root,
+				    struct in6_addr *daddr,
+				    struct in6_addr *saddr)
+{
+	return __fib6_lookup(root, root, daddr, saddr);
+}
+
 /*
  *	Get node with specified destination prefix (and source prefix,
  *	if subtrees are used)
@@ -1051,6 +1185,7 @@ static struct fib6_node * fib6_repair_tree(struct fib6_node *fn)
 #endif
 			if (child)
 				child->parent = pn;
+			fib6_stride_invalidate(pn);
 			nstate = FWS_R;
 #ifdef CONFIG_IPV6_SUBTREES
 		}
@@ -1109,6 +1244,7 @@ static void fib6_del_route(struct fib6_node *fn, struct rt6_info **rtp,
 	rt->rt6i_node = NULL;
 	rt6_stats.fib_rt_entries--;
 	rt6_stats.fib_discarded_routes++;
+	fib6_stride_account(rt, -1);
 
 	/* Adjust walkers */
 	read_lock(&fib6_walker_lock);
@@ -34,4 +34,12 @@ EXPORT_SYMBOL(xfrm6_input_addr);
 EXPORT_SYMBOL(xfrm6_find_1stfragopt);
 #endif
 EXPORT_SYMBOL(rt6_lookup);
+EXPORT_SYMBOL_GPL(fib6_get_table);
+EXPORT_SYMBOL_GPL(fib6_lookup);
+EXPORT_SYMBOL_GPL(fib6_lookup_radix);
 EXPORT_SYMBOL(ipv6_push_nfrag_opts);
+EXPORT_SYMBOL_GPL(inet6_hash_frag);
+EXPORT_SYMBOL_GPL(ip6_frag_hashfn);
+EXPORT_SYMBOL_GPL(ip6_frag_keyhash);
+EXPORT_SYMBOL_GPL(ip6_frag_match);
+EXPORT_SYMBOL_GPL(ip6_frag_init);
@@ -77,13 +77,11 @@ do {								\
 #endif
 
 /*
-   We keep a set of rules for each CPU, so we can avoid write-locking
-   them in the softirq when updating the counters and therefore
-   only need to read-lock in the softirq; doing a write_lock_bh() in user
-   context stops packets coming through and allows user context to read
-   the counters or update the rules.
-
-   Hence the start of any table is given by get_table() below.  */
+   All CPUs share one read-only copy of the rules, found under RCU;
+   each CPU counts into its own array, indexed by rule number, so the
+   softirq never writes to the rules and takes no lock.  A replace
+   swaps in the new table and waits for readers to leave the old one.
+*/
 
 #if 0
 #define down(x) do { printk("DOWN:%u:" #x "\n", __LINE__); down(x); } while(0)
@@ -266,8 +264,11 @@ ip6t_do_table(struct sk_buff **pskb,
 	unsigned int verdict = NF_DROP;
 	const char *indev, *outdev;
 	void *table_base;
-	struct ip6t_entry *e, *back;
+	struct ip6t_entry *e;
 	struct xt_table_info *private;
+	struct xt_counters *counters;
+	void **jumpstack;
+	unsigned int *stackptr, origptr, addend;
 
 	/* Initialization */
 	indev = in ? in->name : nulldevname;
@@ -279,18 +280,19 @@ ip6t_do_table(struct sk_buff **pskb,
 	 * rule is also a fragment-specific rule, non-fragments won't
 	 * match it. */
 
-	read_lock_bh(&table->lock);
-	private = table->private;
+	rcu_read_lock_bh();
+	private = rcu_dereference(table->private);
 	IP_NF_ASSERT(table->valid_hooks & (1 << hook));
-	table_base = (void *)private->entries[smp_processor_id()];
+	table_base = (void *)private->entries;
+	counters = private->counters[smp_processor_id()];
+	jumpstack = private->jumpstack[smp_processor_id()];
+	stackptr = per_cpu_ptr(private->stackptr, smp_processor_id());
+	origptr = *stackptr;
+	addend = xt_write_recseq_begin();
 	e = get_entry(table_base, private->hook_entry[hook]);
 
-	/* For return from builtin chain */
-	back = get_entry(table_base, private->underflow[hook]);
-
 	do {
 		IP_NF_ASSERT(e);
-		IP_NF_ASSERT(back);
 		if (ip6_packet_match(*pskb, indev, outdev, &e->ipv6,
 			&protoff, &offset, &hotdrop)) {
 			struct ip6t_entry_target *t;
@@ -300,7 +302,7 @@ ip6t_do_table(struct sk_buff **pskb,
 					       offset, protoff, &hotdrop) != 0)
 				goto no_match;
 
-			ADD_COUNTER(e->counters,
+			ADD_COUNTER(counters[e->counters.pcnt],
 				    ntohs((*pskb)->nh.ipv6h->payload_len)
 				    + IPV6_HDR_LEN,
 				    1);
@@ -318,47 +320,36 @@ ip6t_do_table(struct sk_buff **pskb,
 						verdict = (unsigned)(-v) - 1;
 						break;
 					}
-					e = back;
-					back = get_entry(table_base,
-							 back->comefrom);
+					/* Return from builtin chain */
+					if (*stackptr <= origptr) {
+						e = get_entry(table_base,
+							private->underflow[hook]);
+						continue;
+					}
+					e = jumpstack[--*stackptr];
+					e = (void *)e + e->next_offset;
 					continue;
 				}
 				if (table_base + v != (void *)e + e->next_offset
 				    && !(e->ipv6.flags & IP6T_F_GOTO)) {
-					/* Save old back ptr in next entry */
-					struct ip6t_entry *next
-						= (void *)e + e->next_offset;
-					next->comefrom
-						= (void *)back - table_base;
-					/* set back pointer to next entry */
-					back = next;
+					/* Push the jump, return after it */
+					if (*stackptr >= private->stacksize) {
+						verdict = NF_DROP;
+						break;
+					}
+					jumpstack[(*stackptr)++] = e;
 				}
 
 				e = get_entry(table_base, v);
 			} else {
 				/* Targets which reenter must return
                                    abs. verdicts */
-#ifdef CONFIG_NETFILTER_DEBUG
-				((struct ip6t_entry *)table_base)->comefrom
-					= 0xeeeeeeec;
-#endif
 				verdict = t->u.kernel.target->target(pskb,
 								     in, out,
 								     hook,
 								     t->u.kernel.target,
 								     t->data);
 
-#ifdef CONFIG_NETFILTER_DEBUG
-				if (((struct ip6t_entry *)table_base)->comefrom
-				    != 0xeeeeeeec
-				    && verdict == IP6T_CONTINUE) {
-					printk("Target %s reentered!\n",
-					       t->u.kernel.target->name);
-					verdict = NF_DROP;
-				}
-				((struct ip6t_entry *)table_base)->comefrom
-					= 0x57acc001;
-#endif
 				if (verdict == IP6T_CONTINUE)
 					e = (void *)e + e->next_offset;
 				else
@@ -372,10 +363,9 @@ ip6t_do_table(struct sk_buff **pskb,
 		}
 	} while (!hotdrop);
 
-#ifdef CONFIG_NETFILTER_DEBUG
-	((struct ip6t_entry *)table_base)->comefrom = NETFILTER_LINK_POISON;
-#endif
-	read_unlock_bh(&table->lock);
+	*stackptr = origptr;
+	xt_write_recseq_end(addend);
+	rcu_read_unlock_bh();
 
 #ifdef DEBUG_ALLOW_ALL
 	return NF_ACCEPT;
@@ -688,6 +678,31 @@ cleanup_entry(struct ip6t_entry *e, unsigned int *i)
 	return 0;
 }
 
+/* Number the rules for the per-cpu counters, and count the chains: each
+   user chain starts with an ERROR target, so this bounds the jump stack. */
+static inline int
+index_entry(struct ip6t_entry *e, struct xt_table_info *newinfo,
+	    unsigned int *i)
+{
+	struct ip6t_entry_target *t = ip6t_get_target(e);
+
+	e->counters.pcnt = (*i)++;
+	e->counters.bcnt = 0;
+	if (strcmp(t->u.kernel.target->name, IP6T_ERROR_TARGET) == 0)
+		newinfo->stacksize++;
+	return 0;
+}
+
+static int
+index_entries(struct xt_table_info *newinfo, void *entry0)
+{
+	unsigned int i = 0;
+
+	newinfo->stacksize = 0;
+	IP6T_ENTRY_ITERATE(entry0, newinfo->size, index_entry, newinfo, &i);
+	return xt_alloc_table_percpu(newinfo);
+}
+
 /* Checks and translates the user-supplied table segment (held in
    newinfo) */
 static int
@@ -761,70 +776,11 @@ translate_table(const char *name,
 		return ret;
 	}
 
-	/* And one copy for every other CPU */
-	for_each_possible_cpu(i) {
-		if (newinfo->entries[i] && newinfo->entries[i] != entry0)
-			memcpy(newinfo->entries[i], entry0, newinfo->size);
-	}
-
-	return 0;
-}
-
-/* Gets counters. */
-static inline int
-add_entry_to_counter(const struct ip6t_entry *e,
-		     struct xt_counters total[],
-		     unsigned int *i)
-{
-	ADD_COUNTER(total[*i], e->counters.bcnt, e->counters.pcnt);
-
-	(*i)++;
-	return 0;
-}
-
-static inline int
-set_entry_to_counter(const struct ip6t_entry *e,
-		     struct ip6t_counters total[],
-		     unsigned int *i)
-{
-	SET_COUNTER(total[*i], e->counters.bcnt, e->counters.pcnt);
-
-	(*i)++;
-	return 0;
-}
-
-static void
-get_counters(const struct xt_table_info *t,
-	     struct xt_counters counters[])
-{
-	unsigned int cpu;
-	unsigned int i;
-	unsigned int curcpu;
-
-	/* Instead of clearing (by a previous call to memset())
-	 * the counters and using adds, we set the counters
-	 * with data used by 'current' CPU
-	 * We dont care about preemption here.
-	 */
-	curcpu = raw_smp_processor_id();
-
-	i = 0;
-	IP6T_ENTRY_ITERATE(t->entries[curcpu],
-			   t->size,
-			   set_entry_to_counter,
-			   counters,
-			   &i);
-
-	for_each_possible_cpu(cpu) {
-		if (cpu == curcpu)
-			continue;
-		i = 0;
-		IP6T_ENTRY_ITERATE(t->entries[cpu],
-				  t->size,
-				  add_entry_to_counter,
-				  counters,
-				  &i);
-	}
+	ret = index_entries(newinfo, entry0);
+	if (ret != 0)
+		IP6T_ENTRY_ITERATE(entry0, newinfo->size,
+				   cleanup_entry, NULL);
+	return ret;
 }
 
 static int
@@ -839,22 +795,17 @@ copy_entries_to_user(unsigned int total_size,
 	int ret = 0;
 	void *loc_cpu_entry;
 
-	/* We need atomic snapshot of counters: rest doesn't change
-	   (other than comefrom, which userspace doesn't care
-	   about). */
+	/* The rules don't change under the table mutex, and the
+	   counters are snapshotted per CPU without stopping packets. */
 	countersize = sizeof(struct xt_counters) * private->number;
 	counters = vmalloc(countersize);
 
 	if (counters == NULL)
 		return -ENOMEM;
 
-	/* First, sum counters... */
-	write_lock_bh(&table->lock);
-	get_counters(private, counters);
-	write_unlock_bh(&table->lock);
+	xt_get_counters(private, counters);
 
-	/* choose the copy that is on ourc node/cpu */
-	loc_cpu_entry = private->entries[raw_smp_processor_id()];
+	loc_cpu_entry = private->entries;
 	if (copy_to_user(userptr, loc_cpu_entry, total_size) != 0) {
 		ret = -EFAULT;
 		goto free_counters;
@@ -959,8 +910,7 @@ do_replace(void __user *user, unsigned int len)
 	if (!newinfo)
 		return -ENOMEM;
 
-	/* choose the copy that is on our node/cpu */
-	loc_cpu_entry = newinfo->entries[raw_smp_processor_id()];
+	loc_cpu_entry = newinfo->entries;
 	if (copy_from_user(loc_cpu_entry, user + sizeof(tmp),
 			   tmp.size) != 0) {
 		ret = -EFAULT;
@@ -1011,9 +961,9 @@ do_replace(void __user *user, unsigned int len)
 		module_put(t->me);
 
 	/* Get the old counters. */
-	get_counters(oldinfo, counters);
+	xt_get_counters(oldinfo, counters);
 	/* Decrease module usage counts and free resource */
-	loc_cpu_old_entry = oldinfo->entries[raw_smp_processor_id()];
+	loc_cpu_old_entry = oldinfo->entries;
 	IP6T_ENTRY_ITERATE(loc_cpu_old_entry, oldinfo->size, cleanup_entry,NULL);
 	xt_free_table_info(oldinfo);
 	if (copy_to_user(tmp.counters, counters,
@@ -1035,37 +985,13 @@ do_replace(void __user *user, unsigned int len)
 	return ret;
 }
 
-/* We're lazy, and add to the first CPU; overflow works its fey magic
- * and everything is OK. */
-static inline int
-add_counter_to_entry(struct ip6t_entry *e,
-		     const struct xt_counters addme[],
-		     unsigned int *i)
-{
-#if 0
-	duprintf("add_counter: Entry %u %lu/%lu + %lu/%lu\n",
-		 *i,
-		 (long unsigned int)e->counters.pcnt,
-		 (long unsigned int)e->counters.bcnt,
-		 (long unsigned int)addme[*i].pcnt,
-		 (long unsigned int)addme[*i].bcnt);
-#endif
-
-	ADD_COUNTER(e->counters, addme[*i].bcnt, addme[*i].pcnt);
-
-	(*i)++;
-	return 0;
-}
-
 static int
 do_add_counters(void __user *user, unsigned int len)
 {
-	unsigned int i;
 	struct xt_counters_info tmp, *paddc;
 	struct xt_table_info *private;
 	struct xt_table *t;
 	int ret = 0;
-	void *loc_cpu_entry;
 
 	if (copy_from_user(&tmp, user, sizeof(tmp)) != 0)
 		return -EFAULT;
@@ -1088,23 +1014,14 @@ do_add_counters(void __user *user, unsigned int len)
 		goto free;
 	}
 
-	write_lock_bh(&t->lock);
 	private = t->private;
 	if (private->number != tmp.num_counters) {
 		ret = -EINVAL;
 		goto unlock_up_free;
 	}
 
-	i = 0;
-	/* Choose the copy that is on our node */
-	loc_cpu_entry = private->entries[smp_processor_id()];
-	IP6T_ENTRY_ITERATE(loc_cpu_entry,
-			  private->size,
-			  add_counter_to_entry,
-			  paddc->counters,
-			  &i);
+	xt_add_counters(private, paddc->counters);
  unlock_up_free:
-	write_unlock_bh(&t->lock);
 	xt_table_unlock(t);
 	module_put(t->me);
  free:
@@ -1247,15 +1164,14 @@ int ip6t_register_table(struct xt_table *table,
 	int ret;
 	struct xt_table_info *newinfo;
 	static struct xt_table_info bootstrap
-		= { 0, 0, 0, { 0 }, { 0 }, { } };
+		= { 0, 0, 0, { 0 }, { 0 } };
 	void *loc_cpu_entry;
 
 	newinfo = xt_alloc_table_info(repl->size);
 	if (!newinfo)
 		return -ENOMEM;
 
-	/* choose the copy on our node/cpu */
-	loc_cpu_entry = newinfo->entries[raw_smp_processor_id()];
+	loc_cpu_entry = newinfo->entries;
 	memcpy(loc_cpu_entry, repl->entries, repl->size);
 
 	ret = translate_table(table->name, table->valid_hooks,
@@ -1285,7 +1201,7 @@ void ip6t_unregister_table(struct xt_table *table)
 	private = xt_unregister_table(table);
 
 	/* Decrease module usage counts and free resources */
-	loc_cpu_entry = private->entries[raw_smp_processor_id()];
+	loc_cpu_entry = private->entries;
 	IP6T_ENTRY_ITERATE(loc_cpu_entry, private->size, cleanup_entry, NULL);
 	xt_free_table_info(private);
 }
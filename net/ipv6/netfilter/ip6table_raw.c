@@ -109,7 +109,6 @@ static struct
 static struct xt_table packet_raw = { 
 	.name = "raw", 
 	.valid_hooks = RAW_VALID_HOOKS, 
-	.lock = RW_LOCK_UNLOCKED, 
 	.me = THIS_MODULE,
 	.af = AF_INET6,
 };
@@ -36,6 +36,7 @@
 #include <linux/icmpv6.h>
 #include <linux/init.h>
 #include <linux/skbuff.h>
+#include <linux/jhash.h>
 #include <asm/uaccess.h>
 
 #include <net/ndisc.h>
@@ -53,59 +54,158 @@
 
 DEFINE_SNMP_STAT(struct udp_mib, udp_stats_in6) __read_mostly;
 
+/* Must agree with udp4_portaddr_hash() for v4-mapped and unspecified
+ * addresses, so that dual-stack sockets share slots with IPv4 ones.
+ */
+unsigned int udp6_portaddr_hash(struct in6_addr *addr6, unsigned int port)
+{
+	unsigned int hash;
+
+	if (ipv6_addr_any(addr6))
+		hash = jhash_1word(0, 0);
+	else if (ipv6_addr_type(addr6) & IPV6_ADDR_MAPPED)
+		hash = jhash_1word((__force u32)addr6->s6_addr32[3], 0);
+	else
+		hash = jhash2((__force u32 *)addr6->s6_addr32, 4, 0);
+
+	return hash ^ port;
+}
+
 static inline int udp_v6_get_port(struct sock *sk, unsigned short snum)
 {
+	udp_sk(sk)->udp_portaddr_hash =
+		udp6_portaddr_hash(&inet6_sk(sk)->rcv_saddr, 0);
 	return udp_get_port(sk, snum, ipv6_rcv_saddr_equal);
 }
 
+void udp_v6_rehash(struct sock *sk)
+{
+	udp_lib_rehash(sk, udp6_portaddr_hash(&inet6_sk(sk)->rcv_saddr,
+					      inet_sk(sk)->num));
+}
+
+static inline int compute_score(struct sock *sk, unsigned short hnum,
+				struct in6_addr *saddr, __be16 sport,
+				struct in6_addr *daddr, int dif)
+{
+	struct inet_sock *inet = inet_sk(sk);
+	struct ipv6_pinfo *np;
+	int score = -1;
+
+	if (inet->num == hnum && sk->sk_family == PF_INET6) {
+		np = inet6_sk(sk);
+		score = 0;
+		if (inet->dport) {
+			if (inet->dport != sport)
+				return -1;
+			score++;
+		}
+		if (!ipv6_addr_any(&np->rcv_saddr)) {
+			if (!ipv6_addr_equal(&np->rcv_saddr, daddr))
+				return -1;
+			score++;
+		}
+		if (!ipv6_addr_any(&np->daddr)) {
+			if (!ipv6_addr_equal(&np->daddr, saddr))
+				return -1;
+			score++;
+		}
+		if (sk->sk_bound_dev_if) {
+			if (sk->sk_bound_dev_if != dif)
+				return -1;
+			score++;
+		}
+	}
+	return score;
+}
+
+#define UDP6_SCORE_MAX		4
+
+/* Above this many sockets on a port, look them up by address as well. */
+#define UDP_HSLOT_SCAN_MAX	10
+
+/* Best match in one secondary slot; called under rcu_read_lock(). */
+static struct sock *udp6_lib_lookup2(struct in6_addr *saddr, __be16 sport,
+				     struct in6_addr *daddr,
+				     unsigned short hnum, int dif,
+				     struct udp_hslot *hslot2, int *badness)
+{
+	struct sock *sk, *result = NULL;
+	struct udp_sock *up;
+	struct hlist_node *node;
+	int score;
+
+	hlist_for_each_entry_rcu(up, node, &hslot2->head, udp_portaddr_node) {
+		sk = (struct sock *)up;
+		score = compute_score(sk, hnum, saddr, sport, daddr, dif);
+		if (score > *badness) {
+			result = sk;
+			*badness = score;
+			if (score == UDP6_SCORE_MAX)
+				break;
+		}
+	}
+	return result;
+}
+
+/* Lockless, see __udp4_lib_lookup(). */
 static struct sock *__udp6_lib_lookup(struct in6_addr *saddr, __be16 sport,
 				      struct in6_addr *daddr, __be16 dport,
-				      int dif, struct hlist_head udptable[])
+				      int dif, struct udp_table *udptable)
 {
-	struct sock *sk, *result = NULL;
+	struct sock *sk, *result, *result2;
 	struct hlist_node *node;
 	unsigned short hnum = ntohs(dport);
-	int badness = -1;
-
- 	read_lock(&udp_hash_lock);
-	sk_for_each(sk, node, &udptable[hnum & (UDP_HTABLE_SIZE - 1)]) {
-		struct inet_sock *inet = inet_sk(sk);
-
-		if (inet->num == hnum && sk->sk_family == PF_INET6) {
-			struct ipv6_pinfo *np = inet6_sk(sk);
-			int score = 0;
-			if (inet->dport) {
-				if (inet->dport != sport)
-					continue;
-				score++;
-			}
-			if (!ipv6_addr_any(&np->rcv_saddr)) {
-				if (!ipv6_addr_equal(&np->rcv_saddr, daddr))
-					continue;
-				score++;
-			}
-			if (!ipv6_addr_any(&np->daddr)) {
-				if (!ipv6_addr_equal(&np->daddr, saddr))
-					continue;
-				score++;
-			}
-			if (sk->sk_bound_dev_if) {
-				if (sk->sk_bound_dev_if != dif)
-					continue;
-				score++;
+	struct udp_hslot *hslot = udp_hashslot(udptable, hnum);
+	struct udp_hslot *hslot2, *hslot2_any;
+	int score, badness, badness2;
+
+	rcu_read_lock();
+begin:
+	result = NULL;
+	badness = -1;
+	if (hslot->count > UDP_HSLOT_SCAN_MAX) {
+		hslot2 = udp_hashslot2(udptable, udp6_portaddr_hash(daddr, hnum));
+		/* :: hashes like INADDR_ANY */
+		hslot2_any = udp_hashslot2(udptable,
+					   udp4_portaddr_hash(INADDR_ANY, hnum));
+		if (hslot2->count + hslot2_any->count <= hslot->count) {
+			result = udp6_lib_lookup2(saddr, sport, daddr, hnum,
+						  dif, hslot2, &badness);
+			if (badness < UDP6_SCORE_MAX && hslot2_any != hslot2) {
+				badness2 = badness;
+				result2 = udp6_lib_lookup2(saddr, sport, daddr,
+							   hnum, dif,
+							   hslot2_any,
+							   &badness2);
+				if (result2) {
+					result = result2;
+					badness = badness2;
+				}
 			}
-			if(score == 4) {
-				result = sk;
+			goto found;
+		}
+	}
+	sk_for_each_rcu(sk, node, &hslot->head) {
+		score = compute_score(sk, hnum, saddr, sport, daddr, dif);
+		if (score > badness) {
+			result = sk;
+			badness = score;
+			if (score == UDP6_SCORE_MAX)
 				break;
-			} else if(score > badness) {
-				result = sk;
-				badness = score;
-			}
 		}
 	}
-	if (result)
-		sock_hold(result);
- 	read_unlock(&udp_hash_lock);
+found:
+	if (result) {
+		if (unlikely(!atomic_inc_not_zero(&result->sk_refcnt)))
+			result = NULL;
+		else if (unlikely(compute_score(result, hnum, saddr, sport,
+						daddr, dif) < badness)) {
+			sock_put(result);
+			goto begin;
+		}
+	}
+	rcu_read_unlock();
 	return result;
 }
 
@@ -131,7 +231,7 @@ int udpv6_recvmsg(struct kiocb *iocb, struct sock *sk,
 		return ipv6_recv_error(sk, msg, len);
 
 try_again:
-	skb = skb_recv_datagram(sk, flags, noblock, &err);
+	skb = udp_recv_datagram(sk, flags, noblock, &err);
 	if (!skb)
 		goto out;
 
@@ -203,7 +303,7 @@ out:
 	return err;
 
 csum_copy_err:
-	skb_kill_datagram(sk, skb, flags);
+	udp_kill_datagram(sk, skb, flags);
 
 	if (flags & MSG_DONTWAIT) {
 		UDP6_INC_STATS_USER(UDP_MIB_INERRORS, is_udplite);
@@ -214,7 +314,7 @@ csum_copy_err:
 
 void __udp6_lib_err(struct sk_buff *skb, struct inet6_skb_parm *opt,
 		    int type, int code, int offset, __be32 info,
-		    struct hlist_head udptable[]                    )
+		    struct udp_table *udptable                      )
 {
 	struct ipv6_pinfo *np;
 	struct ipv6hdr *hdr = (struct ipv6hdr*)skb->data;
@@ -250,7 +350,7 @@ static __inline__ void udpv6_err(struct sk_buff *skb,
 				 struct inet6_skb_parm *opt, int type,
 				 int code, int offset, __be32 info     )
 {
-	return __udp6_lib_err(skb, opt, type, code, offset, info, udp_hash);
+	return __udp6_lib_err(skb, opt, type, code, offset, info, &udp_table);
 }
 
 int udpv6_queue_rcv_skb(struct sock * sk, struct sk_buff *skb)
@@ -335,18 +435,19 @@ static struct sock *udp_v6_mcast_next(struct sock *sk,
 }
 
 /*
- * Note: called only from the BH handler context,
- * so we don't need to lock the hashes.
+ * Note: called only from the BH handler context, so the
+ * slot lock is taken without disabling BHs.
  */
 static int __udp6_lib_mcast_deliver(struct sk_buff *skb, struct in6_addr *saddr,
-		           struct in6_addr *daddr, struct hlist_head udptable[])
+		           struct in6_addr *daddr, struct udp_table *udptable)
 {
 	struct sock *sk, *sk2;
 	const struct udphdr *uh = skb->h.uh;
+	struct udp_hslot *hslot = udp_hashslot(udptable, ntohs(uh->dest));
 	int dif;
 
-	read_lock(&udp_hash_lock);
-	sk = sk_head(&udptable[ntohs(uh->dest) & (UDP_HTABLE_SIZE - 1)]);
+	spin_lock(&hslot->lock);
+	sk = sk_head(&hslot->head);
 	dif = inet6_iif(skb);
 	sk = udp_v6_mcast_next(sk, uh->dest, daddr, uh->source, saddr, dif);
 	if (!sk) {
@@ -363,7 +464,7 @@ static int __udp6_lib_mcast_deliver(struct sk_buff *skb, struct in6_addr *saddr,
 	}
 	udpv6_queue_rcv_skb(sk, skb);
 out:
-	read_unlock(&udp_hash_lock);
+	spin_unlock(&hslot->lock);
 	return 0;
 }
 
@@ -391,7 +492,7 @@ static inline int udp6_csum_init(struct sk_buff *skb, struct udphdr *uh)
 	return (UDP_SKB_CB(skb)->partial_cov = 0);
 }
 
-int __udp6_lib_rcv(struct sk_buff **pskb, struct hlist_head udptable[],
+int __udp6_lib_rcv(struct sk_buff **pskb, struct udp_table *udptable,
 		   int is_udplite)
 {
 	struct sk_buff *skb = *pskb;
@@ -484,7 +585,7 @@ discard:
 
 static __inline__ int udpv6_rcv(struct sk_buff **pskb)
 {
-	return __udp6_lib_rcv(pskb, udp_hash, 0);
+	return __udp6_lib_rcv(pskb, &udp_table, 0);
 }
 
 /*
@@ -684,6 +785,17 @@ do_udp_sendmsg:
 		fl.oif = sk->sk_bound_dev_if;
 
 	if (msg->msg_controllen) {
+		u16 gso_size = 0;
+
+		/* UDP_SEGMENT is only implemented for IPv4 output */
+		err = udp_cmsg_send(msg, &gso_size);
+		if (!err && gso_size)
+			err = -EOPNOTSUPP;
+		if (err) {
+			fl6_sock_release(flowlabel);
+			return err;
+		}
+
 		opt = &opt_space;
 		memset(opt, 0, sizeof(struct ipv6_txoptions));
 		opt->tot_len = sizeof(*opt);
@@ -836,6 +948,7 @@ int udpv6_destroy_sock(struct sock *sk)
 	lock_sock(sk);
 	udp_v6_flush_pending_frames(sk);
 	release_sock(sk);
+	udp_purge_reader_queue(sk);
 
 	inet6_destroy_sock(sk);
 
@@ -939,7 +1052,7 @@ static struct udp_seq_afinfo udp6_seq_afinfo = {
 	.owner		= THIS_MODULE,
 	.name		= "udp6",
 	.family		= AF_INET6,
-	.hashtable	= udp_hash,
+	.udp_table	= &udp_table,
 	.seq_show	= udp6_seq_show,
 	.seq_fops	= &udp6_seq_fops,
 };
@@ -963,6 +1076,7 @@ struct proto udpv6_prot = {
 	.connect	   = ip6_datagram_connect,
 	.disconnect	   = udp_disconnect,
 	.ioctl		   = udp_ioctl,
+	.init		   = udp_lib_init_sock,
 	.destroy	   = udpv6_destroy_sock,
 	.setsockopt	   = udpv6_setsockopt,
 	.getsockopt	   = udpv6_getsockopt,
@@ -971,6 +1085,7 @@ struct proto udpv6_prot = {
 	.backlog_rcv	   = udpv6_queue_rcv_skb,
 	.hash		   = udp_lib_hash,
 	.unhash		   = udp_lib_unhash,
+	.rehash		   = udp_v6_rehash,
 	.get_port	   = udp_v6_get_port,
 	.obj_size	   = sizeof(struct udp6_sock),
 #ifdef CONFIG_COMPAT
@@ -6,9 +6,12 @@
 #include <net/addrconf.h>
 #include <net/inet_common.h>
 
-extern int  	__udp6_lib_rcv(struct sk_buff **, struct hlist_head [], int );
+extern int  	__udp6_lib_rcv(struct sk_buff **, struct udp_table *, int );
 extern void 	__udp6_lib_err(struct sk_buff *, struct inet6_skb_parm *,
-			       int , int , int , __be32 , struct hlist_head []);
+			       int , int , int , __be32 , struct udp_table *);
+extern unsigned int udp6_portaddr_hash(struct in6_addr *addr6,
+				       unsigned int port);
+extern void	udp_v6_rehash(struct sock *sk);
 
 extern int	udpv6_getsockopt(struct sock *sk, int level, int optname,
 		     		 char __user *optval, int __user *optlen);
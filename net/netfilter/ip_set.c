@@ -0,0 +1,715 @@
+/*
+ * IP sets core: the set registry, the nfnetlink interface used to
+ * manage sets and the packet path entry points of the "set" match and
+ * "SET" target.  The set types themselves live in separate modules.
+ *
+ * Sets are kept in a fixed array and rules refer to them by index, so
+ * the packet path never looks anything up by name.  The array slots and
+ * the per-set reference counts are protected by ip_set_ref_lock;
+ * nfnetlink requests are serialized by the nfnetlink semaphore, which
+ * is the only place slots are changed, so requests may look sets up
+ * without taking the lock for reading.
+ *
+ * Loading a large set atomically is done by filling a temporary set of
+ * the same type with batched ADD requests, swapping it with the live
+ * one and destroying the temporary: rules keep pointing at the same
+ * slot and never see a half-filled set.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/init.h>
+#include <linux/kernel.h>
+#include <linux/kmod.h>
+#include <linux/skbuff.h>
+#include <linux/ip.h>
+#include <linux/in.h>
+#include <linux/netlink.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/sched.h>
+#include <linux/string.h>
+#include <net/sock.h>
+#include <net/ip.h>
+
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/ip_set.h>
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("IP sets core");
+MODULE_ALIAS_NFNL_SUBSYS(NFNL_SUBSYS_IPSET);
+
+static unsigned int max_sets = 256;
+module_param(max_sets, uint, 0400);
+MODULE_PARM_DESC(max_sets, "maximal number of sets");
+
+static LIST_HEAD(ip_set_type_list);
+static DEFINE_MUTEX(ip_set_type_mutex);
+
+static struct ip_set **ip_set_list;
+static DEFINE_RWLOCK(ip_set_ref_lock);
+
+/* Set type registration */
+
+static struct ip_set_type *__find_set_type(const char *name)
+{
+	struct ip_set_type *type;
+
+	list_for_each_entry(type, &ip_set_type_list, list)
+		if (!strncmp(type->name, name, IPSET_MAXNAMELEN))
+			return type;
+	return NULL;
+}
+
+static struct ip_set_type *find_set_type_get(const char *name)
+{
+	struct ip_set_type *type;
+
+	mutex_lock(&ip_set_type_mutex);
+	type = __find_set_type(name);
+	if (type && !try_module_get(type->me))
+		type = NULL;
+	mutex_unlock(&ip_set_type_mutex);
+	return type;
+}
+
+int ip_set_type_register(struct ip_set_type *type)
+{
+	int ret = 0;
+
+	mutex_lock(&ip_set_type_mutex);
+	if (__find_set_type(type->name))
+		ret = -EEXIST;
+	else
+		list_add(&type->list, &ip_set_type_list);
+	mutex_unlock(&ip_set_type_mutex);
+	return ret;
+}
+EXPORT_SYMBOL_GPL(ip_set_type_register);
+
+void ip_set_type_unregister(struct ip_set_type *type)
+{
+	mutex_lock(&ip_set_type_mutex);
+	list_del(&type->list);
+	mutex_unlock(&ip_set_type_mutex);
+}
+EXPORT_SYMBOL_GPL(ip_set_type_unregister);
+
+/* Member storage of set types: small areas come from the slab, large
+ * bitmaps and hash tables from vmalloc. */
+void *ip_set_alloc(size_t size)
+{
+	void *members;
+
+	if (size <= PAGE_SIZE)
+		members = kmalloc(size, GFP_KERNEL);
+	else
+		members = vmalloc(size);
+	if (members)
+		memset(members, 0, size);
+	return members;
+}
+EXPORT_SYMBOL_GPL(ip_set_alloc);
+
+void ip_set_free(void *members, size_t size)
+{
+	if (size <= PAGE_SIZE)
+		kfree(members);
+	else
+		vfree(members);
+}
+EXPORT_SYMBOL_GPL(ip_set_free);
+
+int ip_set_get_port(const struct sk_buff *skb, int src,
+		    __be16 *port, u_int8_t *proto)
+{
+	const struct iphdr *iph = skb->nh.iph;
+	__be16 _ports[2], *pptr;
+
+	if (iph->frag_off & htons(IP_OFFSET))
+		return 0;
+	if (iph->protocol != IPPROTO_TCP && iph->protocol != IPPROTO_UDP)
+		return 0;
+
+	/* TCP and UDP both start with the source and destination port */
+	pptr = skb_header_pointer(skb, iph->ihl * 4, sizeof(_ports), _ports);
+	if (pptr == NULL)
+		return 0;
+
+	*port = src ? pptr[0] : pptr[1];
+	*proto = iph->protocol;
+	return 1;
+}
+EXPORT_SYMBOL_GPL(ip_set_get_port);
+
+/* Packet path */
+
+static inline int
+ip_set_kadt(ip_set_id_t index, const struct sk_buff *skb,
+	    enum ipset_adt adt, u_int8_t flags)
+{
+	struct ip_set *set;
+	int ret;
+
+	read_lock_bh(&ip_set_ref_lock);
+	set = ip_set_list[index];
+	if (adt == IPSET_TEST) {
+		read_lock(&set->lock);
+		ret = set->type->kadt(set, skb, adt, flags);
+		read_unlock(&set->lock);
+	} else {
+		write_lock(&set->lock);
+		ret = set->type->kadt(set, skb, adt, flags);
+		write_unlock(&set->lock);
+	}
+	read_unlock_bh(&ip_set_ref_lock);
+
+	return ret;
+}
+
+int ip_set_test(ip_set_id_t index, const struct sk_buff *skb, u_int8_t flags)
+{
+	return ip_set_kadt(index, skb, IPSET_TEST, flags);
+}
+EXPORT_SYMBOL_GPL(ip_set_test);
+
+int ip_set_add(ip_set_id_t index, const struct sk_buff *skb, u_int8_t flags)
+{
+	return ip_set_kadt(index, skb, IPSET_ADD, flags);
+}
+EXPORT_SYMBOL_GPL(ip_set_add);
+
+int ip_set_del(ip_set_id_t index, const struct sk_buff *skb, u_int8_t flags)
+{
+	return ip_set_kadt(index, skb, IPSET_DEL, flags);
+}
+EXPORT_SYMBOL_GPL(ip_set_del);
+
+/* References from rules */
+
+static ip_set_id_t __find_set_id(const char *name)
+{
+	ip_set_id_t i;
+
+	for (i = 0; i < max_sets; i++)
+		if (ip_set_list[i] != NULL &&
+		    !strncmp(ip_set_list[i]->name, name, IPSET_MAXNAMELEN))
+			return i;
+	return IPSET_INVALID_ID;
+}
+
+ip_set_id_t ip_set_get_byname(const char *name, u_int8_t *dim)
+{
+	ip_set_id_t index;
+
+	write_lock_bh(&ip_set_ref_lock);
+	index = __find_set_id(name);
+	if (index != IPSET_INVALID_ID) {
+		ip_set_list[index]->ref++;
+		*dim = ip_set_list[index]->type->dimension;
+	}
+	write_unlock_bh(&ip_set_ref_lock);
+
+	return index;
+}
+EXPORT_SYMBOL_GPL(ip_set_get_byname);
+
+void ip_set_put_byindex(ip_set_id_t index)
+{
+	write_lock_bh(&ip_set_ref_lock);
+	ip_set_list[index]->ref--;
+	write_unlock_bh(&ip_set_ref_lock);
+}
+EXPORT_SYMBOL_GPL(ip_set_put_byindex);
+
+/* nfnetlink interface */
+
+static const char *ip_set_attr_name(struct nfattr *attr)
+{
+	int len;
+
+	if (attr == NULL)
+		return NULL;
+	len = NFA_PAYLOAD(attr);
+	if (len > IPSET_MAXNAMELEN)
+		len = IPSET_MAXNAMELEN;
+	if (len == 0 || memchr(NFA_DATA(attr), '\0', len) == NULL)
+		return NULL;
+	return NFA_DATA(attr);
+}
+
+static struct ip_set *ip_set_find(struct nfattr *attr)
+{
+	const char *name = ip_set_attr_name(attr);
+	ip_set_id_t index;
+
+	if (name == NULL)
+		return NULL;
+	index = __find_set_id(name);
+	return index == IPSET_INVALID_ID ? NULL : ip_set_list[index];
+}
+
+static const size_t ip_set_data_min[IPSET_ATTR_DATA_MAX] = {
+	[IPSET_ATTR_IP-1]		= sizeof(__be32),
+	[IPSET_ATTR_IP_TO-1]		= sizeof(__be32),
+	[IPSET_ATTR_CIDR-1]		= sizeof(u_int8_t),
+	[IPSET_ATTR_PORT-1]		= sizeof(__be16),
+	[IPSET_ATTR_PROTO-1]		= sizeof(u_int8_t),
+	[IPSET_ATTR_TIMEOUT-1]		= sizeof(__be32),
+	[IPSET_ATTR_HASHSIZE-1]		= sizeof(__be32),
+	[IPSET_ATTR_MAXELEM-1]		= sizeof(__be32),
+};
+
+static int ip_set_parse_data(struct nfattr *tb[], struct nfattr *attr)
+{
+	if (attr == NULL) {
+		memset(tb, 0, sizeof(struct nfattr *) * IPSET_ATTR_DATA_MAX);
+		return 0;
+	}
+	nfattr_parse_nested(tb, IPSET_ATTR_DATA_MAX, attr);
+	if (nfattr_bad_size(tb, IPSET_ATTR_DATA_MAX, ip_set_data_min))
+		return -EINVAL;
+	return 0;
+}
+
+static void ip_set_destroy_set(struct ip_set *set)
+{
+	set->type->destroy(set);
+	module_put(set->type->me);
+	kfree(set);
+}
+
+static int
+ip_set_create(struct sock *ctnl, struct sk_buff *skb,
+	      struct nlmsghdr *nlh, struct nfattr *cda[], int *errp)
+{
+	struct nfattr *tb[IPSET_ATTR_DATA_MAX];
+	const char *name, *typename;
+	struct ip_set_type *type;
+	struct ip_set *set;
+	ip_set_id_t index;
+	int ret;
+
+	name = ip_set_attr_name(cda[IPSET_ATTR_SETNAME-1]);
+	typename = ip_set_attr_name(cda[IPSET_ATTR_TYPENAME-1]);
+	if (name == NULL || typename == NULL)
+		return -EINVAL;
+	ret = ip_set_parse_data(tb, cda[IPSET_ATTR_DATA-1]);
+	if (ret < 0)
+		return ret;
+
+	if (__find_set_id(name) != IPSET_INVALID_ID)
+		return -EEXIST;
+	for (index = 0; index < max_sets; index++)
+		if (ip_set_list[index] == NULL)
+			break;
+	if (index == max_sets)
+		return -ENOSPC;
+
+	type = find_set_type_get(typename);
+	if (type == NULL) {
+		request_module("ip_set_%s", typename);
+		type = find_set_type_get(typename);
+		if (type == NULL)
+			return -ENOENT;
+	}
+
+	set = kzalloc(sizeof(*set), GFP_KERNEL);
+	if (set == NULL) {
+		ret = -ENOMEM;
+		goto err_put;
+	}
+	strncpy(set->name, name, IPSET_MAXNAMELEN);
+	rwlock_init(&set->lock);
+	set->type = type;
+
+	ret = type->create(set, tb);
+	if (ret < 0)
+		goto err_free;
+
+	write_lock_bh(&ip_set_ref_lock);
+	ip_set_list[index] = set;
+	write_unlock_bh(&ip_set_ref_lock);
+	return 0;
+
+err_free:
+	kfree(set);
+err_put:
+	module_put(type->me);
+	return ret;
+}
+
+/* Unhook an unreferenced set from its slot; the caller destroys it. */
+static struct ip_set *ip_set_unlink(ip_set_id_t index)
+{
+	struct ip_set *set;
+
+	write_lock_bh(&ip_set_ref_lock);
+	set = ip_set_list[index];
+	if (set != NULL && set->ref == 0)
+		ip_set_list[index] = NULL;
+	else
+		set = NULL;
+	write_unlock_bh(&ip_set_ref_lock);
+
+	return set;
+}
+
+static int
+ip_set_destroy(struct sock *ctnl, struct sk_buff *skb,
+	       struct nlmsghdr *nlh, struct nfattr *cda[], int *errp)
+{
+	struct ip_set *set;
+	const char *name;
+	ip_set_id_t index;
+	int ret = 0;
+
+	if (cda[IPSET_ATTR_SETNAME-1]) {
+		name = ip_set_attr_name(cda[IPSET_ATTR_SETNAME-1]);
+		if (name == NULL)
+			return -EINVAL;
+		index = __find_set_id(name);
+		if (index == IPSET_INVALID_ID)
+			return -ENOENT;
+		set = ip_set_unlink(index);
+		if (set == NULL)
+			return -EBUSY;
+		ip_set_destroy_set(set);
+		return 0;
+	}
+
+	/* All sets: referenced ones stay and make the request fail */
+	for (index = 0; index < max_sets; index++) {
+		if (ip_set_list[index] == NULL)
+			continue;
+		set = ip_set_unlink(index);
+		if (set == NULL) {
+			ret = -EBUSY;
+			continue;
+		}
+		ip_set_destroy_set(set);
+	}
+	return ret;
+}
+
+static void ip_set_flush_set(struct ip_set *set)
+{
+	write_lock_bh(&set->lock);
+	set->type->flush(set);
+	write_unlock_bh(&set->lock);
+}
+
+static int
+ip_set_flush(struct sock *ctnl, struct sk_buff *skb,
+	     struct nlmsghdr *nlh, struct nfattr *cda[], int *errp)
+{
+	struct ip_set *set;
+	ip_set_id_t index;
+
+	if (cda[IPSET_ATTR_SETNAME-1]) {
+		set = ip_set_find(cda[IPSET_ATTR_SETNAME-1]);
+		if (set == NULL)
+			return -ENOENT;
+		ip_set_flush_set(set);
+		return 0;
+	}
+
+	for (index = 0; index < max_sets; index++)
+		if (ip_set_list[index] != NULL)
+			ip_set_flush_set(ip_set_list[index]);
+	return 0;
+}
+
+static int
+ip_set_swap(struct sock *ctnl, struct sk_buff *skb,
+	    struct nlmsghdr *nlh, struct nfattr *cda[], int *errp)
+{
+	struct ip_set *from, *to;
+	const char *name, *name2;
+	ip_set_id_t from_id, to_id;
+	char from_name[IPSET_MAXNAMELEN];
+	unsigned int from_ref;
+
+	name = ip_set_attr_name(cda[IPSET_ATTR_SETNAME-1]);
+	name2 = ip_set_attr_name(cda[IPSET_ATTR_SETNAME2-1]);
+	if (name == NULL || name2 == NULL)
+		return -EINVAL;
+
+	from_id = __find_set_id(name);
+	to_id = __find_set_id(name2);
+	if (from_id == IPSET_INVALID_ID || to_id == IPSET_INVALID_ID)
+		return -ENOENT;
+	from = ip_set_list[from_id];
+	to = ip_set_list[to_id];
+	if (from->type != to->type)
+		return -EINVAL;
+
+	/* Exchange the contents, not the slots: names and references
+	 * belong to the slot, which rules point at. */
+	write_lock_bh(&ip_set_ref_lock);
+	memcpy(from_name, from->name, IPSET_MAXNAMELEN);
+	memcpy(from->name, to->name, IPSET_MAXNAMELEN);
+	memcpy(to->name, from_name, IPSET_MAXNAMELEN);
+	from_ref = from->ref;
+	from->ref = to->ref;
+	to->ref = from_ref;
+	ip_set_list[from_id] = to;
+	ip_set_list[to_id] = from;
+	write_unlock_bh(&ip_set_ref_lock);
+
+	return 0;
+}
+
+/* Listing.  cb->args[0] is the slot being dumped, cb->args[1] the
+ * position inside the set and cb->args[2] is 1 when dumping every set,
+ * 2 when dumping the one named in the request. */
+static void ip_set_dump_start(struct netlink_callback *cb)
+{
+	struct nlmsghdr *nlh = cb->nlh;
+	struct nfattr *cda[IPSET_ATTR_MAX];
+	const char *name;
+	int attrlen;
+
+	attrlen = nlh->nlmsg_len - NLMSG_ALIGN(NLMSG_SPACE(sizeof(struct nfgenmsg)));
+	nfattr_parse(cda, IPSET_ATTR_MAX, NFM_NFA(NLMSG_DATA(nlh)), attrlen);
+
+	name = ip_set_attr_name(cda[IPSET_ATTR_SETNAME-1]);
+	if (name == NULL) {
+		cb->args[2] = 1;
+		return;
+	}
+	cb->args[2] = 2;
+	read_lock_bh(&ip_set_ref_lock);
+	cb->args[0] = __find_set_id(name);
+	read_unlock_bh(&ip_set_ref_lock);
+	if (cb->args[0] == IPSET_INVALID_ID)
+		cb->args[0] = max_sets;
+}
+
+static int ip_set_dump(struct sk_buff *skb, struct netlink_callback *cb)
+{
+	struct nlmsghdr *nlh;
+	struct nfgenmsg *nfmsg;
+	struct nfattr *nest;
+	struct ip_set *set;
+	unsigned char *b;
+	__be32 ref;
+	int ret;
+
+	if (cb->args[2] == 0)
+		ip_set_dump_start(cb);
+
+	read_lock_bh(&ip_set_ref_lock);
+	for (; cb->args[0] < max_sets; cb->args[0]++, cb->args[1] = 0) {
+		set = ip_set_list[cb->args[0]];
+		if (set == NULL)
+			goto next;
+
+		b = skb->tail;
+		nlh = NLMSG_PUT(skb, NETLINK_CB(cb->skb).pid,
+				cb->nlh->nlmsg_seq,
+				NFNL_SUBSYS_IPSET << 8 | IPSET_MSG_LIST,
+				sizeof(struct nfgenmsg));
+		nlh->nlmsg_flags = NLM_F_MULTI;
+		nfmsg = NLMSG_DATA(nlh);
+		nfmsg->nfgen_family = AF_INET;
+		nfmsg->version = NFNETLINK_V0;
+		nfmsg->res_id = 0;
+
+		NFA_PUT(skb, IPSET_ATTR_SETNAME, strlen(set->name) + 1,
+			set->name);
+		NFA_PUT(skb, IPSET_ATTR_TYPENAME, strlen(set->type->name) + 1,
+			set->type->name);
+
+		nest = NFA_NEST(skb, IPSET_ATTR_DATA);
+		ref = htonl(set->ref);
+		NFA_PUT(skb, IPSET_ATTR_REFERENCES, sizeof(ref), &ref);
+		read_lock(&set->lock);
+		ret = set->type->head(set, skb);
+		read_unlock(&set->lock);
+		if (ret < 0)
+			goto nfattr_failure;
+		NFA_NEST_END(skb, nest);
+
+		nest = NFA_NEST(skb, IPSET_ATTR_ADT);
+		read_lock(&set->lock);
+		ret = set->type->dump(set, skb, &cb->args[1]);
+		read_unlock(&set->lock);
+		NFA_NEST_END(skb, nest);
+		nlh->nlmsg_len = skb->tail - b;
+
+		/* Out of room: continue this set in the next message */
+		if (ret)
+			goto out;
+next:
+		if (cb->args[2] == 2) {
+			cb->args[0] = max_sets;
+			break;
+		}
+	}
+out:
+	read_unlock_bh(&ip_set_ref_lock);
+	return skb->len;
+
+nlmsg_failure:
+nfattr_failure:
+	skb_trim(skb, b - skb->data);
+	goto out;
+}
+
+static int ip_set_dump_done(struct netlink_callback *cb)
+{
+	return 0;
+}
+
+static int
+ip_set_list_sets(struct sock *ctnl, struct sk_buff *skb,
+		 struct nlmsghdr *nlh, struct nfattr *cda[], int *errp)
+{
+	u32 rlen;
+
+	if (cda[IPSET_ATTR_SETNAME-1] &&
+	    ip_set_find(cda[IPSET_ATTR_SETNAME-1]) == NULL)
+		return -ENOENT;
+
+	if ((*errp = netlink_dump_start(ctnl, skb, nlh, ip_set_dump,
+					ip_set_dump_done)) != 0)
+		return -EINVAL;
+
+	rlen = NLMSG_ALIGN(nlh->nlmsg_len);
+	if (rlen > skb->len)
+		rlen = skb->len;
+	skb_pull(skb, rlen);
+	return 0;
+}
+
+static int
+ip_set_adt_one(struct ip_set *set, struct nfattr *attr,
+	       enum ipset_adt adt, int excl)
+{
+	struct nfattr *tb[IPSET_ATTR_DATA_MAX];
+	int ret;
+
+	ret = ip_set_parse_data(tb, attr);
+	if (ret < 0)
+		return ret;
+	return set->type->uadt(set, tb, adt, excl);
+}
+
+static int
+ip_set_adt(struct nfattr *cda[], struct nlmsghdr *nlh, enum ipset_adt adt)
+{
+	int excl = (nlh->nlmsg_flags & NLM_F_EXCL) != 0;
+	struct ip_set *set;
+	struct nfattr *attr;
+	int len, ret;
+
+	set = ip_set_find(cda[IPSET_ATTR_SETNAME-1]);
+	if (set == NULL)
+		return -ENOENT;
+
+	if (cda[IPSET_ATTR_DATA-1])
+		return ip_set_adt_one(set, cda[IPSET_ATTR_DATA-1], adt, excl);
+	if (cda[IPSET_ATTR_ADT-1] == NULL)
+		return -EINVAL;
+
+	/* A batch stops at the first failing element; the ones before it
+	 * stay applied. */
+	attr = NFA_DATA(cda[IPSET_ATTR_ADT-1]);
+	len = NFA_PAYLOAD(cda[IPSET_ATTR_ADT-1]);
+	while (NFA_OK(attr, len)) {
+		if (NFA_TYPE(attr) == IPSET_ATTR_DATA) {
+			ret = ip_set_adt_one(set, attr, adt, excl);
+			if (ret < 0)
+				return ret;
+			cond_resched();
+		}
+		attr = NFA_NEXT(attr, len);
+	}
+	return 0;
+}
+
+static int
+ip_set_uadd(struct sock *ctnl, struct sk_buff *skb,
+	    struct nlmsghdr *nlh, struct nfattr *cda[], int *errp)
+{
+	return ip_set_adt(cda, nlh, IPSET_ADD);
+}
+
+static int
+ip_set_udel(struct sock *ctnl, struct sk_buff *skb,
+	    struct nlmsghdr *nlh, struct nfattr *cda[], int *errp)
+{
+	return ip_set_adt(cda, nlh, IPSET_DEL);
+}
+
+static int
+ip_set_utest(struct sock *ctnl, struct sk_buff *skb,
+	     struct nlmsghdr *nlh, struct nfattr *cda[], int *errp)
+{
+	return ip_set_adt(cda, nlh, IPSET_TEST);
+}
+
+static struct nfnl_callback ip_set_cb[IPSET_MSG_MAX] = {
+	[IPSET_MSG_CREATE]	= { .call = ip_set_create,
+				    .attr_count = IPSET_ATTR_MAX, },
+	[IPSET_MSG_DESTROY]	= { .call = ip_set_destroy,
+				    .attr_count = IPSET_ATTR_MAX, },
+	[IPSET_MSG_FLUSH]	= { .call = ip_set_flush,
+				    .attr_count = IPSET_ATTR_MAX, },
+	[IPSET_MSG_SWAP]	= { .call = ip_set_swap,
+				    .attr_count = IPSET_ATTR_MAX, },
+	[IPSET_MSG_LIST]	= { .call = ip_set_list_sets,
+				    .attr_count = IPSET_ATTR_MAX, },
+	[IPSET_MSG_ADD]		= { .call = ip_set_uadd,
+				    .attr_count = IPSET_ATTR_MAX, },
+	[IPSET_MSG_DEL]		= { .call = ip_set_udel,
+				    .attr_count = IPSET_ATTR_MAX, },
+	[IPSET_MSG_TEST]	= { .call = ip_set_utest,
+				    .attr_count = IPSET_ATTR_MAX, },
+};
+
+static struct nfnetlink_subsystem ip_set_subsys = {
+	.name		= "ip_set",
+	.subsys_id	= NFNL_SUBSYS_IPSET,
+	.cb_count	= IPSET_MSG_MAX,
+	.cb		= ip_set_cb,
+};
+
+static int __init ip_set_init(void)
+{
+	int ret;
+
+	if (max_sets == 0 || max_sets >= IPSET_INVALID_ID)
+		max_sets = IPSET_INVALID_ID - 1;
+
+	ip_set_list = ip_set_alloc(max_sets * sizeof(struct ip_set *));
+	if (ip_set_list == NULL)
+		return -ENOMEM;
+
+	ret = nfnetlink_subsys_register(&ip_set_subsys);
+	if (ret < 0) {
+		printk(KERN_ERR "ip_set: cannot register with nfnetlink.\n");
+		ip_set_free(ip_set_list, max_sets * sizeof(struct ip_set *));
+		return ret;
+	}
+
+	printk(KERN_INFO "ip_set: %u sets\n", max_sets);
+	return 0;
+}
+
+static void __exit ip_set_fini(void)
+{
+	/* Every set pins its type module, which pins us: none is left */
+	nfnetlink_subsys_unregister(&ip_set_subsys);
+	ip_set_free(ip_set_list, max_sets * sizeof(struct ip_set *));
+}
+
+module_init(ip_set_init);
+module_exit(ip_set_fini);
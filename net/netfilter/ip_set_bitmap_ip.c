@@ -0,0 +1,318 @@
+/*
+ * IP sets: the bitmap:ip type, a range of at most 65536 IPv4 addresses
+ * stored as one bit per address, or as one expiry time per address when
+ * the set is created with a timeout.  As in the hash types, an element
+ * added with a timeout of zero never expires.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/kernel.h>
+#include <linux/skbuff.h>
+#include <linux/bitops.h>
+#include <linux/bitmap.h>
+#include <linux/timer.h>
+#include <linux/slab.h>
+
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/ip_set.h>
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("IP sets bitmap:ip type");
+MODULE_ALIAS("ip_set_bitmap:ip");
+
+#define BITMAP_IP_MAX_ELEMENTS	65536
+
+struct bitmap_ip {
+	u_int32_t first_ip;		/* host order */
+	u_int32_t last_ip;
+	u_int32_t elements;		/* last_ip - first_ip + 1 */
+	u_int32_t timeout;		/* seconds, 0 for a plain bitmap */
+	size_t memsize;
+	void *members;			/* bitmap, or unsigned long expires[] */
+	struct timer_list gc;
+};
+
+static inline int bitmap_ip_live(const struct bitmap_ip *map, u_int32_t id)
+{
+	const unsigned long *expires = map->members;
+
+	if (!map->timeout)
+		return test_bit(id, map->members);
+	if (expires[id] == IPSET_ELEM_PERMANENT)
+		return 1;
+	return expires[id] && !ip_set_timeout_expired(expires[id]);
+}
+
+/* Apply @adt to element @id with the set lock held.  Returns 1 if the
+ * element was present before. */
+static int bitmap_ip_do(struct bitmap_ip *map, u_int32_t id,
+			enum ipset_adt adt, u_int32_t timeout)
+{
+	unsigned long *expires = map->members;
+	int present = bitmap_ip_live(map, id);
+
+	switch (adt) {
+	case IPSET_ADD:
+		if (!map->timeout)
+			__set_bit(id, map->members);
+		else
+			expires[id] = timeout ? ip_set_timeout_set(timeout) :
+						IPSET_ELEM_PERMANENT;
+		break;
+	case IPSET_DEL:
+		if (!map->timeout)
+			__clear_bit(id, map->members);
+		else
+			expires[id] = 0;
+		break;
+	case IPSET_TEST:
+		break;
+	}
+	return present;
+}
+
+static int bitmap_ip_kadt(struct ip_set *set, const struct sk_buff *skb,
+			  enum ipset_adt adt, u_int8_t flags)
+{
+	struct bitmap_ip *map = set->data;
+	u_int32_t ip;
+	int present;
+
+	ip = ntohl(ip_set_get_ip(skb, flags & IPSET_DIM_ONE_SRC));
+	if (ip < map->first_ip || ip > map->last_ip)
+		return 0;
+
+	present = bitmap_ip_do(map, ip - map->first_ip, adt, map->timeout);
+	return adt == IPSET_ADD ? !present || map->timeout : present;
+}
+
+static int bitmap_ip_uadt(struct ip_set *set, struct nfattr *tb[],
+			  enum ipset_adt adt, int excl)
+{
+	struct bitmap_ip *map = set->data;
+	u_int32_t ip, ip_to, timeout = map->timeout;
+	int ret = 0;
+
+	if (tb[IPSET_ATTR_IP-1] == NULL)
+		return -EINVAL;
+	ip = ntohl(*(__be32 *)NFA_DATA(tb[IPSET_ATTR_IP-1]));
+
+	/* A range may be added or deleted in one go */
+	if (tb[IPSET_ATTR_IP_TO-1]) {
+		ip_to = ntohl(*(__be32 *)NFA_DATA(tb[IPSET_ATTR_IP_TO-1]));
+	} else if (tb[IPSET_ATTR_CIDR-1]) {
+		u_int8_t cidr = *(u_int8_t *)NFA_DATA(tb[IPSET_ATTR_CIDR-1]);
+
+		if (cidr > 32)
+			return -EINVAL;
+		ip &= ntohl(ip_set_netmask(cidr));
+		ip_to = ip | ~ntohl(ip_set_netmask(cidr));
+	} else
+		ip_to = ip;
+	if (ip > ip_to || ip < map->first_ip || ip_to > map->last_ip)
+		return -ERANGE;
+	if (adt == IPSET_TEST && ip != ip_to)
+		return -EINVAL;
+
+	if (tb[IPSET_ATTR_TIMEOUT-1]) {
+		if (!map->timeout)
+			return -EINVAL;
+		timeout = ntohl(*(__be32 *)NFA_DATA(tb[IPSET_ATTR_TIMEOUT-1]));
+	}
+
+	if (adt == IPSET_TEST) {
+		read_lock_bh(&set->lock);
+		if (!bitmap_ip_live(map, ip - map->first_ip))
+			ret = -ENOENT;
+		read_unlock_bh(&set->lock);
+		return ret;
+	}
+
+	write_lock_bh(&set->lock);
+	for (; ; ip++) {
+		u_int32_t id = ip - map->first_ip;
+
+		if (excl && bitmap_ip_live(map, id) == (adt == IPSET_ADD)) {
+			ret = adt == IPSET_ADD ? -EEXIST : -ENOENT;
+			break;
+		}
+		bitmap_ip_do(map, id, adt, timeout);
+		if (ip == ip_to)
+			break;
+	}
+	write_unlock_bh(&set->lock);
+
+	return ret;
+}
+
+/* Forget expired elements before jiffies wraps around to them */
+static void bitmap_ip_gc(unsigned long data)
+{
+	struct ip_set *set = (struct ip_set *)data;
+	struct bitmap_ip *map = set->data;
+	unsigned long *expires = map->members;
+	u_int32_t id;
+
+	write_lock_bh(&set->lock);
+	for (id = 0; id < map->elements; id++)
+		if (!bitmap_ip_live(map, id))
+			expires[id] = 0;
+	write_unlock_bh(&set->lock);
+
+	mod_timer(&map->gc, jiffies + IPSET_GC_PERIOD(map->timeout) * HZ);
+}
+
+static int bitmap_ip_create(struct ip_set *set, struct nfattr *tb[])
+{
+	struct bitmap_ip *map;
+	u_int32_t first_ip, last_ip;
+
+	if (tb[IPSET_ATTR_IP-1] == NULL)
+		return -EINVAL;
+	first_ip = ntohl(*(__be32 *)NFA_DATA(tb[IPSET_ATTR_IP-1]));
+
+	if (tb[IPSET_ATTR_IP_TO-1]) {
+		last_ip = ntohl(*(__be32 *)NFA_DATA(tb[IPSET_ATTR_IP_TO-1]));
+	} else if (tb[IPSET_ATTR_CIDR-1]) {
+		u_int8_t cidr = *(u_int8_t *)NFA_DATA(tb[IPSET_ATTR_CIDR-1]);
+
+		if (cidr > 32)
+			return -EINVAL;
+		first_ip &= ntohl(ip_set_netmask(cidr));
+		last_ip = first_ip | ~ntohl(ip_set_netmask(cidr));
+	} else
+		return -EINVAL;
+	if (first_ip > last_ip ||
+	    last_ip - first_ip >= BITMAP_IP_MAX_ELEMENTS)
+		return -ERANGE;
+
+	map = kzalloc(sizeof(*map), GFP_KERNEL);
+	if (map == NULL)
+		return -ENOMEM;
+	map->first_ip = first_ip;
+	map->last_ip = last_ip;
+	map->elements = last_ip - first_ip + 1;
+	if (tb[IPSET_ATTR_TIMEOUT-1])
+		map->timeout = ntohl(*(__be32 *)NFA_DATA(tb[IPSET_ATTR_TIMEOUT-1]));
+
+	if (map->timeout)
+		map->memsize = map->elements * sizeof(unsigned long);
+	else
+		map->memsize = BITS_TO_LONGS(map->elements) * sizeof(unsigned long);
+	map->members = ip_set_alloc(map->memsize);
+	if (map->members == NULL) {
+		kfree(map);
+		return -ENOMEM;
+	}
+	set->data = map;
+
+	if (map->timeout) {
+		setup_timer(&map->gc, bitmap_ip_gc, (unsigned long)set);
+		mod_timer(&map->gc,
+			  jiffies + IPSET_GC_PERIOD(map->timeout) * HZ);
+	}
+	return 0;
+}
+
+static void bitmap_ip_destroy(struct ip_set *set)
+{
+	struct bitmap_ip *map = set->data;
+
+	if (map->timeout)
+		del_timer_sync(&map->gc);
+	ip_set_free(map->members, map->memsize);
+	kfree(map);
+}
+
+static void bitmap_ip_flush(struct ip_set *set)
+{
+	struct bitmap_ip *map = set->data;
+
+	memset(map->members, 0, map->memsize);
+}
+
+static int bitmap_ip_head(struct ip_set *set, struct sk_buff *skb)
+{
+	struct bitmap_ip *map = set->data;
+	__be32 val;
+	u_int32_t id, n = 0;
+
+	for (id = 0; id < map->elements; id++)
+		n += bitmap_ip_live(map, id);
+
+	val = htonl(map->first_ip);
+	NFA_PUT(skb, IPSET_ATTR_IP, sizeof(val), &val);
+	val = htonl(map->last_ip);
+	NFA_PUT(skb, IPSET_ATTR_IP_TO, sizeof(val), &val);
+	val = htonl(n);
+	NFA_PUT(skb, IPSET_ATTR_ELEMENTS, sizeof(val), &val);
+	if (map->timeout) {
+		val = htonl(map->timeout);
+		NFA_PUT(skb, IPSET_ATTR_TIMEOUT, sizeof(val), &val);
+	}
+	return 0;
+
+nfattr_failure:
+	return -1;
+}
+
+static int bitmap_ip_dump(struct ip_set *set, struct sk_buff *skb,
+			  unsigned long *pos)
+{
+	struct bitmap_ip *map = set->data;
+	unsigned long *expires = map->members;
+	struct nfattr *nest;
+	unsigned char *b;
+	__be32 val;
+
+	for (; *pos < map->elements; (*pos)++) {
+		if (!bitmap_ip_live(map, *pos))
+			continue;
+
+		b = skb->tail;
+		nest = NFA_NEST(skb, IPSET_ATTR_DATA);
+		val = htonl(map->first_ip + *pos);
+		NFA_PUT(skb, IPSET_ATTR_IP, sizeof(val), &val);
+		if (map->timeout && expires[*pos] != IPSET_ELEM_PERMANENT) {
+			val = htonl((expires[*pos] - jiffies) / HZ);
+			NFA_PUT(skb, IPSET_ATTR_TIMEOUT, sizeof(val), &val);
+		}
+		NFA_NEST_END(skb, nest);
+	}
+	return 0;
+
+nfattr_failure:
+	skb_trim(skb, b - skb->data);
+	return 1;
+}
+
+static struct ip_set_type bitmap_ip_type = {
+	.name		= "bitmap:ip",
+	.dimension	= 1,
+	.create		= bitmap_ip_create,
+	.destroy	= bitmap_ip_destroy,
+	.flush		= bitmap_ip_flush,
+	.kadt		= bitmap_ip_kadt,
+	.uadt		= bitmap_ip_uadt,
+	.head		= bitmap_ip_head,
+	.dump		= bitmap_ip_dump,
+	.me		= THIS_MODULE,
+};
+
+static int __init bitmap_ip_init(void)
+{
+	return ip_set_type_register(&bitmap_ip_type);
+}
+
+static void __exit bitmap_ip_fini(void)
+{
+	ip_set_type_unregister(&bitmap_ip_type);
+}
+
+module_init(bitmap_ip_init);
+module_exit(bitmap_ip_fini);
@@ -0,0 +1,554 @@
+/*
+ * IP sets: the hash types.
+ *
+ *	hash:ip		single IPv4 addresses
+ *	hash:net	IPv4 networks of any prefix length; a lookup tries
+ *			each prefix length present in the set, longest first
+ *	hash:ip,port	address and TCP or UDP port pairs
+ *
+ * Elements hang off a power-of-two bucket array hashed with a random
+ * seed.  The table doubles when a userspace add finds more than two
+ * elements per bucket; elements added from the packet path never grow
+ * it.  With a timeout, expired elements are invisible at once and freed
+ * by a periodic garbage collector.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/kernel.h>
+#include <linux/skbuff.h>
+#include <linux/in.h>
+#include <linux/list.h>
+#include <linux/jhash.h>
+#include <linux/random.h>
+#include <linux/timer.h>
+#include <linux/slab.h>
+#include <linux/log2.h>
+
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/ip_set.h>
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("IP sets hash:ip, hash:net and hash:ip,port types");
+MODULE_ALIAS("ip_set_hash:ip");
+MODULE_ALIAS("ip_set_hash:net");
+MODULE_ALIAS("ip_set_hash:ip,port");
+
+#define HASH_DEFAULT_SIZE	1024
+#define HASH_MIN_SIZE		64
+#define HASH_MAX_SIZE		(1 << 20)
+
+enum hash_kind {
+	HASH_IP,
+	HASH_NET,
+	HASH_IP_PORT,
+};
+
+struct hash_elem {
+	struct hlist_node node;
+	__be32 ip;
+	__be16 port;
+	u_int8_t proto;
+	u_int8_t cidr;
+	unsigned long expires;		/* 0: never */
+};
+
+struct ip_set_hash {
+	struct hlist_head *table;
+	unsigned int hashsize;		/* power of two */
+	u_int32_t initval;
+	enum hash_kind kind;
+	u_int32_t elements;		/* including expired ones */
+	u_int32_t maxelem;
+	u_int32_t timeout;		/* default, seconds */
+	u_int32_t nets[33];		/* hash:net elements per prefix length */
+	struct timer_list gc;
+};
+
+static struct kmem_cache *hash_elem_cache __read_mostly;
+
+static inline unsigned int
+hash_key(const struct ip_set_hash *h, const struct hash_elem *key,
+	 unsigned int size)
+{
+	return jhash_2words((__force u32)key->ip,
+			    ((__force u32)key->port << 16) |
+			    (key->proto << 8) | key->cidr,
+			    h->initval) & (size - 1);
+}
+
+static inline int hash_elem_live(const struct hash_elem *e)
+{
+	return !e->expires || !ip_set_timeout_expired(e->expires);
+}
+
+/* Find @key, expired or not */
+static struct hash_elem *
+hash_find(const struct ip_set_hash *h, const struct hash_elem *key)
+{
+	struct hash_elem *e;
+	struct hlist_node *n;
+
+	hlist_for_each_entry(e, n, &h->table[hash_key(h, key, h->hashsize)],
+			     node)
+		if (e->ip == key->ip && e->port == key->port &&
+		    e->proto == key->proto && e->cidr == key->cidr)
+			return e;
+	return NULL;
+}
+
+static inline int
+hash_test(const struct ip_set_hash *h, const struct hash_elem *key)
+{
+	const struct hash_elem *e = hash_find(h, key);
+
+	return e != NULL && hash_elem_live(e);
+}
+
+/* hash:net test: the address against every prefix length in use */
+static int hash_net_test(const struct ip_set_hash *h, __be32 ip)
+{
+	struct hash_elem key = { .ip = ip };
+	int cidr;
+
+	for (cidr = 32; cidr >= 0; cidr--) {
+		if (!h->nets[cidr])
+			continue;
+		key.ip = ip & ip_set_netmask(cidr);
+		key.cidr = cidr;
+		if (hash_test(h, &key))
+			return 1;
+	}
+	return 0;
+}
+
+static void hash_unlink(struct ip_set_hash *h, struct hash_elem *e)
+{
+	hlist_del(&e->node);
+	h->elements--;
+	h->nets[e->cidr]--;
+	kmem_cache_free(hash_elem_cache, e);
+}
+
+/* Add or delete @key with the set lock held for writing.  @new is a
+ * preallocated element for an add, consumed on success; @timeout is in
+ * seconds, 0 for a permanent element.  Returns 1 if the key was present
+ * before, 0 if not, or -ENOSPC when the set is full. */
+static int hash_update(struct ip_set_hash *h, const struct hash_elem *key,
+		       enum ipset_adt adt, u_int32_t timeout,
+		       struct hash_elem **new)
+{
+	struct hash_elem *e = hash_find(h, key);
+	int present = e != NULL && hash_elem_live(e);
+
+	if (adt == IPSET_DEL) {
+		if (e != NULL)
+			hash_unlink(h, e);
+		return present;
+	}
+
+	if (e == NULL) {
+		if (h->elements >= h->maxelem)
+			return -ENOSPC;
+		e = *new;
+		*new = NULL;
+		*e = *key;
+		hlist_add_head(&e->node,
+			       &h->table[hash_key(h, key, h->hashsize)]);
+		h->elements++;
+		h->nets[e->cidr]++;
+	}
+	e->expires = timeout ? ip_set_timeout_set(timeout) : 0;
+	return present;
+}
+
+/* Build the key of a packet; returns 0 if the packet has none */
+static int hash_skb_key(const struct ip_set_hash *h, const struct sk_buff *skb,
+			u_int8_t flags, struct hash_elem *key)
+{
+	memset(key, 0, sizeof(*key));
+	key->ip = ip_set_get_ip(skb, flags & IPSET_DIM_ONE_SRC);
+	key->cidr = 32;
+	if (h->kind == HASH_IP_PORT)
+		return ip_set_get_port(skb, flags & IPSET_DIM_TWO_SRC,
+				       &key->port, &key->proto);
+	return 1;
+}
+
+static int hash_kadt(struct ip_set *set, const struct sk_buff *skb,
+		     enum ipset_adt adt, u_int8_t flags)
+{
+	struct ip_set_hash *h = set->data;
+	struct hash_elem key, *new = NULL;
+	int ret;
+
+	if (!hash_skb_key(h, skb, flags, &key))
+		return 0;
+
+	if (adt == IPSET_TEST) {
+		if (h->kind == HASH_NET)
+			return hash_net_test(h, key.ip);
+		return hash_test(h, &key);
+	}
+
+	/* The SET target adds host entries to hash:net sets */
+	if (adt == IPSET_ADD) {
+		new = kmem_cache_alloc(hash_elem_cache, GFP_ATOMIC);
+		if (new == NULL)
+			return 0;
+	}
+	ret = hash_update(h, &key, adt, h->timeout, &new);
+	if (new != NULL)
+		kmem_cache_free(hash_elem_cache, new);
+
+	if (ret < 0)
+		return 0;
+	return adt == IPSET_ADD ? !ret || h->timeout : ret;
+}
+
+/* Double the bucket array.  Only called for userspace requests, which
+ * nfnetlink serializes, so nobody else resizes concurrently. */
+static void hash_grow(struct ip_set *set)
+{
+	struct ip_set_hash *h = set->data;
+	struct hlist_head *table, *old;
+	struct hlist_node *n, *tmp;
+	struct hash_elem *e;
+	unsigned int size, oldsize, i;
+
+	oldsize = h->hashsize;
+	size = oldsize << 1;
+	table = ip_set_alloc(size * sizeof(struct hlist_head));
+	if (table == NULL)
+		return;
+	for (i = 0; i < size; i++)
+		INIT_HLIST_HEAD(&table[i]);
+
+	write_lock_bh(&set->lock);
+	old = h->table;
+	for (i = 0; i < oldsize; i++)
+		hlist_for_each_entry_safe(e, n, tmp, &old[i], node) {
+			hlist_del(&e->node);
+			hlist_add_head(&e->node, &table[hash_key(h, e, size)]);
+		}
+	h->table = table;
+	h->hashsize = size;
+	write_unlock_bh(&set->lock);
+
+	ip_set_free(old, oldsize * sizeof(struct hlist_head));
+}
+
+static int hash_uadt(struct ip_set *set, struct nfattr *tb[],
+		     enum ipset_adt adt, int excl)
+{
+	struct ip_set_hash *h = set->data;
+	struct hash_elem key, *new = NULL;
+	u_int32_t timeout = h->timeout;
+	int ret;
+
+	memset(&key, 0, sizeof(key));
+	if (tb[IPSET_ATTR_IP-1] == NULL)
+		return -EINVAL;
+	key.ip = *(__be32 *)NFA_DATA(tb[IPSET_ATTR_IP-1]);
+	key.cidr = 32;
+
+	switch (h->kind) {
+	case HASH_IP:
+		break;
+	case HASH_NET:
+		if (tb[IPSET_ATTR_CIDR-1])
+			key.cidr = *(u_int8_t *)NFA_DATA(tb[IPSET_ATTR_CIDR-1]);
+		if (key.cidr > 32)
+			return -EINVAL;
+		key.ip &= ip_set_netmask(key.cidr);
+		break;
+	case HASH_IP_PORT:
+		if (tb[IPSET_ATTR_PORT-1] == NULL)
+			return -EINVAL;
+		key.port = *(__be16 *)NFA_DATA(tb[IPSET_ATTR_PORT-1]);
+		key.proto = IPPROTO_TCP;
+		if (tb[IPSET_ATTR_PROTO-1])
+			key.proto = *(u_int8_t *)NFA_DATA(tb[IPSET_ATTR_PROTO-1]);
+		if (key.proto != IPPROTO_TCP && key.proto != IPPROTO_UDP)
+			return -EINVAL;
+		break;
+	}
+
+	if (tb[IPSET_ATTR_TIMEOUT-1]) {
+		if (!h->timeout)
+			return -EINVAL;
+		timeout = ntohl(*(__be32 *)NFA_DATA(tb[IPSET_ATTR_TIMEOUT-1]));
+	}
+
+	if (adt == IPSET_TEST) {
+		read_lock_bh(&set->lock);
+		ret = hash_test(h, &key);
+		read_unlock_bh(&set->lock);
+		return ret ? 0 : -ENOENT;
+	}
+
+	if (adt == IPSET_ADD) {
+		if (h->elements > 2 * h->hashsize && h->hashsize < HASH_MAX_SIZE)
+			hash_grow(set);
+		new = kmem_cache_alloc(hash_elem_cache, GFP_KERNEL);
+		if (new == NULL)
+			return -ENOMEM;
+	}
+
+	write_lock_bh(&set->lock);
+	if (excl) {
+		ret = hash_test(h, &key);
+		if (ret == (adt == IPSET_ADD)) {
+			ret = adt == IPSET_ADD ? -EEXIST : -ENOENT;
+			goto out;
+		}
+	}
+	ret = hash_update(h, &key, adt, timeout, &new);
+out:
+	write_unlock_bh(&set->lock);
+
+	if (new != NULL)
+		kmem_cache_free(hash_elem_cache, new);
+	return ret < 0 ? ret : 0;
+}
+
+static void hash_gc(unsigned long data)
+{
+	struct ip_set *set = (struct ip_set *)data;
+	struct ip_set_hash *h = set->data;
+	struct hlist_node *n, *tmp;
+	struct hash_elem *e;
+	unsigned int i;
+
+	write_lock_bh(&set->lock);
+	for (i = 0; i < h->hashsize; i++)
+		hlist_for_each_entry_safe(e, n, tmp, &h->table[i], node)
+			if (!hash_elem_live(e))
+				hash_unlink(h, e);
+	write_unlock_bh(&set->lock);
+
+	mod_timer(&h->gc, jiffies + IPSET_GC_PERIOD(h->timeout) * HZ);
+}
+
+static int hash_create(struct ip_set *set, struct nfattr *tb[],
+		       enum hash_kind kind)
+{
+	struct ip_set_hash *h;
+	u_int32_t hashsize = HASH_DEFAULT_SIZE;
+	unsigned int i;
+
+	if (tb[IPSET_ATTR_HASHSIZE-1])
+		hashsize = ntohl(*(__be32 *)NFA_DATA(tb[IPSET_ATTR_HASHSIZE-1]));
+	if (hashsize < HASH_MIN_SIZE)
+		hashsize = HASH_MIN_SIZE;
+	if (hashsize > HASH_MAX_SIZE)
+		hashsize = HASH_MAX_SIZE;
+
+	h = kzalloc(sizeof(*h), GFP_KERNEL);
+	if (h == NULL)
+		return -ENOMEM;
+
+	h->hashsize = roundup_pow_of_two(hashsize);
+	h->table = ip_set_alloc(h->hashsize * sizeof(struct hlist_head));
+	if (h->table == NULL) {
+		kfree(h);
+		return -ENOMEM;
+	}
+	for (i = 0; i < h->hashsize; i++)
+		INIT_HLIST_HEAD(&h->table[i]);
+
+	get_random_bytes(&h->initval, sizeof(h->initval));
+	h->kind = kind;
+	h->maxelem = IPSET_DEFAULT_MAXELEM;
+	if (tb[IPSET_ATTR_MAXELEM-1])
+		h->maxelem = ntohl(*(__be32 *)NFA_DATA(tb[IPSET_ATTR_MAXELEM-1]));
+	if (tb[IPSET_ATTR_TIMEOUT-1])
+		h->timeout = ntohl(*(__be32 *)NFA_DATA(tb[IPSET_ATTR_TIMEOUT-1]));
+	set->data = h;
+
+	if (h->timeout) {
+		setup_timer(&h->gc, hash_gc, (unsigned long)set);
+		mod_timer(&h->gc, jiffies + IPSET_GC_PERIOD(h->timeout) * HZ);
+	}
+	return 0;
+}
+
+static int hash_ip_create(struct ip_set *set, struct nfattr *tb[])
+{
+	return hash_create(set, tb, HASH_IP);
+}
+
+static int hash_net_create(struct ip_set *set, struct nfattr *tb[])
+{
+	return hash_create(set, tb, HASH_NET);
+}
+
+static int hash_ip_port_create(struct ip_set *set, struct nfattr *tb[])
+{
+	return hash_create(set, tb, HASH_IP_PORT);
+}
+
+static void hash_flush(struct ip_set *set)
+{
+	struct ip_set_hash *h = set->data;
+	struct hlist_node *n, *tmp;
+	struct hash_elem *e;
+	unsigned int i;
+
+	for (i = 0; i < h->hashsize; i++)
+		hlist_for_each_entry_safe(e, n, tmp, &h->table[i], node)
+			hash_unlink(h, e);
+}
+
+static void hash_destroy(struct ip_set *set)
+{
+	struct ip_set_hash *h = set->data;
+
+	if (h->timeout)
+		del_timer_sync(&h->gc);
+	hash_flush(set);
+	ip_set_free(h->table, h->hashsize * sizeof(struct hlist_head));
+	kfree(h);
+}
+
+static int hash_head(struct ip_set *set, struct sk_buff *skb)
+{
+	struct ip_set_hash *h = set->data;
+	__be32 val;
+
+	val = htonl(h->hashsize);
+	NFA_PUT(skb, IPSET_ATTR_HASHSIZE, sizeof(val), &val);
+	val = htonl(h->maxelem);
+	NFA_PUT(skb, IPSET_ATTR_MAXELEM, sizeof(val), &val);
+	val = htonl(h->elements);
+	NFA_PUT(skb, IPSET_ATTR_ELEMENTS, sizeof(val), &val);
+	if (h->timeout) {
+		val = htonl(h->timeout);
+		NFA_PUT(skb, IPSET_ATTR_TIMEOUT, sizeof(val), &val);
+	}
+	return 0;
+
+nfattr_failure:
+	return -1;
+}
+
+/* *pos is a bucket; a bucket that does not fit is sent again whole */
+static int hash_dump(struct ip_set *set, struct sk_buff *skb,
+		     unsigned long *pos)
+{
+	struct ip_set_hash *h = set->data;
+	struct hlist_node *n;
+	struct hash_elem *e;
+	struct nfattr *nest;
+	unsigned char *b;
+	__be32 val;
+
+	for (; *pos < h->hashsize; (*pos)++) {
+		b = skb->tail;
+		hlist_for_each_entry(e, n, &h->table[*pos], node) {
+			if (!hash_elem_live(e))
+				continue;
+			nest = NFA_NEST(skb, IPSET_ATTR_DATA);
+			NFA_PUT(skb, IPSET_ATTR_IP, sizeof(e->ip), &e->ip);
+			if (h->kind == HASH_NET)
+				NFA_PUT(skb, IPSET_ATTR_CIDR, sizeof(e->cidr),
+					&e->cidr);
+			if (h->kind == HASH_IP_PORT) {
+				NFA_PUT(skb, IPSET_ATTR_PORT, sizeof(e->port),
+					&e->port);
+				NFA_PUT(skb, IPSET_ATTR_PROTO, sizeof(e->proto),
+					&e->proto);
+			}
+			if (e->expires) {
+				val = htonl((e->expires - jiffies) / HZ);
+				NFA_PUT(skb, IPSET_ATTR_TIMEOUT, sizeof(val),
+					&val);
+			}
+			NFA_NEST_END(skb, nest);
+		}
+	}
+	return 0;
+
+nfattr_failure:
+	skb_trim(skb, b - skb->data);
+	return 1;
+}
+
+static struct ip_set_type hash_types[] = {
+	{
+		.name		= "hash:ip",
+		.dimension	= 1,
+		.create		= hash_ip_create,
+		.destroy	= hash_destroy,
+		.flush		= hash_flush,
+		.kadt		= hash_kadt,
+		.uadt		= hash_uadt,
+		.head		= hash_head,
+		.dump		= hash_dump,
+		.me		= THIS_MODULE,
+	},
+	{
+		.name		= "hash:net",
+		.dimension	= 1,
+		.create		= hash_net_create,
+		.destroy	= hash_destroy,
+		.flush		= hash_flush,
+		.kadt		= hash_kadt,
+		.uadt		= hash_uadt,
+		.head		= hash_head,
+		.dump		= hash_dump,
+		.me		= THIS_MODULE,
+	},
+	{
+		.name		= "hash:ip,port",
+		.dimension	= 2,
+		.create		= hash_ip_port_create,
+		.destroy	= hash_destroy,
+		.flush		= hash_flush,
+		.kadt		= hash_kadt,
+		.uadt		= hash_uadt,
+		.head		= hash_head,
+		.dump		= hash_dump,
+		.me		= THIS_MODULE,
+	},
+};
+
+static int __init ip_set_hash_init(void)
+{
+	int i, ret;
+
+	hash_elem_cache = kmem_cache_create("ip_set_hash",
+					    sizeof(struct hash_elem), 0, 0,
+					    NULL, NULL);
+	if (hash_elem_cache == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < ARRAY_SIZE(hash_types); i++) {
+		ret = ip_set_type_register(&hash_types[i]);
+		if (ret < 0)
+			goto err;
+	}
+	return 0;
+
+err:
+	while (--i >= 0)
+		ip_set_type_unregister(&hash_types[i]);
+	kmem_cache_destroy(hash_elem_cache);
+	return ret;
+}
+
+static void __exit ip_set_hash_fini(void)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(hash_types); i++)
+		ip_set_type_unregister(&hash_types[i]);
+	kmem_cache_destroy(hash_elem_cache);
+}
+
+module_init(ip_set_hash_init);
+module_exit(ip_set_hash_fini);
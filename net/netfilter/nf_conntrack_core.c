@@ -46,6 +46,9 @@
 #include <linux/kernel.h>
 #include <linux/netdevice.h>
 #include <linux/socket.h>
+#include <linux/rcupdate.h>
+#include <linux/seqlock.h>
+#include <linux/mutex.h>
 #include <linux/mm.h>
 
 #include <net/netfilter/nf_conntrack.h>
@@ -63,9 +66,32 @@
 #define DEBUGP(format, args...)
 #endif
 
+/*
+ * nf_conntrack_lock covers expectations, helpers and protocol
+ * registration.  The conntrack hash is read under RCU; inserts and
+ * deletes take the striped locks below, one per group of buckets.
+ */
 DEFINE_RWLOCK(nf_conntrack_lock);
 EXPORT_SYMBOL_GPL(nf_conntrack_lock);
 
+#define NF_CONNTRACK_LOCKS	1024
+
+static spinlock_t nf_conntrack_locks[NF_CONNTRACK_LOCKS] __cacheline_aligned_in_smp;
+
+/*
+ * Bumped whenever a resize changes where entries live: when the new
+ * table is installed, around each chunk of buckets it moves, and when
+ * the old table is retired.  Lookups use it to read the tables, sizes
+ * and seeds consistently and retry a miss that raced with a move;
+ * writers recheck it once they hold their bucket locks.
+ */
+seqcount_t nf_conntrack_generation __read_mostly;
+EXPORT_SYMBOL_GPL(nf_conntrack_generation);
+
+/* Held across a whole resize, and by walkers that must see every entry. */
+DEFINE_MUTEX(nf_conntrack_hash_mutex);
+EXPORT_SYMBOL_GPL(nf_conntrack_hash_mutex);
+
 /* nf_conntrack_standalone needs this */
 atomic_t nf_conntrack_count = ATOMIC_INIT(0);
 EXPORT_SYMBOL_GPL(nf_conntrack_count);
@@ -79,17 +105,41 @@ EXPORT_SYMBOL_GPL(nf_conntrack_htable_size);
 int nf_conntrack_max __read_mostly;
 EXPORT_SYMBOL_GPL(nf_conntrack_max);
 
-struct list_head *nf_conntrack_hash __read_mostly;
+struct hlist_head *nf_conntrack_hash __read_mostly;
 EXPORT_SYMBOL_GPL(nf_conntrack_hash);
 
+/*
+ * While a resize is in progress the old table is drained a chunk of
+ * buckets at a time.  An entry stays in the old table as long as its
+ * old bucket is at or above nf_conntrack_rehash_pos, so where it lives
+ * follows from its tuple alone.
+ */
+static struct hlist_head *nf_conntrack_old_hash;
+static unsigned int nf_conntrack_old_size;
+static unsigned int nf_conntrack_old_rnd;
+static unsigned int nf_conntrack_rehash_pos;
+
+/* Old buckets moved per nf_conntrack_generation write section. */
+#define NF_CONNTRACK_REHASH_CHUNK	64
+
+/* Grow the table once there are more than this many tuples per bucket
+ * on average; zero leaves the size alone. */
+int nf_conntrack_hash_grow __read_mostly;
+
 struct nf_conn nf_conntrack_untracked __read_mostly;
 EXPORT_SYMBOL_GPL(nf_conntrack_untracked);
 
 unsigned int nf_ct_log_invalid __read_mostly;
-LIST_HEAD(unconfirmed);
 static int nf_conntrack_vmalloc __read_mostly;
 
-static unsigned int nf_conntrack_next_id;
+/* New conntracks wait on the list of the CPU that created them. */
+struct nf_conntrack_unconfirmed {
+	spinlock_t		lock;
+	struct hlist_head	list;
+};
+static DEFINE_PER_CPU(struct nf_conntrack_unconfirmed, nf_conntrack_unconfirmed);
+
+static atomic_t nf_conntrack_next_id = ATOMIC_INIT(0);
 
 DEFINE_PER_CPU(struct ip_conntrack_stat, nf_conntrack_stat);
 EXPORT_PER_CPU_SYMBOL(nf_conntrack_stat);
@@ -142,6 +192,149 @@ static inline u_int32_t hash_conntrack(const struct nf_conntrack_tuple *tuple)
 				nf_conntrack_hash_rnd);
 }
 
+/*
+ * Chain holding the entries that hash like @tuple, and the index of
+ * the lock covering it.  Only meaningful if the nf_conntrack_generation
+ * read section it was computed in turns out to be valid.
+ */
+static struct hlist_head *
+hash_chain(const struct nf_conntrack_tuple *tuple, unsigned int *lock)
+{
+	struct hlist_head *old_hash = rcu_dereference(nf_conntrack_old_hash);
+	unsigned int bucket;
+
+	if (unlikely(old_hash != NULL)) {
+		bucket = __hash_conntrack(tuple, nf_conntrack_old_size,
+					  nf_conntrack_old_rnd);
+		if (bucket >= nf_conntrack_rehash_pos) {
+			*lock = bucket % NF_CONNTRACK_LOCKS;
+			return &old_hash[bucket];
+		}
+	}
+
+	bucket = hash_conntrack(tuple);
+	*lock = bucket % NF_CONNTRACK_LOCKS;
+	return &rcu_dereference(nf_conntrack_hash)[bucket];
+}
+
+/* Chain for @tuple in a consistent view of the tables.  Needs RCU. */
+static struct hlist_head *
+hash_bucket(const struct nf_conntrack_tuple *tuple, unsigned int *seq)
+{
+	struct hlist_head *chain;
+	unsigned int lock;
+
+	do {
+		*seq = read_seqcount_begin(&nf_conntrack_generation);
+		chain = hash_chain(tuple, &lock);
+	} while (read_seqcount_retry(&nf_conntrack_generation, *seq));
+
+	return chain;
+}
+
+/* Takes two of the striped locks, always in ascending order. */
+static void nf_conntrack_double_lock(unsigned int h1, unsigned int h2)
+{
+	if (h1 > h2) {
+		unsigned int tmp = h1;
+		h1 = h2;
+		h2 = tmp;
+	}
+	spin_lock(&nf_conntrack_locks[h1]);
+	if (h1 != h2)
+		spin_lock_nested(&nf_conntrack_locks[h2], SINGLE_DEPTH_NESTING);
+}
+
+static void nf_conntrack_double_unlock(unsigned int h1, unsigned int h2)
+{
+	spin_unlock(&nf_conntrack_locks[h1]);
+	if (h1 != h2)
+		spin_unlock(&nf_conntrack_locks[h2]);
+}
+
+/* Where both directions of a conntrack live, see nf_conntrack_lock_ct(). */
+struct nf_conntrack_chains {
+	struct hlist_head	*chain[IP_CT_DIR_MAX];
+	unsigned int		lock[IP_CT_DIR_MAX];
+};
+
+/*
+ * Lock both chains of @ct with BH disabled.  If a resize moved things
+ * while we were hashing, the chains are stale: drop the locks and try
+ * again.  The chains stay put for as long as their locks are held.
+ */
+static void nf_conntrack_lock_ct(struct nf_conn *ct,
+				 struct nf_conntrack_chains *c)
+{
+	unsigned int seq;
+
+	local_bh_disable();
+	for (;;) {
+		seq = read_seqcount_begin(&nf_conntrack_generation);
+		if (seq & 1) {
+			/* resize is moving a chunk */
+			cpu_relax();
+			continue;
+		}
+		c->chain[IP_CT_DIR_ORIGINAL] =
+			hash_chain(&ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple,
+				   &c->lock[IP_CT_DIR_ORIGINAL]);
+		c->chain[IP_CT_DIR_REPLY] =
+			hash_chain(&ct->tuplehash[IP_CT_DIR_REPLY].tuple,
+				   &c->lock[IP_CT_DIR_REPLY]);
+		nf_conntrack_double_lock(c->lock[IP_CT_DIR_ORIGINAL],
+					 c->lock[IP_CT_DIR_REPLY]);
+		if (!read_seqcount_retry(&nf_conntrack_generation, seq))
+			break;
+		nf_conntrack_double_unlock(c->lock[IP_CT_DIR_ORIGINAL],
+					   c->lock[IP_CT_DIR_REPLY]);
+	}
+}
+
+static void nf_conntrack_unlock_ct(struct nf_conntrack_chains *c)
+{
+	nf_conntrack_double_unlock(c->lock[IP_CT_DIR_ORIGINAL],
+				   c->lock[IP_CT_DIR_REPLY]);
+	local_bh_enable();
+}
+
+static void unconfirmed_add(struct nf_conn *ct)
+{
+	struct nf_conntrack_unconfirmed *pcpu;
+
+	ct->cpu = smp_processor_id();
+	pcpu = &per_cpu(nf_conntrack_unconfirmed, ct->cpu);
+
+	spin_lock(&pcpu->lock);
+	hlist_add_head(&ct->tuplehash[IP_CT_DIR_ORIGINAL].hnode, &pcpu->list);
+	spin_unlock(&pcpu->lock);
+}
+
+static void unconfirmed_del(struct nf_conn *ct)
+{
+	struct nf_conntrack_unconfirmed *pcpu;
+
+	pcpu = &per_cpu(nf_conntrack_unconfirmed, ct->cpu);
+
+	spin_lock_bh(&pcpu->lock);
+	BUG_ON(hlist_unhashed(&ct->tuplehash[IP_CT_DIR_ORIGINAL].hnode));
+	hlist_del(&ct->tuplehash[IP_CT_DIR_ORIGINAL].hnode);
+	spin_unlock_bh(&pcpu->lock);
+}
+
+/* Most connections never expect any others: skip the global lock. */
+static void remove_expectations(struct nf_conn *ct)
+{
+	struct nf_conn_help *help = nfct_help(ct);
+
+	if (!help || help->expecting == 0)
+		return;
+
+	write_lock_bh(&nf_conntrack_lock);
+	nf_ct_remove_expectations(ct);
+	write_unlock_bh(&nf_conntrack_lock);
+}
+
 int nf_conntrack_register_cache(u_int32_t features, const char *name,
 				size_t size)
 {
@@ -207,10 +400,12 @@ int nf_conntrack_register_cache(u_int32_t features, const char *name,
 	}
 
 	write_lock_bh(&nf_ct_cache_lock);
-	nf_ct_cache[features].use = 1;
 	nf_ct_cache[features].size = size;
 	nf_ct_cache[features].cachep = cachep;
 	nf_ct_cache[features].name = cache_name;
+	/* __nf_conntrack_alloc() checks use without the lock */
+	smp_wmb();
+	nf_ct_cache[features].use = 1;
 	write_unlock_bh(&nf_ct_cache_lock);
 
 	goto out_up_mutex;
@@ -250,6 +445,8 @@ void nf_conntrack_unregister_cache(u_int32_t features)
 	write_unlock_bh(&nf_ct_cache_lock);
 
 	synchronize_net();
+	/* conntracks are returned to the cache from RCU callbacks */
+	rcu_barrier();
 
 	kmem_cache_destroy(cachep);
 	kfree(name);
@@ -303,12 +500,17 @@ EXPORT_SYMBOL_GPL(nf_ct_invert_tuple);
 static void
 clean_from_lists(struct nf_conn *ct)
 {
+	struct nf_conntrack_chains c;
+
 	DEBUGP("clean_from_lists(%p)\n", ct);
-	list_del(&ct->tuplehash[IP_CT_DIR_ORIGINAL].list);
-	list_del(&ct->tuplehash[IP_CT_DIR_REPLY].list);
+	nf_conntrack_lock_ct(ct, &c);
+	NF_CT_STAT_INC(delete_list);
+	hlist_del_rcu(&ct->tuplehash[IP_CT_DIR_ORIGINAL].hnode);
+	hlist_del_rcu(&ct->tuplehash[IP_CT_DIR_REPLY].hnode);
+	nf_conntrack_unlock_ct(&c);
 
 	/* Destroy all pending expectations */
-	nf_ct_remove_expectations(ct);
+	remove_expectations(ct);
 }
 
 static void
@@ -323,7 +525,7 @@ destroy_conntrack(struct nf_conntrack *nfct)
 	NF_CT_ASSERT(atomic_read(&nfct->use) == 0);
 	NF_CT_ASSERT(!timer_pending(&ct->timeout));
 
-	nf_conntrack_event(IPCT_DESTROY, ct);
+	/* Confirmed entries reported their end in death_by_timeout() */
 	set_bit(IPS_DYING_BIT, &ct->status);
 
 	if (help && help->helper && help->helper->destroy)
@@ -343,21 +545,19 @@ destroy_conntrack(struct nf_conntrack *nfct)
 	if (nf_conntrack_destroyed)
 		nf_conntrack_destroyed(ct);
 
-	write_lock_bh(&nf_conntrack_lock);
 	/* Expectations will have been removed in clean_from_lists,
 	 * except TFTP can create an expectation on the first packet,
 	 * before connection is in the list, so we need to clean here,
 	 * too. */
-	nf_ct_remove_expectations(ct);
+	remove_expectations(ct);
 
 	/* We overload first tuple to link into unconfirmed list. */
-	if (!nf_ct_is_confirmed(ct)) {
-		BUG_ON(list_empty(&ct->tuplehash[IP_CT_DIR_ORIGINAL].list));
-		list_del(&ct->tuplehash[IP_CT_DIR_ORIGINAL].list);
-	}
+	if (!nf_ct_is_confirmed(ct))
+		unconfirmed_del(ct);
 
+	local_bh_disable();
 	NF_CT_STAT_INC(delete);
-	write_unlock_bh(&nf_conntrack_lock);
+	local_bh_enable();
 
 	if (ct->master)
 		nf_ct_put(ct->master);
@@ -369,13 +569,18 @@ destroy_conntrack(struct nf_conntrack *nfct)
 static void death_by_timeout(unsigned long ul_conntrack)
 {
 	struct nf_conn *ct = (void *)ul_conntrack;
+	int err = nf_conntrack_destroy_event(ct);
 
-	write_lock_bh(&nf_conntrack_lock);
-	/* Inside lock so preempt is disabled on module removal path.
-	 * Otherwise we can get spurious warnings. */
-	NF_CT_STAT_INC(delete_list);
-	clean_from_lists(ct);
-	write_unlock_bh(&nf_conntrack_lock);
+	/* We may be back to retry the event of an entry already dying */
+	if (!test_and_set_bit(IPS_DYING_BIT, &ct->status))
+		clean_from_lists(ct);
+
+	/* A listener wants every destroy event and missed this one: keep
+	 * the entry, out of the hash, until the event gets through. */
+	if (err < 0) {
+		nf_ct_destroy_event_retry(ct);
+		return;
+	}
 	nf_ct_put(ct);
 }
 
@@ -384,9 +589,11 @@ __nf_conntrack_find(const struct nf_conntrack_tuple *tuple,
 		    const struct nf_conn *ignored_conntrack)
 {
 	struct nf_conntrack_tuple_hash *h;
-	unsigned int hash = hash_conntrack(tuple);
+	struct hlist_node *n;
+	unsigned int seq;
 
-	list_for_each_entry(h, &nf_conntrack_hash[hash], list) {
+begin:
+	hlist_for_each_entry_rcu(h, n, hash_bucket(tuple, &seq), hnode) {
 		if (nf_ct_tuplehash_to_ctrack(h) != ignored_conntrack &&
 		    nf_ct_tuple_equal(tuple, &h->tuple)) {
 			NF_CT_STAT_INC(found);
@@ -394,6 +601,10 @@ __nf_conntrack_find(const struct nf_conntrack_tuple *tuple,
 		}
 		NF_CT_STAT_INC(searched);
 	}
+	/* A resize may have moved an entry from under us and sent us off
+	 * down another chain: look again rather than report a miss. */
+	if (read_seqcount_retry(&nf_conntrack_generation, seq))
+		goto begin;
 
 	return NULL;
 }
@@ -406,37 +617,36 @@ nf_conntrack_find_get(const struct nf_conntrack_tuple *tuple,
 {
 	struct nf_conntrack_tuple_hash *h;
 
-	read_lock_bh(&nf_conntrack_lock);
+	rcu_read_lock();
 	h = __nf_conntrack_find(tuple, ignored_conntrack);
-	if (h)
-		atomic_inc(&nf_ct_tuplehash_to_ctrack(h)->ct_general.use);
-	read_unlock_bh(&nf_conntrack_lock);
+	/* A zero count means it is on its way out: treat as not found. */
+	if (h && unlikely(!atomic_inc_not_zero(
+				&nf_ct_tuplehash_to_ctrack(h)->ct_general.use)))
+		h = NULL;
+	rcu_read_unlock();
 
 	return h;
 }
 EXPORT_SYMBOL_GPL(nf_conntrack_find_get);
 
+/* Called with both chain locks held. */
 static void __nf_conntrack_hash_insert(struct nf_conn *ct,
-				       unsigned int hash,
-				       unsigned int repl_hash) 
+				       struct nf_conntrack_chains *c)
 {
-	ct->id = ++nf_conntrack_next_id;
-	list_add(&ct->tuplehash[IP_CT_DIR_ORIGINAL].list,
-		 &nf_conntrack_hash[hash]);
-	list_add(&ct->tuplehash[IP_CT_DIR_REPLY].list,
-		 &nf_conntrack_hash[repl_hash]);
+	ct->id = atomic_inc_return(&nf_conntrack_next_id);
+	hlist_add_head_rcu(&ct->tuplehash[IP_CT_DIR_ORIGINAL].hnode,
+			   c->chain[IP_CT_DIR_ORIGINAL]);
+	hlist_add_head_rcu(&ct->tuplehash[IP_CT_DIR_REPLY].hnode,
+			   c->chain[IP_CT_DIR_REPLY]);
 }
 
 void nf_conntrack_hash_insert(struct nf_conn *ct)
 {
-	unsigned int hash, repl_hash;
-
-	hash = hash_conntrack(&ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple);
-	repl_hash = hash_conntrack(&ct->tuplehash[IP_CT_DIR_REPLY].tuple);
+	struct nf_conntrack_chains c;
 
-	write_lock_bh(&nf_conntrack_lock);
-	__nf_conntrack_hash_insert(ct, hash, repl_hash);
-	write_unlock_bh(&nf_conntrack_lock);
+	nf_conntrack_lock_ct(ct, &c);
+	__nf_conntrack_hash_insert(ct, &c);
+	nf_conntrack_unlock_ct(&c);
 }
 EXPORT_SYMBOL_GPL(nf_conntrack_hash_insert);
 
@@ -444,8 +654,9 @@ EXPORT_SYMBOL_GPL(nf_conntrack_hash_insert);
 int
 __nf_conntrack_confirm(struct sk_buff **pskb)
 {
-	unsigned int hash, repl_hash;
+	struct nf_conntrack_chains c;
 	struct nf_conntrack_tuple_hash *h;
+	struct hlist_node *n;
 	struct nf_conn *ct;
 	struct nf_conn_help *help;
 	enum ip_conntrack_info ctinfo;
@@ -459,9 +670,6 @@ __nf_conntrack_confirm(struct sk_buff **pskb)
 	if (CTINFO2DIR(ctinfo) != IP_CT_DIR_ORIGINAL)
 		return NF_ACCEPT;
 
-	hash = hash_conntrack(&ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple);
-	repl_hash = hash_conntrack(&ct->tuplehash[IP_CT_DIR_REPLY].tuple);
-
 	/* We're not in hash table, and we refuse to set up related
 	   connections for unconfirmed conns.  But packet copies and
 	   REJECT will give spurious warnings here. */
@@ -472,33 +680,34 @@ __nf_conntrack_confirm(struct sk_buff **pskb)
 	NF_CT_ASSERT(!nf_ct_is_confirmed(ct));
 	DEBUGP("Confirming conntrack %p\n", ct);
 
-	write_lock_bh(&nf_conntrack_lock);
+	nf_conntrack_lock_ct(ct, &c);
 
 	/* See if there's one in the list already, including reverse:
 	   NAT could have grabbed it without realizing, since we're
 	   not in the hash.  If there is, we lost race. */
-	list_for_each_entry(h, &nf_conntrack_hash[hash], list)
+	hlist_for_each_entry(h, n, c.chain[IP_CT_DIR_ORIGINAL], hnode)
 		if (nf_ct_tuple_equal(&ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple,
 				      &h->tuple))
 			goto out;
-	list_for_each_entry(h, &nf_conntrack_hash[repl_hash], list)
+	hlist_for_each_entry(h, n, c.chain[IP_CT_DIR_REPLY], hnode)
 		if (nf_ct_tuple_equal(&ct->tuplehash[IP_CT_DIR_REPLY].tuple,
 				      &h->tuple))
 			goto out;
 
 	/* Remove from unconfirmed list */
-	list_del(&ct->tuplehash[IP_CT_DIR_ORIGINAL].list);
+	unconfirmed_del(ct);
 
-	__nf_conntrack_hash_insert(ct, hash, repl_hash);
 	/* Timer relative to confirmation time, not original
 	   setting time, otherwise we'd get timer wrap in
-	   weird delay cases. */
+	   weird delay cases.  Everything is set up before lookups
+	   can see us. */
 	ct->timeout.expires += jiffies;
 	add_timer(&ct->timeout);
 	atomic_inc(&ct->ct_general.use);
 	set_bit(IPS_CONFIRMED_BIT, &ct->status);
+	__nf_conntrack_hash_insert(ct, &c);
 	NF_CT_STAT_INC(insert);
-	write_unlock_bh(&nf_conntrack_lock);
+	nf_conntrack_unlock_ct(&c);
 	help = nfct_help(ct);
 	if (help && help->helper)
 		nf_conntrack_event_cache(IPCT_HELPER, *pskb);
@@ -513,7 +722,7 @@ __nf_conntrack_confirm(struct sk_buff **pskb)
 
 out:
 	NF_CT_STAT_INC(insert_failed);
-	write_unlock_bh(&nf_conntrack_lock);
+	nf_conntrack_unlock_ct(&c);
 	return NF_DROP;
 }
 EXPORT_SYMBOL_GPL(__nf_conntrack_confirm);
@@ -526,9 +735,9 @@ nf_conntrack_tuple_taken(const struct nf_conntrack_tuple *tuple,
 {
 	struct nf_conntrack_tuple_hash *h;
 
-	read_lock_bh(&nf_conntrack_lock);
+	rcu_read_lock();
 	h = __nf_conntrack_find(tuple, ignored_conntrack);
-	read_unlock_bh(&nf_conntrack_lock);
+	rcu_read_unlock();
 
 	return h != NULL;
 }
@@ -536,23 +745,25 @@ EXPORT_SYMBOL_GPL(nf_conntrack_tuple_taken);
 
 /* There's a small race here where we may free a just-assured
    connection.  Too bad: we're in trouble anyway. */
-static int early_drop(struct list_head *chain)
+static int early_drop(const struct nf_conntrack_tuple *tuple)
 {
-	/* Traverse backwards: gives us oldest, which is roughly LRU */
+	/* Entries are added at the head, so the last unassured one we
+	   see is the oldest, which is roughly LRU */
 	struct nf_conntrack_tuple_hash *h;
+	struct hlist_node *n;
 	struct nf_conn *ct = NULL, *tmp;
+	unsigned int seq;
 	int dropped = 0;
 
-	read_lock_bh(&nf_conntrack_lock);
-	list_for_each_entry_reverse(h, chain, list) {
+	rcu_read_lock();
+	hlist_for_each_entry_rcu(h, n, hash_bucket(tuple, &seq), hnode) {
 		tmp = nf_ct_tuplehash_to_ctrack(h);
-		if (!test_bit(IPS_ASSURED_BIT, &tmp->status)) {
+		if (!test_bit(IPS_ASSURED_BIT, &tmp->status))
 			ct = tmp;
-			atomic_inc(&ct->ct_general.use);
-			break;
-		}
 	}
-	read_unlock_bh(&nf_conntrack_lock);
+	if (ct && !atomic_inc_not_zero(&ct->ct_general.use))
+		ct = NULL;
+	rcu_read_unlock();
 
 	if (!ct)
 		return dropped;
@@ -566,6 +777,27 @@ static int early_drop(struct list_head *chain)
 	return dropped;
 }
 
+/* Chains too long on average, and the table not yet one bucket per
+ * connection allowed (or, with no limit, per connection tracked)? */
+static inline int nf_conntrack_need_grow(void)
+{
+	unsigned int size = nf_conntrack_htable_size;
+	unsigned int count = atomic_read(&nf_conntrack_count);
+	unsigned int limit = nf_conntrack_max ? : count;
+
+	return nf_conntrack_hash_grow > 0 &&
+	       2 * (u64)count > (u64)nf_conntrack_hash_grow * size &&
+	       size < limit;
+}
+
+static void nf_conntrack_grow(struct work_struct *work)
+{
+	if (nf_conntrack_need_grow())
+		nf_conntrack_set_hashsize(2 * nf_conntrack_htable_size);
+}
+
+static DECLARE_WORK(nf_conntrack_grow_work, nf_conntrack_grow);
+
 static struct nf_conn *
 __nf_conntrack_alloc(const struct nf_conntrack_tuple *orig,
 		     const struct nf_conntrack_tuple *repl,
@@ -583,11 +815,13 @@ __nf_conntrack_alloc(const struct nf_conntrack_tuple *orig,
 	/* We don't want any race condition at early drop stage */
 	atomic_inc(&nf_conntrack_count);
 
+	if (unlikely(nf_conntrack_need_grow()))
+		schedule_work(&nf_conntrack_grow_work);
+
 	if (nf_conntrack_max
 	    && atomic_read(&nf_conntrack_count) > nf_conntrack_max) {
-		unsigned int hash = hash_conntrack(orig);
 		/* Try dropping from this hash chain. */
-		if (!early_drop(&nf_conntrack_hash[hash])) {
+		if (!early_drop(orig)) {
 			atomic_dec(&nf_conntrack_count);
 			if (net_ratelimit())
 				printk(KERN_WARNING
@@ -600,23 +834,22 @@ __nf_conntrack_alloc(const struct nf_conntrack_tuple *orig,
 	/*  find features needed by this conntrack. */
 	features |= l3proto->get_features(orig);
 
-	/* FIXME: protect helper list per RCU */
-	read_lock_bh(&nf_conntrack_lock);
+	/* Helpers and slab caches are only freed after a grace period. */
+	rcu_read_lock();
 	helper = __nf_ct_helper_find(repl);
 	/* NAT might want to assign a helper later */
 	if (helper || features & NF_CT_F_NAT)
 		features |= NF_CT_F_HELP;
-	read_unlock_bh(&nf_conntrack_lock);
 
 	DEBUGP("nf_conntrack_alloc: features=0x%x\n", features);
 
-	read_lock_bh(&nf_ct_cache_lock);
-
 	if (unlikely(!nf_ct_cache[features].use)) {
 		DEBUGP("nf_conntrack_alloc: not supported features = 0x%x\n",
 			features);
 		goto out;
 	}
+	/* pairs with smp_wmb() in nf_conntrack_register_cache() */
+	smp_rmb();
 
 	conntrack = kmem_cache_alloc(nf_ct_cache[features].cachep, GFP_ATOMIC);
 	if (conntrack == NULL) {
@@ -626,6 +859,7 @@ __nf_conntrack_alloc(const struct nf_conntrack_tuple *orig,
 
 	memset(conntrack, 0, nf_ct_cache[features].size);
 	conntrack->features = features;
+	spin_lock_init(&conntrack->lock);
 	atomic_set(&conntrack->ct_general.use, 1);
 	conntrack->ct_general.destroy = destroy_conntrack;
 	conntrack->tuplehash[IP_CT_DIR_ORIGINAL].tuple = *orig;
@@ -634,11 +868,11 @@ __nf_conntrack_alloc(const struct nf_conntrack_tuple *orig,
 	init_timer(&conntrack->timeout);
 	conntrack->timeout.data = (unsigned long)conntrack;
 	conntrack->timeout.function = death_by_timeout;
-	read_unlock_bh(&nf_ct_cache_lock);
+	rcu_read_unlock();
 
 	return conntrack;
 out:
-	read_unlock_bh(&nf_ct_cache_lock);
+	rcu_read_unlock();
 	atomic_dec(&nf_conntrack_count);
 	return conntrack;
 }
@@ -653,15 +887,23 @@ struct nf_conn *nf_conntrack_alloc(const struct nf_conntrack_tuple *orig,
 }
 EXPORT_SYMBOL_GPL(nf_conntrack_alloc);
 
-void nf_conntrack_free(struct nf_conn *conntrack)
+static void nf_conntrack_free_rcu(struct rcu_head *head)
 {
+	struct nf_conn *conntrack = container_of(head, struct nf_conn, rcu);
 	u_int32_t features = conntrack->features;
-	NF_CT_ASSERT(features >= NF_CT_F_BASIC && features < NF_CT_F_NUM);
-	DEBUGP("nf_conntrack_free: features = 0x%x, conntrack=%p\n", features,
-	       conntrack);
+
 	kmem_cache_free(nf_ct_cache[features].cachep, conntrack);
 	atomic_dec(&nf_conntrack_count);
 }
+
+void nf_conntrack_free(struct nf_conn *conntrack)
+{
+	NF_CT_ASSERT(conntrack->features >= NF_CT_F_BASIC &&
+		     conntrack->features < NF_CT_F_NUM);
+	DEBUGP("nf_conntrack_free: features = 0x%x, conntrack=%p\n",
+	       conntrack->features, conntrack);
+	call_rcu(&conntrack->rcu, nf_conntrack_free_rcu);
+}
 EXPORT_SYMBOL_GPL(nf_conntrack_free);
 
 /* Allocate a new conntrack: we return -ENOMEM if classification
@@ -683,11 +925,14 @@ init_conntrack(const struct nf_conntrack_tuple *tuple,
 		return NULL;
 	}
 
-	read_lock_bh(&nf_conntrack_lock);
-	exp = __nf_conntrack_expect_find(tuple);
-	if (exp && exp->helper)
-		features = NF_CT_F_HELP;
-	read_unlock_bh(&nf_conntrack_lock);
+	/* Nothing is expected most of the time: skip the global lock. */
+	if (!list_empty(&nf_conntrack_expect_list)) {
+		read_lock_bh(&nf_conntrack_lock);
+		exp = __nf_conntrack_expect_find(tuple);
+		if (exp && exp->helper)
+			features = NF_CT_F_HELP;
+		read_unlock_bh(&nf_conntrack_lock);
+	}
 
 	conntrack = __nf_conntrack_alloc(tuple, &repl_tuple, l3proto, features);
 	if (conntrack == NULL || IS_ERR(conntrack)) {
@@ -701,26 +946,36 @@ init_conntrack(const struct nf_conntrack_tuple *tuple,
 		return NULL;
 	}
 
-	write_lock_bh(&nf_conntrack_lock);
-	exp = find_expectation(tuple);
-
-	if (exp) {
-		DEBUGP("conntrack: expectation arrives ct=%p exp=%p\n",
-			conntrack, exp);
-		/* Welcome, Mr. Bond.  We've been expecting you... */
-		__set_bit(IPS_EXPECTED_BIT, &conntrack->status);
-		conntrack->master = exp->master;
-		if (exp->helper)
-			nfct_help(conntrack)->helper = exp->helper;
+	/* Helper unregistration waits for a grace period before it
+	 * walks the unconfirmed lists, so whatever helper we pick here
+	 * is either seen by that walk or still registered. */
+	rcu_read_lock();
+	local_bh_disable();
+	exp = NULL;
+	if (!list_empty(&nf_conntrack_expect_list)) {
+		write_lock(&nf_conntrack_lock);
+		exp = find_expectation(tuple);
+		if (exp) {
+			DEBUGP("conntrack: expectation arrives ct=%p exp=%p\n",
+				conntrack, exp);
+			/* Welcome, Mr. Bond.  We've been expecting you... */
+			__set_bit(IPS_EXPECTED_BIT, &conntrack->status);
+			conntrack->master = exp->master;
+			if (exp->helper)
+				nfct_help(conntrack)->helper = exp->helper;
 #ifdef CONFIG_NF_CONNTRACK_MARK
-		conntrack->mark = exp->master->mark;
+			conntrack->mark = exp->master->mark;
 #endif
 #ifdef CONFIG_NF_CONNTRACK_SECMARK
-		conntrack->secmark = exp->master->secmark;
+			conntrack->secmark = exp->master->secmark;
 #endif
-		nf_conntrack_get(&conntrack->master->ct_general);
-		NF_CT_STAT_INC(expect_new);
-	} else {
+			nf_conntrack_get(&conntrack->master->ct_general);
+			NF_CT_STAT_INC(expect_new);
+		}
+		write_unlock(&nf_conntrack_lock);
+	}
+
+	if (!exp) {
 		struct nf_conn_help *help = nfct_help(conntrack);
 
 		if (help)
@@ -729,9 +984,9 @@ init_conntrack(const struct nf_conntrack_tuple *tuple,
 	}
 
 	/* Overload tuple linked list to put us in unconfirmed list. */
-	list_add(&conntrack->tuplehash[IP_CT_DIR_ORIGINAL].list, &unconfirmed);
-
-	write_unlock_bh(&nf_conntrack_lock);
+	unconfirmed_add(conntrack);
+	local_bh_enable();
+	rcu_read_unlock();
 
 	if (exp) {
 		if (exp->expectfn)
@@ -886,7 +1141,6 @@ void nf_conntrack_alter_reply(struct nf_conn *ct,
 {
 	struct nf_conn_help *help = nfct_help(ct);
 
-	write_lock_bh(&nf_conntrack_lock);
 	/* Should be unconfirmed, so not in hash table yet */
 	NF_CT_ASSERT(!nf_ct_is_confirmed(ct));
 
@@ -894,9 +1148,10 @@ void nf_conntrack_alter_reply(struct nf_conn *ct,
 	NF_CT_DUMP_TUPLE(newreply);
 
 	ct->tuplehash[IP_CT_DIR_REPLY].tuple = *newreply;
+	rcu_read_lock();
 	if (!ct->master && help && help->expecting == 0)
 		help->helper = __nf_ct_helper_find(newreply);
-	write_unlock_bh(&nf_conntrack_lock);
+	rcu_read_unlock();
 }
 EXPORT_SYMBOL_GPL(nf_conntrack_alter_reply);
 
@@ -910,13 +1165,15 @@ void __nf_ct_refresh_acct(struct nf_conn *ct,
 	int event = 0;
 
 	NF_CT_ASSERT(ct->timeout.data == (unsigned long)ct);
-	NF_CT_ASSERT(skb);
+	NF_CT_ASSERT(skb || !do_acct);
 
-	write_lock_bh(&nf_conntrack_lock);
+	spin_lock_bh(&ct->lock);
 
-	/* Only update if this is not a fixed timeout */
-	if (test_bit(IPS_FIXED_TIMEOUT_BIT, &ct->status)) {
-		write_unlock_bh(&nf_conntrack_lock);
+	/* Only update if this is not a fixed timeout, nor a dying entry
+	 * whose timer is retrying its destroy event */
+	if (test_bit(IPS_FIXED_TIMEOUT_BIT, &ct->status) ||
+	    nf_ct_is_dying(ct)) {
+		spin_unlock_bh(&ct->lock);
 		return;
 	}
 
@@ -950,11 +1207,16 @@ void __nf_ct_refresh_acct(struct nf_conn *ct,
 	}
 #endif
 
-	write_unlock_bh(&nf_conntrack_lock);
+	spin_unlock_bh(&ct->lock);
 
 	/* must be unlocked when calling event cache */
-	if (event)
-		nf_conntrack_event_cache(event, skb);
+	if (event) {
+		/* no packet to cache it on when refreshed from a timer */
+		if (skb)
+			nf_conntrack_event_cache(event, skb);
+		else
+			nf_conntrack_event(event, ct);
+	}
 }
 EXPORT_SYMBOL_GPL(__nf_ct_refresh_acct);
 
@@ -1033,32 +1295,47 @@ do_iter(const struct nf_conntrack_tuple_hash *i,
 	return iter(nf_ct_tuplehash_to_ctrack(i), data);
 }
 
-/* Bring out ya dead! */
+/* Bring out ya dead!  Called with nf_conntrack_hash_mutex held, so the
+ * table cannot be swapped under us. */
 static struct nf_conn *
 get_next_corpse(int (*iter)(struct nf_conn *i, void *data),
 		void *data, unsigned int *bucket)
 {
 	struct nf_conntrack_tuple_hash *h;
+	struct nf_conntrack_unconfirmed *pcpu;
+	struct hlist_node *n;
 	struct nf_conn *ct;
+	spinlock_t *lock;
+	int cpu;
 
-	write_lock_bh(&nf_conntrack_lock);
 	for (; *bucket < nf_conntrack_htable_size; (*bucket)++) {
-		list_for_each_entry(h, &nf_conntrack_hash[*bucket], list) {
+		lock = &nf_conntrack_locks[*bucket % NF_CONNTRACK_LOCKS];
+		spin_lock_bh(lock);
+		hlist_for_each_entry(h, n, &nf_conntrack_hash[*bucket], hnode) {
 			ct = nf_ct_tuplehash_to_ctrack(h);
-			if (iter(ct, data))
+			if (iter(ct, data) &&
+			    atomic_inc_not_zero(&ct->ct_general.use))
 				goto found;
 		}
+		spin_unlock_bh(lock);
  	}
-	list_for_each_entry(h, &unconfirmed, list) {
-		ct = nf_ct_tuplehash_to_ctrack(h);
-		if (iter(ct, data))
-			goto found;
+
+	for_each_possible_cpu(cpu) {
+		pcpu = &per_cpu(nf_conntrack_unconfirmed, cpu);
+		lock = &pcpu->lock;
+		spin_lock_bh(lock);
+		hlist_for_each_entry(h, n, &pcpu->list, hnode) {
+			ct = nf_ct_tuplehash_to_ctrack(h);
+			if (iter(ct, data)) {
+				atomic_inc(&ct->ct_general.use);
+				goto found;
+			}
+		}
+		spin_unlock_bh(lock);
 	}
-	write_unlock_bh(&nf_conntrack_lock);
 	return NULL;
 found:
-	atomic_inc(&ct->ct_general.use);
-	write_unlock_bh(&nf_conntrack_lock);
+	spin_unlock_bh(lock);
 	return ct;
 }
 
@@ -1068,6 +1345,7 @@ nf_ct_iterate_cleanup(int (*iter)(struct nf_conn *i, void *data), void *data)
 	struct nf_conn *ct;
 	unsigned int bucket = 0;
 
+	mutex_lock(&nf_conntrack_hash_mutex);
 	while ((ct = get_next_corpse(iter, data, &bucket)) != NULL) {
 		/* Time to push up daises... */
 		if (del_timer(&ct->timeout))
@@ -1076,6 +1354,7 @@ nf_ct_iterate_cleanup(int (*iter)(struct nf_conn *i, void *data), void *data)
 
 		nf_ct_put(ct);
 	}
+	mutex_unlock(&nf_conntrack_hash_mutex);
 }
 EXPORT_SYMBOL_GPL(nf_ct_iterate_cleanup);
 
@@ -1084,13 +1363,13 @@ static int kill_all(struct nf_conn *i, void *data)
 	return 1;
 }
 
-static void free_conntrack_hash(struct list_head *hash, int vmalloced, int size)
+static void free_conntrack_hash(struct hlist_head *hash, int vmalloced, int size)
 {
 	if (vmalloced)
 		vfree(hash);
 	else
 		free_pages((unsigned long)hash, 
-			   get_order(sizeof(struct list_head) * size));
+			   get_order(sizeof(struct hlist_head) * size));
 }
 
 void nf_conntrack_flush(void)
@@ -1113,6 +1392,8 @@ void nf_conntrack_cleanup(void)
 	synchronize_net();
 
 	nf_ct_event_cache_flush();
+	/* No more connections come in to queue a resize. */
+	flush_scheduled_work();
  i_see_dead_people:
 	nf_conntrack_flush();
 	if (atomic_read(&nf_conntrack_count) != 0) {
@@ -1145,41 +1426,71 @@ void nf_conntrack_cleanup(void)
 		}
 }
 
-static struct list_head *alloc_hashtable(int size, int *vmalloced)
+static struct hlist_head *alloc_hashtable(int size, int *vmalloced)
 {
-	struct list_head *hash;
+	struct hlist_head *hash;
 	unsigned int i;
 
 	*vmalloced = 0; 
 	hash = (void*)__get_free_pages(GFP_KERNEL, 
-				       get_order(sizeof(struct list_head)
+				       get_order(sizeof(struct hlist_head)
 						 * size));
 	if (!hash) { 
 		*vmalloced = 1;
 		printk(KERN_WARNING "nf_conntrack: falling back to vmalloc.\n");
-		hash = vmalloc(sizeof(struct list_head) * size);
+		hash = vmalloc(sizeof(struct hlist_head) * size);
 	}
 
 	if (hash)
 		for (i = 0; i < size; i++) 
-			INIT_LIST_HEAD(&hash[i]);
+			INIT_HLIST_HEAD(&hash[i]);
 
 	return hash;
 }
 
-int set_hashsize(const char *val, struct kernel_param *kp)
+/* Move the entries of old buckets [nf_conntrack_rehash_pos, end) over. */
+static void nf_conntrack_rehash_chunk(unsigned int end)
 {
-	int i, bucket, hashsize, vmalloced;
-	int old_vmalloced, old_size;
-	int rnd;
-	struct list_head *hash, *old_hash;
 	struct nf_conntrack_tuple_hash *h;
+	struct hlist_head *old;
+	struct hlist_node *n;
+	unsigned int i, bucket, lock, new_lock;
+
+	local_bh_disable();
+	write_seqcount_begin(&nf_conntrack_generation);
+	for (i = nf_conntrack_rehash_pos; i < end; i++) {
+		old = &nf_conntrack_old_hash[i];
+		lock = i % NF_CONNTRACK_LOCKS;
+		/* With BH off nothing we peek at can be freed under us. */
+		while ((n = rcu_dereference(old->first)) != NULL) {
+			h = hlist_entry(n, struct nf_conntrack_tuple_hash, hnode);
+			bucket = hash_conntrack(&h->tuple);
+			new_lock = bucket % NF_CONNTRACK_LOCKS;
+			nf_conntrack_double_lock(lock, new_lock);
+			/* Otherwise it was deleted meanwhile: look again. */
+			if (old->first == n) {
+				hlist_del_rcu(n);
+				hlist_add_head_rcu(n, &nf_conntrack_hash[bucket]);
+			}
+			nf_conntrack_double_unlock(lock, new_lock);
+		}
+	}
+	nf_conntrack_rehash_pos = end;
+	write_seqcount_end(&nf_conntrack_generation);
+	local_bh_enable();
+}
 
-	/* On boot, we can set this without any fancy locking. */
-	if (!nf_conntrack_htable_size)
-		return param_set_uint(val, kp);
+/*
+ * Replace the hash table with one of @hashsize buckets and a new seed.
+ * The entries move over a chunk at a time, so lookups and inserts go
+ * on throughout; each only waits for the chunk in flight.
+ */
+int nf_conntrack_set_hashsize(unsigned int hashsize)
+{
+	int vmalloced, old_vmalloced;
+	unsigned int pos, old_size, rnd;
+	struct hlist_head *hash, *old_hash;
 
-	hashsize = simple_strtol(val, NULL, 0);
 	if (!hashsize)
 		return -EINVAL;
 
@@ -1187,34 +1498,61 @@ int set_hashsize(const char *val, struct kernel_param *kp)
 	if (!hash)
 		return -ENOMEM;
 
-	/* We have to rehahs for the new table anyway, so we also can
-	 * use a newrandom seed */
+	/* We have to rehash for the new table anyway, so we also can
+	 * use a new random seed */
 	get_random_bytes(&rnd, 4);
 
-	write_lock_bh(&nf_conntrack_lock);
-	for (i = 0; i < nf_conntrack_htable_size; i++) {
-		while (!list_empty(&nf_conntrack_hash[i])) {
-			h = list_entry(nf_conntrack_hash[i].next,
-				       struct nf_conntrack_tuple_hash, list);
-			list_del(&h->list);
-			bucket = __hash_conntrack(&h->tuple, hashsize, rnd);
-			list_add_tail(&h->list, &hash[bucket]);
-		}
-	}
-	old_size = nf_conntrack_htable_size;
+	mutex_lock(&nf_conntrack_hash_mutex);
+
+	/* Every entry is still in the old table, where the chains that
+	 * writers already hold locks on stay valid. */
+	local_bh_disable();
+	write_seqcount_begin(&nf_conntrack_generation);
+	nf_conntrack_old_size = nf_conntrack_htable_size;
+	nf_conntrack_old_rnd = nf_conntrack_hash_rnd;
+	nf_conntrack_rehash_pos = 0;
+	rcu_assign_pointer(nf_conntrack_old_hash, nf_conntrack_hash);
 	old_vmalloced = nf_conntrack_vmalloc;
-	old_hash = nf_conntrack_hash;
 
 	nf_conntrack_htable_size = hashsize;
 	nf_conntrack_vmalloc = vmalloced;
-	nf_conntrack_hash = hash;
 	nf_conntrack_hash_rnd = rnd;
-	write_unlock_bh(&nf_conntrack_lock);
+	nf_conntrack_hash_rnd_initted = 1;
+	rcu_assign_pointer(nf_conntrack_hash, hash);
+	write_seqcount_end(&nf_conntrack_generation);
+	local_bh_enable();
+
+	for (pos = 0; pos < nf_conntrack_old_size;
+	     pos += NF_CONNTRACK_REHASH_CHUNK) {
+		nf_conntrack_rehash_chunk(min(pos + NF_CONNTRACK_REHASH_CHUNK,
+					      nf_conntrack_old_size));
+		cond_resched();
+	}
+
+	local_bh_disable();
+	write_seqcount_begin(&nf_conntrack_generation);
+	old_hash = nf_conntrack_old_hash;
+	old_size = nf_conntrack_old_size;
+	rcu_assign_pointer(nf_conntrack_old_hash, NULL);
+	write_seqcount_end(&nf_conntrack_generation);
+	local_bh_enable();
 
+	mutex_unlock(&nf_conntrack_hash_mutex);
+
+	synchronize_net();
 	free_conntrack_hash(old_hash, old_vmalloced, old_size);
 	return 0;
 }
 
+static int set_hashsize(const char *val, struct kernel_param *kp)
+{
+	/* On boot, we can set this without any fancy locking. */
+	if (!nf_conntrack_htable_size)
+		return param_set_uint(val, kp);
+
+	return nf_conntrack_set_hashsize(simple_strtoul(val, NULL, 0));
+}
+
 module_param_call(hashsize, set_hashsize, param_get_uint,
 		  &nf_conntrack_htable_size, 0600);
 
@@ -1228,7 +1566,7 @@ int __init nf_conntrack_init(void)
 	if (!nf_conntrack_htable_size) {
 		nf_conntrack_htable_size
 			= (((num_physpages << PAGE_SHIFT) / 16384)
-			   / sizeof(struct list_head));
+			   / sizeof(struct hlist_head));
 		if (num_physpages > (1024 * 1024 * 1024 / PAGE_SIZE))
 			nf_conntrack_htable_size = 8192;
 		if (nf_conntrack_htable_size < 16)
@@ -1247,6 +1585,17 @@ int __init nf_conntrack_init(void)
 		goto err_out;
 	}
 
+	seqcount_init(&nf_conntrack_generation);
+	for (i = 0; i < NF_CONNTRACK_LOCKS; i++)
+		spin_lock_init(&nf_conntrack_locks[i]);
+	for_each_possible_cpu(i) {
+		struct nf_conntrack_unconfirmed *pcpu;
+
+		pcpu = &per_cpu(nf_conntrack_unconfirmed, i);
+		spin_lock_init(&pcpu->lock);
+		INIT_HLIST_HEAD(&pcpu->list);
+	}
+
 	ret = nf_conntrack_register_cache(NF_CT_F_BASIC, "nf_conntrack:basic",
 					  sizeof(struct nf_conn));
 	if (ret < 0) {
@@ -1278,6 +1627,7 @@ int __init nf_conntrack_init(void)
 	/* Set up fake conntrack:
 	    - to never be deleted, not in any hashes */
 	atomic_set(&nf_conntrack_untracked.ct_general.use, 1);
+	spin_lock_init(&nf_conntrack_untracked.lock);
 	/*  - and look it like as a confirmed connection */
 	set_bit(IPS_CONFIRMED_BIT, &nf_conntrack_untracked.status);
 
@@ -29,12 +29,13 @@
 
 static __read_mostly LIST_HEAD(helpers);
 
+/* Caller holds rcu_read_lock() or nf_conntrack_lock. */
 struct nf_conntrack_helper *
 __nf_ct_helper_find(const struct nf_conntrack_tuple *tuple)
 {
 	struct nf_conntrack_helper *h;
 
-	list_for_each_entry(h, &helpers, list) {
+	list_for_each_entry_rcu(h, &helpers, list) {
 		if (nf_ct_tuple_mask_cmp(tuple, &h->tuple, &h->mask))
 			return h;
 	}
@@ -46,9 +47,9 @@ nf_ct_helper_find_get( const struct nf_conntrack_tuple *tuple)
 {
 	struct nf_conntrack_helper *helper;
 
-	/* need nf_conntrack_lock to assure that helper exists until
-	 * try_module_get() is called */
-	read_lock_bh(&nf_conntrack_lock);
+	/* unregistration waits for a grace period, so the helper exists
+	 * until try_module_get() is called */
+	rcu_read_lock();
 
 	helper = __nf_ct_helper_find(tuple);
 	if (helper) {
@@ -59,7 +60,7 @@ nf_ct_helper_find_get( const struct nf_conntrack_tuple *tuple)
 			helper = NULL;
 	}
 
-	read_unlock_bh(&nf_conntrack_lock);
+	rcu_read_unlock();
 
 	return helper;
 }
@@ -85,10 +86,8 @@ __nf_conntrack_helper_find_byname(const char *name)
 }
 EXPORT_SYMBOL_GPL(__nf_conntrack_helper_find_byname);
 
-static inline int unhelp(struct nf_conntrack_tuple_hash *i,
-			 const struct nf_conntrack_helper *me)
+static int unhelp(struct nf_conn *ct, void *me)
 {
-	struct nf_conn *ct = nf_ct_tuplehash_to_ctrack(i);
 	struct nf_conn_help *help = nfct_help(ct);
 
 	if (help && help->helper == me) {
@@ -113,7 +112,7 @@ int nf_conntrack_helper_register(struct nf_conntrack_helper *me)
 		return ret;
 	}
 	write_lock_bh(&nf_conntrack_lock);
-	list_add(&me->list, &helpers);
+	list_add_rcu(&me->list, &helpers);
 	write_unlock_bh(&nf_conntrack_lock);
 
 	return 0;
@@ -122,13 +121,11 @@ EXPORT_SYMBOL_GPL(nf_conntrack_helper_register);
 
 void nf_conntrack_helper_unregister(struct nf_conntrack_helper *me)
 {
-	unsigned int i;
-	struct nf_conntrack_tuple_hash *h;
 	struct nf_conntrack_expect *exp, *tmp;
 
 	/* Need write lock here, to delete helper. */
 	write_lock_bh(&nf_conntrack_lock);
-	list_del(&me->list);
+	list_del_rcu(&me->list);
 
 	/* Get rid of expectations */
 	list_for_each_entry_safe(exp, tmp, &nf_conntrack_expect_list, list) {
@@ -140,15 +137,16 @@ void nf_conntrack_helper_unregister(struct nf_conntrack_helper *me)
 		}
 	}
 
-	/* Get rid of expecteds, set helpers to NULL. */
-	list_for_each_entry(h, &unconfirmed, list)
-		unhelp(h, me);
-	for (i = 0; i < nf_conntrack_htable_size; i++) {
-		list_for_each_entry(h, &nf_conntrack_hash[i], list)
-			unhelp(h, me);
-	}
 	write_unlock_bh(&nf_conntrack_lock);
 
+	/* Conntracks being set up may have picked the helper before it
+	 * was unlinked; they are on an unconfirmed list once this
+	 * returns. */
+	synchronize_net();
+
+	/* Get rid of expecteds, set helpers to NULL. */
+	nf_ct_iterate_cleanup(unhelp, me);
+
 	/* Someone could be still looking at the helper in a bh. */
 	synchronize_net();
 }
@@ -313,43 +313,48 @@ nfattr_failure:
 }
 
 #ifdef CONFIG_NF_CONNTRACK_EVENTS
-static int ctnetlink_conntrack_event(struct notifier_block *this,
-                                     unsigned long events, void *ptr)
+static unsigned int event_batch __read_mostly;
+module_param(event_batch, uint, 0600);
+MODULE_PARM_DESC(event_batch, "pack conntrack events into messages of up to "
+			      "this many bytes (0: one event per message)");
+
+static unsigned int event_batch_delay __read_mostly = 10;
+module_param(event_batch_delay, uint, 0600);
+MODULE_PARM_DESC(event_batch_delay, "longest time in ms an event waits in a "
+				    "batch");
+
+static int event_reliable __read_mostly;
+module_param(event_reliable, bool, 0600);
+MODULE_PARM_DESC(event_reliable, "keep a conntrack until its destroy event "
+				 "has reached the listeners");
+
+#define CTNL_EVENT_GROUPS	3	/* NEW, UPDATE and DESTROY */
+#define CTNL_BATCH_MAX_SIZE	65536
+#define CTNL_BATCH_MAX_DYING	256
+
+/* Events of one CPU waiting for their batch to fill up or time out */
+struct ctnl_events {
+	spinlock_t lock;
+	struct timer_list timer;
+	struct sk_buff *skb[CTNL_EVENT_GROUPS];
+	unsigned int qlen[CTNL_EVENT_GROUPS];
+
+	/* conntracks whose destroy event is in the DESTROY batch, held
+	 * until it is delivered (reliable mode) */
+	unsigned int nr_dying;
+	struct nf_conn *dying[CTNL_BATCH_MAX_DYING];
+};
+static DEFINE_PER_CPU(struct ctnl_events, ctnl_events);
+
+static int
+ctnetlink_event_fill(struct sk_buff *skb, struct nf_conn *ct,
+		     unsigned long events, unsigned int type,
+		     unsigned int flags)
 {
 	struct nlmsghdr *nlh;
 	struct nfgenmsg *nfmsg;
 	struct nfattr *nest_parms;
-	struct nf_conn *ct = (struct nf_conn *)ptr;
-	struct sk_buff *skb;
-	unsigned int type;
-	unsigned char *b;
-	unsigned int flags = 0, group;
-
-	/* ignore our fake conntrack entry */
-	if (ct == &nf_conntrack_untracked)
-		return NOTIFY_DONE;
-
-	if (events & IPCT_DESTROY) {
-		type = IPCTNL_MSG_CT_DELETE;
-		group = NFNLGRP_CONNTRACK_DESTROY;
-	} else  if (events & (IPCT_NEW | IPCT_RELATED)) {
-		type = IPCTNL_MSG_CT_NEW;
-		flags = NLM_F_CREATE|NLM_F_EXCL;
-		group = NFNLGRP_CONNTRACK_NEW;
-	} else  if (events & (IPCT_STATUS | IPCT_PROTOINFO)) {
-		type = IPCTNL_MSG_CT_NEW;
-		group = NFNLGRP_CONNTRACK_UPDATE;
-	} else
-		return NOTIFY_DONE;
-
-	if (!nfnetlink_has_listeners(group))
-		return NOTIFY_DONE;
-
-	skb = alloc_skb(NLMSG_GOODSIZE, GFP_ATOMIC);
-	if (!skb)
-		return NOTIFY_DONE;
-
-	b = skb->tail;
+	unsigned char *b = skb->tail;
 
 	type |= NFNL_SUBSYS_CTNETLINK << 8;
 	nlh   = NLMSG_PUT(skb, 0, 0, type, sizeof(struct nfgenmsg));
@@ -402,12 +407,178 @@ static int ctnetlink_conntrack_event(struct notifier_block *this,
 	}
 
 	nlh->nlmsg_len = skb->tail - b;
-	nfnetlink_send(skb, 0, group, 0);
-	return NOTIFY_DONE;
+	return 0;
 
 nlmsg_failure:
 nfattr_failure:
-	kfree_skb(skb);
+	skb_trim(skb, b - skb->data);
+	return -1;
+}
+
+/* Hand the batch of @group to the listeners, closing it with NLMSG_DONE,
+ * for which there is always room.  Called with ce->lock held. */
+static void ctnetlink_batch_send(struct ctnl_events *ce, unsigned int group)
+{
+	unsigned int i = group - NFNLGRP_CONNTRACK_NEW;
+	struct sk_buff *skb = ce->skb[i];
+	int err;
+
+	__nlmsg_put(skb, 0, 0, NLMSG_DONE, 0, NLM_F_MULTI);
+	err = nfnetlink_send(skb, 0, group, 0);
+	if (err == -ENOBUFS)
+		NF_CT_STAT_ADD(event_overflow, ce->qlen[i]);
+	ce->skb[i] = NULL;
+	ce->qlen[i] = 0;
+
+	if (group != NFNLGRP_CONNTRACK_DESTROY)
+		return;
+	for (i = 0; i < ce->nr_dying; i++) {
+		if (err == -ENOBUFS)
+			nf_ct_destroy_event_retry(ce->dying[i]);
+		else
+			nf_ct_put(ce->dying[i]);
+	}
+	ce->nr_dying = 0;
+}
+
+static void ctnetlink_batch_flush(struct ctnl_events *ce)
+{
+	unsigned int group;
+
+	for (group = NFNLGRP_CONNTRACK_NEW;
+	     group <= NFNLGRP_CONNTRACK_DESTROY; group++)
+		if (ce->skb[group - NFNLGRP_CONNTRACK_NEW])
+			ctnetlink_batch_send(ce, group);
+}
+
+static void ctnetlink_event_timer(unsigned long data)
+{
+	struct ctnl_events *ce = (struct ctnl_events *)data;
+
+	spin_lock(&ce->lock);
+	ctnetlink_batch_flush(ce);
+	spin_unlock(&ce->lock);
+}
+
+static inline unsigned int ctnetlink_batch_size(void)
+{
+	return min_t(unsigned int, max_t(unsigned int, event_batch,
+					 NLMSG_GOODSIZE),
+		     CTNL_BATCH_MAX_SIZE);
+}
+
+/* Count an event that did not make it to the listeners, and flag the
+ * entry for a retry if it was a destroy event that had to. */
+static void ctnetlink_event_lost(struct nf_conn *ct, unsigned long events)
+{
+	NF_CT_STAT_INC(event_overflow);
+	if (event_reliable && events & IPCT_DESTROY)
+		set_bit(IPS_EVENT_LOST_BIT, &ct->status);
+}
+
+/* Append an event to this CPU's batch for @group, sending the batch
+ * first if the event does not fit.  In reliable mode the batch holds a
+ * reference to each conntrack whose destroy event it carries, and
+ * gives it back to the conntrack timer for a retry if the batch is
+ * lost. */
+static int ctnetlink_event_batch(struct nf_conn *ct, unsigned long events,
+				 unsigned int type, unsigned int flags,
+				 unsigned int group)
+{
+	int dying = event_reliable && events & IPCT_DESTROY;
+	unsigned int i = group - NFNLGRP_CONNTRACK_NEW;
+	struct ctnl_events *ce;
+	unsigned int len;
+
+	local_bh_disable();
+	ce = &__get_cpu_var(ctnl_events);
+	spin_lock(&ce->lock);
+	for (;;) {
+		if (ce->skb[i] == NULL) {
+			ce->skb[i] = alloc_skb(ctnetlink_batch_size(),
+					       GFP_ATOMIC);
+			if (ce->skb[i] == NULL) {
+				ctnetlink_event_lost(ct, events);
+				goto out;
+			}
+		}
+
+		len = ce->skb[i]->len;
+		if ((!dying || ce->nr_dying < CTNL_BATCH_MAX_DYING) &&
+		    ctnetlink_event_fill(ce->skb[i], ct, events, type,
+					 flags | NLM_F_MULTI) == 0 &&
+		    skb_tailroom(ce->skb[i]) >= NLMSG_LENGTH(0))
+			break;
+		skb_trim(ce->skb[i], len);
+
+		/* too big for even an empty batch */
+		if (len == 0) {
+			ctnetlink_event_lost(ct, events);
+			goto out;
+		}
+		ctnetlink_batch_send(ce, group);
+	}
+
+	ce->qlen[i]++;
+	if (dying) {
+		nf_conntrack_get(&ct->ct_general);
+		ce->dying[ce->nr_dying++] = ct;
+	}
+	if (!timer_pending(&ce->timer))
+		mod_timer(&ce->timer,
+			  jiffies + msecs_to_jiffies(event_batch_delay));
+out:
+	spin_unlock(&ce->lock);
+	local_bh_enable();
+	return NOTIFY_DONE;
+}
+
+static int ctnetlink_conntrack_event(struct notifier_block *this,
+                                     unsigned long events, void *ptr)
+{
+	struct nf_conn *ct = (struct nf_conn *)ptr;
+	struct sk_buff *skb;
+	unsigned int type;
+	unsigned int flags = 0, group;
+
+	/* ignore our fake conntrack entry */
+	if (ct == &nf_conntrack_untracked)
+		return NOTIFY_DONE;
+
+	if (events & IPCT_DESTROY) {
+		type = IPCTNL_MSG_CT_DELETE;
+		group = NFNLGRP_CONNTRACK_DESTROY;
+	} else  if (events & (IPCT_NEW | IPCT_RELATED)) {
+		type = IPCTNL_MSG_CT_NEW;
+		flags = NLM_F_CREATE|NLM_F_EXCL;
+		group = NFNLGRP_CONNTRACK_NEW;
+	} else  if (events & (IPCT_STATUS | IPCT_PROTOINFO)) {
+		type = IPCTNL_MSG_CT_NEW;
+		group = NFNLGRP_CONNTRACK_UPDATE;
+	} else
+		return NOTIFY_DONE;
+
+	if (!nfnetlink_has_listeners(group))
+		return NOTIFY_DONE;
+
+	if (event_batch)
+		return ctnetlink_event_batch(ct, events, type, flags, group);
+
+	skb = alloc_skb(NLMSG_GOODSIZE, GFP_ATOMIC);
+	if (!skb)
+		goto overflow;
+
+	if (ctnetlink_event_fill(skb, ct, events, type, flags) < 0) {
+		kfree_skb(skb);
+		goto overflow;
+	}
+	if (nfnetlink_send(skb, 0, group, 0) != -ENOBUFS)
+		return NOTIFY_DONE;
+
+overflow:
+	local_bh_disable();
+	ctnetlink_event_lost(ct, events);
+	local_bh_enable();
 	return NOTIFY_DONE;
 }
 #endif /* CONFIG_NF_CONNTRACK_EVENTS */
@@ -426,16 +597,19 @@ ctnetlink_dump_table(struct sk_buff *skb, struct netlink_callback *cb)
 {
 	struct nf_conn *ct, *last;
 	struct nf_conntrack_tuple_hash *h;
-	struct list_head *i;
+	struct hlist_head *hash;
+	struct hlist_node *n;
 	struct nfgenmsg *nfmsg = NLMSG_DATA(cb->nlh);
 	u_int8_t l3proto = nfmsg->nfgen_family;
+	unsigned int htable_size;
 
-	read_lock_bh(&nf_conntrack_lock);
+	mutex_lock(&nf_conntrack_hash_mutex);
+	rcu_read_lock();
+	hash = nf_conntrack_get_ht(&htable_size);
 	last = (struct nf_conn *)cb->args[1];
-	for (; cb->args[0] < nf_conntrack_htable_size; cb->args[0]++) {
+	for (; cb->args[0] < htable_size; cb->args[0]++) {
 restart:
-		list_for_each_prev(i, &nf_conntrack_hash[cb->args[0]]) {
-			h = (struct nf_conntrack_tuple_hash *) i;
+		hlist_for_each_entry_rcu(h, n, &hash[cb->args[0]], hnode) {
 			if (NF_CT_DIRECTION(h) != IP_CT_DIR_ORIGINAL)
 				continue;
 			ct = nf_ct_tuplehash_to_ctrack(h);
@@ -453,8 +627,12 @@ restart:
 		                        	cb->nlh->nlmsg_seq,
 						IPCTNL_MSG_CT_NEW,
 						1, ct) < 0) {
-				nf_conntrack_get(&ct->ct_general);
-				cb->args[1] = (unsigned long)ct;
+				/* resume here, or from the bucket start
+				   if it is already going away */
+				if (atomic_inc_not_zero(&ct->ct_general.use))
+					cb->args[1] = (unsigned long)ct;
+				else
+					cb->args[1] = 0;
 				goto out;
 			}
 #ifdef CONFIG_NF_CT_ACCT
@@ -469,7 +647,8 @@ restart:
 		}
 	}
 out:
-	read_unlock_bh(&nf_conntrack_lock);
+	rcu_read_unlock();
+	mutex_unlock(&nf_conntrack_hash_mutex);
 	if (last)
 		nf_ct_put(last);
 
@@ -790,7 +969,7 @@ ctnetlink_change_status(struct nf_conn *ct, struct nfattr *cda[])
 	unsigned int status = ntohl(*(__be32 *)NFA_DATA(cda[CTA_STATUS-1]));
 	d = ct->status ^ status;
 
-	if (d & (IPS_EXPECTED|IPS_CONFIRMED|IPS_DYING))
+	if (d & (IPS_EXPECTED|IPS_CONFIRMED|IPS_DYING|IPS_EVENT_LOST))
 		/* unchangeable */
 		return -EINVAL;
 	
@@ -1014,6 +1193,7 @@ ctnetlink_new_conntrack(struct sock *ctnl, struct sk_buff *skb,
 {
 	struct nf_conntrack_tuple otuple, rtuple;
 	struct nf_conntrack_tuple_hash *h = NULL;
+	struct nf_conn *ct;
 	struct nfgenmsg *nfmsg = NLMSG_DATA(nlh);
 	u_int8_t u3 = nfmsg->nfgen_family;
 	int err = 0;
@@ -1033,35 +1213,36 @@ ctnetlink_new_conntrack(struct sock *ctnl, struct sk_buff *skb,
 			return err;
 	}
 
-	write_lock_bh(&nf_conntrack_lock);
 	if (cda[CTA_TUPLE_ORIG-1])
-		h = __nf_conntrack_find(&otuple, NULL);
+		h = nf_conntrack_find_get(&otuple, NULL);
 	else if (cda[CTA_TUPLE_REPLY-1])
-		h = __nf_conntrack_find(&rtuple, NULL);
+		h = nf_conntrack_find_get(&rtuple, NULL);
 
 	if (h == NULL) {
-		write_unlock_bh(&nf_conntrack_lock);
 		err = -ENOENT;
 		if (nlh->nlmsg_flags & NLM_F_CREATE)
 			err = ctnetlink_create_conntrack(cda, &otuple, &rtuple);
 		return err;
 	}
 	/* implicit 'else' */
+	ct = nf_ct_tuplehash_to_ctrack(h);
 
 	/* we only allow nat config for new conntracks */
 	if (cda[CTA_NAT_SRC-1] || cda[CTA_NAT_DST-1]) {
 		err = -EINVAL;
-		goto out_unlock;
+		goto out_put;
 	}
 
-	/* We manipulate the conntrack inside the global conntrack table lock,
-	 * so there's no need to increase the refcount */
+	/* Helper and expectation changes still need the global lock */
 	err = -EEXIST;
-	if (!(nlh->nlmsg_flags & NLM_F_EXCL))
-		err = ctnetlink_change_conntrack(nf_ct_tuplehash_to_ctrack(h), cda);
+	if (!(nlh->nlmsg_flags & NLM_F_EXCL)) {
+		write_lock_bh(&nf_conntrack_lock);
+		err = ctnetlink_change_conntrack(ct, cda);
+		write_unlock_bh(&nf_conntrack_lock);
+	}
 
-out_unlock:
-	write_unlock_bh(&nf_conntrack_lock);
+out_put:
+	nf_ct_put(ct);
 	return err;
 }
 
@@ -1557,6 +1738,9 @@ MODULE_ALIAS_NFNL_SUBSYS(NFNL_SUBSYS_CTNETLINK_EXP);
 static int __init ctnetlink_init(void)
 {
 	int ret;
+#ifdef CONFIG_NF_CONNTRACK_EVENTS
+	int cpu;
+#endif
 
 	printk("ctnetlink v%s: registering with nfnetlink.\n", version);
 	ret = nfnetlink_subsys_register(&ctnl_subsys);
@@ -1572,6 +1756,14 @@ static int __init ctnetlink_init(void)
 	}
 
 #ifdef CONFIG_NF_CONNTRACK_EVENTS
+	for_each_possible_cpu(cpu) {
+		struct ctnl_events *ce = &per_cpu(ctnl_events, cpu);
+
+		spin_lock_init(&ce->lock);
+		setup_timer(&ce->timer, ctnetlink_event_timer,
+			    (unsigned long)ce);
+	}
+
 	ret = nf_conntrack_register_notifier(&ctnl_notifier);
 	if (ret < 0) {
 		printk("ctnetlink_init: cannot register notifier.\n");
@@ -1601,11 +1793,25 @@ err_out:
 
 static void __exit ctnetlink_exit(void)
 {
+#ifdef CONFIG_NF_CONNTRACK_EVENTS
+	int cpu;
+#endif
+
 	printk("ctnetlink: unregistering from nfnetlink.\n");
 
 #ifdef CONFIG_NF_CONNTRACK_EVENTS
 	nf_conntrack_expect_unregister_notifier(&ctnl_notifier_exp);
 	nf_conntrack_unregister_notifier(&ctnl_notifier);
+
+	/* no new events now, send what is left */
+	for_each_possible_cpu(cpu) {
+		struct ctnl_events *ce = &per_cpu(ctnl_events, cpu);
+
+		del_timer_sync(&ce->timer);
+		spin_lock_bh(&ce->lock);
+		ctnetlink_batch_flush(ce);
+		spin_unlock_bh(&ce->lock);
+	}
 #endif
 
 	nfnetlink_subsys_unregister(&ctnl_exp_subsys);
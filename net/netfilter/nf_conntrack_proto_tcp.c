@@ -707,7 +707,9 @@ static int tcp_in_window(struct ip_ct_tcp *state,
 
 		res = 1;
 	} else {
-		if (LOG_INVALID(IPPROTO_TCP))
+		res = sender->flags & IP_CT_TCP_FLAG_BE_LIBERAL ||
+		      nf_ct_tcp_be_liberal;
+		if (!res && LOG_INVALID(IPPROTO_TCP))
 			nf_log_packet(pf, 0, skb, NULL, NULL, NULL,
 			"nf_ct_tcp: %s ",
 			before(seq, sender->td_maxend + 1) ?
@@ -718,8 +720,6 @@ static int tcp_in_window(struct ip_ct_tcp *state,
 			: "ACK is over the upper bound (ACKed data not seen yet)"
 			: "SEQ is under the lower bound (already ACKed data retransmitted)"
 			: "SEQ is over the upper bound (over the window of the receiver)");
-
-		res = nf_ct_tcp_be_liberal;
   	}
   
 	DEBUGP("tcp_in_window: res=%i sender end=%u maxend=%u maxwin=%u "
@@ -763,6 +763,15 @@ void nf_conntrack_tcp_update(struct sk_buff *skb,
 		receiver->td_scale);
 }
 EXPORT_SYMBOL_GPL(nf_conntrack_tcp_update);
+
+void nf_conntrack_tcp_be_liberal(struct nf_conn *conntrack)
+{
+	write_lock_bh(&tcp_lock);
+	conntrack->proto.tcp.seen[0].flags |= IP_CT_TCP_FLAG_BE_LIBERAL;
+	conntrack->proto.tcp.seen[1].flags |= IP_CT_TCP_FLAG_BE_LIBERAL;
+	write_unlock_bh(&tcp_lock);
+}
+EXPORT_SYMBOL_GPL(nf_conntrack_tcp_be_liberal);
 #endif
 
 #define	TH_FIN	0x01
@@ -68,38 +68,43 @@ seq_print_counters(struct seq_file *s,
 #endif
 
 struct ct_iter_state {
+	struct hlist_head *hash;
+	unsigned int htable_size;
 	unsigned int bucket;
 };
 
-static struct list_head *ct_get_first(struct seq_file *seq)
+static struct hlist_node *ct_get_first(struct seq_file *seq)
 {
 	struct ct_iter_state *st = seq->private;
+	struct hlist_node *n;
 
 	for (st->bucket = 0;
-	     st->bucket < nf_conntrack_htable_size;
+	     st->bucket < st->htable_size;
 	     st->bucket++) {
-		if (!list_empty(&nf_conntrack_hash[st->bucket]))
-			return nf_conntrack_hash[st->bucket].next;
+		n = rcu_dereference(st->hash[st->bucket].first);
+		if (n)
+			return n;
 	}
 	return NULL;
 }
 
-static struct list_head *ct_get_next(struct seq_file *seq, struct list_head *head)
+static struct hlist_node *ct_get_next(struct seq_file *seq,
+				      struct hlist_node *head)
 {
 	struct ct_iter_state *st = seq->private;
 
-	head = head->next;
-	while (head == &nf_conntrack_hash[st->bucket]) {
-		if (++st->bucket >= nf_conntrack_htable_size)
+	head = rcu_dereference(head->next);
+	while (head == NULL) {
+		if (++st->bucket >= st->htable_size)
 			return NULL;
-		head = nf_conntrack_hash[st->bucket].next;
+		head = rcu_dereference(st->hash[st->bucket].first);
 	}
 	return head;
 }
 
-static struct list_head *ct_get_idx(struct seq_file *seq, loff_t pos)
+static struct hlist_node *ct_get_idx(struct seq_file *seq, loff_t pos)
 {
-	struct list_head *head = ct_get_first(seq);
+	struct hlist_node *head = ct_get_first(seq);
 
 	if (head)
 		while (pos && (head = ct_get_next(seq, head)))
@@ -109,7 +114,11 @@ static struct list_head *ct_get_idx(struct seq_file *seq, loff_t pos)
 
 static void *ct_seq_start(struct seq_file *seq, loff_t *pos)
 {
-	read_lock_bh(&nf_conntrack_lock);
+	struct ct_iter_state *st = seq->private;
+
+	mutex_lock(&nf_conntrack_hash_mutex);
+	rcu_read_lock();
+	st->hash = nf_conntrack_get_ht(&st->htable_size);
 	return ct_get_idx(seq, *pos);
 }
 
@@ -121,13 +130,15 @@ static void *ct_seq_next(struct seq_file *s, void *v, loff_t *pos)
 
 static void ct_seq_stop(struct seq_file *s, void *v)
 {
-	read_unlock_bh(&nf_conntrack_lock);
+	rcu_read_unlock();
+	mutex_unlock(&nf_conntrack_hash_mutex);
 }
 
 /* return 0 on success, 1 in case of error */
 static int ct_seq_show(struct seq_file *s, void *v)
 {
-	const struct nf_conntrack_tuple_hash *hash = v;
+	const struct nf_conntrack_tuple_hash *hash =
+		hlist_entry(v, struct nf_conntrack_tuple_hash, hnode);
 	const struct nf_conn *conntrack = nf_ct_tuplehash_to_ctrack(hash);
 	struct nf_conntrack_l3proto *l3proto;
 	struct nf_conntrack_l4proto *l4proto;
@@ -278,12 +289,12 @@ static int ct_cpu_seq_show(struct seq_file *seq, void *v)
 	struct ip_conntrack_stat *st = v;
 
 	if (v == SEQ_START_TOKEN) {
-		seq_printf(seq, "entries  searched found new invalid ignore delete delete_list insert insert_failed drop early_drop icmp_error  expect_new expect_create expect_delete\n");
+		seq_printf(seq, "entries  searched found new invalid ignore delete delete_list insert insert_failed drop early_drop icmp_error  expect_new expect_create expect_delete event_overflow\n");
 		return 0;
 	}
 
 	seq_printf(seq, "%08x  %08x %08x %08x %08x %08x %08x %08x "
-			"%08x %08x %08x %08x %08x  %08x %08x %08x \n",
+			"%08x %08x %08x %08x %08x  %08x %08x %08x %08x \n",
 		   nr_conntracks,
 		   st->searched,
 		   st->found,
@@ -300,7 +311,8 @@ static int ct_cpu_seq_show(struct seq_file *seq, void *v)
 
 		   st->expect_new,
 		   st->expect_create,
-		   st->expect_delete
+		   st->expect_delete,
+		   st->event_overflow
 		);
 	return 0;
 }
@@ -336,8 +348,51 @@ EXPORT_SYMBOL_GPL(nf_conntrack_checksum);
 static int log_invalid_proto_min = 0;
 static int log_invalid_proto_max = 255;
 
+static int hash_grow_min = 0;
+static int hash_grow_max = 64;
+
 static struct ctl_table_header *nf_ct_sysctl_header;
 
+/* Writing nf_conntrack_buckets resizes the table. */
+static int nf_conntrack_buckets_sysctl(ctl_table *ctl, int write,
+				       struct file *filp, void __user *buffer,
+				       size_t *lenp, loff_t *ppos)
+{
+	ctl_table tmp = *ctl;
+	int size = nf_conntrack_htable_size;
+	int ret;
+
+	tmp.data = &size;
+	ret = proc_dointvec(&tmp, write, filp, buffer, lenp, ppos);
+	if (ret || !write || size == nf_conntrack_htable_size)
+		return ret;
+	if (size <= 0)
+		return -EINVAL;
+
+	return nf_conntrack_set_hashsize(size);
+}
+
+static int nf_conntrack_buckets_strategy(ctl_table *table,
+					 int __user *name, int nlen,
+					 void __user *oldval,
+					 size_t __user *oldlenp,
+					 void __user *newval, size_t newlen)
+{
+	int size, ret;
+
+	if (!newval || !newlen)
+		return 0;
+	if (newlen != sizeof(int))
+		return -EINVAL;
+	if (get_user(size, (int __user *)newval))
+		return -EFAULT;
+	if (size <= 0)
+		return -EINVAL;
+
+	ret = nf_conntrack_set_hashsize(size);
+	return ret < 0 ? ret : 1;
+}
+
 static ctl_table nf_ct_sysctl_table[] = {
 	{
 		.ctl_name	= NET_NF_CONNTRACK_MAX,
@@ -360,8 +415,20 @@ static ctl_table nf_ct_sysctl_table[] = {
 		.procname       = "nf_conntrack_buckets",
 		.data           = &nf_conntrack_htable_size,
 		.maxlen         = sizeof(unsigned int),
-		.mode           = 0444,
-		.proc_handler   = &proc_dointvec,
+		.mode           = 0644,
+		.proc_handler   = &nf_conntrack_buckets_sysctl,
+		.strategy	= &nf_conntrack_buckets_strategy,
+	},
+	{
+		.ctl_name	= NET_NF_CONNTRACK_HASH_GROW,
+		.procname	= "nf_conntrack_hash_grow",
+		.data		= &nf_conntrack_hash_grow,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= &proc_dointvec_minmax,
+		.strategy	= &sysctl_intvec,
+		.extra1		= &hash_grow_min,
+		.extra2		= &hash_grow_max,
 	},
 	{
 		.ctl_name	= NET_NF_CONNTRACK_CHECKSUM,
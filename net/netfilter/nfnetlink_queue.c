@@ -26,6 +26,7 @@
 #include <linux/netfilter/nfnetlink.h>
 #include <linux/netfilter/nfnetlink_queue.h>
 #include <linux/list.h>
+#include <linux/err.h>
 #include <net/sock.h>
 
 #include <asm/atomic.h>
@@ -66,6 +67,7 @@ struct nfqnl_instance {
 
 	u_int16_t queue_num;			/* number of this queue */
 	u_int8_t copy_mode;
+	u_int32_t flags;			/* NFQA_CFG_F_* */
 
 	spinlock_t lock;
 
@@ -542,6 +544,7 @@ nfqnl_enqueue_packet(struct sk_buff *skb, struct nf_info *info,
 	struct sk_buff *nskb;
 	struct nfqnl_instance *queue;
 	struct nfqnl_queue_entry *entry;
+	int failopen = 0;
 
 	QDEBUG("entered\n");
 
@@ -580,6 +583,11 @@ nfqnl_enqueue_packet(struct sk_buff *skb, struct nf_info *info,
 		goto err_out_free_nskb; 
 
 	if (queue->queue_total >= queue->queue_maxlen) {
+		if (queue->flags & NFQA_CFG_F_FAIL_OPEN) {
+			failopen = 1;
+			status = 0;
+			goto err_out_free_nskb;
+		}
                 queue->queue_dropped++;
 		status = -ENOSPC;
 		if (net_ratelimit())
@@ -592,7 +600,11 @@ nfqnl_enqueue_packet(struct sk_buff *skb, struct nf_info *info,
 	/* nfnetlink_unicast will either free the nskb or add it to a socket */
 	status = nfnetlink_unicast(nskb, queue->peer_pid, MSG_DONTWAIT);
 	if (status < 0) {
-	        queue->queue_user_dropped++;
+		if (queue->flags & NFQA_CFG_F_FAIL_OPEN) {
+			failopen = 1;
+			status = 0;
+		} else
+			queue->queue_user_dropped++;
 		goto err_out_unlock;
 	}
 
@@ -612,6 +624,9 @@ err_out_free:
 	kfree(entry);
 err_out_put:
 	instance_put(queue);
+	/* The reader can't keep up: let the packet through untouched */
+	if (failopen)
+		nf_reinject(skb, info, NF_ACCEPT);
 	return status;
 }
 
@@ -659,6 +674,13 @@ id_cmp(struct nfqnl_queue_entry *e, unsigned long id)
 	return (id == e->id);
 }
 
+/* Packet ids wrap, so compare them the way TCP compares sequence numbers */
+static inline int
+id_after(unsigned int id, unsigned int max)
+{
+	return (int)(id - max) > 0;
+}
+
 static int
 nfqnl_set_mode(struct nfqnl_instance *queue,
 	       unsigned char mode, unsigned int range)
@@ -781,6 +803,37 @@ static const int nfqa_verdict_min[NFQA_MAX] = {
 	[NFQA_PAYLOAD-1]	= 0,
 };
 
+/* Find the queue a verdict is for, which must be bound by the sender */
+static struct nfqnl_instance *
+verdict_instance_lookup(u_int16_t queue_num, int pid)
+{
+	struct nfqnl_instance *queue;
+
+	queue = instance_lookup_get(queue_num);
+	if (!queue)
+		return ERR_PTR(-ENODEV);
+
+	if (queue->peer_pid != pid) {
+		instance_put(queue);
+		return ERR_PTR(-EPERM);
+	}
+	return queue;
+}
+
+static struct nfqnl_msg_verdict_hdr *
+verdict_hdr_get(struct nfattr *nfqa[])
+{
+	struct nfqnl_msg_verdict_hdr *vhdr;
+
+	if (!nfqa[NFQA_VERDICT_HDR-1])
+		return NULL;
+
+	vhdr = NFA_DATA(nfqa[NFQA_VERDICT_HDR-1]);
+	if ((ntohl(vhdr->verdict) & NF_VERDICT_MASK) > NF_MAX_VERDICT)
+		return NULL;
+	return vhdr;
+}
+
 static int
 nfqnl_recv_verdict(struct sock *ctnl, struct sk_buff *skb,
 		   struct nlmsghdr *nlh, struct nfattr *nfqa[], int *errp)
@@ -799,28 +852,17 @@ nfqnl_recv_verdict(struct sock *ctnl, struct sk_buff *skb,
 		return -EINVAL;
 	}
 
-	queue = instance_lookup_get(queue_num);
-	if (!queue)
-		return -ENODEV;
+	queue = verdict_instance_lookup(queue_num, NETLINK_CB(skb).pid);
+	if (IS_ERR(queue))
+		return PTR_ERR(queue);
 
-	if (queue->peer_pid != NETLINK_CB(skb).pid) {
-		err = -EPERM;
-		goto err_out_put;
-	}
-
-	if (!nfqa[NFQA_VERDICT_HDR-1]) {
+	vhdr = verdict_hdr_get(nfqa);
+	if (!vhdr) {
 		err = -EINVAL;
 		goto err_out_put;
 	}
-
-	vhdr = NFA_DATA(nfqa[NFQA_VERDICT_HDR-1]);
 	verdict = ntohl(vhdr->verdict);
 
-	if ((verdict & NF_VERDICT_MASK) > NF_MAX_VERDICT) {
-		err = -EINVAL;
-		goto err_out_put;
-	}
-
 	entry = find_dequeue_entry(queue, id_cmp, ntohl(vhdr->id));
 	if (entry == NULL) {
 		err = -ENOENT;
@@ -846,6 +888,70 @@ err_out_put:
 	return err;
 }
 
+/* One verdict, and optionally one mark, for every queued packet whose id
+ * is not after vhdr->id: a reader that accepts most packets acks them a
+ * batch at a time instead of one message each. */
+static int
+nfqnl_recv_verdict_batch(struct sock *ctnl, struct sk_buff *skb,
+			 struct nlmsghdr *nlh, struct nfattr *nfqa[],
+			 int *errp)
+{
+	struct nfgenmsg *nfmsg = NLMSG_DATA(nlh);
+	u_int16_t queue_num = ntohs(nfmsg->res_id);
+
+	struct nfqnl_msg_verdict_hdr *vhdr;
+	struct nfqnl_instance *queue;
+	unsigned int verdict, maxid;
+	struct nfqnl_queue_entry *entry, *next;
+	LIST_HEAD(batch);
+	int err = 0;
+
+	if (nfattr_bad_size(nfqa, NFQA_MAX, nfqa_verdict_min)) {
+		QDEBUG("bad attribute size\n");
+		return -EINVAL;
+	}
+
+	queue = verdict_instance_lookup(queue_num, NETLINK_CB(skb).pid);
+	if (IS_ERR(queue))
+		return PTR_ERR(queue);
+
+	/* A payload only makes sense for a single packet */
+	vhdr = verdict_hdr_get(nfqa);
+	if (!vhdr || nfqa[NFQA_PAYLOAD-1]) {
+		err = -EINVAL;
+		goto err_out_put;
+	}
+	verdict = ntohl(vhdr->verdict);
+	maxid = ntohl(vhdr->id);
+
+	/* Newest entries are at the head; adding each to the head of the
+	 * batch leaves it oldest first. */
+	spin_lock_bh(&queue->lock);
+	list_for_each_entry_safe(entry, next, &queue->queue_list, list) {
+		if (id_after(entry->id, maxid))
+			continue;
+		__dequeue_entry(queue, entry);
+		list_add(&entry->list, &batch);
+	}
+	spin_unlock_bh(&queue->lock);
+
+	if (list_empty(&batch)) {
+		err = -ENOENT;
+		goto err_out_put;
+	}
+
+	list_for_each_entry_safe(entry, next, &batch, list) {
+		if (nfqa[NFQA_MARK-1])
+			entry->skb->mark = ntohl(*(__be32 *)
+						 NFA_DATA(nfqa[NFQA_MARK-1]));
+		issue_verdict(entry, verdict);
+	}
+
+err_out_put:
+	instance_put(queue);
+	return err;
+}
+
 static int
 nfqnl_recv_unsupp(struct sock *ctnl, struct sk_buff *skb,
 		  struct nlmsghdr *nlh, struct nfattr *nfqa[], int *errp)
@@ -856,6 +962,8 @@ nfqnl_recv_unsupp(struct sock *ctnl, struct sk_buff *skb,
 static const int nfqa_cfg_min[NFQA_CFG_MAX] = {
 	[NFQA_CFG_CMD-1]	= sizeof(struct nfqnl_msg_config_cmd),
 	[NFQA_CFG_PARAMS-1]	= sizeof(struct nfqnl_msg_config_params),
+	[NFQA_CFG_MASK-1]	= sizeof(u_int32_t),
+	[NFQA_CFG_FLAGS-1]	= sizeof(u_int32_t),
 };
 
 static struct nf_queue_handler nfqh = {
@@ -955,6 +1063,29 @@ nfqnl_recv_config(struct sock *ctnl, struct sk_buff *skb,
 		spin_unlock_bh(&queue->lock);
 	}
 
+	if (nfqa[NFQA_CFG_FLAGS-1]) {
+		u_int32_t flags, mask;
+
+		if (!queue) {
+			ret = -ENOENT;
+			goto out_put;
+		}
+		if (!nfqa[NFQA_CFG_MASK-1]) {
+			ret = -EINVAL;
+			goto out_put;
+		}
+		flags = ntohl(*(__be32 *)NFA_DATA(nfqa[NFQA_CFG_FLAGS-1]));
+		mask = ntohl(*(__be32 *)NFA_DATA(nfqa[NFQA_CFG_MASK-1]));
+		if (flags >= NFQA_CFG_F_MAX) {
+			ret = -EOPNOTSUPP;
+			goto out_put;
+		}
+		spin_lock_bh(&queue->lock);
+		queue->flags &= ~mask;
+		queue->flags |= flags & mask;
+		spin_unlock_bh(&queue->lock);
+	}
+
 out_put:
 	instance_put(queue);
 	return ret;
@@ -967,6 +1098,8 @@ static struct nfnl_callback nfqnl_cb[NFQNL_MSG_MAX] = {
 				    .attr_count = NFQA_MAX, },
 	[NFQNL_MSG_CONFIG]	= { .call = nfqnl_recv_config,
 				    .attr_count = NFQA_CFG_MAX, },
+	[NFQNL_MSG_VERDICT_BATCH] = { .call = nfqnl_recv_verdict_batch,
+				    .attr_count = NFQA_MAX, },
 };
 
 static struct nfnetlink_subsystem nfqnl_subsys = {
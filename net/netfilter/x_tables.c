@@ -21,6 +21,7 @@
 #include <linux/string.h>
 #include <linux/vmalloc.h>
 #include <linux/mutex.h>
+#include <linux/rcupdate.h>
 #include <linux/mm.h>
 
 #include <linux/netfilter/x_tables.h>
@@ -487,7 +488,6 @@ EXPORT_SYMBOL_GPL(xt_compat_target_to_user);
 struct xt_table_info *xt_alloc_table_info(unsigned int size)
 {
 	struct xt_table_info *newinfo;
-	int cpu;
 
 	/* Pedantry: prevent them from hitting BUG() in vmalloc.c --RR */
 	if ((SMP_ALIGN(size) >> PAGE_SHIFT) + 2 > num_physpages)
@@ -499,39 +499,147 @@ struct xt_table_info *xt_alloc_table_info(unsigned int size)
 
 	newinfo->size = size;
 
-	for_each_possible_cpu(cpu) {
-		if (size <= PAGE_SIZE)
-			newinfo->entries[cpu] = kmalloc_node(size,
-							GFP_KERNEL,
-							cpu_to_node(cpu));
-		else
-			newinfo->entries[cpu] = vmalloc_node(size,
-							cpu_to_node(cpu));
-
-		if (newinfo->entries[cpu] == NULL) {
-			xt_free_table_info(newinfo);
-			return NULL;
-		}
+	if (size <= PAGE_SIZE)
+		newinfo->entries = kmalloc(size, GFP_KERNEL);
+	else
+		newinfo->entries = vmalloc(size);
+	if (newinfo->entries == NULL) {
+		xt_free_table_info(newinfo);
+		return NULL;
 	}
 
 	return newinfo;
 }
 EXPORT_SYMBOL(xt_alloc_table_info);
 
+static void *xt_alloc_node(unsigned int size, int cpu)
+{
+	void *p;
+
+	if (size <= PAGE_SIZE)
+		p = kmalloc_node(size, GFP_KERNEL, cpu_to_node(cpu));
+	else
+		p = vmalloc_node(size, cpu_to_node(cpu));
+	if (p)
+		memset(p, 0, size);
+	return p;
+}
+
+static void xt_free_node(void *p, unsigned int size)
+{
+	if (size <= PAGE_SIZE)
+		kfree(p);
+	else
+		vfree(p);
+}
+
+/* Allocate the per-CPU state of a translated table: zeroed counters
+ * for info->number rules, and return stacks for info->stacksize
+ * nested jumps.  The family code sets stacksize to the number of
+ * chains; a target may send a packet that walks the same table again
+ * on this CPU, so the stacks get room for two full-depth walks. */
+int xt_alloc_table_percpu(struct xt_table_info *info)
+{
+	int cpu;
+
+	info->stacksize *= 2;
+	info->stackptr = alloc_percpu(unsigned int);
+	if (info->stackptr == NULL)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		info->counters[cpu] = xt_alloc_node(info->number *
+						    sizeof(struct xt_counters),
+						    cpu);
+		if (info->counters[cpu] == NULL)
+			return -ENOMEM;
+
+		if (info->stacksize == 0)
+			continue;
+		info->jumpstack[cpu] = xt_alloc_node(info->stacksize *
+						     sizeof(void *), cpu);
+		if (info->jumpstack[cpu] == NULL)
+			return -ENOMEM;
+	}
+	return 0;
+}
+EXPORT_SYMBOL(xt_alloc_table_percpu);
+
 void xt_free_table_info(struct xt_table_info *info)
 {
 	int cpu;
 
+	if (info->compiled)
+		info->free_compiled(info->compiled);
+
 	for_each_possible_cpu(cpu) {
-		if (info->size <= PAGE_SIZE)
-			kfree(info->entries[cpu]);
-		else
-			vfree(info->entries[cpu]);
+		xt_free_node(info->counters[cpu],
+			     info->number * sizeof(struct xt_counters));
+		xt_free_node(info->jumpstack[cpu],
+			     info->stacksize * sizeof(void *));
 	}
+	if (info->stackptr)
+		free_percpu(info->stackptr);
+
+	if (info->size <= PAGE_SIZE)
+		kfree(info->entries);
+	else
+		vfree(info->entries);
 	kfree(info);
 }
 EXPORT_SYMBOL(xt_free_table_info);
 
+DEFINE_PER_CPU(seqcount_t, xt_recseq);
+EXPORT_PER_CPU_SYMBOL_GPL(xt_recseq);
+
+/* Sum the per-CPU counters of a table into @counters, in rule order.
+ * The table may be live: each CPU's counters are read under its
+ * xt_recseq, so no 64-bit value is seen half updated, and packet
+ * processing is never stopped. */
+void xt_get_counters(const struct xt_table_info *info,
+		     struct xt_counters counters[])
+{
+	const struct xt_counters *c;
+	u_int64_t bcnt, pcnt;
+	unsigned int i, seq;
+	seqcount_t *s;
+	int cpu;
+
+	memset(counters, 0, info->number * sizeof(struct xt_counters));
+
+	for_each_possible_cpu(cpu) {
+		s = &per_cpu(xt_recseq, cpu);
+		c = info->counters[cpu];
+		for (i = 0; i < info->number; i++) {
+			do {
+				seq = read_seqcount_begin(s);
+				bcnt = c[i].bcnt;
+				pcnt = c[i].pcnt;
+			} while (read_seqcount_retry(s, seq));
+			ADD_COUNTER(counters[i], bcnt, pcnt);
+		}
+		cond_resched();
+	}
+}
+EXPORT_SYMBOL_GPL(xt_get_counters);
+
+/* Add @counters, in rule order, to the table's counters on this CPU. */
+void xt_add_counters(const struct xt_table_info *info,
+		     const struct xt_counters counters[])
+{
+	struct xt_counters *c;
+	unsigned int i, addend;
+
+	local_bh_disable();
+	c = info->counters[smp_processor_id()];
+	addend = xt_write_recseq_begin();
+	for (i = 0; i < info->number; i++)
+		ADD_COUNTER(c[i], counters[i].bcnt, counters[i].pcnt);
+	xt_write_recseq_end(addend);
+	local_bh_enable();
+}
+EXPORT_SYMBOL_GPL(xt_add_counters);
+
 /* Find table by name, grabs mutex & ref.  Returns ERR_PTR() on error. */
 struct xt_table *xt_find_table_lock(int af, const char *name)
 {
@@ -574,23 +682,23 @@ xt_replace_table(struct xt_table *table,
 	      struct xt_table_info *newinfo,
 	      int *error)
 {
-	struct xt_table_info *oldinfo, *private;
+	struct xt_table_info *oldinfo;
 
-	/* Do the substitution. */
-	write_lock_bh(&table->lock);
-	private = table->private;
-	/* Check inside lock: is the old number correct? */
-	if (num_counters != private->number) {
+	/* Do the substitution.  Replacements are serialized by the
+	 * table mutex; packets walk either the old or the new rules. */
+	oldinfo = table->private;
+	if (num_counters != oldinfo->number) {
 		duprintf("num_counters != table->private->number (%u/%u)\n",
-			 num_counters, private->number);
-		write_unlock_bh(&table->lock);
+			 num_counters, oldinfo->number);
 		*error = -EAGAIN;
 		return NULL;
 	}
-	oldinfo = private;
-	table->private = newinfo;
 	newinfo->initial_entries = oldinfo->initial_entries;
-	write_unlock_bh(&table->lock);
+	rcu_assign_pointer(table->private, newinfo);
+
+	/* Wait for walks of the old rules to finish, after which its
+	 * counters are final and it may be freed. */
+	synchronize_net();
 
 	return oldinfo;
 }
@@ -618,7 +726,6 @@ int xt_register_table(struct xt_table *table,
 
 	/* Simplifies replace_table code. */
 	table->private = bootstrap;
-	rwlock_init(&table->lock);
 	if (!xt_replace_table(table, 0, newinfo, &ret))
 		goto unlock;
 
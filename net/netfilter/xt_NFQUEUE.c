@@ -10,6 +10,10 @@
 
 #include <linux/module.h>
 #include <linux/skbuff.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/jhash.h>
+#include <linux/random.h>
 
 #include <linux/netfilter.h>
 #include <linux/netfilter_arp.h>
@@ -36,6 +40,79 @@ target(struct sk_buff **pskb,
 	return NF_QUEUE_NR(tinfo->queuenum);
 }
 
+static u32 jhash_initval __read_mostly;
+
+/* Both directions of a flow hash alike, so a reader sees whole
+ * connections. */
+static u32 hash_v4(const struct sk_buff *skb)
+{
+	const struct iphdr *iph = skb->nh.iph;
+
+	return jhash_2words((__force u32)(iph->saddr ^ iph->daddr),
+			    iph->protocol, jhash_initval);
+}
+
+static u32 hash_v6(const struct sk_buff *skb)
+{
+	const struct ipv6hdr *ip6h = skb->nh.ipv6h;
+	u32 a, b, c;
+
+	a = (__force u32)(ip6h->saddr.s6_addr32[3] ^
+			  ip6h->daddr.s6_addr32[3]);
+	b = (__force u32)(ip6h->saddr.s6_addr32[1] ^
+			  ip6h->daddr.s6_addr32[1]);
+	c = (__force u32)(ip6h->saddr.s6_addr32[0] ^
+			  ip6h->daddr.s6_addr32[0] ^
+			  ip6h->saddr.s6_addr32[2] ^
+			  ip6h->daddr.s6_addr32[2]);
+	return jhash_3words(a, b, c, jhash_initval);
+}
+
+static unsigned int
+target_v1(struct sk_buff **pskb,
+	  const struct net_device *in,
+	  const struct net_device *out,
+	  unsigned int hooknum,
+	  const struct xt_target *target,
+	  const void *targinfo)
+{
+	const struct xt_NFQ_info_v1 *tinfo = targinfo;
+	unsigned int queue = tinfo->queuenum;
+	u32 hash;
+
+	if (tinfo->queues_total > 1) {
+		if (target->family == AF_INET6)
+			hash = hash_v6(*pskb);
+		else
+			hash = hash_v4(*pskb);
+		queue += ((u64)hash * tinfo->queues_total) >> 32;
+	}
+	return NF_QUEUE_NR(queue);
+}
+
+static int
+checkentry_v1(const char *tablename,
+	      const void *entry,
+	      const struct xt_target *target,
+	      void *targinfo,
+	      unsigned int hook_mask)
+{
+	const struct xt_NFQ_info_v1 *tinfo = targinfo;
+	u32 maxid;
+
+	if (tinfo->queues_total == 0) {
+		printk(KERN_ERR "NFQUEUE: number of total queues is 0\n");
+		return 0;
+	}
+	maxid = tinfo->queues_total - 1 + tinfo->queuenum;
+	if (maxid > 0xffff) {
+		printk(KERN_ERR "NFQUEUE: number of queues (%u) out of range "
+		       "(got %u)\n", tinfo->queues_total, maxid);
+		return 0;
+	}
+	return 1;
+}
+
 static struct xt_target xt_nfqueue_target[] = {
 	{
 		.name		= "NFQUEUE",
@@ -58,10 +135,29 @@ static struct xt_target xt_nfqueue_target[] = {
 		.targetsize	= sizeof(struct xt_NFQ_info),
 		.me		= THIS_MODULE,
 	},
+	{
+		.name		= "NFQUEUE",
+		.revision	= 1,
+		.family		= AF_INET,
+		.checkentry	= checkentry_v1,
+		.target		= target_v1,
+		.targetsize	= sizeof(struct xt_NFQ_info_v1),
+		.me		= THIS_MODULE,
+	},
+	{
+		.name		= "NFQUEUE",
+		.revision	= 1,
+		.family		= AF_INET6,
+		.checkentry	= checkentry_v1,
+		.target		= target_v1,
+		.targetsize	= sizeof(struct xt_NFQ_info_v1),
+		.me		= THIS_MODULE,
+	},
 };
 
 static int __init xt_nfqueue_init(void)
 {
+	get_random_bytes(&jhash_initval, sizeof(jhash_initval));
 	return xt_register_targets(xt_nfqueue_target,
 				   ARRAY_SIZE(xt_nfqueue_target));
 }
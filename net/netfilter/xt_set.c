@@ -0,0 +1,172 @@
+/*
+ * The "set" match and "SET" target: test packets against, and add them
+ * to or delete them from, the IP sets of the ip_set core.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <linux/module.h>
+#include <linux/skbuff.h>
+
+#include <linux/netfilter/x_tables.h>
+#include <linux/netfilter/xt_set.h>
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("iptables IP set match and target module");
+MODULE_ALIAS("ipt_set");
+MODULE_ALIAS("ipt_SET");
+
+/* Resolve the set name of a rule and take a reference on the set */
+static int set_info_get(struct xt_set_info *info)
+{
+	info->name[IPSET_MAXNAMELEN - 1] = '\0';
+	info->index = IPSET_INVALID_ID;
+	if (info->name[0] == '\0')
+		return 1;
+
+	info->index = ip_set_get_byname(info->name, &info->dim);
+	if (info->index == IPSET_INVALID_ID) {
+		printk(KERN_WARNING "xt_set: cannot find set `%s'\n",
+		       info->name);
+		return 0;
+	}
+	return 1;
+}
+
+static void set_info_put(const struct xt_set_info *info)
+{
+	if (info->index != IPSET_INVALID_ID)
+		ip_set_put_byindex(info->index);
+}
+
+static int
+match(const struct sk_buff *skb,
+      const struct net_device *in,
+      const struct net_device *out,
+      const struct xt_match *match,
+      const void *matchinfo,
+      int offset,
+      unsigned int protoff,
+      int *hotdrop)
+{
+	const struct xt_set_info_match *info = matchinfo;
+
+	return ip_set_test(info->match_set.index, skb, info->match_set.flags)
+		^ !!(info->match_set.flags & XT_SET_INV);
+}
+
+static int
+checkentry(const char *tablename,
+	   const void *entry,
+	   const struct xt_match *match,
+	   void *matchinfo,
+	   unsigned int hook_mask)
+{
+	struct xt_set_info_match *info = matchinfo;
+
+	if (info->match_set.name[0] == '\0')
+		return 0;
+	return set_info_get(&info->match_set);
+}
+
+static void
+destroy(const struct xt_match *match, void *matchinfo)
+{
+	struct xt_set_info_match *info = matchinfo;
+
+	set_info_put(&info->match_set);
+}
+
+static unsigned int
+target(struct sk_buff **pskb,
+       const struct net_device *in,
+       const struct net_device *out,
+       unsigned int hooknum,
+       const struct xt_target *target,
+       const void *targinfo)
+{
+	const struct xt_set_info_target *info = targinfo;
+
+	if (info->add_set.index != IPSET_INVALID_ID)
+		ip_set_add(info->add_set.index, *pskb, info->add_set.flags);
+	if (info->del_set.index != IPSET_INVALID_ID)
+		ip_set_del(info->del_set.index, *pskb, info->del_set.flags);
+
+	return XT_CONTINUE;
+}
+
+static int
+checkentry_target(const char *tablename,
+		  const void *entry,
+		  const struct xt_target *target,
+		  void *targinfo,
+		  unsigned int hook_mask)
+{
+	struct xt_set_info_target *info = targinfo;
+
+	if (!set_info_get(&info->add_set))
+		return 0;
+	if (!set_info_get(&info->del_set)) {
+		set_info_put(&info->add_set);
+		return 0;
+	}
+	return 1;
+}
+
+static void
+destroy_target(const struct xt_target *target, void *targinfo)
+{
+	struct xt_set_info_target *info = targinfo;
+
+	set_info_put(&info->add_set);
+	set_info_put(&info->del_set);
+}
+
+static struct xt_match xt_set_match[] = {
+	{
+		.name		= "set",
+		.family		= AF_INET,
+		.checkentry	= checkentry,
+		.match		= match,
+		.destroy	= destroy,
+		.matchsize	= sizeof(struct xt_set_info_match),
+		.me		= THIS_MODULE,
+	},
+};
+
+static struct xt_target xt_set_target[] = {
+	{
+		.name		= "SET",
+		.family		= AF_INET,
+		.checkentry	= checkentry_target,
+		.target		= target,
+		.destroy	= destroy_target,
+		.targetsize	= sizeof(struct xt_set_info_target),
+		.me		= THIS_MODULE,
+	},
+};
+
+static int __init xt_set_init(void)
+{
+	int ret;
+
+	ret = xt_register_matches(xt_set_match, ARRAY_SIZE(xt_set_match));
+	if (ret < 0)
+		return ret;
+
+	ret = xt_register_targets(xt_set_target, ARRAY_SIZE(xt_set_target));
+	if (ret < 0)
+		xt_unregister_matches(xt_set_match, ARRAY_SIZE(xt_set_match));
+	return ret;
+}
+
+static void __exit xt_set_fini(void)
+{
+	xt_unregister_targets(xt_set_target, ARRAY_SIZE(xt_set_target));
+	xt_unregister_matches(xt_set_match, ARRAY_SIZE(xt_set_match));
+}
+
+module_init(xt_set_init);
+module_exit(xt_set_fini);